@@ -0,0 +1,321 @@
+//
+// SHSMessageStream.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "SHSMessageStream.hh"
+#include <kj/debug.h>
+#include <algorithm>
+#include <cstring>
+#include <sys/socket.h>
+
+namespace snej::shs {
+    using capnp::word;
+    using Segments = kj::ArrayPtr<const kj::ArrayPtr<const word>>;
+
+
+    // Cap'n Proto's segment table is little-endian 32-bit ints: the segment count minus one,
+    // then the size of each segment in words, padded to a whole word.
+
+    static inline uint32_t readLE32(const kj::byte *p) {
+        return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+    }
+
+    static inline void writeLE32(kj::byte *p, uint32_t n) {
+        p[0] = kj::byte(n);  p[1] = kj::byte(n >> 8);  p[2] = kj::byte(n >> 16);  p[3] = kj::byte(n >> 24);
+    }
+
+    static constexpr size_t tableWords(size_t segmentCount) {
+        return (segmentCount + 2) / 2;
+    }
+
+    static size_t messageBytes(Segments segments) {
+        size_t words = tableWords(segments.size());
+        for (auto &segment : segments)
+            words += segment.size();
+        return words * sizeof(word);
+    }
+
+
+    SHSMessageStream::SHSMessageStream(kj::Own<kj::AsyncIoStream> stream,
+                                       Session const& session,
+                                       CryptoBox::Protocol protocol,
+                                       size_t maxFrameSize,
+                                       kj::ArrayPtr<const kj::byte> pendingInput)
+    :_stream(kj::mv(stream))
+    ,_encryptor(session, protocol)
+    ,_decryptor(session, protocol)
+    ,_maxFrameSize(std::min(maxFrameSize, _encryptor.maxMessageSize()))
+    ,_input(kj::heapArray<kj::byte>(std::max(kInputBufferSize, pendingInput.size())))
+    {
+        KJ_REQUIRE(_maxFrameSize > 0);
+        memcpy(_input.begin(), pendingInput.begin(), pendingInput.size());
+        _inputEnd = pendingInput.size();
+    }
+
+
+#pragma mark - WRITING:
+
+
+    size_t SHSMessageStream::encryptedSize(Segments segments) {
+        size_t size = messageBytes(segments);
+        size_t frames = (size + _maxFrameSize - 1) / _maxFrameSize;
+        return size + frames * _encryptor.encryptedSize(0);
+    }
+
+
+    // Writes the encrypted frames of a message to `dst`, and returns the end of what it wrote.
+    kj::byte* SHSMessageStream::encryptMessage(Segments segments, kj::byte *dst) {
+        KJ_REQUIRE(segments.size() > 0 && segments.size() <= kMaxSegments,
+                   "Invalid number of message segments", segments.size());
+        kj::byte table[tableWords(kMaxSegments) * sizeof(word)];
+        size_t tableSize = tableWords(segments.size()) * sizeof(word);
+        writeLE32(&table[0], uint32_t(segments.size() - 1));
+        for (size_t i = 0; i < segments.size(); ++i)
+            writeLE32(&table[4 + 4 * i], uint32_t(segments[i].size()));
+        if (segments.size() % 2 == 0)
+            writeLE32(&table[4 + 4 * segments.size()], 0);
+
+        // The pieces to gather: first the table, then the segments.
+        size_t piece = 0, pieceOffset = 0;
+        auto pieceAt = [&](size_t i) -> kj::ArrayPtr<const kj::byte> {
+            return (i == 0) ? kj::arrayPtr(table, tableSize) : segments[i - 1].asBytes();
+        };
+
+        size_t overhead = _encryptor.encryptedSize(0);
+        size_t remaining = messageBytes(segments);
+        while (remaining > 0) {
+            // Gather the frame's cleartext where its ciphertext will go, then encrypt in place:
+            size_t frameSize = std::min(remaining, _maxFrameSize);
+            kj::byte *payload = dst + overhead;
+            for (size_t n = 0; n < frameSize; ) {
+                auto bytes = pieceAt(piece).slice(pieceOffset, pieceAt(piece).size());
+                size_t count = std::min(bytes.size(), frameSize - n);
+                memcpy(payload + n, bytes.begin(), count);
+                n += count;
+                pieceOffset += count;
+                if (pieceOffset == pieceAt(piece).size()) {
+                    ++piece;
+                    pieceOffset = 0;
+                }
+            }
+            input_data in = {payload, frameSize};
+            output_buffer out = {dst, overhead + frameSize};
+            status_t status = _encryptor.encrypt(in, out);
+            KJ_ASSERT(status == Success);
+            dst += out.size;
+            remaining -= frameSize;
+        }
+        return dst;
+    }
+
+
+    kj::Promise<void> SHSMessageStream::writeMessage(kj::ArrayPtr<const int> fds,
+                                                     Segments segments)
+    {
+        KJ_REQUIRE(fds.size() == 0, "SHSMessageStream can't send file descriptors");
+        // (`encryptedSize` is only the maximum, with the Compressed protocol.)
+        auto buffer = kj::heapArray<kj::byte>(encryptedSize(segments));
+        kj::byte *end = encryptMessage(segments, buffer.begin());
+        auto promise = _stream->write(buffer.begin(), end - buffer.begin());
+        return promise.attach(kj::mv(buffer));
+    }
+
+
+    kj::Promise<void> SHSMessageStream::writeMessages(kj::ArrayPtr<Segments> messages) {
+        // Encrypt all the messages into one buffer, to send with a single write:
+        size_t size = 0;
+        for (auto &segments : messages)
+            size += encryptedSize(segments);
+        auto buffer = kj::heapArray<kj::byte>(size);
+        kj::byte *dst = buffer.begin();
+        for (auto &segments : messages)
+            dst = encryptMessage(segments, dst);
+        auto promise = _stream->write(buffer.begin(), dst - buffer.begin());
+        return promise.attach(kj::mv(buffer));
+    }
+
+
+    kj::Maybe<int> SHSMessageStream::getSendBufferSize() {
+        int bufSize = 0;
+        kj::uint len = sizeof(int);
+        KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+            _stream->getsockopt(SOL_SOCKET, SO_SNDBUF, &bufSize, &len);
+        })) {
+            return nullptr;
+        }
+        return bufSize;
+    }
+
+
+    kj::Promise<void> SHSMessageStream::end() {
+        _stream->shutdownWrite();
+        return kj::READY_NOW;
+    }
+
+
+#pragma mark - READING:
+
+
+    // Resolves when a complete frame is in `_input`, returning its size; or to null at EOF.
+    kj::Promise<kj::Maybe<DecryptoBox::PeekResult>> SHSMessageStream::nextFrame() {
+        if (_inputStart == _inputEnd)
+            _inputStart = _inputEnd = 0;
+        input_data in = {&_input[_inputStart], _inputEnd - _inputStart};
+        auto peek = _decryptor.peek(in);
+        if (peek.status == CorruptData)
+            return KJ_EXCEPTION(DISCONNECTED, "Received corrupt input data");
+        if (peek.status == Success && in.size >= peek.encryptedSize)
+            return kj::Maybe<DecryptoBox::PeekResult>(peek);
+
+        // Read more. (If `peek` returned IncompleteInput, its `encryptedSize` is the number of
+        // bytes it needs.) First make sure there's room for the whole frame in the buffer:
+        if (_inputStart + peek.encryptedSize > _input.size()) {
+            memmove(_input.begin(), &_input[_inputStart], in.size);
+            _inputStart = 0;
+            _inputEnd = in.size;
+        }
+        return _stream->tryRead(&_input[_inputEnd], 1, _input.size() - _inputEnd)
+                .then([this](size_t nBytes) -> kj::Promise<kj::Maybe<DecryptoBox::PeekResult>> {
+            if (nBytes == 0) {
+                if (_inputStart == _inputEnd)
+                    return kj::Maybe<DecryptoBox::PeekResult>(nullptr);
+                return KJ_EXCEPTION(DISCONNECTED, "SecretHandshake stream ended in mid-frame");
+            }
+            _inputEnd += nBytes;
+            return nextFrame();     // continue
+        });
+    }
+
+
+    // Decrypts the complete frame at the start of `_input` to `dst`, returning its size.
+    size_t SHSMessageStream::decryptFrame(kj::byte *dst, size_t capacity) {
+        input_data in = {&_input[_inputStart], _inputEnd - _inputStart};
+        output_buffer out = {dst, capacity};
+        if (_decryptor.decrypt(in, out) != Success)
+            kj::throwFatalException(KJ_EXCEPTION(DISCONNECTED, "Received corrupt input data"));
+        _inputStart = _inputEnd - in.size;
+        return out.size;
+    }
+
+
+    kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>>
+    SHSMessageStream::tryReadMessage(kj::ArrayPtr<kj::AutoCloseFd>,
+                                     capnp::ReaderOptions options,
+                                     kj::ArrayPtr<word> scratchSpace)
+    {
+        return nextFrame().then([this, options, scratchSpace](kj::Maybe<DecryptoBox::PeekResult> maybeFrame)
+                                -> kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> {
+            size_t frameSize;
+            KJ_IF_MAYBE(frame, maybeFrame) {
+                frameSize = frame->decryptedSize;
+            } else {
+                return kj::Maybe<capnp::MessageReaderAndFds>(nullptr);      // EOF
+            }
+
+            // Decrypt the first frame into the scratch space if it fits, else a new buffer:
+            size_t frameWords = (frameSize + sizeof(word) - 1) / sizeof(word);
+            kj::Array<word> owned;
+            kj::ArrayPtr<word> buffer = scratchSpace;
+            if (frameWords > scratchSpace.size()) {
+                owned = kj::heapArray<word>(frameWords);
+                buffer = owned;
+            }
+            // (With the Compressed protocol, the peeked `frameSize` was only the maximum.)
+            frameSize = decryptFrame(buffer.asBytes().begin(), buffer.asBytes().size());
+
+            // Read the segment table to get the message size:
+            auto table = buffer.asBytes().begin();
+            if (frameSize < sizeof(word))
+                return KJ_EXCEPTION(DISCONNECTED, "Invalid Cap'n Proto message");
+            size_t segmentCount = size_t(readLE32(table)) + 1;
+            if (segmentCount > kMaxSegments || frameSize < tableWords(segmentCount) * sizeof(word))
+                return KJ_EXCEPTION(DISCONNECTED, "Invalid Cap'n Proto message");
+            uint64_t totalWords = tableWords(segmentCount);
+            for (size_t i = 0; i < segmentCount; ++i)
+                totalWords += readLE32(table + 4 + 4 * i);
+            if (totalWords > options.traversalLimitInWords)
+                return KJ_EXCEPTION(DISCONNECTED, "Message is too large. To increase the limit on "
+                                    "the receiving end, see capnp::ReaderOptions.");
+
+            size_t totalBytes = totalWords * sizeof(word);
+            if (totalBytes == frameSize) {
+                // The common case: the message was a single frame, so it's ready to read.
+                return makeReader(buffer.slice(0, totalWords), kj::mv(owned), options);
+            } else if (totalBytes < frameSize) {
+                return KJ_EXCEPTION(DISCONNECTED, "Invalid Cap'n Proto message");
+            }
+
+            // The message continues into more frames:
+            auto message = kj::heapArray<word>(totalWords);
+            memcpy(message.begin(), buffer.begin(), frameSize);
+            return readRemainingFrames(kj::mv(message), frameSize)
+                    .then([options](kj::Array<word> message) {
+                kj::ArrayPtr<const word> words = message;
+                return makeReader(words, kj::mv(message), options);
+            });
+        });
+    }
+
+
+    kj::Promise<kj::Array<word>> SHSMessageStream::readRemainingFrames(kj::Array<word> message,
+                                                                       size_t filled)
+    {
+        return nextFrame().then([this, message=kj::mv(message), filled]
+                                (kj::Maybe<DecryptoBox::PeekResult> maybeFrame) mutable
+                                -> kj::Promise<kj::Array<word>> {
+            auto bytes = message.asBytes();
+            KJ_IF_MAYBE(frame, maybeFrame) {
+                if (frame->decryptedSize > bytes.size() - filled
+                        && _decryptor.protocol() != CryptoBox::Compressed)  // (size is a maximum)
+                    return KJ_EXCEPTION(DISCONNECTED, "Invalid Cap'n Proto message framing");
+                filled += decryptFrame(bytes.begin() + filled, bytes.size() - filled);
+                if (filled < bytes.size())
+                    return readRemainingFrames(kj::mv(message), filled);     // continue
+                return kj::mv(message);
+            } else {
+                return KJ_EXCEPTION(DISCONNECTED, "SecretHandshake stream ended in mid-message");
+            }
+        });
+    }
+
+
+    // Creates a MessageReader on a complete message, whose segment table has been validated.
+    kj::Maybe<capnp::MessageReaderAndFds> SHSMessageStream::makeReader(kj::ArrayPtr<const word> message,
+                                                                       kj::Array<word> owned,
+                                                                       capnp::ReaderOptions options)
+    {
+        auto table = message.asBytes().begin();
+        size_t segmentCount = size_t(readLE32(table)) + 1;
+        auto segments = kj::heapArray<kj::ArrayPtr<const word>>(segmentCount);
+        const word *pos = message.begin() + tableWords(segmentCount);
+        for (size_t i = 0; i < segmentCount; ++i) {
+            size_t size = readLE32(table + 4 + 4 * i);
+            segments[i] = kj::arrayPtr(pos, size);
+            pos += size;
+        }
+        auto reader = kj::heap<capnp::SegmentArrayMessageReader>(segments.asPtr(), options);
+        return capnp::MessageReaderAndFds{reader.attach(kj::mv(segments), kj::mv(owned)), nullptr};
+    }
+
+}
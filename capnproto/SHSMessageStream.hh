@@ -0,0 +1,79 @@
+//
+// SHSMessageStream.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include "SecretHandshake.hh"
+#include "SecretStream.hh"
+#include <capnp/serialize-async.h>
+#include <kj/async-io.h>
+
+namespace snej::shs {
+
+    /// A Cap'n Proto `MessageStream` that encrypts with SecretHandshake, mapping each capnp
+    /// message to SHS frames instead of treating the connection as a byte stream.
+    ///
+    /// A message (its segment table followed by its segments) is gathered into a single frame,
+    /// or, if it's larger than a frame, split across as many frames as necessary. Each message
+    /// starts a new frame. On the receiving side the frames are decrypted directly into a
+    /// word-aligned buffer -- the caller's scratch space if it's big enough -- and the segments
+    /// are read from there without being copied.
+    ///
+    /// Get one from `StreamWrapper::wrapMessageStream`, and pass it to `TwoPartyVatNetwork`.
+    /// Both peers must use this class; it isn't compatible with the byte-stream `wrap`.
+    class SHSMessageStream final : public capnp::MessageStream {
+    public:
+        /// Constructs a message stream on a connection that's already completed the handshake.
+        /// @param stream  The underlying (unencrypted) stream.
+        /// @param session  The session keys and nonces to start with.
+        /// @param protocol  The encryption protocol.
+        /// @param maxFrameSize  The maximum cleartext size of a frame.
+        /// @param pendingInput  Encrypted data already read from `stream`, if any.
+        SHSMessageStream(kj::Own<kj::AsyncIoStream> stream,
+                         Session const& session,
+                         CryptoBox::Protocol protocol,
+                         size_t maxFrameSize = EncryptoBox::kMaxMessageSize,
+                         kj::ArrayPtr<const kj::byte> pendingInput = nullptr);
+
+        kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> tryReadMessage(
+                kj::ArrayPtr<kj::AutoCloseFd> fdSpace,
+                capnp::ReaderOptions options = capnp::ReaderOptions(),
+                kj::ArrayPtr<capnp::word> scratchSpace = nullptr) override;
+
+        kj::Promise<void> writeMessage(kj::ArrayPtr<const int> fds,
+                                       kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> segments)
+                                       override;
+
+        kj::Promise<void> writeMessages(
+                kj::ArrayPtr<kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>>> messages) override;
+
+        kj::Maybe<int> getSendBufferSize() override;
+
+        kj::Promise<void> end() override;
+
+    private:
+        static constexpr size_t kMaxSegments = 512;
+        static constexpr size_t kInputBufferSize = 128 * 1024;
+
+        size_t encryptedSize(kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> segments);
+        kj::byte* encryptMessage(kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> segments,
+                                 kj::byte *dst);
+        kj::Promise<kj::Maybe<DecryptoBox::PeekResult>> nextFrame();
+        size_t decryptFrame(kj::byte *dst, size_t capacity);
+        kj::Promise<kj::Array<capnp::word>> readRemainingFrames(kj::Array<capnp::word> message,
+                                                                size_t filled);
+        static kj::Maybe<capnp::MessageReaderAndFds> makeReader(kj::ArrayPtr<const capnp::word>,
+                                                                kj::Array<capnp::word> owned,
+                                                                capnp::ReaderOptions);
+
+        kj::Own<kj::AsyncIoStream>  _stream;
+        EncryptoBox                 _encryptor;
+        DecryptoBox                 _decryptor;
+        size_t                      _maxFrameSize;
+        kj::Array<kj::byte>         _input;                 // Encrypted data read from `_stream`
+        size_t                      _inputStart = 0, _inputEnd = 0;
+    };
+
+}
@@ -29,6 +29,7 @@
 // Copyright (c) 2016 Sandstorm Development Group, Inc. and contributors
 
 #include "SecretConnection.hh"
+#include "SHSMessageStream.hh"
 #include "SecretHandshake.hh"
 #include "SecretStream.hh"
 #include <kj/async-queue.h>
@@ -54,13 +55,17 @@ namespace snej::shs {
     }
 
 
-    class WrappedStream final: public kj::AsyncIoStream {
+    class WrappedStream final: public kj::AsyncIoStream, public SecretMessageStream {
     public:
         WrappedStream(kj::Own<kj::AsyncIoStream> stream,
                       kj::Own<Handshake> handshake,
                       StreamWrapper::Authorizer authorizer,
+                      StreamWrapper::AsyncAuthorizer asyncAuthorizer,
+                      std::vector<CryptoBox::Protocol> protocols,
+                      bool negotiate,
                       bool isSocket)
-        :WrappedStream(*stream, kj::mv(handshake), kj::mv(authorizer), isSocket)
+        :WrappedStream(*stream, kj::mv(handshake), kj::mv(authorizer), kj::mv(asyncAuthorizer),
+                       kj::mv(protocols), negotiate, isSocket)
         {
             _ownInner = kj::mv(stream);
         }
@@ -69,17 +74,39 @@ namespace snej::shs {
         WrappedStream(kj::AsyncIoStream& stream,
                       kj::Own<Handshake> handshake,
                       StreamWrapper::Authorizer authorizer,
+                      StreamWrapper::AsyncAuthorizer asyncAuthorizer,
+                      std::vector<CryptoBox::Protocol> protocols,
+                      bool negotiate,
                       bool isSocket)
         :_handshake(kj::mv(handshake))
         ,_authorizer(kj::mv(authorizer))
+        ,_asyncAuthorizer(kj::mv(asyncAuthorizer))
         ,_inner(stream)
+        ,_protocols(kj::mv(protocols))
+        ,_negotiate(negotiate)
         ,_isSocket(isSocket)
-        { }
+        ,_isServer(dynamic_cast<ServerHandshake*>(_handshake.get()) != nullptr)
+        {
+            KJ_REQUIRE(!_protocols.empty(), "No SecretHandshake protocols given");
+            if (_asyncAuthorizer) {
+                _server = dynamic_cast<ServerHandshake*>(_handshake.get());
+                KJ_REQUIRE(_server != nullptr, "Async authorizer given for a client handshake");
+                _server->setAsyncAuthorization(true);
+            }
+        }
 
 
         ~WrappedStream() noexcept(false) { }
 
 
+        // On a server, assume a client that sends nothing for `delay` after the handshake is a
+        // legacy peer. Only applies if negotiating.
+        void setSilentClientDelay(kj::Duration delay, kj::Timer &timer) {
+            _silentClientDelay = delay;
+            _timer = &timer;
+        }
+
+
         kj::Promise<Session> runHandshake() {
             std::string address = getPeerName();
             if (_handshake->finished()) {
@@ -101,6 +128,14 @@ namespace snej::shs {
                     _handshake->readCompleted();
                     return runHandshake(); // continue
                 });
+            } else if (_server && _server->authorizationPending()) {
+                // Wait for the app to decide; other connections keep running meanwhile:
+                return _asyncAuthorizer(_server->clientPublicKey()).then([this](bool allow) {
+                    if (!allow)
+                        KJ_LOG(ERROR, "SecretHandshake: async authorizer rejected client key");
+                    _server->resumeAuthorization(allow);
+                    return runHandshake(); // continue
+                });
             } else {
                 KJ_LOG(ERROR, "SecretHandshake failed!", address, _handshake->error());
                 assert(_handshake->error());
@@ -113,11 +148,13 @@ namespace snej::shs {
             std::string address = getPeerName();
             KJ_LOG(INFO, "Beginning SecretHandshake", address);
 
-            return runHandshake().then([this](Session result) {
+            return runHandshake().then([this](Session result) -> kj::Promise<void> {
                 _session = result;
-                _encryptor.emplace(result.encryptionKey, result.encryptionNonce);
-                _decryptor.emplace(result.decryptionKey, result.decryptionNonce);
-            }, [this](kj::Exception &&x) {
+                if (_negotiate)
+                    return negotiateProtocol(result);
+                startStreams(result, _protocols[0], EncryptoBox::kMaxMessageSize);
+                return kj::READY_NOW;
+            }).then([]() { }, [this](kj::Exception &&x) {
                 KJ_LOG(ERROR, "SecretHandshake: Connection error", x.getDescription());
                 _inner.shutdownWrite();
                 _inner.abortRead();
@@ -126,6 +163,97 @@ namespace snej::shs {
         }
 
 
+        void startStreams(Session const& session, CryptoBox::Protocol protocol, size_t maxSize) {
+            _streamSession = session;
+            _protocol = protocol;
+            _maxMessageSize = maxSize;
+            _encryptor.emplace(session, protocol);
+            _decryptor.emplace(session, protocol);
+            KJ_REQUIRE_NONNULL(_encryptor).setMaxMessageSize(maxSize);
+        }
+
+
+        // The client sends its protocol offer and reads the server's; the server reads the
+        // client's offer and replies with its own, unless the client is a legacy peer.
+        // Then both start the streams.
+        kj::Promise<void> negotiateProtocol(Session const& session) {
+            auto negotiator = kj::heap<ProtocolNegotiator>(
+                                    session,
+                                    _isServer ? ProtocolNegotiator::Server : ProtocolNegotiator::Client,
+                                    _protocols);
+            kj::Promise<void> done = nullptr;
+            if (_isServer) {
+                done = readOffer(*negotiator);
+                KJ_IF_MAYBE(delay, _silentClientDelay) {
+                    // A client that sends nothing at all may be a legacy peer waiting for us:
+                    done = KJ_REQUIRE_NONNULL(_timer)->afterDelay(*delay)
+                            .then([this,&negotiator = *negotiator]() -> kj::Promise<void> {
+                        if (_negotiationStarted)
+                            return kj::NEVER_DONE;  // it's not silent; keep reading its offer
+                        if (negotiator.peerIsSilent() != Success)
+                            return KJ_EXCEPTION(DISCONNECTED, "SecretHandshake protocol negotiation timed out");
+                        _silentClient = true;
+                        return startNegotiatedStreams(negotiator, {});
+                    }).exclusiveJoin(kj::mv(done));
+                }
+                done = done.then([this,&negotiator = *negotiator]() -> kj::Promise<void> {
+                    auto offer = negotiator.bytesToSend();
+                    if (offer.size == 0)
+                        return kj::READY_NOW;
+                    return _inner.write(offer.data, offer.size);
+                });
+            } else {
+                auto offer = negotiator->bytesToSend();
+                done = _inner.write(offer.data, offer.size).then([this,&negotiator = *negotiator] {
+                    return readOffer(negotiator);
+                });
+            }
+            return done.then([this,negotiator = kj::mv(negotiator)]() mutable {
+                // If the client was silent, keep the negotiator to check its first frame:
+                if (_silentClient)
+                    _lateOfferCheck = kj::mv(negotiator);
+            });
+        }
+
+
+        kj::Promise<void> readOffer(ProtocolNegotiator &negotiator) {
+            static constexpr size_t kReadSize = 1024;
+            size_t start = _negotiationBuf.size();
+            _negotiationBuf.resize(start + kReadSize);
+            return _inner.tryRead(&_negotiationBuf[start], 1, kReadSize)
+                    .then([this,&negotiator,start](size_t nBytes) -> kj::Promise<void> {
+                _negotiationBuf.resize(start + nBytes);
+                if (nBytes == 0)
+                    return KJ_EXCEPTION(DISCONNECTED, "Disconnected during protocol negotiation");
+                _negotiationStarted = true;
+                input_data in = {_negotiationBuf.data(), _negotiationBuf.size()};
+                switch (negotiator.receivedBytes(in)) {
+                    case Success:
+                        break;
+                    case IncompleteInput:
+                        return readOffer(negotiator);   // continue
+                    default:
+                        return KJ_EXCEPTION(DISCONNECTED, "SecretHandshake protocol negotiation failed");
+                }
+                return startNegotiatedStreams(negotiator, in);
+            });
+        }
+
+
+        kj::Promise<void> startNegotiatedStreams(ProtocolNegotiator &negotiator, input_data in) {
+            KJ_LOG(INFO, "SecretHandshake negotiated protocol", int(negotiator.protocol()),
+                   negotiator.peerIsLegacy());
+            startStreams(negotiator.session(), negotiator.protocol(),
+                         negotiator.maxMessageSize());
+            // Any data the peer sent after its offer is the start of the encrypted stream.
+            // Keep it until the first read, which may be a byte or a message read:
+            auto begin = (const uint8_t*)in.data;
+            _pendingInput.assign(begin, begin + in.size);
+            _negotiationBuf = {};
+            return kj::READY_NOW;
+        }
+
+
         kj::Own<SHSPeerIdentity> getIdentity(kj::Own<kj::PeerIdentity> inner) {
             KJ_IF_MAYBE(keys, _session) {
                 return kj::heap<SHSPeerIdentity>(keys->peerPublicKey, kj::mv(inner));
@@ -140,7 +268,56 @@ namespace snej::shs {
         }
 
 
+        // Pushes any encrypted data left over from protocol negotiation to the decryptor.
+        void pushPendingInput() {
+            if (!_pendingInput.empty()) {
+                if (!pushInput(_pendingInput.data(), _pendingInput.size()))
+                    throw std::runtime_error("Received corrupt input data");
+                _pendingInput = {};
+            }
+        }
+
+
+        // Pushes encrypted data to the decryptor. If the server fell back to BoxStream because
+        // the client was silent, the client's first frame is checked first, since it could be a
+        // negotiating client's late offer, which must not be read as data.
+        bool pushInput(const void *data, size_t size) {
+            auto &decryptor = KJ_REQUIRE_NONNULL(_decryptor);
+            KJ_IF_MAYBE(negotiator, _lateOfferCheck) {
+                auto begin = (const uint8_t*)data;
+                _negotiationBuf.insert(_negotiationBuf.end(), begin, begin + size);
+                input_data in = {_negotiationBuf.data(), _negotiationBuf.size()};
+                switch ((*negotiator)->receivedBytes(in)) {
+                    case IncompleteInput:
+                        return true;
+                    case Success:
+                        break;
+                    default:
+                        KJ_LOG(ERROR, "SecretHandshake: silent client sent a late protocol offer");
+                        return false;
+                }
+                _lateOfferCheck = nullptr;
+                bool ok = decryptor.push(_negotiationBuf.data(), _negotiationBuf.size());
+                _negotiationBuf = {};
+                return ok;
+            }
+            return decryptor.push(data, size);
+        }
+
+
+        /// Creates an `SHSMessageStream` that takes over the underlying stream and session.
+        /// Must be called right after the handshake, before any reads or writes.
+        kj::Own<SHSMessageStream> toMessageStream() {
+            KJ_REQUIRE(_ownInner.get() != nullptr, "WrappedStream doesn't own its stream");
+            KJ_REQUIRE(!_silentClient, "Message streams can't be used with a legacy client");
+            auto input = kj::arrayPtr((const kj::byte*)_pendingInput.data(), _pendingInput.size());
+            return kj::heap<SHSMessageStream>(kj::mv(_ownInner), _streamSession, _protocol,
+                                              _maxMessageSize, input);
+        }
+
+
         kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+            pushPendingInput();
             auto &decryptor = KJ_REQUIRE_NONNULL(_decryptor);
             if (decryptor.bytesAvailable() >= minBytes) {
                 return decryptor.pull(buffer, maxBytes);
@@ -149,7 +326,7 @@ namespace snej::shs {
                                                                 -> kj::Promise<size_t> {
                     if (nBytes == 0)  // this happens when the socket is disconnected
                         return kj::Promise<size_t>(size_t(0));
-                    if (!KJ_REQUIRE_NONNULL(_decryptor).push(buffer, nBytes))
+                    if (!pushInput(buffer, nBytes))
                         throw std::runtime_error("Received corrupt input data");
                     return tryRead(buffer, minBytes, maxBytes);
                 });
@@ -180,6 +357,48 @@ namespace snej::shs {
         }
 
 
+        kj::Promise<void> writeMessage(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+            size_t size = 0;
+            for (auto &piece : pieces)
+                size += piece.size();
+            KJ_REQUIRE(size <= KJ_REQUIRE_NONNULL(_encryptor).maxMessageSize(),
+                       "SecretHandshake message too large", size);
+            return write(pieces);   // `write` sends all the pieces as a single frame
+        }
+
+
+        kj::Promise<void> readMessages(kj::Function<void(kj::ArrayPtr<const kj::byte>)> visitor) override {
+            auto &decryptor = KJ_REQUIRE_NONNULL(_decryptor);
+            KJ_REQUIRE(decryptor.bytesAvailable() == 0, "Stream has unread data");
+            _messageVisitor = kj::mv(visitor);
+            decryptor.setFrameVisitor([this](input_data frame) {
+                KJ_REQUIRE_NONNULL(_messageVisitor)(kj::arrayPtr((const kj::byte*)frame.data,
+                                                                 frame.size));
+            });
+            pushPendingInput();
+            _readBuffer.resize(kReadBufferSize);
+            return readFrames();
+        }
+
+
+        kj::Promise<void> readFrames() {
+            return _inner.tryRead(_readBuffer.data(), 1, _readBuffer.size())
+                    .then([this](size_t nBytes) -> kj::Promise<void> {
+                auto &decryptor = KJ_REQUIRE_NONNULL(_decryptor);
+                if (nBytes == 0) {
+                    decryptor.setFrameVisitor(nullptr);
+                    _messageVisitor = nullptr;
+                    if (!decryptor.close())
+                        return KJ_EXCEPTION(DISCONNECTED, "Unexpected EOF in the middle of a message");
+                    return kj::READY_NOW;
+                }
+                if (!pushInput(_readBuffer.data(), nBytes))
+                    return KJ_EXCEPTION(DISCONNECTED, "Received corrupt input data");
+                return readFrames();    // continue
+            });
+        }
+
+
         void shutdownWrite() override {
             _inner.shutdownWrite();
         }
@@ -206,18 +425,42 @@ namespace snej::shs {
         }
 
     private:
+        static constexpr size_t kReadBufferSize = 65536;
+
         kj::Own<Handshake>           _handshake;
         StreamWrapper::Authorizer    _authorizer;
+        StreamWrapper::AsyncAuthorizer _asyncAuthorizer;
+        ServerHandshake*             _server = nullptr;  // Set if using `_asyncAuthorizer`
         kj::AsyncIoStream&           _inner;
         kj::Own<kj::AsyncIoStream>   _ownInner;
         kj::Maybe<kj::Promise<void>> _shutdownTask;
         kj::Maybe<Session>           _session;
+        Session                      _streamSession;     // Session as of the start of the streams
+        CryptoBox::Protocol          _protocol = CryptoBox::Compact;
+        size_t                       _maxMessageSize = EncryptoBox::kMaxMessageSize;
         kj::Maybe<EncryptionStream>  _encryptor;
         kj::Maybe<DecryptionStream>  _decryptor;
+        std::vector<CryptoBox::Protocol> _protocols;
+        std::vector<uint8_t>         _negotiationBuf;
+        kj::Maybe<kj::Own<ProtocolNegotiator>> _lateOfferCheck; // Checks a silent client's 1st frame
+        std::vector<uint8_t>         _pendingInput;
+        std::vector<uint8_t>         _readBuffer;
+        kj::Maybe<kj::Function<void(kj::ArrayPtr<const kj::byte>)>> _messageVisitor;
+        kj::Maybe<kj::Duration>      _silentClientDelay;
+        kj::Maybe<kj::Timer*>        _timer;
+        bool                         _negotiate;
+        bool                         _negotiationStarted = false;
+        bool                         _silentClient = false;  // Fell back after `peerIsSilent`
         bool                         _isSocket;
+        bool                         _isServer;
     };
 
 
+    SecretMessageStream* SecretMessageStream::from(kj::AsyncIoStream &stream) {
+        return dynamic_cast<WrappedStream*>(&stream);
+    }
+
+
 #pragma mark - CONTEXT:
 
 
@@ -228,7 +471,11 @@ namespace snej::shs {
 
     
     kj::Promise<kj::Own<kj::AsyncIoStream>> StreamWrapper::wrap(kj::Own<kj::AsyncIoStream> stream) {
-        auto conn = kj::heap<WrappedStream>(kj::mv(stream), newHandshake(), _authorizer, _isSocket);
+        auto conn = kj::heap<WrappedStream>(kj::mv(stream), newHandshake(), _authorizer, _asyncAuthorizer,
+                                            _protocols, _negotiate, _isSocket);
+        KJ_IF_MAYBE(delay, _silentClientDelay) {
+            conn->setSilentClientDelay(*delay, *KJ_REQUIRE_NONNULL(_connectTimer));
+        }
         auto promise = conn->connect();
         return promise.then(kj::mvCapture(conn, [](kj::Own<WrappedStream> conn)
                                           -> kj::Own<kj::AsyncIoStream> {
@@ -239,7 +486,11 @@ namespace snej::shs {
 
 
     kj::Promise<kj::AuthenticatedStream> StreamWrapper::wrap(kj::AuthenticatedStream stream) {
-        auto conn = kj::heap<WrappedStream>(kj::mv(stream.stream), newHandshake(), _authorizer, _isSocket);
+        auto conn = kj::heap<WrappedStream>(kj::mv(stream.stream), newHandshake(), _authorizer, _asyncAuthorizer,
+                                            _protocols, _negotiate, _isSocket);
+        KJ_IF_MAYBE(delay, _silentClientDelay) {
+            conn->setSilentClientDelay(*delay, *KJ_REQUIRE_NONNULL(_connectTimer));
+        }
         auto promise = conn->connect();
         KJ_IF_MAYBE(timeout, _connectTimeout) {
             promise = KJ_REQUIRE_NONNULL(_connectTimer)->afterDelay(*timeout).then([]() -> kj::Promise<void> {
@@ -253,6 +504,24 @@ namespace snej::shs {
     }
 
 
+    kj::Promise<kj::Own<SHSMessageStream>> StreamWrapper::wrapMessageStream(kj::Own<kj::AsyncIoStream> stream) {
+        auto conn = kj::heap<WrappedStream>(kj::mv(stream), newHandshake(), _authorizer, _asyncAuthorizer,
+                                            _protocols, _negotiate, _isSocket);
+        KJ_IF_MAYBE(delay, _silentClientDelay) {
+            conn->setSilentClientDelay(*delay, *KJ_REQUIRE_NONNULL(_connectTimer));
+        }
+        auto promise = conn->connect();
+        KJ_IF_MAYBE(timeout, _connectTimeout) {
+            promise = KJ_REQUIRE_NONNULL(_connectTimer)->afterDelay(*timeout).then([]() -> kj::Promise<void> {
+                return KJ_EXCEPTION(DISCONNECTED, "timed out during Secret Handshake");
+            }).exclusiveJoin(kj::mv(promise));
+        }
+        return promise.then([conn=kj::mv(conn)]() mutable {
+            return conn->toMessageStream();
+        });
+    }
+
+
     kj::Own<Handshake> ServerWrapper::newHandshake() {
         return kj::heap<ServerHandshake>(_context);
     }
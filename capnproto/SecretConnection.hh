@@ -6,10 +6,13 @@
 
 #pragma once
 #include "SecretHandshake.hh"
+#include "SecretStream.hh"
 #include <functional>
+#include <vector>
 #include <kj/async-io.h>
 
 namespace snej::shs {
+    class SHSMessageStream;
 
     /// Cap'n Proto AsyncStream wrapper factory for SecretHandshake connections.
     /// This is an abstract class; use `ServerWrapper` or `ClientWrapper`.
@@ -18,6 +21,11 @@ namespace snej::shs {
         /// A server-side callback that accepts or rejects a client given its public key.
         using Authorizer = std::function<bool(PublicKey const&)>;
 
+        /// An asynchronous server-side authorizer, for decisions that need I/O such as a database
+        /// lookup. The handshake waits for the promise, without blocking the event loop, before
+        /// sending its final message; resolving to false rejects the client.
+        using AsyncAuthorizer = std::function<kj::Promise<bool>(PublicKey const&)>;
+
         explicit StreamWrapper(Context const& context)     :_context(context) { }
         virtual ~StreamWrapper() = default;
 
@@ -26,6 +34,27 @@ namespace snej::shs {
         void setIsSocket(bool isSocket)                     {_isSocket = isSocket;}
         bool isSocket() const                               {return _isSocket;}
 
+        /// Sets the single encryption protocol to use after the handshake. Both peers must use
+        /// the same one. Defaults to `CryptoBox::Compact`.
+        void setProtocol(CryptoBox::Protocol p)             {_protocols = {p}; _negotiate = false;}
+
+        /// Enables in-band negotiation of the encryption protocol after the handshake, choosing
+        /// the fastest protocol in `protocols` that the peer also supports; see
+        /// `ProtocolNegotiator`. A server can enable this even if some clients are legacy
+        /// BoxStream peers, as long as `protocols` includes `BoxStream`. A client must only
+        /// enable it if the server negotiates too.
+        void setNegotiatedProtocols(std::vector<CryptoBox::Protocol> protocols) {
+            _protocols = std::move(protocols);
+            _negotiate = true;
+        }
+
+        /// When negotiating, a server assumes that a client that sends nothing for this long
+        /// after the handshake is a legacy peer waiting for the server to send first, and falls
+        /// back to `BoxStream`. Make it well over the round-trip time. Requires a timer to have
+        /// been set by `setConnectTimeout`. By default there's no fallback; such a client just
+        /// times out.
+        void setSilentClientDelay(kj::Duration delay)      {_silentClientDelay = delay;}
+
         /// Upgrades a regular network stream to use SecretHandshake.
         /// The returned promise resolves when the handshake has completed successfully.
         kj::Promise<kj::Own<kj::AsyncIoStream>> wrap(kj::Own<kj::AsyncIoStream>);
@@ -35,6 +64,11 @@ namespace snej::shs {
         /// @note  The stream's `peerIdentity` will be a `SHSPeerIdentity`.
         kj::Promise<kj::AuthenticatedStream> wrap(kj::AuthenticatedStream stream);
 
+        /// Like `wrap`, but returns a Cap'n Proto `MessageStream` that sends each message in its
+        /// own frame(s), for use with `TwoPartyVatNetwork`. The peer must use this too.
+        /// See `SHSMessageStream` for details.
+        kj::Promise<kj::Own<SHSMessageStream>> wrapMessageStream(kj::Own<kj::AsyncIoStream>);
+
 
         /// Async version of `wrap` that takes a promised stream.
         /// The wrapper is passed as a parameter so that it can be NULL, which is a no-op.
@@ -54,8 +88,12 @@ namespace snej::shs {
 
         Context                 _context;
         Authorizer              _authorizer;
+        AsyncAuthorizer         _asyncAuthorizer;
         kj::Maybe<kj::Duration> _connectTimeout;
+        kj::Maybe<kj::Duration> _silentClientDelay;
         kj::Maybe<kj::Timer*>   _connectTimer;
+        std::vector<CryptoBox::Protocol> _protocols {CryptoBox::Compact};
+        bool                    _negotiate = false;
         bool                    _isSocket = true;
     };
 
@@ -72,6 +110,11 @@ namespace snej::shs {
 
         Authorizer const& authorizer() const                {return _authorizer;}
 
+        /// Sets a callback that returns a promise of whether to accept a client, given its
+        /// public key. It's called after the `Authorizer` (if any) accepts the client.
+        void setAsyncAuthorizer(AsyncAuthorizer auth)       {_asyncAuthorizer = kj::mv(auth);}
+        AsyncAuthorizer const& asyncAuthorizer() const      {return _asyncAuthorizer;}
+
     private:
         kj::Own<Handshake> newHandshake() override;
     };
@@ -97,6 +140,29 @@ namespace snej::shs {
 
 
 
+    /// Message-oriented interface to a stream created by `StreamWrapper::wrap`.
+    /// Each message is sent as exactly one encrypted frame, and the receiver gets it as a whole,
+    /// pointing into the decryption buffer, without copying or re-parsing it.
+    class SecretMessageStream {
+    public:
+        /// Returns the message interface of a stream created by `StreamWrapper::wrap`,
+        /// or nullptr if it's some other kind of stream.
+        static SecretMessageStream* from(kj::AsyncIoStream&);
+
+        /// Sends the pieces, gathered into one frame. The total size can't exceed the maximum
+        /// message size, normally `EncryptoBox::kMaxMessageSize`.
+        virtual kj::Promise<void> writeMessage(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) =0;
+
+        /// Reads until EOF, calling the visitor with each message the peer sent with
+        /// `writeMessage`. The array is only valid during the call.
+        /// Don't mix this with the stream's byte-oriented `read` methods.
+        virtual kj::Promise<void> readMessages(kj::Function<void(kj::ArrayPtr<const kj::byte>)> visitor) =0;
+
+    protected:
+        ~SecretMessageStream() = default;
+    };
+
+
     /// PeerIdentity of an AuthenticatedStream produced by a SecretHandshake Context.
     /// Reveals the peer's public key. This is useful for the server, but not for the client
     /// (which had to know the server's public key already, to make the handshake.)
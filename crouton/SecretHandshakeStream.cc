@@ -28,26 +28,29 @@
 #include "../include/SecretHandshake.hh"
 #include "../include/SecretStream.hh"
 #include "crouton/Future.hh"
+#include "crouton/Timer.hh"
 #include "crouton/util/Logging.hh"
 #include <mutex>
+#include <optional>
 
 namespace snej::shs::crouton {
     using namespace std;
     using namespace ::crouton;
 
 
-    shs_printflike(2,0)
-    static void shslog(LogLevel level, const char* format, va_list args)  {
-        char* message = nullptr;
-        if (vasprintf(&message, format, args) >= 0)
-            LNet->log(log::level::level_enum(int(level)), "SecretHandshake: {}", message);
-        free(message);
+    static void shslog(LogEvent const& event)  {
+        char message[100];
+        event.format(message, sizeof(message));
+        LNet->log(log::level::level_enum(int(event.level)), "SecretHandshake: {}", message);
     }
 
 
     SecretHandshake::SecretHandshake(Context const& context, PublicKey const* serverKey) {
         static once_flag sOnce;
-        call_once(sOnce, [] { if (!LogCallback) LogCallback = shslog; });
+        call_once(sOnce, [] {
+            if (!LogEventCallback && !LogCallback)
+                LogEventCallback = shslog;
+        });
 
         if (serverKey)
             _handshake = make_unique<ClientHandshake>(context, *serverKey);
@@ -61,28 +64,110 @@ namespace snej::shs::crouton {
     }
 
 
+    void SecretHandshake::setAsyncClientAuthorizer(std::function<ASYNC<bool>(PublicKey const&)> auth) {
+        dynamic_cast<ServerHandshake&>(*_handshake).setAsyncAuthorization(auth != nullptr);
+        _asyncAuthorizer = std::move(auth);
+    }
+
+
+    // The state of a call to the async authorizer, shared between the handshake and the
+    // coroutine awaiting the authorizer, so that the handshake can stop waiting on a timeout.
+    struct SecretHandshake::AuthorizerCall {
+        bool        done = false;
+        bool        allow = false;
+        CoCondition answered;
+
+        void finish(bool a) {
+            if (!done) {
+                done = true;
+                allow = a;
+                answered.notifyOne();
+            }
+        }
+    };
+
+
+    Task SecretHandshake::awaitAuthorizer(Future<bool> answer, shared_ptr<AuthorizerCall> call) {
+        Result<bool> allow = AWAIT NoThrow(std::move(answer));
+        call->finish(allow.ok() && *allow);
+    }
+
+
     ASYNC<Session> SecretHandshake::handshake(std::shared_ptr<io::IStream> stream) {
         precondition(stream);
         if (!stream->isOpen())
             AWAIT stream->open();
 
+        // If a step takes too long, closing the stream makes its pending I/O fail, and a
+        // pending authorizer call is abandoned:
+        bool timedOut = false;
+        shared_ptr<AuthorizerCall> authCall;
+        optional<Timer> timer;
+        if (_stepTimeout > 0) {
+            timer.emplace([&] {
+                timedOut = true;
+                (void)stream->close();
+                if (authCall)
+                    authCall->finish(false);
+            });
+        }
+
         // Handshake:
+        Error ioError;
         do {
             auto [toSend, sizeToSend] = _handshake->bytesToSend();
             if (sizeToSend > 0) {
-                AWAIT stream->write(ConstBytes{toSend, sizeToSend});
+                if (timer) timer->once(_stepTimeout);
+                Result<void> sent = AWAIT NoThrow(stream->write(ConstBytes{toSend, sizeToSend}));
+                if (timer) timer->stop();
+                if (!sent.ok()) {
+                    ioError = sent.error();
+                    break;
+                }
                 _handshake->sendCompleted();
             }
             auto [toRead, sizeToRead] = _handshake->bytesToRead();
             if (sizeToRead > 0) {
-                size_t n = AWAIT stream->read(MutableBytes{toRead, sizeToRead});
-                if (n == sizeToRead)
+                if (timer) timer->once(_stepTimeout);
+                Result<size_t> n = AWAIT NoThrow(stream->read(MutableBytes{toRead, sizeToRead}));
+                if (timer) timer->stop();
+                if (!n.ok()) {
+                    ioError = n.error();
+                    break;
+                }
+                if (*n == sizeToRead)
                     _handshake->readCompleted();
                 else
                     _handshake->readFailed();
             }
+            if (_asyncAuthorizer) {
+                auto &server = dynamic_cast<ServerHandshake&>(*_handshake);
+                if (server.authorizationPending()) {
+                    authCall = make_shared<AuthorizerCall>();
+                    if (timer) timer->once(_stepTimeout);
+                    awaitAuthorizer(_asyncAuthorizer(server.clientPublicKey()), authCall);
+                    while (!authCall->done)
+                        AWAIT authCall->answered;
+                    if (timer) timer->stop();
+                    bool allow = authCall->allow;
+                    authCall = nullptr;
+                    if (timedOut)
+                        break;
+                    if (!allow)
+                        LNet->error("SecretHandshake authorizer rejected peer");
+                    server.resumeAuthorization(allow);
+                }
+            }
         } while (!_handshake->finished() && !_handshake->error());
 
+        if (timedOut) {
+            LNet->error("SecretHandshake timed out");
+            ioError = SecretHandshakeError::Timeout;
+        }
+        if (ioError) {
+            _handshake = nullptr;
+            RETURN ioError;
+        }
         if (_handshake->error()) {
             Error err(SecretHandshakeError(int(_handshake->error())));
             _handshake = nullptr;
@@ -104,6 +189,7 @@ namespace snej::shs::crouton {
                                                  PublicKey const* serverKey)
     :_stream(stream)
     ,_handshake(context, serverKey)
+    ,_isServer(serverKey == nullptr)
     { }
 
     SecretHandshakeStream::~SecretHandshakeStream() = default;
@@ -113,27 +199,119 @@ namespace snej::shs::crouton {
     void SecretHandshakeStream::setRawStream(shared_ptr<io::IStream> stream) {_stream = std::move(stream);}
 
 
+    void SecretHandshakeStream::setProtocols(vector<CryptoBox::Protocol> protocols, bool negotiate) {
+        precondition(!_open && !protocols.empty());
+        _protocols = std::move(protocols);
+        _negotiate = negotiate;
+    }
+
+
     ASYNC<void> SecretHandshakeStream::open() {
         if (_delegate) {
-            _handshake.setClientAuthorizer([this](PublicKey const& clientKey) {
-                bool ok = _delegate->authorizeSecretHandshake(clientKey);
-                if (!ok)
-                    LNet->error("SecretHandshake delegate rejected peer");
-                return ok;
+            _handshake.setAsyncClientAuthorizer([this](PublicKey const& clientKey) {
+                return _delegate->authorizeSecretHandshakeAsync(clientKey);
             });
         }
 
         Result<Session> session = AWAIT NoThrow(_handshake.handshake(_stream));
+        Error error = session.error();
         if (session.ok()) {
             _peerPublicKey = session->peerPublicKey;
-            _writer = make_unique<EncryptionStream>(*session);
-            _reader = make_unique<DecryptionStream>(*session);
+            if (_negotiate) {
+                Result<void> negotiated = AWAIT NoThrow(negotiateProtocol(*session));
+                error = negotiated.error();
+            } else {
+                startStreams(*session, _protocols[0], EncryptoBox::kMaxMessageSize);
+            }
+        }
+        if (!error) {
             _open = true;
         } else {
             AWAIT _stream->close();
             notifyClosed();
         }
-        RETURN session.error();
+        RETURN error;
+    }
+
+
+    // The client sends its protocol offer, then reads the server's. The server reads the
+    // client's offer, then replies with its own, unless the client is a legacy peer.
+    // Each read and write has the same time limit as a step of the handshake.
+    ASYNC<void> SecretHandshakeStream::negotiateProtocol(Session session) {
+        ProtocolNegotiator negotiator(session,
+                                      _isServer ? ProtocolNegotiator::Server
+                                                : ProtocolNegotiator::Client,
+                                      _protocols);
+        bool timedOut = false;
+        optional<Timer> timer;
+        if (_stepTimeout > 0) {
+            timer.emplace([&] {
+                timedOut = true;
+                (void)_stream->close();
+            });
+        }
+
+        auto sendOffer = [&]() -> ASYNC<void> {
+            input_data offer = negotiator.bytesToSend();
+            if (timer) timer->once(_stepTimeout);
+            Result<void> sent = AWAIT NoThrow(_stream->write(ConstBytes{offer.data, offer.size}));
+            if (timer) timer->stop();
+            if (timedOut)
+                RETURN Error(SecretHandshakeError::Timeout);
+            RETURN sent.error();
+        };
+
+        if (!_isServer)
+            AWAIT sendOffer();
+
+        vector<uint8_t> received;
+        while (true) {
+            if (timer) timer->once(_stepTimeout);
+            Result<ConstBytes> bytes = AWAIT NoThrow(_stream->readNoCopy());
+            if (timer) timer->stop();
+            if (timedOut) {
+                LNet->error("SecretHandshakeStream {} timed out negotiating protocol", (void*)this);
+                RETURN Error(SecretHandshakeError::Timeout);
+            } else if (!bytes.ok()) {
+                RETURN bytes.error();
+            }
+            ConstBytes data = *bytes;
+            if (data.empty())
+                RETURN Error(SecretHandshakeError::ProtocolError);
+            received.insert(received.end(), data.data(), data.data() + data.size());
+            input_data in = {received.data(), received.size()};
+            status_t status = negotiator.receivedBytes(in);
+            if (status == IncompleteInput)
+                continue;
+            else if (status != Success)
+                RETURN Error(SecretHandshakeError::ProtocolError);
+
+            LNet->info("SecretHandshakeStream {} negotiated protocol {}{}", (void*)this,
+                       int(negotiator.protocol()), (negotiator.peerIsLegacy() ? " (legacy peer)" : ""));
+            if (_isServer && negotiator.bytesToSend().size > 0)
+                AWAIT sendOffer();
+            startStreams(negotiator.session(), negotiator.protocol(), negotiator.maxMessageSize());
+            // Any data the peer sent after its offer is the start of the encrypted stream:
+            if (in.size > 0 && !_reader->push(in.data, in.size))
+                RETURN Error(SecretHandshakeError::DataError);
+            RETURN noerror;
+        }
+    }
+
+
+    void SecretHandshakeStream::startStreams(Session const& session,
+                                             CryptoBox::Protocol protocol,
+                                             size_t maxMessageSize)
+    {
+        _writer = make_unique<EncryptionStream>(session, protocol);
+        _writer->setMaxMessageSize(maxMessageSize);
+        _reader = make_unique<DecryptionStream>(session, protocol);
+    }
+
+
+    void SecretHandshakeStream::setMaxWritesInFlight(size_t n) {
+        precondition(n > 0);
+        _maxWritesInFlight = n;
     }
 
 
@@ -153,15 +331,30 @@ namespace snej::shs::crouton {
         _open = false;
         if (!_stream)
             RETURN noerror;
+        Result<void> flushed = AWAIT NoThrow(flushWrites());
         Result<void> result = AWAIT NoThrow(_stream->close());
+        _pendingRead.reset();
         notifyClosed();
-        RETURN result.error();
+        RETURN flushed.ok() ? result.error() : flushed.error();
     }
 
 
     ASYNC<void> SecretHandshakeStream::closeWrite() {
         assert(_stream);
-        return _stream->closeWrite();
+        AWAIT flushWrites();
+        AWAIT _stream->closeWrite();
+        RETURN noerror;
+    }
+
+
+    // Returns the next bytes from the underlying stream: the read-ahead if there is one.
+    ASYNC<ConstBytes> SecretHandshakeStream::readEncrypted() {
+        if (_pendingRead) {
+            Future<ConstBytes> read = std::move(*_pendingRead);
+            _pendingRead.reset();
+            return read;
+        }
+        return _stream->readNoCopy();
     }
 
 
@@ -173,7 +366,7 @@ namespace snej::shs::crouton {
             _lastReadSize = 0;
         }
         while (_reader->bytesAvailable() == 0) {
-            ConstBytes encBytes = AWAIT _stream->readNoCopy();
+            ConstBytes encBytes = AWAIT readEncrypted();
             if (encBytes.empty()) {
                 if (_reader->close()) {
                     LNet->debug("SecretHandshakeStream {} read EOF", (void*)this);
@@ -191,6 +384,9 @@ namespace snej::shs::crouton {
             }
             LNet->debug("SecretHandshakeStream {} has {} bytes available", (void*)this, _reader->availableData().size);
         }
+        // The encrypted bytes have been copied, so start the next read while the caller works:
+        if (_readAhead > 0 && !_pendingRead && _reader->bytesAvailable() < _readAhead)
+            _pendingRead = _stream->readNoCopy();
         input_data avail = _reader->availableData();
         RETURN ConstBytes(avail.data, avail.size);
     }
@@ -209,8 +405,6 @@ namespace snej::shs::crouton {
     }
 
     ASYNC<void> SecretHandshakeStream::write(const ConstBytes buffers[], size_t nBuffers) {
-        _writer->skip(_lastWriteSize);
-        _lastWriteSize = 0;
         if (LNet->level() <= crouton::log::level::debug) {
             size_t total = 0;
             for (size_t i = 0; i < nBuffers; ++i)
@@ -218,14 +412,176 @@ namespace snej::shs::crouton {
             LNet->debug("SecretHandshakeStream {} writing {} bytes", (void*)this, total);
         }
         if (!_open)
-            return CroutonError::InvalidState;
+            RETURN CroutonError::InvalidState;
         for (size_t i = 0; i < nBuffers; ++i)
             _writer->pushPartial(buffers[i].data(), buffers[i].size());
         _writer->flush();
+
         auto encBytes = _writer->availableData();
-        _lastWriteSize = encBytes.size;
         LNet->debug("SecretHandshakeStream {} sending {} encrypted bytes", (void*)this, encBytes.size);
-        return _stream->write(ConstBytes{encBytes.data, encBytes.size});
+        if (_maxWritesInFlight == 1) {
+            // No queue: write straight from the EncryptionStream's buffer, which doesn't change
+            // until the next write, and skip the data once it's been written.
+            if (!_writeQueue.empty()) {
+                if (Result<void> flushed = AWAIT NoThrow(flushWrites()); !flushed.ok())
+                    RETURN flushed.error();
+            }
+            Result<void> result = AWAIT NoThrow(_stream->write(ConstBytes{encBytes.data,
+                                                                          encBytes.size}));
+            _writer->skip(encBytes.size);
+            RETURN result.error();
+        }
+
+        // Move the encrypted data into its own buffer, which stays put until the write is done,
+        // and start writing it:
+        PendingWrite &pending = _writeQueue.emplace_back();
+        pending.data.assign((const uint8_t*)encBytes.data, (const uint8_t*)encBytes.data + encBytes.size);
+        _writer->skip(encBytes.size);
+        pending.done = _stream->write(ConstBytes{pending.data.data(), pending.data.size()});
+
+        // Wait until there's room for another write:
+        while (_writeQueue.size() >= _maxWritesInFlight) {
+            Future<void> done = std::move(*_writeQueue.front().done);
+            Result<void> result = AWAIT NoThrow(std::move(done));
+            _writeQueue.pop_front();
+            if (!result.ok())
+                RETURN result.error();
+        }
+        RETURN noerror;
+    }
+
+
+    // Waits for all writes in progress to complete.
+    ASYNC<void> SecretHandshakeStream::flushWrites() {
+        Error error;
+        while (!_writeQueue.empty()) {
+            Future<void> done = std::move(*_writeQueue.front().done);
+            Result<void> result = AWAIT NoThrow(std::move(done));
+            _writeQueue.pop_front();
+            if (!result.ok() && !error)
+                error = result.error();
+        }
+        RETURN error;
+    }
+
+
+    ASYNC<void> SecretHandshakeStream::writeMessage(ConstBytes message) {
+        if (!_open)
+            return CroutonError::InvalidState;
+        if (message.size() > _writer->maxMessageSize())
+            return CroutonError::InvalidArgument;
+        return write(message);     // `write` sends all its data as a single frame
+    }
+
+
+    ASYNC<void> SecretHandshakeStream::readMessages(std::function<void(ConstBytes)> visitor) {
+        if (!_open)
+            RETURN CroutonError::InvalidState;
+        precondition(_reader->bytesAvailable() == 0);
+        _reader->setFrameVisitor([&](input_data frame) {
+            visitor(ConstBytes(frame.data, frame.size));
+        });
+        Error error;
+        while (true) {
+            ConstBytes encBytes = AWAIT readEncrypted();
+            if (encBytes.empty()) {
+                if (!_reader->close()) {
+                    LNet->error("SecretHandshakeStream {} unexpected EOF!", (void*)this);
+                    error = SecretHandshakeError::DataError;
+                }
+                break;
+            }
+            if (!_reader->push(encBytes.data(), encBytes.size())) {
+                error = SecretHandshakeError::DataError;
+                break;
+            }
+        }
+        _reader->setFrameVisitor(nullptr);
+        if (error)
+            (void)close();
+        RETURN error;
+    }
+
+
+#pragma mark - SERVER:
+
+
+    SecretHandshakeServer::SecretHandshakeServer(Context const& context,
+                                                 uint16_t port,
+                                                 const char* interfaceAddr)
+    :_context(context)
+    ,_tcpServer(make_unique<io::TCPServer>(port, interfaceAddr))
+    { }
+
+    SecretHandshakeServer::~SecretHandshakeServer() {
+        close();
+    }
+
+
+    void SecretHandshakeServer::setProtocols(vector<CryptoBox::Protocol> protocols, bool negotiate) {
+        precondition(!protocols.empty());
+        _protocols = std::move(protocols);
+        _negotiate = negotiate;
+    }
+
+
+    void SecretHandshakeServer::listen(Acceptor acceptor) {
+        precondition(acceptor && !_acceptor);
+        _acceptor = std::move(acceptor);
+        _listening = true;
+        _tcpServer->listen([this](std::shared_ptr<io::TCPSocket> socket) {
+            runHandshake(socket->stream());
+        });
+    }
+
+
+    void SecretHandshakeServer::close() {
+        if (_listening) {
+            _listening = false;
+            _tcpServer->close();
+        }
+    }
+
+
+    Task SecretHandshakeServer::runHandshake(std::shared_ptr<io::IStream> rawStream) {
+        // Wait for a free slot, unless too many connections are waiting already:
+        if (_active >= _maxConcurrent) {
+            if (_waiting >= _maxWaiting) {
+                ++_rejected;
+                LNet->warn("SecretHandshakeServer: too many connections waiting; closing one");
+                (void)rawStream->close();
+                RETURN;
+            }
+            ++_waiting;
+            while (_active >= _maxConcurrent)
+                AWAIT _slotAvailable;
+            --_waiting;
+        }
+        ++_active;
+
+        auto stream = make_shared<SecretHandshakeStream>(rawStream, _context, nullptr);
+        stream->setProtocols(_protocols, _negotiate);
+        stream->setStepTimeout(_stepTimeout);
+        if (_authorizer)
+            stream->setDelegate(this);
+        Result<void> opened = AWAIT NoThrow(stream->open());
+        stream->setDelegate(nullptr);
+
+        --_active;
+        _slotAvailable.notifyOne();
+        if (opened.ok()) {
+            ++_succeeded;
+            _acceptor(std::move(stream));
+        } else {
+            ++_failed;
+            LNet->info("SecretHandshakeServer: handshake failed: {}",
+                       opened.error().description());
+        }
+    }
+
+
+    ASYNC<bool> SecretHandshakeServer::authorizeSecretHandshakeAsync(PublicKey const& key) {
+        return _authorizer(key);
     }
 
 
@@ -258,7 +614,7 @@ namespace snej::shs::crouton {
 namespace crouton {
     string ErrorDomainInfo<snej::shs::crouton::SecretHandshakeError>::description(errorcode_t code) {
         static constexpr string_view kErrorNames[] = {
-            "", "protocol error", "authentication error", "data error" };
+            "", "protocol error", "authentication error", "data error", "timeout" };
         return string(kErrorNames[code]);
     }
 }
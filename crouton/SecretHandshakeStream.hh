@@ -6,12 +6,17 @@
 
 #pragma once
 #include "../include/SecretHandshakeTypes.hh"
+#include "../include/SecretStream.hh"
+#include "crouton/CoCondition.hh"
+#include "crouton/Future.hh"
+#include "crouton/Task.hh"
 #include "crouton/io/IStream.hh"
 #include "crouton/io/ISocket.hh"
+#include "crouton/io/TCPServer.hh"
+#include <deque>
+#include <optional>
 
 namespace snej::shs {
-    class DecryptionStream;
-    class EncryptionStream;
     class Handshake;
 }
 namespace snej::shs::crouton {
@@ -22,6 +27,7 @@ namespace snej::shs::crouton {
         ProtocolError = 1,  // Handshake failed due to bad data
         AuthError,          // Handshake failed because peer rejected public key
         DataError,          // Invalid data received after handshake
+        Timeout,            // Peer took too long to send a handshake message
     };
 
 
@@ -42,13 +48,29 @@ namespace snej::shs::crouton {
         /// If this is not called, the default is to allow any client.
         void setClientAuthorizer(std::function<bool(PublicKey const&)>);
 
+        /// Registers an asynchronous callback that determines whether a client should be allowed
+        /// to connect, for decisions that need I/O like a database lookup. The handshake awaits
+        /// it before sending its final message, while other coroutines keep running.
+        /// It's called after the synchronous authorizer, if there is one, accepts the client.
+        void setAsyncClientAuthorizer(std::function<ASYNC<bool>(PublicKey const&)>);
+
+        /// Sets a time limit on each step of the handshake, i.e. sending or receiving a message,
+        /// or waiting for the async authorizer. If it expires, the stream is closed and the
+        /// handshake fails with `Timeout`. The default is 0, meaning no limit.
+        void setStepTimeout(double secs)                {_stepTimeout = secs;}
+
         /// Performs the handshake.
         /// Upon successful completion, returns the Session struct with the sesssion keys.
         /// On failure, returns a SecretHandshakeError.
         ASYNC<shs::Session> handshake(std::shared_ptr<io::IStream>);
 
     private:
+        struct AuthorizerCall;
+        static Task awaitAuthorizer(Future<bool>, std::shared_ptr<AuthorizerCall>);
+
         std::unique_ptr<shs::Handshake> _handshake;
+        std::function<ASYNC<bool>(PublicKey const&)> _asyncAuthorizer;
+        double                          _stepTimeout = 0;
     };
 
 
@@ -56,6 +78,11 @@ namespace snej::shs::crouton {
     /** Optional delegate interface for a SecretHandshakeStream. */
     struct SecretHandshakeStreamDelegate {
         virtual bool authorizeSecretHandshake(PublicKey const&) {return true;}
+        /// Asynchronous version of `authorizeSecretHandshake`, which it calls by default.
+        /// Override this instead if the decision needs I/O.
+        virtual ASYNC<bool> authorizeSecretHandshakeAsync(PublicKey const& key) {
+            return authorizeSecretHandshake(key);
+        }
         virtual void secretHandshakeStreamClosed() { }
         virtual ~SecretHandshakeStreamDelegate() = default;
     };
@@ -70,6 +97,36 @@ namespace snej::shs::crouton {
                               PublicKey const* serverKey);
         ~SecretHandshakeStream();
 
+        /// Sets the encryption protocol(s) to use after the handshake. Call before `open`.
+        /// If `negotiate` is true, the peers agree in-band on the fastest protocol in `protocols`
+        /// that both support (see `ProtocolNegotiator`.) Otherwise the first protocol is used,
+        /// and the peer must be using the same one. The default is `Compact`, not negotiated.
+        /// A server may negotiate with legacy BoxStream clients, if `protocols` includes
+        /// `BoxStream`, as long as they send first; a client must only negotiate with servers
+        /// that negotiate too.
+        void setProtocols(std::vector<CryptoBox::Protocol> protocols, bool negotiate);
+
+        /// Sets a time limit on each step of the handshake; see `SecretHandshake::setStepTimeout`.
+        /// It also applies to each step of protocol negotiation.
+        void setStepTimeout(double secs)                {_handshake.setStepTimeout(secs);
+                                                         _stepTimeout = secs;}
+
+        /// Enables read-ahead: after reading from the underlying stream, if fewer than
+        /// `maxBuffered` bytes of decrypted data are waiting to be read, the next read is started
+        /// right away, so that data can arrive while the app processes what it has. Only one read
+        /// of the underlying stream is in progress at a time, and its data is decrypted when the
+        /// app has read everything before it. The default is 0, meaning no read-ahead.
+        void setReadAhead(size_t maxBuffered)           {_readAhead = maxBuffered;}
+
+        /// Sets the maximum number of encrypted writes to the underlying stream in progress at
+        /// once. With a limit of N, `write` returns as soon as at most N-1 writes (including its
+        /// own) are still in progress, so the app can encrypt ahead while the socket catches up.
+        /// Each write in progress keeps its own copy of its encrypted data, which bounds memory
+        /// use to N writes. The default is 1: `write` completes when its data has been written,
+        /// and the data isn't copied.
+        /// Writes must not overlap: await each one before starting the next.
+        void setMaxWritesInFlight(size_t n);
+
         bool isOpen() const override;
         ASYNC<void> open() override;
         ASYNC<void> close() override;
@@ -81,6 +138,16 @@ namespace snej::shs::crouton {
         ASYNC<void> write(ConstBytes) override;
         ASYNC<void> write(const ConstBytes buffers[], size_t nBuffers) override;
 
+        /// Message-oriented writing: sends the data as exactly one encrypted frame, which the
+        /// peer's `readMessages` receives as one message. The size can't exceed the maximum
+        /// message size, normally `EncryptoBox::kMaxMessageSize`.
+        ASYNC<void> writeMessage(ConstBytes);
+
+        /// Message-oriented reading: calls the visitor with each message sent by the peer's
+        /// `writeMessage`, until EOF. The bytes point into the stream's buffer and are only valid
+        /// during the call. Don't mix this with the byte-stream read methods.
+        ASYNC<void> readMessages(std::function<void(ConstBytes)> visitor);
+
         /// The connected peer's public key. Stream MUST be open.
         PublicKey const& peerPublicKey() const;
 
@@ -92,6 +159,15 @@ namespace snej::shs::crouton {
         void setRawStream(std::shared_ptr<io::IStream>);
 
     private:
+        struct PendingWrite {
+            std::vector<uint8_t>        data;       // Encrypted bytes being written
+            std::optional<Future<void>> done;       // Result of the underlying write
+        };
+
+        ASYNC<void> negotiateProtocol(Session);
+        ASYNC<ConstBytes> readEncrypted();
+        ASYNC<void> flushWrites();
+        void startStreams(Session const&, CryptoBox::Protocol, size_t maxMessageSize);
         void notifyClosed();
 
         std::shared_ptr<io::IStream>    _stream;
@@ -100,13 +176,95 @@ namespace snej::shs::crouton {
         shs::PublicKey                  _peerPublicKey;
         std::unique_ptr<EncryptionStream> _writer;
         std::unique_ptr<DecryptionStream> _reader;
+        std::vector<CryptoBox::Protocol> _protocols {CryptoBox::Compact};
+        bool                            _negotiate = false;
+        bool                            _isServer;
+        double                          _stepTimeout = 0;
         size_t                          _lastReadSize = 0;
-        size_t                          _lastWriteSize = 0;
+        size_t                          _readAhead = 0;
+        std::optional<Future<ConstBytes>> _pendingRead;     // Read-ahead in progress
+        size_t                          _maxWritesInFlight = 1;
+        std::deque<PendingWrite>        _writeQueue;        // Writes in progress, oldest first
         bool                            _open = false;
     };
 
 
 
+    /** Listens for incoming TCP connections, runs the SecretHandshake on each one, and passes
+        the resulting open SecretHandshakeStreams to the app.
+        Handshakes run concurrently as coroutines, up to a limit; connections accepted beyond it
+        wait for a handshake to finish, up to another limit, beyond which they're closed right
+        away. Each step of a handshake, including protocol negotiation and the authorizer, has a
+        time limit, so clients that go silent don't hold on to a slot.
+        The server must not be destroyed while handshakes are in progress. */
+    class SecretHandshakeServer : private SecretHandshakeStreamDelegate {
+    public:
+        using Acceptor = std::function<void(std::shared_ptr<SecretHandshakeStream>)>;
+        using Authorizer = std::function<ASYNC<bool>(PublicKey const&)>;
+
+        /// Constructs a server; call `listen` to start it.
+        /// @param context  The app ID and the server's key-pair.
+        /// @param port  The TCP port to listen on.
+        /// @param interfaceAddr  The address of the interface to listen on; default is all.
+        SecretHandshakeServer(Context const& context,
+                              uint16_t port,
+                              const char* interfaceAddr = nullptr);
+        ~SecretHandshakeServer();
+
+        /// Sets the maximum number of handshakes in progress at once. Default is 64.
+        void setMaxConcurrentHandshakes(size_t max)     {_maxConcurrent = max;}
+
+        /// Sets the maximum number of connections waiting for a handshake slot. Connections
+        /// accepted when this many are waiting are closed immediately. Default is 1024.
+        void setMaxWaitingConnections(size_t max)       {_maxWaiting = max;}
+
+        /// Sets the time limit on each step of a handshake. Default is 10 seconds.
+        void setStepTimeout(double secs)                {_stepTimeout = secs;}
+
+        /// Sets the encryption protocol(s); see `SecretHandshakeStream::setProtocols`.
+        void setProtocols(std::vector<CryptoBox::Protocol> protocols, bool negotiate);
+
+        /// Sets a callback that decides whether to accept a client, given its public key.
+        /// If none is set, any client is accepted.
+        void setClientAuthorizer(Authorizer a)          {_authorizer = std::move(a);}
+
+        /// Starts listening. The acceptor is called with each stream whose handshake succeeds;
+        /// at that point the stream is open and has no delegate.
+        void listen(Acceptor);
+
+        /// Stops listening. Handshakes already in progress continue.
+        void close();
+
+        size_t activeHandshakes() const                 {return _active;}
+        size_t handshakesSucceeded() const              {return _succeeded;}
+        size_t handshakesFailed() const                 {return _failed;}
+        size_t connectionsWaiting() const               {return _waiting;}
+        size_t connectionsRejected() const              {return _rejected;}
+
+    private:
+        Task runHandshake(std::shared_ptr<io::IStream>);
+        ASYNC<bool> authorizeSecretHandshakeAsync(PublicKey const&) override;
+
+        Context const                       _context;
+        std::unique_ptr<io::TCPServer>      _tcpServer;
+        Acceptor                            _acceptor;
+        Authorizer                          _authorizer;
+        std::vector<CryptoBox::Protocol>    _protocols {CryptoBox::Compact};
+        bool                                _negotiate = false;
+        bool                                _listening = false;
+        size_t                              _maxConcurrent = 64;
+        double                              _stepTimeout = 10.0;
+        size_t                              _maxWaiting = 1024;
+        size_t                              _active = 0;        // Handshakes in progress
+        size_t                              _waiting = 0;       // Connections awaiting a slot
+        size_t                              _rejected = 0;      // Closed because too many waited
+        CoCondition                         _slotAvailable;     // Notified when _active drops
+        size_t                              _succeeded = 0;
+        size_t                              _failed = 0;
+    };
+
+
+
     /** An ISocket implementation that opens a TCPSocket and wraps its stream with a
         SecretHandshakeStream. */
     class SecretHandshakeSocket : public io::ISocket {
@@ -0,0 +1,75 @@
+//
+// AsyncLogSink.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include "SecretHandshakeTypes.hh"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace snej::shs {
+
+    /// Moves logging off the threads running handshakes. While one of these exists, log events
+    /// are pushed into a fixed-size lock-free queue, and a background thread pops them and passes
+    /// them to a handler. So a slow handler (formatting, writing to a file...) doesn't slow down
+    /// handshakes, and logging never blocks.
+    ///
+    /// If the queue is full, the event is dropped and counted, rather than waiting.
+    /// Only one AsyncLogSink can exist at a time.
+    class AsyncLogSink {
+    public:
+        using Handler = std::function<void(LogEvent const&)>;
+
+        /// Creates the sink and starts its thread.
+        /// @param handler  Called on the background thread with each event. If it's empty,
+        ///                 events go to `LogEventCallback` or `LogCallback`, as usual.
+        /// @param capacity  The number of events the queue holds; must be a power of 2.
+        /// @throws std::logic_error if another AsyncLogSink exists.
+        explicit AsyncLogSink(Handler handler = nullptr, size_t capacity = 1024);
+
+        /// Stops logging to this sink, handles the events still in the queue, and stops the thread.
+        ~AsyncLogSink();
+
+        AsyncLogSink(const AsyncLogSink&) = delete;
+        AsyncLogSink& operator=(const AsyncLogSink&) = delete;
+
+        /// Blocks until all events pushed so far have been handled.
+        void flush();
+
+        /// The number of events dropped because the queue was full.
+        uint64_t droppedCount() const       {return _dropped.load(std::memory_order_relaxed);}
+
+        /// Pushes an event. (Called by the library; you don't need to.)
+        void push(LogEvent const&) noexcept;
+
+    private:
+        struct Slot {
+            std::atomic<uint64_t> seq;
+            LogEvent event;
+        };
+
+        bool pop(LogEvent&);
+        void run();
+
+        Handler                     _handler;
+        std::unique_ptr<Slot[]>     _slots;
+        size_t                      _mask;
+        alignas(64) std::atomic<uint64_t> _pushPos = 0;     // Next slot producers will claim
+        alignas(64) uint64_t        _popPos = 0;            // Next slot to pop (consumer only)
+        std::atomic<uint64_t>       _handled = 0;           // Number of events handled
+        std::atomic<uint64_t>       _dropped = 0;
+        std::atomic<bool>           _sleeping = false;      // True while consumer is waiting
+        std::atomic<bool>           _stop = false;
+        std::mutex                  _mutex;
+        std::condition_variable     _cond;
+        std::thread                 _thread;
+    };
+
+}
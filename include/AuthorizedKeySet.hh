@@ -0,0 +1,98 @@
+//
+// AuthorizedKeySet.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include "SecretHandshakeTypes.hh"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace snej::shs {
+
+    /// A set of client public keys allowed to connect to a server, optimized for very large sets
+    /// and for fast rejection of keys that aren't in it.
+    ///
+    /// - The keys are stored in an open-addressing hash table (linear probing, at most half full.)
+    ///   Ed25519 public keys are already uniformly distributed, so their bytes serve as the hash.
+    /// - An optional Bloom filter, 16 bits per key in 64-bit blocks, answers most lookups of
+    ///   absent keys with a single cache-line read; useful once the table outgrows the CPU cache.
+    /// - The table can be saved to a binary file and loaded with `mmap`, so a set of millions of
+    ///   keys loads instantly and its pages are shared between processes.
+    /// - The contents can be replaced at any time, even while other threads are looking up keys.
+    ///   Lookups never block: they're protected by a read-copy-update scheme in which the old
+    ///   table is freed only after every lookup that might be using it has finished.
+    ///
+    /// Use it with `ServerHandshake::setClientPreAuthorizer`, so that unknown clients are
+    /// rejected before the expensive parts of the handshake.
+    ///
+    /// @note  The all-zeroes key can't be stored in the set; it's silently skipped.
+    class AuthorizedKeySet {
+    public:
+        /// Constructs an empty set.
+        AuthorizedKeySet();
+
+        /// Constructs a set containing the given keys.
+        explicit AuthorizedKeySet(std::vector<PublicKey> const& keys, bool bloomFilter = true);
+
+        ~AuthorizedKeySet();
+
+        /// True if the key is in the set. Thread-safe and lock-free.
+        bool contains(PublicKey const&) const;
+
+        /// The number of keys in the set.
+        size_t size() const;
+
+        /// Replaces the contents with the given keys. Thread-safe.
+        void reset(std::vector<PublicKey> const& keys, bool bloomFilter = true);
+
+        /// Replaces the contents with those of a file written by `writeFile`, which is memory-
+        /// mapped rather than read. Thread-safe.
+        /// @warning  Don't modify the file in place while it's loaded; `writeFile` is safe, since
+        ///           it replaces the file instead of overwriting it.
+        /// @throws std::system_error if the file can't be read,
+        ///         std::runtime_error if it isn't a valid key-set file.
+        void loadFile(std::string const& path);
+
+        /// Writes a set of keys to a file that can be loaded by `loadFile`.
+        /// @throws std::system_error if the file can't be written.
+        static void writeFile(std::string const& path,
+                              std::vector<PublicKey> const& keys,
+                              bool bloomFilter = true);
+
+        /// Returns a callback for `ServerHandshake::setClientPreAuthorizer` (or
+        /// `setClientAuthorizer`) that accepts only keys in this set.
+        /// The set must outlive the handshakes using the callback; reloading it is fine.
+        std::function<bool(PublicKey const&)> authorizer() const {
+            return [this](PublicKey const& key) {return contains(key);};
+        }
+
+        AuthorizedKeySet(AuthorizedKeySet const&) = delete;
+        AuthorizedKeySet& operator=(AuthorizedKeySet const&) = delete;
+
+    private:
+        class Table;
+
+        static constexpr size_t kReaderShards = 16;
+
+        // Counts of lookups in progress, per epoch parity. Each thread uses one of
+        // `kReaderShards` of these, each in its own cache line, so concurrent lookups on
+        // different threads don't contend for a counter.
+        struct alignas(64) ReaderShard {
+            std::atomic<size_t> readers[2] {};
+        };
+
+        ReaderShard& myReaderShard() const;
+        void replace(Table*);
+
+        std::atomic<Table*>             _table;         // The current table
+        std::atomic<unsigned>           _epoch {0};     // Parity selects the reader counter
+        mutable ReaderShard             _readers[kReaderShards];
+        std::mutex                      _writeMutex;    // Serializes `replace`
+    };
+
+}
@@ -0,0 +1,112 @@
+//
+// ByteRing.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include "SecretStream.hh"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+namespace snej::shs {
+
+    /// A fixed-capacity ring buffer of bytes, for exactly one producer thread and one consumer
+    /// thread. Neither side ever takes a lock: the producer advances the `head` and the consumer
+    /// the `tail`, each an atomic counter of the total bytes ever written/read.
+    ///
+    /// The ring's state and data can live in memory it doesn't own, such as a shared-memory
+    /// mapping used by two processes. In that case the other process can't be trusted, so the
+    /// counters are sanity-checked and a bogus value just makes the ring look empty or full.
+    class ByteRing {
+    public:
+        /// The shared state of the ring, at the start of its memory; the buffer follows it.
+        /// The two counters are on separate cache lines so the producer and consumer don't contend.
+        struct Header {
+            alignas(64) std::atomic<uint64_t> head;         ///< Total bytes written
+            alignas(64) std::atomic<uint64_t> tail;         ///< Total bytes read
+        };
+
+        /// The number of bytes of memory needed for a ring of the given capacity.
+        static constexpr size_t memorySize(size_t capacity) {return sizeof(Header) + capacity;}
+
+        /// Constructs a ring that allocates its own memory.
+        /// @param capacity  The size of the buffer; must be a power of 2.
+        explicit ByteRing(size_t capacity);
+
+        /// Constructs a ring on existing memory.
+        /// @param memory  At least `memorySize(capacity)` bytes, 64-byte aligned.
+        /// @param capacity  The size of the buffer; must be a power of 2.
+        /// @param initialize  If true, the ring is reset to empty; else its state is preserved.
+        ByteRing(void *memory, size_t capacity, bool initialize);
+
+        ~ByteRing();
+
+        ByteRing(const ByteRing&) = delete;
+        ByteRing& operator=(const ByteRing&) = delete;
+
+        size_t capacity() const                 {return _capacity;}
+
+        //---- Producer side:
+
+        /// The number of bytes that can currently be written.
+        size_t spaceAvailable() const {
+            uint64_t used = _head - _header->tail.load(std::memory_order_acquire);
+            return (used <= _capacity) ? _capacity - used : 0;
+        }
+
+        /// The contiguous free space at the head, which may be less than `spaceAvailable` if it
+        /// wraps around the end of the buffer. Write into it, then call `commit`.
+        output_buffer writable() const {
+            size_t offset = _head & _mask;
+            return {&_data[offset], std::min(spaceAvailable(), _capacity - offset)};
+        }
+
+        /// Makes `n` bytes written into `writable()` available to the consumer.
+        void commit(size_t n) {
+            _head += n;
+            _header->head.store(_head, std::memory_order_release);
+        }
+
+        /// Copies as much of the data as fits into the ring, and returns the number of bytes.
+        size_t write(const void *src, size_t size);
+
+        //---- Consumer side:
+
+        /// The number of bytes that can currently be read.
+        size_t bytesAvailable() const {
+            uint64_t avail = _header->head.load(std::memory_order_acquire) - _tail;
+            return (avail <= _capacity) ? avail : 0;
+        }
+
+        /// The contiguous readable data at the tail, which may be less than `bytesAvailable` if it
+        /// wraps around the end of the buffer. Read from it, then call `consume`.
+        input_data readable() const {
+            size_t offset = _tail & _mask;
+            return {&_data[offset], std::min(bytesAvailable(), _capacity - offset)};
+        }
+
+        /// Frees `n` bytes at the tail, returned by `readable()`, for the producer to reuse.
+        void consume(size_t n) {
+            _tail += n;
+            _header->tail.store(_tail, std::memory_order_release);
+        }
+
+        /// Copies up to `size` bytes out of the ring, and returns the number of bytes.
+        size_t read(void *dst, size_t size);
+
+    private:
+        static void* allocate(size_t capacity);
+
+        Header*     _header;
+        uint8_t*    _data;
+        size_t      _capacity;
+        size_t      _mask;
+        uint64_t    _head;              // Producer's copy of header->head
+        uint64_t    _tail;              // Consumer's copy of header->tail
+        bool        _ownsMemory;
+    };
+
+}
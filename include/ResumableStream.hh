@@ -0,0 +1,143 @@
+//
+// ResumableStream.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include "SecretStream.hh"
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+namespace snej::shs {
+
+    /// A bidirectional encrypted stream that survives losing its connection: after reconnecting,
+    /// the peers pick up exactly where they left off, without another handshake and without
+    /// losing or repeating any data.
+    ///
+    /// Like `ProtocolNegotiator`, it doesn't do any I/O itself. Give it the data to send with
+    /// `write`, and send what `outgoingData` returns over the connection; pass the bytes received
+    /// from the connection to `received`, and get the decrypted data from `read`.
+    ///
+    /// Every frame sent is kept, encrypted, in a bounded retransmit buffer until the peer
+    /// acknowledges it. Acknowledgements are frames too, sent automatically every 16 frames or
+    /// 32KB received. When the connection is lost, both peers call `reconnect` and open a new
+    /// connection. The first thing each sends on it is a short "resume message" giving the number
+    /// of frames it received, authenticated with a key derived from the Session; then each resends
+    /// only the frames the other didn't get. Since those are the original encrypted frames, the
+    /// nonce sequence just continues.
+    ///
+    /// Both peers must use this class, with the same protocol.
+    class ResumableStream {
+    public:
+        using Protocol = CryptoBox::Protocol;
+        using ResumeID = std::array<uint8_t,16>;
+
+        /// The size of a resume message.
+        static constexpr size_t kResumeMessageSize = 16 + 4 + 8 + 16;
+
+        /// The minimum capacity of the retransmit buffer.
+        static constexpr size_t kMinCapacity = 256 * 1024;
+
+        /// Constructs a stream.
+        /// @param session  The session from the handshake.
+        /// @param protocol  The encryption protocol.
+        /// @param retransmitCapacity  The maximum number of bytes of unacknowledged frames to
+        ///                 keep. `write` stops accepting data when this fills up. (The small
+        ///                 acknowledgement frames aren't limited, so it may go slightly over.)
+        /// @throws std::invalid_argument if the capacity is less than `kMinCapacity`, or the
+        ///         protocol is `Compressed` (whose frame sizes aren't known in advance.)
+        ResumableStream(Session const& session,
+                        Protocol protocol = CryptoBox::Compact,
+                        size_t retransmitCapacity = 1 << 20);
+        ~ResumableStream();
+
+        //---- Sending:
+
+        /// Encrypts data to be sent, returning the number of bytes accepted. This will be less
+        /// than `size` if the retransmit buffer fills up; call again after more is acknowledged.
+        size_t write(const void *data, size_t size);
+
+        /// The number of bytes `write` will currently accept.
+        size_t writableBytes() const;
+
+        /// The next bytes to send over the connection, or an empty range if there are none.
+        input_data outgoingData() const;
+
+        /// Call this after sending bytes returned by `outgoingData`.
+        void didSend(size_t byteCount);
+
+        /// The total size of the encrypted frames the peer hasn't acknowledged.
+        size_t unacknowledgedBytes() const          {return _unackedBytes;}
+
+        //---- Receiving:
+
+        /// Call this with bytes received from the connection.
+        /// @return  False if the data is corrupt, or the peer's resume message is invalid.
+        ///          The connection should be closed.
+        [[nodiscard]] bool received(const void *data, size_t size);
+
+        /// The number of decrypted bytes available to `read`.
+        size_t readableBytes() const                {return _readable.size() - _readableStart;}
+
+        /// Reads decrypted bytes, returning the number read.
+        size_t read(void *dst, size_t maxSize);
+
+        //---- Reconnecting:
+
+        /// Call this when the connection is lost, before using a new connection to the peer.
+        /// Anything partially sent or received on the old connection is discarded. The outgoing
+        /// data then starts with a resume message, and the stream waits for the peer's resume
+        /// message before sending any frames. If the new connection fails too, call this again;
+        /// the peers don't need to have called it the same number of times.
+        void reconnect();
+
+        /// True if `reconnect` was called and the peer's resume message hasn't arrived yet.
+        bool isResuming() const                     {return _awaitingResume;}
+
+        /// The ID at the start of the resume messages sent by the peer. A server can use this
+        /// to find the stream an incoming connection wants to resume.
+        ResumeID const& peerResumeID() const        {return _peerID;}
+
+        /// Returns the ID at the start of a resume message.
+        static ResumeID resumeIDOf(const void *resumeMessage);
+
+    private:
+        enum FrameType : uint8_t { kDataFrame, kAckFrame };
+
+        void queueFrame(FrameType, const void *data, size_t size);
+        void sendAck();
+        bool handleAck(uint64_t framesReceived);
+        bool receivedResumeMessage(const uint8_t*);
+        std::array<uint8_t,16> resumeTag(SessionKey const&, const uint8_t *message) const;
+
+        EncryptoBox                 _encryptor;
+        DecryptoBox                 _decryptor;
+        size_t                      _capacity;
+        SessionKey                  _resumeKey, _peerResumeKey;
+        ResumeID                    _id, _peerID;
+
+        std::deque<std::vector<uint8_t>> _unacked;          // Encrypted frames not yet acked
+        uint64_t                    _firstUnacked = 0;      // Number of _unacked.front()
+        size_t                      _unackedBytes = 0;      // Total size of _unacked
+        size_t                      _sendIndex = 0;         // Index in _unacked of next to send
+        size_t                      _sendOffset = 0;        // Offset in that frame
+
+        std::vector<uint8_t>        _input;                 // Received data not yet decrypted
+        std::vector<uint8_t>        _scratch;               // Decryption buffer
+        std::vector<uint8_t>        _readable;              // Decrypted data not yet read
+        size_t                      _readableStart = 0;
+        uint64_t                    _framesReceived = 0;
+        uint64_t                    _framesAcked = 0;       // _framesReceived as of last ack
+        size_t                      _bytesSinceAck = 0;
+
+        std::array<uint8_t,kResumeMessageSize> _resumeMessage;
+        size_t                      _resumeMessageSent = kResumeMessageSize;
+        uint32_t                    _attempt = 0;           // Number of reconnects
+        uint32_t                    _peerAttempt = 0;       // Peer's last accepted reconnect
+        bool                        _awaitingResume = false;
+    };
+
+}
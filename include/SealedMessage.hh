@@ -0,0 +1,115 @@
+//
+// SealedMessage.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include "SecretStream.hh"
+#include <functional>
+
+namespace snej::shs {
+
+    /// One-shot messages sealed to a recipient's long-term public key, for store-and-forward or
+    /// very short exchanges, where the round trips of a handshake would cost more than the
+    /// payload. The recipient authenticates and decrypts a message in one pass; there's no
+    /// interaction between sender and recipient.
+    ///
+    /// A sealed message is `ep | box[key](Ap | sig | message)`, where (as in CheatSheet.md)
+    /// - `K` is the AppID, `A`/`Ap` the sender's key-pair, `B`/`Bp` the recipient's;
+    /// - `e`/`ep` is an ephemeral X25519 key-pair made for this message;
+    /// - `key = hash(K | e·B | ep | Bp)`, with `B` converted to X25519 as in the handshake;
+    /// - `sig = sign[A](K | Bp | ep | hash(message))`;
+    /// - `box` is XChaCha20-Poly1305 with a zero nonce, which is safe since the key is unique.
+    ///
+    /// So only the recipient can read it, and it's bound to the AppID: an app with a different
+    /// one can't open it. The sender's identity is encrypted. Since the signature covers the
+    /// recipient's key, the recipient can't re-seal it to someone else as though it came from
+    /// the sender.
+    ///
+    /// @warning  Unlike a handshake's session, this has no forward secrecy against compromise
+    ///           of the recipient's long-term key, and no replay protection: the same sealed
+    ///           message can be delivered twice. If that matters, deduplicate by the first 32
+    ///           bytes of the sealed message (`ep`), which are unique to each message.
+    class MessageSealer {
+    public:
+        /// The number of bytes a sealed message adds to its payload.
+        static constexpr size_t kOverhead = 32 + 16 + 32 + 64;
+
+        /// Returns the sealed size of a message.
+        static constexpr size_t sealedSize(size_t messageSize)   {return kOverhead + messageSize;}
+
+        /// Constructs a sealer that signs with the Context's key-pair, for its AppID.
+        explicit MessageSealer(Context const& context)          :_context(context) { }
+
+        /// Seals a message to a recipient.
+        /// @param recipient  The recipient's long-term public key.
+        /// @param in  The message. It must not overlap `out`.
+        /// @param out  Where to write the sealed message. On success, `size` is updated to the
+        ///             sealed size.
+        /// @return  `Success` or `OutTooSmall`.
+        status_t seal(PublicKey const& recipient, input_data in, output_buffer &out);
+
+    private:
+        Context const _context;
+    };
+
+
+    /// Opens messages sealed by a `MessageSealer` to this Context's public key.
+    class MessageOpener {
+    public:
+        /// Constructs an opener for messages sealed to the Context's public key and AppID.
+        explicit MessageOpener(Context const& context);
+        ~MessageOpener();
+
+        using SenderAuthorizer = std::function<bool(PublicKey const&)>;
+
+        /// Registers a fast check of a message's claimed sender, called _before_ its signature
+        /// is verified. Returning false rejects the message as `CorruptData` without the costly
+        /// signature check. Like `ServerHandshake::setClientPreAuthorizer`, the key isn't yet
+        /// authenticated, so the callback must have no side effects. It may be called on
+        /// several threads at once by `openAll`.
+        void setSenderPreAuthorizer(SenderAuthorizer a)     {_preAuth = std::move(a);}
+
+        /// Authenticates and decrypts a sealed message.
+        /// @param in  The sealed message.
+        /// @param out  Where to write the message, which is `MessageSealer::kOverhead` bytes
+        ///             smaller than `in`. On success, `size` is updated to the message size.
+        /// @param outSender  If non-null, the sender's authenticated public key is stored here.
+        /// @return  `Success`; `OutTooSmall`; `IncompleteInput` if `in` is too short; or
+        ///          `CorruptData` if it's forged, altered, for a different recipient or AppID,
+        ///          or rejected by the pre-authorizer.
+        status_t open(input_data in, output_buffer &out, PublicKey *outSender = nullptr) const;
+
+        /// The outcome of one message of `openAll`.
+        struct Result {
+            status_t   status;  ///< The status, as returned by `open`
+            input_data message; ///< On success, the message, pointing into the output buffer
+            PublicKey  sender;  ///< On success, the sender's authenticated public key
+        };
+
+        /// Opens a batch of sealed messages, such as a queue being drained, writing them
+        /// consecutively into `out`. Each message is independent: one that fails doesn't stop
+        /// the others. The work is spread over `threads` threads (including the caller's.)
+        /// Messages that don't all fit in `out` get `OutTooSmall`.
+        /// @param messages  An array of `count` sealed messages. None may overlap `out`.
+        /// @param out  Where to write the opened messages. On return, `size` is set to the
+        ///             number of bytes used, including space reserved for failed messages.
+        /// @param results  An array of `count` results.
+        /// @param threads  The number of threads to use; 0 means the number of CPU cores.
+        /// @return  The number of messages successfully opened.
+        size_t openAll(input_data const messages[], size_t count,
+                       output_buffer &out,
+                       Result results[],
+                       unsigned threads = 1) const;
+
+    private:
+        status_t open(input_data in, output_buffer &out, PublicKey *outSender,
+                      std::vector<uint8_t> &scratch) const;
+
+        Context const            _context;
+        std::array<uint8_t,32>   _kxSecret;         // X25519 form of my signing key
+        SenderAuthorizer         _preAuth;
+    };
+
+}
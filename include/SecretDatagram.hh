@@ -0,0 +1,108 @@
+//
+// SecretDatagram.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include "SecretStream.hh"
+#include <array>
+#include <cstdint>
+
+namespace snej::shs {
+
+    /// Datagram-oriented encryption using the keys & nonces from a Session, for unreliable
+    /// transports like UDP, where packets may be lost, duplicated or reordered.
+    ///
+    /// Unlike `EncryptoBox`, whose nonce is implicit and increments with every frame, each
+    /// datagram carries an explicit 64-bit sequence number, and its nonce is the session nonce
+    /// plus that number. So each datagram can be decrypted on its own, in any order.
+    ///
+    /// An encrypted datagram is the big-endian sequence number, the 16-byte MAC, and the
+    /// XChaCha20-Poly1305 ciphertext. (There's no length prefix; the datagram has its own.) The
+    /// sequence number isn't encrypted, but altering it changes the nonce, so it's authenticated.
+    ///
+    /// The key is derived from the session key, so it's safe to use the same Session for a
+    /// stream and for datagrams.
+    class DatagramCrypto {
+    public:
+        /// The number of bytes an encrypted datagram adds to its payload.
+        static constexpr size_t kOverhead = 8 + 16;
+
+        /// Returns the encrypted size of a payload.
+        static constexpr size_t encryptedSize(size_t payloadSize)    {return kOverhead + payloadSize;}
+
+        ~DatagramCrypto();
+
+    protected:
+        DatagramCrypto(SessionKey const& key, Nonce const& nonce);
+        Nonce nonceFor(uint64_t sequence) const;
+
+        SessionKey _key;
+        Nonce      _nonce;
+    };
+
+
+    /// Encrypts datagrams; see `DatagramCrypto`.
+    class DatagramEncryptor : public DatagramCrypto {
+    public:
+        explicit DatagramEncryptor(Session const& session)
+        :DatagramCrypto(session.encryptionKey, session.encryptionNonce) { }
+
+        /// Encrypts a datagram, giving it the next sequence number.
+        /// It's OK for the input to be located at `out.data + kOverhead`; the encryption will
+        /// happen in place.
+        /// @param in  The payload to encrypt.
+        /// @param out  Where to write the encrypted datagram. On success, `size` is updated to
+        ///             the encrypted size.
+        /// @return  `Success` or `OutTooSmall`.
+        status_t encrypt(input_data in, output_buffer &out);
+
+        /// The sequence number the next datagram will have.
+        uint64_t nextSequence() const                   {return _nextSequence;}
+
+    private:
+        uint64_t _nextSequence = 0;
+    };
+
+
+    /// Decrypts datagrams in any order, rejecting duplicates and replays; see `DatagramCrypto`.
+    ///
+    /// It keeps a sliding window of the sequence numbers it's seen, ending at the highest one.
+    /// A datagram is rejected if its number is in the window and already seen, or is older than
+    /// the window. The window is `kWindowSize` datagrams long; a datagram delayed behind more
+    /// newer ones than that is dropped.
+    class DatagramDecryptor : public DatagramCrypto {
+    public:
+        /// The minimum number of sequence numbers tracked behind the highest one received.
+        static constexpr uint64_t kWindowSize = 1024 - 64;
+
+        explicit DatagramDecryptor(Session const& session)
+        :DatagramCrypto(session.decryptionKey, session.decryptionNonce) { }
+
+        /// Verifies and decrypts a datagram.
+        /// It's OK for the output buffer to be the same as the input; decryption will happen
+        /// in place.
+        /// @param in  The encrypted datagram.
+        /// @param out  Where to write the payload. On success, `size` is updated to the payload
+        ///             size.
+        /// @param outSequence  If non-null, the datagram's sequence number is stored here.
+        /// @return  `Success`; `OutTooSmall`; `IncompleteInput` if the datagram is too short;
+        ///          or `CorruptData` if the datagram is forged, altered, a replay, or too old.
+        status_t decrypt(input_data in, output_buffer &out, uint64_t *outSequence = nullptr);
+
+        /// The number of datagrams that have been rejected as replays or as too old.
+        uint64_t replaysRejected() const                {return _replays;}
+
+    private:
+        static constexpr size_t kBlocks = (kWindowSize + 64) / 64;
+
+        bool isReplay(uint64_t sequence) const;
+        void markReceived(uint64_t sequence);
+
+        uint64_t                        _nextSequence = 0;   // 1 + the highest sequence received
+        std::array<uint64_t,kBlocks>    _bitmap {};          // Bits of received sequences
+        uint64_t                        _replays = 0;
+    };
+
+}
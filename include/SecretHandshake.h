@@ -59,6 +59,7 @@ extern "C" {
         SHSSessionKey  decryptionKey;          ///< The session decryption key
         SHSNonce       decryptionNonce;        ///< Nonce to use with the decryption key
         SHSPublicKey   peerPublicKey;          ///< The peer's authenticated public key
+        SHSAppID       appID;                  ///< The AppID used
     } SHSSession;
 
     /// Securely erases the memory occupied by a SHSSession. Call this when finished with it.
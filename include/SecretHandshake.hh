@@ -6,9 +6,12 @@
 
 #pragma once
 #include "SecretHandshakeTypes.hh"
+#include <chrono>
 #include <cstring>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -95,9 +98,9 @@ namespace snej::shs {
             Finished
         };
 
-        explicit Handshake(Context const&);
+        explicit Handshake(Context const&, bool deferKeys = false);
         void nextStep();
-        void failed();
+        void failed(LogEventType why = LogEventType::invalidData);
         virtual bool _receivedBytes(const uint8_t*) =0;          // process received bytes
         virtual void _fillOutputBuffer(std::vector<uint8_t>&) =0;// Resize & fill vector with output
 
@@ -108,6 +111,10 @@ namespace snej::shs {
     private:
         std::vector<uint8_t>    _inputBuffer;               // Unread bytes
         std::vector<uint8_t>    _outputBuffer;              // Unsent bytes
+        uint64_t                _startTime = 0;             // For metrics; 0 if not recording
+        uint64_t                _stepStartTime = 0;         // For metrics
+        uint64_t                _probeStartTime = 0;        // For USDT probes; 0 if not attached
+        uint64_t                _probeStepStartTime = 0;    // For USDT probes
     };
 
 
@@ -129,6 +136,107 @@ namespace snej::shs {
 
 
 
+    /// Server-wide state for `ServerHandshake`s in "cookie mode", a defense against floods of
+    /// spoofed or abandoned connections.
+    ///
+    /// A normal server generates an ephemeral key-pair for every connection it accepts, and keeps
+    /// the full handshake state from then on. In cookie mode, the server's ephemeral key is
+    /// instead derived from a secret held here and the client's challenge; so until a valid
+    /// ClientAuth message arrives, the connection costs only a copy of that challenge and of the
+    /// server's ephemeral public key; a connection that never sends a valid challenge costs
+    /// just the HMAC check of its challenge.
+    /// The messages on the wire are exactly the same, so clients can't tell the difference.
+    ///
+    /// The secret rotates periodically. A handshake fails if its secret has been rotated out,
+    /// i.e. if the client takes between one and two rotation intervals to send its auth.
+    /// Since the server's ephemeral key is no longer random, the jar also remembers which client
+    /// ephemeral keys have completed a handshake with the current secrets, so that a recorded
+    /// handshake can't be replayed.
+    ///
+    /// A CookieJar is thread-safe and can be shared by any number of `ServerHandshake`s.
+    class CookieJar {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        /// Constructs a CookieJar.
+        /// @param context  The application ID and the server's key-pair.
+        /// @param rotationInterval  How often to replace the secret.
+        explicit CookieJar(Context const& context,
+                           clock::duration rotationInterval = std::chrono::minutes(2));
+        ~CookieJar();
+
+        Context const& context() const                  {return _context;}
+
+        /// Replaces the current secret with a new random one. The previous secret remains valid,
+        /// for handshakes in progress, until the next rotation.
+        /// This is called automatically when the rotation interval has elapsed.
+        void rotate();
+
+        CookieJar(CookieJar const&) = delete;
+        CookieJar& operator=(CookieJar const&) = delete;
+
+    private:
+        friend class ServerHandshake;
+        using Secret = std::array<uint8_t, 32>;
+
+        uint64_t currentSecret(Secret&);
+        bool secretForEpoch(uint64_t epoch, Secret&);
+        bool firstUse(uint64_t epoch, const uint8_t *clientEphemeralKey);
+        void _update();
+        void _rotate();
+
+        Context const                   _context;       // App ID and server key-pair
+        clock::duration const           _interval;      // Rotation interval
+        std::mutex                      _mutex;         // Guards everything below
+        clock::time_point               _rotatedAt;     // Time of the last rotation
+        uint64_t                        _epoch = 0;     // Incremented by each rotation
+        Secret                          _secrets[2];    // Current & previous, by epoch parity
+        std::unordered_set<uint64_t>    _used[2];       // Client ephemeral keys seen, by parity
+    };
+
+
+
+    /// A set of Contexts with distinct AppIDs, for a multi-tenant server that accepts several
+    /// application protocols, possibly with different server key-pairs, on one listener.
+    /// A `ServerHandshake` constructed from a ContextSet identifies the AppID from the client's
+    /// challenge, then proceeds with the matching Context. `Session::appID` reports which one.
+    ///
+    /// Identifying the AppID means checking the challenge's HMAC with each AppID in turn; that's
+    /// made cheap by precomputing each AppID's HMAC key state, but is still linear in the
+    /// number of Contexts.
+    class ContextSet {
+    public:
+        ContextSet();
+        explicit ContextSet(std::vector<Context> const&);
+        ~ContextSet();
+
+        /// Adds a Context. Not thread-safe: add all Contexts before starting any handshakes.
+        /// @throws std::invalid_argument if the set already has a Context with the same AppID.
+        void add(Context const&);
+
+        /// The number of Contexts.
+        size_t size() const;
+
+        /// The Contexts, in the order they were added.
+        Context const& operator[](size_t) const;
+
+        /// The Context with the given AppID, or nullptr if none.
+        Context const* find(AppID const&) const;
+
+        /// Returns the Context whose AppID was used to create a ClientChallenge message, or
+        /// nullptr if none; the size must be that of a ClientChallenge (64 bytes.)
+        Context const* findForChallenge(const void *challenge, size_t size) const;
+
+        ContextSet(ContextSet const&) = delete;
+        ContextSet& operator=(ContextSet const&) = delete;
+
+    private:
+        struct Tenant;
+        std::vector<std::unique_ptr<Tenant>> _tenants;
+    };
+
+
+
     /// Server (passive) side of Secret Handshake protocol.
     class ServerHandshake final : public Handshake {
     public:
@@ -136,18 +244,65 @@ namespace snej::shs {
         /// @param context  The application ID and the server's key-pair.
         explicit ServerHandshake(Context const& context);
 
+        /// Constructs a Server in "cookie mode", which keeps almost no state and does no crypto
+        /// until the client has sent a valid challenge; see `CookieJar` for details.
+        /// @param cookieJar  The server-wide secrets, whose context is used.
+        explicit ServerHandshake(std::shared_ptr<CookieJar> cookieJar);
+
+        /// Constructs a multi-tenant Server, which accepts a client using any of the Contexts'
+        /// AppIDs, and authenticates itself with the corresponding key-pair.
+        /// @param contexts  The Contexts; must not be empty.
+        explicit ServerHandshake(std::shared_ptr<ContextSet const> contexts);
+
         using ClientAuthorizer = std::function<bool(PublicKey const&)>;
 
         /// Registers a callback that determines whether a client should be allowed to connect.
         /// It takes the client public key as a parameter, and returns true to allow connection.
         void setClientAuthorizer(ClientAuthorizer a)    {_clientAuth = std::move(a);}
 
+        /// Registers a fast check that runs on the client's public key as soon as it's decrypted,
+        /// _before_ the client's signature is verified. Returning false fails the handshake
+        /// right away, skipping the costliest crypto (a scalar multiplication and an Ed25519
+        /// signature check), which makes rejecting unknown clients much cheaper.
+        /// Since the key is not yet authenticated, the callback must have no side effects;
+        /// use `setClientAuthorizer` for decisions that need an authenticated key.
+        /// `AuthorizedKeySet::authorizer` is designed for this.
+        void setClientPreAuthorizer(ClientAuthorizer a) {_clientPreAuth = std::move(a);}
+
+        /// Enables asynchronous authorization, for when deciding whether to accept a client
+        /// requires I/O, like a database lookup, that shouldn't block the caller's event loop.
+        /// Once the client's key has been verified (and accepted by the `ClientAuthorizer`, if
+        /// any), the handshake pauses: `authorizationPending` becomes true, and it has nothing to
+        /// read or send until you call `resumeAuthorization` with your decision.
+        void setAsyncAuthorization(bool async)          {_asyncAuth = async;}
+
+        /// True if the handshake is paused, awaiting a call to `resumeAuthorization`.
+        bool authorizationPending() const               {return _authPending;}
+
+        /// The client's verified public key. Call this when `authorizationPending` is true.
+        PublicKey clientPublicKey() const;
+
+        /// Resumes a paused handshake with the app's decision. If `allow` is true, the handshake
+        /// continues and will next send the last message; else it fails with `AuthError`.
+        /// @throws std::logic_error if `authorizationPending` is false.
+        void resumeAuthorization(bool allow);
+
         size_t byteCountNeeded() override;
     protected:
         bool _receivedBytes(const uint8_t *bytes) override;
         void _fillOutputBuffer(std::vector<uint8_t>&) override;
+        bool recreateCookieHandshake();
 
         ClientAuthorizer _clientAuth;
+        ClientAuthorizer _clientPreAuth;
+        bool             _asyncAuth = false;
+        bool             _authPending = false;
+
+        std::shared_ptr<ContextSet const> _contexts;    // Only in multi-tenant mode
+        std::shared_ptr<CookieJar> _cookieJar;          // Only in cookie mode
+        std::array<uint8_t,64>     _cookieChallenge;    // Client's challenge, in cookie mode
+        std::array<uint8_t,32>     _cookieEphemeralKey; // Server's ephemeral public key, in cookie mode
+        uint64_t                   _cookieEpoch = 0;    // CookieJar epoch of ServerChallenge
     };
 
 }
@@ -108,15 +108,61 @@ namespace snej::shs {
         Nonce       decryptionNonce;        ///< Nonce to use with the decryption key
 
         PublicKey   peerPublicKey;          ///< The peer's authenticated public key
+        AppID       appID;                  ///< The app ID; on a multi-tenant server, identifies the Context
 
         ~Session();
     };
 
 
     /// Log levels; same values as spdlog or Crouton.
-    enum class LogLevel { trace, debug, info, warn, err, critical, off };
+    enum class LogLevel : uint8_t { trace, debug, info, warn, err, critical, off };
+
+    /// The kinds of events a Handshake logs.
+    enum class LogEventType : uint8_t {
+        awaitingBytes,      ///< (debug) Waiting to read `byteCount` bytes in `step`
+        receivedPartial,    ///< (debug) Received `byteCount` bytes, but needs more
+        stepOK,             ///< (debug) Received valid data in `step`
+        sendingBytes,       ///< (debug) Has `byteCount` bytes to send in `step`
+        sentPartial,        ///< (debug) Sent `byteCount` bytes, with more to go
+        sendCompleted,      ///< (debug) Finished sending the data of `step`
+        succeeded,          ///< (info)  The handshake finished
+        invalidData,        ///< (err)   Received invalid data in `step`; the handshake failed
+        unexpectedEOF,      ///< (err)   The peer disconnected in `step`; the handshake failed
+        awaitingAuthorization, ///< (debug) Paused until the app decides whether to accept the client
+        authorizationRejected, ///< (err)   The app rejected the client; the handshake failed
+    };
+
+    /// A log message from a Handshake, as a small struct instead of a string; it's only
+    /// formatted if and when `format` is called.
+    struct LogEvent {
+        const void*     handshake;      ///< The Handshake that logged it (only as an identifier)
+        LogLevel        level;
+        LogEventType    type;
+        uint8_t         step;           ///< Handshake step: 1 (client challenge) to 4 (server ack)
+        uint8_t         error;          ///< A `Handshake::Error` value; nonzero on failure
+        uint32_t        byteCount;      ///< Number of bytes, for events that have one
+
+        /// Writes the event as a readable message. Like `snprintf`, the output is truncated if
+        /// it doesn't fit, and the return value is the full length.
+        int format(char *buffer, size_t bufferSize) const;
+    };
+
+    /// Sets the minimum level of events that are logged. Events below it are skipped before
+    /// doing any other work. The default is `info`.
+    ///
+    /// (`trace` and `debug` events are also compiled out of release builds unless the library
+    /// is built with `SHS_MIN_LOG_LEVEL=0`.)
+    void setLogLevel(LogLevel);
+
+    /// The current minimum log level.
+    LogLevel logLevel();
+
+    /// Optional callback to receive log events. It's called on the thread running the handshake,
+    /// unless an `AsyncLogSink` exists.
+    extern void (*LogEventCallback)(LogEvent const&);
 
-    /// Optional callback to receive log messages created by SecretHandshake.
+    /// Optional callback to receive log messages created by SecretHandshake, as format strings.
+    /// It's not called if `LogEventCallback` is set.
     extern void (*LogCallback)(LogLevel, const char* format, va_list args) shs_printflike(2,0);
 
 }
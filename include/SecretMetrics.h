@@ -0,0 +1,78 @@
+//
+//  SecretMetrics.h
+//
+//  Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#ifndef SecretMetrics_h
+#define SecretMetrics_h
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/// The number of steps in a handshake: client challenge, server challenge, client auth and
+/// server ack.
+#define SHS_METRICS_STEPS 4
+
+/// The number of buckets in a latency histogram. The last one has no upper bound.
+#define SHS_METRICS_BUCKETS 16
+
+/// The upper bounds, in microseconds, of the histogram buckets (except the last.)
+extern const uint32_t SHSMetrics_BucketBoundsMicros[SHS_METRICS_BUCKETS - 1];
+
+/// A latency histogram with fixed buckets.
+typedef struct SHSHistogram {
+    uint64_t buckets[SHS_METRICS_BUCKETS];  ///< Number of samples in each bucket (not cumulative)
+    uint64_t count;                         ///< Total number of samples
+    uint64_t sumMicros;                     ///< Sum of the samples, in microseconds
+} SHSHistogram;
+
+/// A snapshot of the library's metrics.
+typedef struct SHSMetrics {
+    uint64_t handshakesStarted;
+    uint64_t handshakesSucceeded;
+    /// Failed handshakes, indexed by error (0 = ProtocolError, 1 = AuthError) and by the step
+    /// that failed (0 = client challenge ... 3 = server ack.)
+    uint64_t handshakesFailed[2][SHS_METRICS_STEPS];
+    /// The time each handshake step took, including waiting for the peer.
+    SHSHistogram stepLatency[SHS_METRICS_STEPS];
+    /// The total time of each successful handshake.
+    SHSHistogram handshakeLatency;
+
+    uint64_t framesEncrypted;               ///< Frames encrypted by all `EncryptoBox`es
+    uint64_t bytesEncrypted;                ///< Cleartext bytes in those frames
+    uint64_t framesDecrypted;               ///< Frames successfully decrypted by `DecryptoBox`es
+    uint64_t bytesDecrypted;                ///< Cleartext bytes in those frames
+    uint64_t decryptionFailures;            ///< Frames rejected as corrupt (usually a bad MAC)
+} SHSMetrics;
+
+
+/// Turns metrics collection on or off. It's off by default.
+/// While off, the only cost is a check of a flag in each handshake step and each frame.
+void SHSMetrics_SetEnabled(bool enabled);
+
+/// True if metrics collection is on.
+bool SHSMetrics_IsEnabled(void);
+
+/// Copies the current metrics, summed over all threads, into `metrics`.
+void SHSMetrics_GetSnapshot(SHSMetrics *metrics);
+
+/// Resets all metrics to zero.
+void SHSMetrics_Reset(void);
+
+/// Writes a snapshot in the Prometheus text exposition format. Like `snprintf`, the output is
+/// truncated if it doesn't fit, and the return value is the full length (not including the
+/// trailing null byte.)
+size_t SHSMetrics_WritePrometheusText(const SHSMetrics *metrics, char *buffer, size_t bufferSize);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SecretMetrics_h */
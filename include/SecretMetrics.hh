@@ -0,0 +1,40 @@
+//
+// SecretMetrics.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include "SecretMetrics.h"
+#include <string>
+
+namespace snej::shs {
+
+    /// Optional counters and latency histograms for handshakes and encrypted frames.
+    ///
+    /// Collection is off until you call `Metrics::enable(true)`. The counters are sharded across
+    /// cache lines, and each thread updates its own shard with relaxed atomic increments, so
+    /// collecting is cheap even with many threads; a snapshot sums the shards.
+    ///
+    /// The snapshot is a plain C struct, `SHSMetrics`, so it's the same from C and C++.
+    class Metrics {
+    public:
+        using Snapshot = SHSMetrics;
+
+        /// Turns metrics collection on or off. It's off by default.
+        static void enable(bool);
+
+        /// True if metrics collection is on.
+        static bool enabled();
+
+        /// Returns the current metrics, summed over all threads.
+        static Snapshot snapshot();
+
+        /// Resets all metrics to zero.
+        static void reset();
+
+        /// Formats a snapshot in the Prometheus text exposition format.
+        static std::string prometheusText(Snapshot const&);
+    };
+
+}
@@ -0,0 +1,44 @@
+//
+// SecretProfiler.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include <string>
+
+namespace snej::shs {
+
+    /// Results of the profiling build mode, for finding out which crypto primitive a handshake
+    /// or stream spends its time in.
+    ///
+    /// If the library is built with `SHS_PROFILE` (a CMake option), the handshake code and
+    /// CryptoBoxes record a "span" -- a name with start and end timestamps, from the CPU's cycle
+    /// counter where there is one -- for each handshake operation, each primitive call (X25519,
+    /// Ed25519 sign/check, SHA-256, HMAC-SHA-512, boxing), and each frame encrypted or decrypted.
+    /// Each thread records into its own buffer without locking. Don't use this mode in production!
+    ///
+    /// The functions here read or clear the buffers of all threads. Call them only while no
+    /// other threads are using the library, such as at the end of a benchmark.
+    class Profiler {
+    public:
+        /// True if the library was built with profiling; otherwise nothing is recorded.
+        static bool available();
+
+        /// Discards all recorded spans and statistics.
+        static void reset();
+
+        /// Returns the spans in Chrome's Trace Event JSON format, which can be opened in
+        /// `chrome://tracing` or <https://ui.perfetto.dev> to view a flame chart.
+        /// Each thread keeps at most `kMaxSpansPerThread` spans; later ones are only counted
+        /// in the summary.
+        static std::string chromeTraceJSON();
+
+        /// Returns a table of the number of calls, total time and self time (excluding nested
+        /// spans) of each kind of span, most expensive first.
+        static std::string summaryTable();
+
+        static constexpr size_t kMaxSpansPerThread = 100'000;
+    };
+
+}
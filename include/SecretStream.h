@@ -15,7 +15,10 @@ extern "C" {
 
 typedef enum {
     Compact,    ///< Less overhead, but message lengths are eavesdroppable.
-    BoxStream   ///< Scuttlebutt-compatible. More overhead, but msg lengths are encrypted.
+    BoxStream,  ///< Scuttlebutt-compatible. More overhead, but msg lengths are encrypted.
+    AES256GCM,  ///< Like Compact, but uses AES-256-GCM; fastest on CPUs with AES-NI.
+    MACOnly,    ///< Authenticated but NOT ENCRYPTED; for trusted same-host links only.
+    Compressed, ///< Like Compact, but compresses messages (with LZ4) before encrypting.
 } SHSCryptoBoxProtocol;
 
 typedef enum {
@@ -26,6 +29,10 @@ typedef enum {
 } SHSStatus;
 
 
+/// True if this CPU has AES instructions, making the `AES256GCM` protocol faster than the others.
+bool SHSCryptoBox_AESIsHardwareAccelerated(void);
+
+
 //-------- ENCRYPTION:
 
 /// Message-oriented encryption using keys & nonces from a Session.
@@ -51,6 +58,38 @@ size_t SHSEncryptoBox_GetEncryptedSize(SHSEncryptoBox*, size_t inputSize);
 /// @return  The status, either `Success` or `OutTooSmall`.
 SHSStatus SHSEncryptoBox_Encrypt(SHSEncryptoBox*, SHSInputBuffer in, SHSOutputBuffer* out);
 
+/// Returns the encrypted size of a message sent with `SHSEncryptoBox_EncryptMessage`.
+size_t SHSEncryptoBox_GetEncryptedMessageSize(SHSEncryptoBox*, size_t inputSize);
+
+/// Encrypts a message of any size as a sequence of frames, to be read by an
+/// `SHSMessageReassembler`. `in` must not overlap `out`.
+/// @return  The status, either `Success` or `OutTooSmall`.
+SHSStatus SHSEncryptoBox_EncryptMessage(SHSEncryptoBox*, SHSInputBuffer in, SHSOutputBuffer* out);
+
+/// The outcome of one item of a batched call (`SHSEncryptoBox_EncryptMany` or
+/// `SHSDecryptoBox_DecryptAll`.)
+typedef struct SHSBatchResult {
+    SHSStatus status;       ///< `Success`, or the reason this item was not processed
+    SHSInputBuffer data;    ///< On success, the item's output, pointing into the output buffer
+} SHSBatchResult;
+
+/// Encrypts a batch of messages in one call, as though `SHSEncryptoBox_Encrypt` were called on
+/// each in order, writing the frames consecutively into `out`.
+/// Stops at the first message that doesn't fit; that message and the ones after it are not
+/// encrypted, and the nonce is left ready for them, so they can be passed to another call.
+/// @param messages  An array of `count` messages to encrypt. None may overlap `out`.
+/// @param out  Where to write the encrypted frames.
+///             On entry `out.data` must be set and `out.size` must be the maximum capacity.
+///             On return, `out.size` will be set to the total number of bytes written.
+/// @param results  An array of `count` results (or NULL.) Each encrypted message's result has
+///             status `Success` and points to its frame in `out`. If the batch stopped early,
+///             the result of the first unencrypted message holds the reason.
+/// @return  The number of messages encrypted.
+size_t SHSEncryptoBox_EncryptMany(SHSEncryptoBox*,
+                                  const SHSInputBuffer messages[], size_t count,
+                                  SHSOutputBuffer *out,
+                                  SHSBatchResult results[]);
+
 
 //-------- DECRYPTION:
 
@@ -110,6 +149,151 @@ SHSPeekResult  SHSDecryptoBox_Peek(SHSDecryptoBox*, SHSInputBuffer);
 /// @return  The status; see the description of the 'status' enum values.
 SHSStatus SHSDecryptoBox_Decrypt(SHSDecryptoBox*, SHSInputBuffer *in, SHSOutputBuffer *out);
 
+/// Decrypts as many consecutive messages as possible from `in` in one call, as though
+/// `SHSDecryptoBox_Decrypt` were called repeatedly, writing them consecutively into `out`.
+/// Stops when the input has no complete message left, when the next message doesn't fit in
+/// `out`, when it's corrupt, or after `maxResults` messages.
+///
+/// @param in  Data from the stream. On return, **this will be adjusted** past the messages that
+///            were decrypted, exactly as `SHSDecryptoBox_Decrypt` does; the remaining bytes
+///            start with the next message, which may be incomplete.
+/// @param out  Where to write the decrypted messages.
+///             On input, its `data` must be set, and `size` must be the maximum capacity.
+///             On return, its `size` will be set to the total number of bytes written.
+/// @param results  An array of `maxResults` results. Each decrypted message's result has
+///             status `Success` and points to its cleartext in `out`. If fewer than `maxResults`
+///             messages were decrypted, the next result holds the reason: `IncompleteInput`
+///             (including when `in` is now empty), `OutTooSmall` or `CorruptData`.
+/// @return  The number of messages decrypted.
+size_t SHSDecryptoBox_DecryptAll(SHSDecryptoBox*,
+                                 SHSInputBuffer *in,
+                                 SHSOutputBuffer *out,
+                                 SHSBatchResult results[], size_t maxResults);
+
+
+/// Reassembles messages of any size sent by `SHSEncryptoBox_EncryptMessage`.
+typedef struct SHSMessageReassembler SHSMessageReassembler;
+
+/// Constructs an `SHSMessageReassembler` from the decryption key and nonce of a SHSSession.
+/// Messages larger than `maxMessageSize` are rejected.
+SHSMessageReassembler* SHSMessageReassembler_Create(const SHSSession *session,
+                                                    SHSCryptoBoxProtocol,
+                                                    size_t maxMessageSize);
+
+void SHSMessageReassembler_Free(SHSMessageReassembler*);
+
+/// Assembles messages in the caller's buffer instead of an internal one. It must have room for
+/// the message plus one frame's overhead. Pass `{NULL, 0}` to go back to the internal buffer.
+void SHSMessageReassembler_SetBuffer(SHSMessageReassembler*, SHSOutputBuffer);
+
+/// Consumes encrypted frames from `in` until a message is complete, returning `Success`;
+/// or `IncompleteInput` if more data is needed. `OutTooSmall` means the message was too big.
+SHSStatus SHSMessageReassembler_Receive(SHSMessageReassembler*, SHSInputBuffer *in);
+
+/// Returns the message completed by the last call to `SHSMessageReassembler_Receive`.
+/// It's valid until the next call to `SHSMessageReassembler_Receive`.
+SHSInputBuffer SHSMessageReassembler_GetMessage(SHSMessageReassembler*);
+
+
+//-------- STREAMS:
+
+
+/// Stream-oriented encryption: you push cleartext bytes into it, and pull encrypted bytes out.
+/// Data is buffered as needed. (This wraps the C++ class `EncryptionStream`.)
+///
+/// To avoid copying, you can write cleartext directly into the stream's buffer with
+/// `SHSEncryptionStream_Reserve` and `_Commit`, and write ciphertext to a socket directly from
+/// it with `SHSEncryptionStream_AvailableData` and `_Skip`.
+typedef struct SHSEncryptionStream SHSEncryptionStream;
+
+/// Constructs an `SHSEncryptionStream` from the encryption key and nonce of a SHSSession.
+SHSEncryptionStream* SHSEncryptionStream_Create(const SHSSession *session, SHSCryptoBoxProtocol);
+
+void SHSEncryptionStream_Free(SHSEncryptionStream*);
+
+/// Sets the maximum size of an encrypted message; larger pushes are split up.
+/// Defaults to, and can't be larger than, 65535.
+void SHSEncryptionStream_SetMaxMessageSize(SHSEncryptionStream*, size_t maxSize);
+
+/// Encrypts data. The ciphertext is then available to pull.
+void SHSEncryptionStream_Push(SHSEncryptionStream*, const void *data, size_t size);
+
+/// Appends cleartext data to the internal buffer, but doesn't encrypt it until
+/// `SHSEncryptionStream_Flush` is called.
+void SHSEncryptionStream_PushPartial(SHSEncryptionStream*, const void *data, size_t size);
+
+/// Returns space in the internal buffer for up to `size` bytes of cleartext (possibly less.)
+/// Write the data there, then call `SHSEncryptionStream_Commit`, with no other calls in between.
+/// This invalidates the pointer returned by `SHSEncryptionStream_AvailableData`.
+SHSOutputBuffer SHSEncryptionStream_Reserve(SHSEncryptionStream*, size_t size);
+
+/// Adds the first `size` bytes written to the space returned by `SHSEncryptionStream_Reserve`,
+/// as with `SHSEncryptionStream_PushPartial`.
+void SHSEncryptionStream_Commit(SHSEncryptionStream*, size_t size);
+
+/// Encrypts all data added by `SHSEncryptionStream_PushPartial` or `_Commit`.
+void SHSEncryptionStream_Flush(SHSEncryptionStream*);
+
+/// Returns the number of encrypted bytes available to pull.
+size_t SHSEncryptionStream_BytesAvailable(SHSEncryptionStream*);
+
+/// Returns a pointer to the encrypted data in the internal buffer, and its size, without copying.
+/// Call `SHSEncryptionStream_Skip` after using it. The pointer is invalidated by a push.
+SHSInputBuffer SHSEncryptionStream_AvailableData(SHSEncryptionStream*);
+
+/// Removes up to `size` bytes of encrypted data from the buffer, returning the number removed.
+size_t SHSEncryptionStream_Skip(SHSEncryptionStream*, size_t size);
+
+/// Copies up to `maxSize` bytes of encrypted data to `dst` and removes it from the buffer,
+/// returning the number of bytes copied.
+size_t SHSEncryptionStream_Pull(SHSEncryptionStream*, void *dst, size_t maxSize);
+
+
+/// Stream-oriented decryption: you push encrypted bytes into it, and pull decrypted bytes out.
+/// Data is buffered as needed. (This wraps the C++ class `DecryptionStream`.)
+///
+/// To avoid copying, you can read from a socket directly into the stream's buffer with
+/// `SHSDecryptionStream_Reserve` and `_Commit`, and read the cleartext directly from it with
+/// `SHSDecryptionStream_AvailableData` and `_Skip`.
+typedef struct SHSDecryptionStream SHSDecryptionStream;
+
+/// Constructs an `SHSDecryptionStream` from the decryption key and nonce of a SHSSession.
+SHSDecryptionStream* SHSDecryptionStream_Create(const SHSSession *session, SHSCryptoBoxProtocol);
+
+void SHSDecryptionStream_Free(SHSDecryptionStream*);
+
+/// Adds encrypted data, and decrypts all the complete messages.
+/// @return  True on success, false if the data is corrupted.
+bool SHSDecryptionStream_Push(SHSDecryptionStream*, const void *data, size_t size);
+
+/// Returns space in the internal buffer for `size` bytes of encrypted data. Write the data there,
+/// then call `SHSDecryptionStream_Commit`, with no other calls in between.
+/// This invalidates the pointer returned by `SHSDecryptionStream_AvailableData`.
+SHSOutputBuffer SHSDecryptionStream_Reserve(SHSDecryptionStream*, size_t size);
+
+/// Adds the first `size` bytes written to the space returned by `SHSDecryptionStream_Reserve`,
+/// then decrypts as with `SHSDecryptionStream_Push`.
+/// @return  True on success, false if the data is corrupted.
+bool SHSDecryptionStream_Commit(SHSDecryptionStream*, size_t size);
+
+/// Call this when the encrypted stream ends.
+/// @return  True if this is a clean close, false if there's an incomplete message.
+bool SHSDecryptionStream_Close(SHSDecryptionStream*);
+
+/// Returns the number of decrypted bytes available to pull.
+size_t SHSDecryptionStream_BytesAvailable(SHSDecryptionStream*);
+
+/// Returns a pointer to the decrypted data in the internal buffer, and its size, without copying.
+/// Call `SHSDecryptionStream_Skip` after using it. The pointer is invalidated by a push.
+SHSInputBuffer SHSDecryptionStream_AvailableData(SHSDecryptionStream*);
+
+/// Removes up to `size` bytes of decrypted data from the buffer, returning the number removed.
+size_t SHSDecryptionStream_Skip(SHSDecryptionStream*, size_t size);
+
+/// Copies up to `maxSize` bytes of decrypted data to `dst` and removes it from the buffer,
+/// returning the number of bytes copied.
+size_t SHSDecryptionStream_Pull(SHSDecryptionStream*, void *dst, size_t maxSize);
+
 
 #ifdef __cplusplus
 }
@@ -6,10 +6,14 @@
 
 #pragma once
 #include "SecretHandshakeTypes.hh"
+#include <functional>
+#include <memory>
 #include <utility>
 #include <vector>
 
 namespace snej::shs {
+    namespace impl { class aes256gcm; }
+    class ByteRing;
 
     /// Points to immutable data to be encrypted or decrypted.
     struct input_data {
@@ -42,26 +46,66 @@ namespace snej::shs {
         /// Data format to use for encrypted messages.
         enum Protocol {
             Compact,    ///< Less overhead, but message lengths are eavesdroppable.
-            BoxStream   ///< Scuttlebutt-compatible. More overhead, but msg lengths are encrypted.
+            BoxStream,  ///< Scuttlebutt-compatible. More overhead, but msg lengths are encrypted.
+            AES256GCM,  ///< Like Compact, but uses AES-256-GCM; fastest on CPUs with AES-NI.
+            MACOnly,    ///< Like Compact, but NOT ENCRYPTED: only authenticated. See warning below.
+            Compressed, ///< Like Compact, but compresses messages first. See note below.
         };
+        // WARNING: `MACOnly` sends the message data in cleartext! Each message is authenticated
+        // (with Poly1305, keyed from the session) so it can't be forged, altered, reordered or
+        // replayed, but anyone who can observe the connection can read it. Use this only for
+        // links that never leave a trusted host, where confidentiality isn't needed. Both
+        // peers must request it explicitly; `ProtocolNegotiator` never chooses it on its own.
+        //
+        // NOTE: `Compressed` compresses each message with a `Codec` (LZ4 by default) before
+        // encrypting it, unless that wouldn't make it smaller. The codec and uncompressed size
+        // are inside the encrypted payload. Compression pays off on text-like traffic over slow
+        // links, but the ciphertext size reveals how compressible a message is, which can leak
+        // secrets mixed with attacker-chosen data (as in the CRIME attack.) Like MACOnly it's
+        // opt-in: `ProtocolNegotiator` only chooses it if both peers ask for it.
+
+        /// Compression algorithms used by the `Compressed` protocol.
+        enum Codec : uint8_t {
+            Uncompressed,   ///< No compression
+            LZ4,            ///< LZ4: very fast, modest compression. The default.
+            Zstd,           ///< Zstandard: better compression but slower. Requires SHS_ZSTD.
+        };
+
+        /// True if this build supports a codec.
+        static bool codecAvailable(Codec);
 
         /// Returns the encrypted size of a message. (It will be somewhat larger than the input.)
+        /// With the `Compressed` protocol this is the maximum size; it's usually smaller.
         size_t encryptedSize(size_t inputSize);
 
+        /// The maximum byte length of a message this box can encrypt: `kMaxMessageSize`,
+        /// except one less with the `Compressed` protocol.
+        size_t maxMessageSize() const;
+
+        /// True if this CPU has AES instructions, making the `AES256GCM` protocol faster than
+        /// the others. (If not, `AES256GCM` still works, but it's much slower.)
+        static bool aesIsHardwareAccelerated();
+
+        /// The protocol this box uses.
+        Protocol protocol() const               {return _protocol;}
+
+        /// The nonce that will be used for the next message.
+        Nonce const& nonce() const              {return _nonce;}
+
         ~CryptoBox();
 
     protected:
-        CryptoBox(SessionKey const& key, Nonce const& nonce, Protocol protocol =Compact)
-        :_key(key)
-        ,_nonce(nonce)
-        ,_protocol(protocol)
-        { }
+        CryptoBox(SessionKey const& key, Nonce const& nonce, Protocol protocol =Compact);
 
         struct BoxStreamHeader;
 
+        impl::aes256gcm& aes();
+
         SessionKey const _key;
         Nonce            _nonce;
         Protocol const   _protocol;
+        std::unique_ptr<impl::aes256gcm> _aes;  // Expanded AES key; created on first use
+        std::vector<uint8_t> _scratch;          // Cleartext payload, with `Compressed` protocol
     };
 
 
@@ -83,14 +127,44 @@ namespace snej::shs {
         /// The maximum byte length of a message, before encryption.
         static constexpr size_t kMaxMessageSize = 0xFFFF;
 
+        /// Sets the codec used by the `Compressed` protocol; the default is `LZ4`.
+        /// Throws `std::invalid_argument` if `codecAvailable` returns false for it.
+        void setCodec(Codec);
+
+        Codec codec() const                     {return _codec;}
+
         /// Encrypts an outgoing message, attaching the MAC and size.
-        /// @note  Currently the maximum size message is 65535 bytes.
+        /// @note  Currently the maximum size message is 65535 bytes (65534 if `Compressed`.)
         /// @param in  The message to be sent.
         /// @param out  Where to write the encrypted message.
         ///             On entry `out.data` must be set and `out.size` must be the maximum capacity.
         ///             On success, `out.size` will be set to the encrypted size.
         /// @return  The status, either `Success` or `OutTooSmall`.
         status_t encrypt(input_data in, output_buffer &out);
+
+        //---- Large messages:
+
+        /// The encrypted size of a message of any length sent by `encryptMessage`.
+        size_t encryptedMessageSize(size_t inputSize);
+
+        /// Encrypts a logical message of any length as a sequence of one or more frames, each
+        /// ending with an encrypted flag that says whether more frames follow. The frames must be
+        /// read by a `MessageReassembler`, not a `DecryptoBox` or `DecryptionStream`.
+        /// @param in  The message to be sent. It must not overlap `out`.
+        /// @param out  Where to write the encrypted frames.
+        ///             On entry `out.data` must be set and `out.size` must be the maximum capacity.
+        ///             On success, `out.size` will be set to the encrypted size.
+        /// @return  The status, either `Success` or `OutTooSmall`.
+        status_t encryptMessage(input_data in, output_buffer &out);
+
+        /// The maximum number of message bytes `encryptMessage` puts in one frame.
+        static constexpr size_t kMaxFramePayload = kMaxMessageSize - 1;
+
+    private:
+        input_data compressPayload(input_data);
+
+        Codec    _codec = LZ4;
+        unsigned _skipCompression = 0;      // # frames to send uncompressed before trying again
     };
 
 
@@ -122,6 +196,8 @@ namespace snej::shs {
         /// and returns the length of the encrypted and decrypted messages.
         /// The `status` value will be:
         /// - `Success` if the size is known; `encryptedSize` and `decryptedSize` will be accurate.
+        ///   (Except that with the `Compressed` protocol, `decryptedSize` is only the maximum,
+        ///   since the uncompressed size is encrypted.)
         /// - `IncompleteInput` if there's not enough input to determine the size; `decryptedSize`
         ///   will be set to the length of input needed to determine it.
         /// - `CorruptData` if the input data is corrupted
@@ -155,12 +231,93 @@ namespace snej::shs {
         /// @return  The status; see the description of the 'status' enum values.
         status_t decrypt(input_data &in, output_buffer &out);
 
+        /// Sets the largest message the `Compressed` protocol will decompress; a frame claiming
+        /// to be larger is rejected as `CorruptData`, without decompressing it. This guards
+        /// against "decompression bombs". Defaults to `EncryptoBox::kMaxMessageSize`.
+        void setMaxDecompressedSize(size_t size)    {_maxDecompressedSize = size;}
+
     private:
+        status_t _decrypt(input_data &in, output_buffer &out);
+        status_t decryptCompressed(const uint8_t *src, PeekResult&, output_buffer &out);
+
+        size_t _maxDecompressedSize = EncryptoBox::kMaxMessageSize;
         PeekResult decryptBoxStreamHeader(input_data in, BoxStreamHeader &header);
     };
 
 
 
+    /// Receives logical messages of any size sent by `EncryptoBox::encryptMessage`, reassembling
+    /// their frames. Each frame is copied into the message buffer and decrypted in place, so the
+    /// message ends up contiguous without any further copying. (With the `Compressed` protocol,
+    /// frames are instead decompressed straight from the input into the message buffer.)
+    ///
+    /// By default the message buffer is managed internally, and reused for the next message.
+    /// You can take ownership of a completed message's buffer with `takeMessage`, and give it
+    /// back with `recycle` when you're done, to avoid allocating a new one. Or you can provide
+    /// your own buffer with `setBuffer`.
+    class MessageReassembler {
+    public:
+        using Protocol = CryptoBox::Protocol;
+
+        static constexpr size_t kDefaultMaxMessageSize = 1 << 20;
+
+        /// Constructs a reassembler.
+        /// @param session  The session from the handshake.
+        /// @param protocol  The encryption protocol.
+        /// @param maxMessageSize  The largest message that will be accepted.
+        explicit MessageReassembler(Session const& session,
+                                    Protocol protocol =CryptoBox::Compact,
+                                    size_t maxMessageSize =kDefaultMaxMessageSize)
+        :_decryptor(session, protocol)
+        ,_maxMessageSize(maxMessageSize)
+        { }
+
+        /// Assembles messages in the caller's buffer instead of an internal one. It needs room
+        /// for the message plus the overhead of one frame (`EncryptoBox::encryptedSize(1)`);
+        /// a larger message fails with `OutTooSmall`. The buffer is used until `setBuffer` is
+        /// called again, with `{nullptr, 0}` to go back to internal buffers.
+        /// @note  Can only be called between messages.
+        void setBuffer(output_buffer);
+
+        /// Reads encrypted frames from `in` until a message is complete.
+        /// @param in  Data from the stream. On return, **this will be adjusted** to skip the
+        ///            frames consumed. An incomplete frame at the end is not consumed.
+        /// @return  - `Success` if a message is complete; call `message` to get it.
+        ///          - `IncompleteInput` if more data is needed.
+        ///          - `OutTooSmall` if the message is larger than the maximum size or buffer.
+        ///          - `CorruptData` if the data is corrupted.
+        ///          After `OutTooSmall` or `CorruptData` the stream can't be read any further.
+        status_t receive(input_data &in);
+
+        /// The message completed by the last call to `receive`. It's valid until the next call
+        /// to `receive`, `takeMessage` or `setBuffer`.
+        input_data message() const              {return _complete ? input_data{_data, _size}
+                                                                  : input_data{nullptr, 0};}
+
+        /// Moves the completed message out of the internal buffer. (Not for use with `setBuffer`.)
+        std::vector<uint8_t> takeMessage();
+
+        /// Returns a buffer from `takeMessage`, so it can be reused for another message.
+        void recycle(std::vector<uint8_t>&&);
+
+    private:
+        static constexpr size_t kMaxPooledBuffers = 4;
+
+        uint8_t* reserve(size_t size);
+        void startMessage();
+
+        DecryptoBox                         _decryptor;
+        size_t                              _maxMessageSize;
+        std::vector<uint8_t>                _buffer;        // Internal message buffer
+        std::vector<std::vector<uint8_t>>   _pool;          // Recycled buffers
+        output_buffer                       _callerBuffer {nullptr, 0};
+        uint8_t*                            _data = nullptr;// Start of the message
+        size_t                              _size = 0;      // Length of the message so far
+        bool                                _complete = false;
+    };
+
+
+
     /// Byte-oriented stream crypto API;
     /// abstract base class of EncryptionStream and DecryptionStream.
     class CryptoStream {
@@ -191,6 +348,7 @@ namespace snej::shs {
 
         std::vector<uint8_t> _buffer;                // processed followed by unprocessed bytes
         size_t               _processedBytes = 0;    // # of bytes already encrypted/decrypted
+        size_t               _reservedBytes = 0;     // # of bytes at end given out by `reserve`
     };
 
 
@@ -202,10 +360,11 @@ namespace snej::shs {
     public:
         /// Constructs an EncryptionStream.
         EncryptionStream(SessionKey const& key, Nonce const& nonce, Protocol p =CryptoBox::Compact)
-        :_encryptor(key, nonce, p) { }
+        :_encryptor(key, nonce, p)
+        ,_maxMessageSize(_encryptor.maxMessageSize()) { }
 
         explicit EncryptionStream(Session const& session, Protocol p =CryptoBox::Compact)
-        :_encryptor(session.encryptionKey, session.encryptionNonce, p) { }
+        :EncryptionStream(session.encryptionKey, session.encryptionNonce, p) { }
 
         /// Encrypts data. The ciphertext is then available to pull.
         /// @param data  The address of the cleartext data to add
@@ -221,8 +380,29 @@ namespace snej::shs {
         /// Encrypts all data buffered by `pushPartial`, which is then available to pull.
         void flush();
 
+        /// Zero-copy alternative to `pushPartial`: returns space in the internal buffer for up to
+        /// `size` bytes of cleartext. Write the data there, then call `commit`. (The space may
+        /// be smaller than `size`, since it's limited to `maxMessageSize`.)
+        /// @warning  Don't call any other methods in between, and note that this invalidates the
+        ///           pointer returned by `availableData`.
+        output_buffer reserve(size_t size);
+
+        /// Adds the first `size` bytes written into the space returned by `reserve` to the
+        /// cleartext, as with `pushPartial`. Call `flush` to encrypt it.
+        void commit(size_t size);
+
+        /// Sets the maximum size of an encrypted message; larger pushes are split up.
+        /// Defaults to, and can't be larger than, `EncryptoBox::maxMessageSize`.
+        void setMaxMessageSize(size_t);
+
+        size_t maxMessageSize() const           {return _maxMessageSize;}
+
+        /// Sets the codec used by the `Compressed` protocol. (See `EncryptoBox::setCodec`.)
+        void setCodec(CryptoBox::Codec c)       {_encryptor.setCodec(c);}
+
     private:
         EncryptoBox _encryptor;
+        size_t      _maxMessageSize;
     };
 
 
@@ -253,8 +433,248 @@ namespace snej::shs {
         /// @return  True if this is a clean close, false if there's an incomplete message.
         bool close();
 
+        /// Zero-copy alternative to `push`: returns space in the internal buffer for `size`
+        /// bytes, such as for reading from a socket. Write the data there, then call `commit`.
+        /// @warning  Don't call any other methods in between, and note that this invalidates the
+        ///           pointer returned by `availableData`.
+        output_buffer reserve(size_t size);
+
+        /// Adds the first `size` bytes written into the space returned by `reserve`, then
+        /// decrypts as with `push`.
+        /// @return  True on success, false if the data is corrupted.
+        bool commit(size_t size);
+
+        /// A callback that's given each decrypted frame (one message from the sender's
+        /// `EncryptoBox`, or one flush of its `EncryptionStream`.) The data points into the
+        /// stream's buffer, and is only valid until the callback returns.
+        using FrameVisitor = std::function<void(input_data)>;
+
+        /// Switches to message mode, where instead of making decrypted data available to `pull`,
+        /// `push` passes each decrypted frame to the visitor, preserving the frame boundaries.
+        /// The visitor must not call `push`. Pass `nullptr` to switch back to byte-stream mode.
+        /// @note  Can't be called while there's data available to pull.
+        void setFrameVisitor(FrameVisitor);
+
+        /// Limits the size of a decompressed message with the `Compressed` protocol.
+        /// (See `DecryptoBox::setMaxDecompressedSize`.)
+        void setMaxDecompressedSize(size_t s)   {_decryptor.setMaxDecompressedSize(s);}
+
+    private:
+        bool decryptBuffer();
+        bool pushFrames();
+        output_buffer decryptionSpace(input_data);
+
+        DecryptoBox          _decryptor;
+        FrameVisitor         _frameVisitor;
+        std::vector<uint8_t> _expanded;     // Decompressed frame, with `Compressed` protocol
+    };
+
+
+
+    /// A variant of `EncryptionStream` for use by exactly two threads without any locking:
+    /// a producer thread that pushes cleartext and encrypts it, and a consumer thread (typically
+    /// doing I/O) that reads the ciphertext. The ciphertext is stored in a lock-free `ByteRing`
+    /// of fixed capacity, so `push` doesn't block, but it accepts only as much as fits.
+    class SPSCEncryptionStream {
+    public:
+        using Protocol = CryptoBox::Protocol;
+
+        static constexpr size_t kDefaultCapacity = 256 * 1024;
+
+        /// Constructs a stream.
+        /// @param session  The session from the handshake.
+        /// @param protocol  The encryption protocol.
+        /// @param capacity  The size of the ciphertext buffer; must be a power of 2, and at
+        ///                  least 64KB so it can hold the largest message.
+        explicit SPSCEncryptionStream(Session const& session,
+                                      Protocol protocol =CryptoBox::Compact,
+                                      size_t capacity =kDefaultCapacity);
+        ~SPSCEncryptionStream();
+
+        //---- Producer thread only:
+
+        /// Encrypts as much of the data as there's room for.
+        /// @return  The number of bytes accepted; 0 if the buffer is full.
+        size_t push(const void *data, size_t size);
+
+        //---- Consumer thread only:
+
+        /// The contiguous ciphertext available to send. (There may be more after this, if the
+        /// buffer wrapped around.) Call `skip` after sending it.
+        input_data availableData() const;
+
+        /// The total number of bytes of ciphertext available.
+        size_t bytesAvailable() const;
+
+        /// Removes ciphertext from the buffer, making room for more pushes.
+        size_t skip(size_t);
+
+        /// Copies ciphertext out of the buffer, and returns the number of bytes copied.
+        size_t pull(void *dst, size_t maxSize);
+
+    private:
+        EncryptoBox               _encryptor;
+        std::unique_ptr<ByteRing> _ring;
+        std::vector<uint8_t>      _scratch;         // Used when a message would wrap around
+    };
+
+
+
+    /// A variant of `DecryptionStream` for use by exactly two threads without any locking:
+    /// a producer thread (typically doing I/O) that pushes ciphertext and decrypts it, and a
+    /// consumer thread that reads the cleartext. The cleartext is stored in a lock-free `ByteRing`
+    /// of fixed capacity; ciphertext that can't be decrypted yet because the ring is full stays
+    /// pending on the producer side until `decryptPending` is called.
+    class SPSCDecryptionStream {
+    public:
+        using Protocol = CryptoBox::Protocol;
+
+        static constexpr size_t kDefaultCapacity = 256 * 1024;
+
+        /// Constructs a stream.
+        /// @param session  The session from the handshake.
+        /// @param protocol  The encryption protocol.
+        /// @param capacity  The size of the cleartext buffer; must be a power of 2, and at
+        ///                  least 64KB so it can hold the largest message.
+        explicit SPSCDecryptionStream(Session const& session,
+                                      Protocol protocol =CryptoBox::Compact,
+                                      size_t capacity =kDefaultCapacity);
+        ~SPSCDecryptionStream();
+
+        //---- Producer thread only:
+
+        /// Adds encrypted data, and decrypts as many complete messages as there's room for.
+        /// @return  True on success, false if the data is corrupted.
+        bool push(const void *data, size_t size);
+
+        /// Decrypts pending messages, if the consumer has made room for them.
+        /// @return  True on success, false if the data is corrupted.
+        bool decryptPending();
+
+        /// The number of bytes of ciphertext not yet decrypted. If this gets large, the consumer
+        /// isn't keeping up, and the producer should stop reading for a while.
+        size_t pendingBytes() const             {return _pending.size() - _pendingStart;}
+
+        /// Call this when the encrypted stream ends, after `pendingBytes` has dropped to 0.
+        /// @return  True if this is a clean close, false if there's undecrypted data left.
+        bool close()                            {return pendingBytes() == 0;}
+
+        //---- Consumer thread only:
+
+        /// The contiguous cleartext available to read. (There may be more after this, if the
+        /// buffer wrapped around.) Call `skip` after reading it.
+        input_data availableData() const;
+
+        /// The total number of bytes of cleartext available.
+        size_t bytesAvailable() const;
+
+        /// Removes cleartext from the buffer.
+        size_t skip(size_t);
+
+        /// Copies cleartext out of the buffer, and returns the number of bytes copied.
+        size_t pull(void *dst, size_t maxSize);
+
+    private:
+        DecryptoBox               _decryptor;
+        std::unique_ptr<ByteRing> _ring;
+        std::vector<uint8_t>      _pending;         // Ciphertext not yet decrypted
+        size_t                    _pendingStart = 0;// Start of unconsumed data in `_pending`
+        std::vector<uint8_t>      _scratch;         // Used when a message would wrap around
+    };
+
+
+
+    /// Optional in-band negotiation of the `CryptoBox::Protocol` and maximum message size,
+    /// run by both peers right after the handshake.
+    ///
+    /// The client sends a small "offer" message, encrypted under the session as a BoxStream
+    /// message, listing the protocols it supports. The server replies with its own offer, and
+    /// each peer then picks the same protocol: the fastest one both support. (`AES256GCM` only
+    /// counts as fastest if both peers have AES hardware acceleration.) The server can send data
+    /// right after its offer, but the client has to wait for the server's offer before sending
+    /// any data, which costs it a full round trip. That's deliberate: if both sent their offers
+    /// at once, a legacy peer would read ours as data. If the client speaks first and latency
+    /// matters more than the protocol, don't negotiate; use a fixed protocol instead.
+    ///
+    /// The server only sends its offer after receiving the client's, so it's safe to enable
+    /// negotiation on a server that also has legacy (Scuttlebutt-compatible) clients: if the
+    /// first message from the client is a valid BoxStream message but not an offer, `BoxStream`
+    /// is chosen, if it's in the supported list, and nothing is sent. The received message is
+    /// _not_ consumed, so it'll be decrypted as data by the `DecryptionStream`. A legacy client
+    /// that waits for the server to send first can be handled with a timeout; see `peerIsSilent`.
+    ///
+    /// A client's offer would be read as data by a legacy server, so only enable negotiation on
+    /// a client that connects to servers known to negotiate. If the server doesn't reply with an
+    /// offer, the client fails rather than falling back.
+    class ProtocolNegotiator {
+    public:
+        using Protocol = CryptoBox::Protocol;
+
+        /// Which side of the handshake this peer was on.
+        enum Role : uint8_t { Client, Server };
+
+        /// The size of an encrypted offer, as sent by either peer.
+        static constexpr size_t kEncryptedOfferSize = 44;
+
+        /// Constructs a negotiator.
+        /// @param session  The Session from the handshake.
+        /// @param role  Whether this peer was the client or the server in the handshake.
+        /// @param protocols  The protocols this peer supports. Order doesn't matter.
+        /// @param maxMessageSize  The largest message this peer wants to send or receive.
+        ProtocolNegotiator(Session const& session,
+                           Role role,
+                           std::vector<Protocol> const& protocols,
+                           size_t maxMessageSize = EncryptoBox::kMaxMessageSize);
+
+        /// The encrypted offer to send to the peer. A client's is available right away. A
+        /// server's is empty until `receivedBytes` returns `Success`, and stays empty if the
+        /// client is a legacy peer; if it's non-empty, send it before any other data.
+        input_data bytesToSend() const          {return {_offer.data(), _offer.size()};}
+
+        /// Call this with data received from the peer (more than once, if necessary.)
+        /// @param in  The received data. On `Success` **this is adjusted** to skip the peer's
+        ///            offer; any remaining bytes must be pushed to the `DecryptionStream`.
+        /// @return  `Success` when negotiation is complete, `IncompleteInput` if more data is
+        ///          needed, or `CorruptData` if the data is invalid or the peers have no protocol
+        ///          in common.
+        status_t receivedBytes(input_data &in);
+
+        /// A server calls this if the client has sent nothing for a while, instead of waiting
+        /// for its offer: the client is assumed to be a legacy peer that's waiting for the
+        /// server to send first. Choose a timeout well over the round-trip time, since a
+        /// negotiating client whose offer arrives later would fail.
+        /// After this, start the streams with `session()` as usual, but pass the first data
+        /// received from the client to `receivedBytes` before the `DecryptionStream`: it returns
+        /// `CorruptData` if it's a late offer, or `Success` without consuming anything.
+        /// @return  `Success` if `BoxStream` is supported, else `CorruptData`.
+        status_t peerIsSilent();
+
+        /// The chosen protocol. Only valid after `receivedBytes` returns `Success`.
+        Protocol protocol() const               {return _protocol;}
+
+        /// The maximum message size both peers agreed on.
+        size_t maxMessageSize() const           {return _maxMessageSize;}
+
+        /// True if the client didn't send an offer, and was assumed to be a legacy BoxStream peer.
+        bool peerIsLegacy() const               {return _peerIsLegacy;}
+
+        /// The Session to construct the `EncryptionStream` and `DecryptionStream` with.
+        /// Its nonces have been advanced past the offer messages.
+        Session const& session() const          {return _session;}
+
     private:
-        DecryptoBox _decryptor;
+        void makeOffer();
+        status_t assumeLegacyPeer();
+
+        Session              _session;
+        std::vector<uint8_t> _offer;
+        DecryptoBox          _decryptor;
+        Role                 _role;
+        unsigned             _protocolMask;
+        bool                 _fastAES;
+        size_t               _maxMessageSize;
+        Protocol             _protocol = CryptoBox::BoxStream;
+        bool                 _peerIsLegacy = false;
     };
 
 }
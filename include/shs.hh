@@ -9,6 +9,8 @@
 #include "monocypher/signatures.hh"
 #include "monocypher/ext/ed25519.hh"
 #include "monocypher/ext/sha256.hh"
+#include "monocypher/ext/sha512.hh"
+#include <functional>
 #include <optional>
 
 #ifndef SHS_SCUTTLEBUTT_COMPATIBLE
@@ -61,6 +63,23 @@ namespace snej::shs::impl {
                   signing_key const& longTermSigningKey,
                   public_key const& longTermPublicKey);
 
+        /// A fast check of a peer's _claimed_ public key; returns false to reject it.
+        using key_filter = std::function<bool(public_key const&)>;
+
+        /// Initialize with an existing ephemeral key-pair instead of generating a random one.
+        handshake(app_id const& appID,
+                  signing_key const& longTermSigningKey,
+                  public_key const& longTermPublicKey,
+                  key_exchange const& ephemeralKey);
+
+        /// Initialize with an existing ephemeral key-pair whose public key is already known,
+        /// saving the cost of recomputing it.
+        handshake(app_id const& appID,
+                  signing_key const& longTermSigningKey,
+                  public_key const& longTermPublicKey,
+                  key_exchange const& ephemeralKey,
+                  key_exchange::public_key const& ephemeralPublicKey);
+
         /// Setting custom ephemeral keys is optional; typically only done by unit tests.
         void setEphemeralKeys(key_exchange const&);
 
@@ -76,10 +95,11 @@ namespace snej::shs::impl {
 
         bool verifyClientChallenge(ChallengeData const& c)  {return verifyChallenge(c);}
         ChallengeData createServerChallenge()               {return createChallenge();}
-        bool verifyClientAuth(ClientAuthData const&);
+        bool verifyClientAuth(ClientAuthData const&, key_filter const& preAuthorize = nullptr);
         ServerAckData createServerAck();
 
         /// Returns the peer's public key. May be called after `verifyClientAuth` returns true.
+        app_id const& getAppID() const                      {return _K;}
         public_key const& getPeerPublicKey() const          {return _Yp.value();}
 
         // Both client and server call this last, to get the session keys:
@@ -94,6 +114,17 @@ namespace snej::shs::impl {
         ChallengeData createChallenge();
         bool verifyChallenge(ChallengeData const&);
 
+        // Stateless helpers for a server in cookie mode (see `CookieJar`), which answers a
+        // challenge without creating a `handshake` until the client's auth message arrives:
+
+        /// True if a challenge has a valid HMAC, i.e. the peer uses the same AppID.
+        static bool isValidChallenge(app_id const&, ChallengeData const&);
+        /// Creates a challenge, given the ephemeral public key.
+        static ChallengeData createChallenge(app_id const&, key_exchange::public_key const&);
+        /// Derives the server's ephemeral key from a secret and the client's challenge.
+        static key_exchange cookieEphemeralKey(byte_array<32> const& secret,
+                                               ChallengeData const& clientChallenge);
+
         using kx_public_key = key_exchange::public_key;
         using kx_secret_key = key_exchange::secret_key;
         using kx_shared_secret = key_exchange::shared_secret;
@@ -121,4 +152,19 @@ namespace snej::shs::impl {
         std::optional<byte_array<96>>    _H;             // sign[A](K | Bp | hash(a·b)) | Ap
     };
 
+
+
+    /// Checks whether a challenge was made with a particular AppID, as `isValidChallenge` does,
+    /// but faster: the HMAC-SHA-512 inner and outer hash states, after absorbing the padded key,
+    /// are precomputed, so each check costs two SHA-512 compressions instead of four.
+    /// Used by multi-tenant servers, which have to check a challenge against every AppID.
+    class challenge_matcher {
+    public:
+        explicit challenge_matcher(app_id const&);
+        ~challenge_matcher();
+        bool matches(ChallengeData const&) const;
+    private:
+        monocypher::c::crypto_sha512_ctx _inner, _outer;
+    };
+
 }
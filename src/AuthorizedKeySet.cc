@@ -0,0 +1,347 @@
+//
+// AuthorizedKeySet.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#include "AuthorizedKeySet.hh"
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace snej::shs {
+    using namespace std;
+
+
+    // The binary image of a table, which is the same in memory and in a file:
+    //   FileHeader | uint64_t bloom[bloomWords] | PublicKey slots[capacity]
+    // Keys are hashed by reading their bytes as native-endian words, so the image is only
+    // valid on hosts of the same byte order; `byteOrder` detects that.
+
+    static constexpr char     kMagic[8]       = {'S','H','S','K','E','Y','S','1'};
+    static constexpr uint32_t kByteOrderMark  = 0x01020304;
+    static constexpr size_t   kBloomBitsPerKey = 16;
+
+    struct FileHeader {
+        char     magic[8];      // kMagic
+        uint32_t byteOrder;     // kByteOrderMark, as written by the host
+        uint32_t keySize;       // sizeof(PublicKey)
+        uint64_t count;         // Number of keys
+        uint64_t capacity;      // Number of hash-table slots; a power of 2
+        uint64_t bloomWords;    // Number of 64-bit Bloom filter blocks; 0 or a power of 2
+    };
+
+
+    static inline uint64_t keyWord(PublicKey const& key, size_t i) {
+        uint64_t w;
+        ::memcpy(&w, &key[8 * i], sizeof(w));
+        return w;
+    }
+
+    static inline bool isZero(PublicKey const& key) {
+        return (keyWord(key, 0) | keyWord(key, 1) | keyWord(key, 2) | keyWord(key, 3)) == 0;
+    }
+
+    // The Bloom filter is "blocked": each key sets 3 bits within a single 64-bit word.
+    static inline uint64_t bloomBits(PublicKey const& key) {
+        uint64_t h = keyWord(key, 2);
+        return (1ull << (h & 63)) | (1ull << ((h >> 6) & 63)) | (1ull << ((h >> 12) & 63));
+    }
+
+    static uint64_t ceilPowerOf2(uint64_t n) {
+        uint64_t p = 1;
+        while (p < n)
+            p <<= 1;
+        return p;
+    }
+
+
+    class AuthorizedKeySet::Table {
+    public:
+        /// Builds a table from a list of keys.
+        Table(vector<PublicKey> const& keys, bool bloomFilter) {
+            uint64_t capacity = ceilPowerOf2(max<uint64_t>(16, 2 * keys.size()));
+            uint64_t bloomWords = 0;
+            if (bloomFilter)
+                bloomWords = ceilPowerOf2(max<uint64_t>(1, keys.size() * kBloomBitsPerKey / 64));
+            _image.resize(sizeof(FileHeader) + 8 * bloomWords + sizeof(PublicKey) * capacity);
+            auto header = (FileHeader*)_image.data();
+            ::memcpy(header->magic, kMagic, sizeof(kMagic));
+            header->byteOrder = kByteOrderMark;
+            header->keySize = sizeof(PublicKey);
+            header->capacity = capacity;
+            header->bloomWords = bloomWords;
+            setPointers(header);
+
+            for (auto &key : keys) {
+                if (isZero(key))
+                    continue;
+                uint64_t i = keyWord(key, 0) & _slotMask;
+                while (!isZero(_slots[i]) && _slots[i] != key)
+                    i = (i + 1) & _slotMask;
+                if (isZero(_slots[i])) {
+                    const_cast<PublicKey&>(_slots[i]) = key;
+                    if (_bloom)
+                        const_cast<uint64_t&>(_bloom[keyWord(key, 1) & _bloomMask]) |= bloomBits(key);
+                    ++_count;
+                }
+            }
+            header->count = _count;
+        }
+
+        /// Adopts a memory-mapped file. Throws if it's not valid; the caller then unmaps it.
+        Table(void const* mapping, size_t size)
+        :_mapping(mapping)
+        ,_mappingSize(size)
+        {
+            validate(mapping, size);
+        }
+
+        /// Adopts an image read from a file. Throws if it's not valid.
+        explicit Table(vector<uint8_t> image)
+        :_image(std::move(image))
+        {
+            validate(_image.data(), _image.size());
+        }
+
+        ~Table() {
+#ifndef _WIN32
+            if (_mapping)
+                ::munmap(const_cast<void*>(_mapping), _mappingSize);
+#endif
+        }
+
+        size_t size() const         {return _count;}
+
+        vector<uint8_t> const& image() const {return _image;}
+
+        bool contains(PublicKey const& key) const {
+            if (_bloom) {
+                uint64_t bits = bloomBits(key);
+                if ((_bloom[keyWord(key, 1) & _bloomMask] & bits) != bits)
+                    return false;
+            }
+            if (isZero(key))
+                return false;
+            // The probe is bounded, in case a corrupt file has no empty slots:
+            uint64_t i = keyWord(key, 0) & _slotMask;
+            for (uint64_t n = 0; n <= _slotMask; ++n, i = (i + 1) & _slotMask) {
+                if (_slots[i] == key)
+                    return true;
+                else if (isZero(_slots[i]))
+                    return false;
+            }
+            return false;
+        }
+
+    private:
+        void validate(void const* data, size_t size) {
+            auto header = (FileHeader const*)data;
+            if (size < sizeof(FileHeader) || ::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0)
+                throw runtime_error("AuthorizedKeySet: not a key-set file");
+            if (header->byteOrder != kByteOrderMark || header->keySize != sizeof(PublicKey))
+                throw runtime_error("AuthorizedKeySet: key-set file is from an incompatible host");
+            uint64_t capacity = header->capacity, bloomWords = header->bloomWords;
+            if (capacity == 0 || (capacity & (capacity - 1)) != 0
+                    || (bloomWords & (bloomWords - 1)) != 0
+                    || capacity > (size - sizeof(FileHeader)) / sizeof(PublicKey)
+                    || bloomWords > (size - sizeof(FileHeader)) / 8
+                    || size != sizeof(FileHeader) + 8 * bloomWords + sizeof(PublicKey) * capacity
+                    || header->count >= capacity)
+                throw runtime_error("AuthorizedKeySet: key-set file is corrupt");
+            setPointers(header);
+            _count = header->count;
+        }
+
+        void setPointers(FileHeader const* header) {
+            auto start = (uint8_t const*)(header + 1);
+            if (header->bloomWords > 0) {
+                _bloom = (uint64_t const*)start;
+                _bloomMask = header->bloomWords - 1;
+            }
+            _slots = (PublicKey const*)(start + 8 * header->bloomWords);
+            _slotMask = header->capacity - 1;
+        }
+
+        vector<uint8_t>     _image;                 // Table data, if built in memory
+        void const*         _mapping = nullptr;     // Table data, if memory-mapped
+        size_t              _mappingSize = 0;
+        uint64_t const*     _bloom = nullptr;       // Bloom filter blocks, or null
+        uint64_t            _bloomMask = 0;
+        PublicKey const*    _slots;                 // Hash table
+        uint64_t            _slotMask;
+        uint64_t            _count = 0;             // Number of keys
+    };
+
+
+#pragma mark - AUTHORIZEDKEYSET:
+
+
+    AuthorizedKeySet::AuthorizedKeySet()
+    :AuthorizedKeySet(vector<PublicKey>{}, false)
+    { }
+
+    AuthorizedKeySet::AuthorizedKeySet(vector<PublicKey> const& keys, bool bloomFilter)
+    :_table(new Table(keys, bloomFilter))
+    { }
+
+    AuthorizedKeySet::~AuthorizedKeySet() {
+        delete _table.load();
+    }
+
+
+    // Each thread is assigned a shard the first time it does a lookup; a thread always
+    // decrements the same counter it incremented, so no shard's count ever goes negative.
+    AuthorizedKeySet::ReaderShard& AuthorizedKeySet::myReaderShard() const {
+        static atomic<unsigned> sNextShard = 0;
+        static thread_local unsigned tShard = sNextShard++ % kReaderShards;
+        return _readers[tShard];
+    }
+
+
+    // A lookup registers itself in its shard's reader counter of the current epoch's parity,
+    // and only then loads the table pointer; so a table that's been replaced can only be in use
+    // by a lookup that's counted. (All these atomic ops are sequentially consistent.)
+    bool AuthorizedKeySet::contains(PublicKey const& key) const {
+        auto &readers = myReaderShard().readers[_epoch.load() & 1];
+        ++readers;
+        bool result = _table.load()->contains(key);
+        --readers;
+        return result;
+    }
+
+    size_t AuthorizedKeySet::size() const {
+        auto &readers = myReaderShard().readers[_epoch.load() & 1];
+        ++readers;
+        size_t result = _table.load()->size();
+        --readers;
+        return result;
+    }
+
+
+    void AuthorizedKeySet::replace(Table *newTable) {
+        unique_lock<mutex> lock(_writeMutex);
+        Table *oldTable = _table.exchange(newTable);
+        // Wait out a grace period. A lookup that read the epoch before the exchange may still
+        // be counted under either parity, so flip the epoch twice, each time waiting for the
+        // lookups counted under the old parity to finish. New lookups see the new table.
+        // (It's enough to see each shard reach zero in turn: a lookup that increments a shard
+        // after it's been checked loads the table after the exchange.)
+        for (int i = 0; i < 2; ++i) {
+            unsigned oldEpoch = _epoch++;
+            for (ReaderShard &shard : _readers) {
+                while (shard.readers[oldEpoch & 1].load() != 0)
+                    this_thread::yield();
+            }
+        }
+        delete oldTable;
+    }
+
+
+    void AuthorizedKeySet::reset(vector<PublicKey> const& keys, bool bloomFilter) {
+        replace(new Table(keys, bloomFilter));
+    }
+
+
+    [[noreturn]] static void throwErrno(const char *what) {
+        throw system_error(errno, generic_category(), what);
+    }
+
+
+    void AuthorizedKeySet::writeFile(string const& path,
+                                     vector<PublicKey> const& keys,
+                                     bool bloomFilter)
+    {
+        // Write to a temporary file and then rename it, so a server that has the old file
+        // mapped keeps a consistent view until it reloads:
+        Table table(keys, bloomFilter);
+        auto &image = table.image();
+        string tmpPath = path + ".tmp";
+        FILE *out = ::fopen(tmpPath.c_str(), "wb");
+        if (!out)
+            throwErrno("AuthorizedKeySet: can't create file");
+        bool ok = ::fwrite(image.data(), image.size(), 1, out) == 1;
+        ok = (::fclose(out) == 0) && ok;
+        if (!ok || ::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            int err = errno;
+            ::remove(tmpPath.c_str());
+            throw system_error(err, generic_category(), "AuthorizedKeySet: can't write file");
+        }
+    }
+
+
+    void AuthorizedKeySet::loadFile(string const& path) {
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throwErrno("AuthorizedKeySet: can't open file");
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            int err = errno;
+            ::close(fd);
+            throw system_error(err, generic_category(), "AuthorizedKeySet: can't read file");
+        }
+        size_t size = size_t(st.st_size);
+        void *mapping = size ? ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+        int err = errno;
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+            throw system_error(err, generic_category(), "AuthorizedKeySet: mmap");
+        if (!mapping)
+            throw runtime_error("AuthorizedKeySet: not a key-set file");
+        Table *table;
+        try {
+            table = new Table(mapping, size);
+        } catch (...) {
+            ::munmap(mapping, size);
+            throw;
+        }
+        replace(table);
+#else
+        // No mmap; read the file into memory instead:
+        FILE *in = ::fopen(path.c_str(), "rb");
+        if (!in)
+            throwErrno("AuthorizedKeySet: can't open file");
+        vector<uint8_t> image;
+        uint8_t buf[65536];
+        size_t n;
+        while ((n = ::fread(buf, 1, sizeof(buf), in)) > 0)
+            image.insert(image.end(), buf, buf + n);
+        bool ok = !::ferror(in);
+        ::fclose(in);
+        if (!ok)
+            throw system_error(EIO, generic_category(), "AuthorizedKeySet: can't read file");
+        replace(new Table(std::move(image)));
+#endif
+    }
+
+}
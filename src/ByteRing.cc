@@ -0,0 +1,107 @@
+//
+// ByteRing.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "ByteRing.hh"
+#include <new>
+#include <stdexcept>
+
+namespace snej::shs {
+
+    static void checkCapacity(size_t capacity) {
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+            throw std::invalid_argument("ByteRing capacity must be a power of 2");
+    }
+
+
+    void* ByteRing::allocate(size_t capacity) {
+        checkCapacity(capacity);
+        return ::operator new(memorySize(capacity), std::align_val_t(alignof(Header)));
+    }
+
+
+    ByteRing::ByteRing(size_t capacity)
+    :ByteRing(allocate(capacity), capacity, true)
+    {
+        _ownsMemory = true;
+    }
+
+
+    ByteRing::ByteRing(void *memory, size_t capacity, bool initialize)
+    :_header((Header*)memory)
+    ,_data((uint8_t*)(_header + 1))
+    ,_capacity(capacity)
+    ,_mask(capacity - 1)
+    ,_ownsMemory(false)
+    {
+        checkCapacity(capacity);
+        if (initialize) {
+            new (&_header->head) std::atomic<uint64_t>(0);
+            new (&_header->tail) std::atomic<uint64_t>(0);
+        }
+        _head = _header->head.load(std::memory_order_acquire);
+        _tail = _header->tail.load(std::memory_order_acquire);
+    }
+
+
+    ByteRing::~ByteRing() {
+        if (_ownsMemory)
+            ::operator delete(_header, std::align_val_t(alignof(Header)));
+    }
+
+
+    size_t ByteRing::write(const void *src, size_t size) {
+        size_t total = 0;
+        while (size > 0) {
+            output_buffer buf = writable();
+            size_t n = std::min(size, buf.size);
+            if (n == 0)
+                break;
+            ::memcpy(buf.data, src, n);
+            commit(n);
+            src = (const uint8_t*)src + n;
+            size -= n;
+            total += n;
+        }
+        return total;
+    }
+
+
+    size_t ByteRing::read(void *dst, size_t size) {
+        size_t total = 0;
+        while (size > 0) {
+            input_data buf = readable();
+            size_t n = std::min(size, buf.size);
+            if (n == 0)
+                break;
+            ::memcpy(dst, buf.data, n);
+            consume(n);
+            dst = (uint8_t*)dst + n;
+            size -= n;
+            total += n;
+        }
+        return total;
+    }
+
+}
@@ -0,0 +1,233 @@
+//
+// Logging.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#include "AsyncLogSink.hh"
+#include "SecretHandshake_Internal.hh"
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <stdexcept>
+
+namespace snej::shs {
+    using namespace std;
+
+
+    void (*LogCallback)(LogLevel, const char* format, va_list args);
+    void (*LogEventCallback)(LogEvent const&);
+
+    namespace impl {
+        atomic<LogLevel> gLogLevel = LogLevel::info;
+    }
+
+    void setLogLevel(LogLevel level)    {impl::gLogLevel.store(level, memory_order_relaxed);}
+    LogLevel logLevel()                 {return impl::gLogLevel.load(memory_order_relaxed);}
+
+
+    int LogEvent::format(char *buffer, size_t bufferSize) const {
+        switch (type) {
+            case LogEventType::awaitingBytes:
+                return snprintf(buffer, bufferSize, "Step %d/4: Awaiting %u bytes...", step, byteCount);
+            case LogEventType::receivedPartial:
+                return snprintf(buffer, bufferSize, "Received %u bytes; waiting...", byteCount);
+            case LogEventType::stepOK:
+                return snprintf(buffer, bufferSize, "Step %d OK", step);
+            case LogEventType::sendingBytes:
+                return snprintf(buffer, bufferSize, "Step %d/4: Sending %u bytes...", step, byteCount);
+            case LogEventType::sentPartial:
+                return snprintf(buffer, bufferSize, "Sent %u bytes...", byteCount);
+            case LogEventType::sendCompleted:
+                return snprintf(buffer, bufferSize, "Send completed");
+            case LogEventType::succeeded:
+                return snprintf(buffer, bufferSize, "Successful handshake!");
+            case LogEventType::invalidData:
+                return snprintf(buffer, bufferSize,
+                                "Received invalid data in step %d; HANDSHAKE FAILED", step);
+            case LogEventType::unexpectedEOF:
+                return snprintf(buffer, bufferSize, "Unexpected EOF at step %d; HANDSHAKE FAILED",
+                                step);
+            case LogEventType::awaitingAuthorization:
+                return snprintf(buffer, bufferSize, "Awaiting authorization of client key...");
+            case LogEventType::authorizationRejected:
+                return snprintf(buffer, bufferSize, "Client key was not authorized; HANDSHAKE FAILED");
+        }
+        return snprintf(buffer, bufferSize, "(unknown log event %d)", int(type));
+    }
+
+
+    shs_printflike(2,3)
+    static void callLogCallback(LogLevel level, const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        LogCallback(level, format, args);
+        va_end(args);
+    }
+
+
+    // Passes an event to the callbacks.
+    static void deliver(LogEvent const& event) noexcept {
+        if (auto callback = LogEventCallback) {
+            callback(event);
+        } else if (LogCallback) {
+            char message[100];
+            event.format(message, sizeof(message));
+            callLogCallback(event.level, "%s", message);
+        }
+    }
+
+
+    // The installed AsyncLogSink, and the number of threads that might be pushing to it.
+    static atomic<AsyncLogSink*> sAsyncSink = nullptr;
+    static atomic<int>           sAsyncSinkUsers = 0;
+
+
+    void impl::logEvent(LogEvent const& event) noexcept {
+        if (sAsyncSink.load(memory_order_relaxed)) {
+            // The sink can't be destructed while sAsyncSinkUsers is nonzero:
+            ++sAsyncSinkUsers;
+            if (AsyncLogSink *sink = sAsyncSink.load()) {
+                sink->push(event);
+                --sAsyncSinkUsers;
+                return;
+            }
+            --sAsyncSinkUsers;
+        }
+        deliver(event);
+    }
+
+
+#pragma mark - ASYNC LOG SINK:
+
+
+    AsyncLogSink::AsyncLogSink(Handler handler, size_t capacity)
+    :_handler(std::move(handler))
+    ,_slots(new Slot[capacity])
+    ,_mask(capacity - 1)
+    {
+        if (capacity == 0 || (capacity & _mask) != 0)
+            throw invalid_argument("AsyncLogSink capacity must be a power of 2");
+        for (size_t i = 0; i < capacity; ++i)
+            _slots[i].seq.store(i, memory_order_relaxed);
+        _thread = thread([this] {run();});
+        AsyncLogSink *expected = nullptr;
+        if (!sAsyncSink.compare_exchange_strong(expected, this)) {
+            _stop = true;
+            _cond.notify_one();
+            _thread.join();
+            throw logic_error("Only one AsyncLogSink can exist at a time");
+        }
+    }
+
+
+    AsyncLogSink::~AsyncLogSink() {
+        // Uninstall, then wait for any threads still pushing:
+        sAsyncSink.store(nullptr);
+        while (sAsyncSinkUsers.load() > 0)
+            this_thread::yield();
+        // Let the thread handle the rest of the queue and exit:
+        {
+            unique_lock<mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cond.notify_one();
+        _thread.join();
+    }
+
+
+    // The queue is Dmitry Vyukov's bounded MPMC queue, with one consumer. Each slot's `seq`
+    // says whose turn it is: it equals the position when the slot is free for the producer
+    // claiming that position, and position+1 once the event is written.
+
+    void AsyncLogSink::push(LogEvent const& event) noexcept {
+        uint64_t pos = _pushPos.load(memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &_slots[pos & _mask];
+            int64_t diff = int64_t(slot->seq.load(memory_order_acquire) - pos);
+            if (diff == 0) {
+                if (_pushPos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                _dropped.fetch_add(1, memory_order_relaxed);        // Queue is full
+                return;
+            } else {
+                pos = _pushPos.load(memory_order_relaxed);
+            }
+        }
+        slot->event = event;
+        slot->seq.store(pos + 1, memory_order_release);
+        if (_sleeping.load(memory_order_acquire))
+            _cond.notify_one();
+    }
+
+
+    bool AsyncLogSink::pop(LogEvent &event) {
+        Slot &slot = _slots[_popPos & _mask];
+        if (slot.seq.load(memory_order_acquire) != _popPos + 1)
+            return false;
+        event = slot.event;
+        slot.seq.store(_popPos + _mask + 1, memory_order_release);
+        ++_popPos;
+        return true;
+    }
+
+
+    void AsyncLogSink::run() {
+        auto handleQueue = [&] {
+            LogEvent event;
+            while (pop(event)) {
+                if (_handler)
+                    _handler(event);
+                else
+                    deliver(event);
+                _handled.fetch_add(1, memory_order_release);
+            }
+        };
+
+        while (true) {
+            handleQueue();
+            unique_lock<mutex> lock(_mutex);
+            if (_stop) {
+                // No one can push any more, but the last pushes may have just arrived:
+                lock.unlock();
+                handleQueue();
+                break;
+            }
+            // Sleep until a producer notifies. It doesn't lock the mutex, so a notification can
+            // be missed; the timeout limits the delay that causes.
+            _sleeping.store(true);
+            _cond.wait_for(lock, 10ms);
+            _sleeping.store(false);
+        }
+    }
+
+
+    void AsyncLogSink::flush() {
+        uint64_t pushed = _pushPos.load(memory_order_acquire);
+        while (_handled.load(memory_order_acquire) < pushed)
+            this_thread::sleep_for(100us);
+    }
+
+}
@@ -0,0 +1,40 @@
+//
+// Probes.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#include "Probes.hh"
+
+#if SHS_USDT
+
+// The probes' semaphores, which tracers increment while attached. They have to be in the
+// ".probes" section, which is where <sys/sdt.h> tells tracers to look for them.
+#define SHS_DEFINE_PROBE_SEMAPHORE(NAME) \
+    __attribute__((section(".probes"))) volatile unsigned short shs_##NAME##_semaphore = 0;
+
+extern "C" {
+    SHS_PROBES(SHS_DEFINE_PROBE_SEMAPHORE)
+}
+
+#endif
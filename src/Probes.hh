@@ -0,0 +1,79 @@
+//
+// Probes.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+#ifndef SHS_USDT
+/// If true, USDT static probes (as used by SystemTap, bpftrace and perf) are compiled in.
+/// This requires <sys/sdt.h>, from the `systemtap-sdt-dev` or `systemtap-sdt-devel` package.
+#define SHS_USDT 0
+#endif
+
+// The probes, all in provider `shs`, with their arguments. Durations are in nanoseconds.
+// These are a stable interface used by the scripts in tools/bpftrace; don't change their
+// arguments, only add new probes.
+//
+//  handshake_start     (Handshake*)
+//  handshake_step      (Handshake*, int step, uint64 duration)         step 1..4 completed
+//  handshake_done      (Handshake*, uint64 duration)                   successful handshake
+//  handshake_failed    (Handshake*, int step, int error)               Handshake::Error
+//  handshake_eof       (Handshake*, int step)                          peer disconnected
+//  crypto_op           (impl::handshake*, const char *op, uint64 duration)
+//  frame_encrypt       (EncryptoBox*, size_t plaintextSize, size_t frameSize)
+//  frame_decrypt       (DecryptoBox*, size_t frameSize, size_t plaintextSize, int status)
+//  stream_grow         (CryptoStream*, size_t oldCapacity, size_t newCapacity)
+#define SHS_PROBES(X) \
+    X(handshake_start) X(handshake_step) X(handshake_done) X(handshake_failed) X(handshake_eof) \
+    X(crypto_op) X(frame_encrypt) X(frame_decrypt) X(stream_grow)
+
+#if SHS_USDT
+    // With semaphores, a tracer attaching to a probe increments its semaphore, so the code can
+    // skip computing arguments (like timestamps) when no one's listening.
+#   define _SDT_HAS_SEMAPHORES 1
+#   include <sys/sdt.h>
+
+#   define SHS_DECLARE_PROBE_SEMAPHORE(NAME) extern "C" volatile unsigned short shs_##NAME##_semaphore;
+    SHS_PROBES(SHS_DECLARE_PROBE_SEMAPHORE)
+
+    /// True if a tracer is attached to the probe.
+#   define SHS_PROBE_ENABLED(NAME)  __builtin_expect(shs_##NAME##_semaphore != 0, 0)
+
+    /// Fires a probe. When not attached, this is just a `nop` instruction.
+#   define SHS_PROBE(NAME, ...)     STAP_PROBEV(shs, NAME, ## __VA_ARGS__)
+#else
+#   define SHS_PROBE_ENABLED(NAME)  false
+#   define SHS_PROBE(NAME, ...)     do { if (false) snej::shs::impl::unusedProbeArgs(__VA_ARGS__); } while (false)
+#endif
+
+namespace snej::shs::impl {
+
+    template <typename... Args> inline void unusedProbeArgs(Args&&...) { }
+
+    /// A monotonic clock for probe durations.
+    static inline uint64_t probeNanos() {
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// Fires the `crypto_op` probe with the time until it's destructed, if a tracer is attached.
+    class CryptoOpProbe {
+    public:
+        CryptoOpProbe(const void *handshake, const char *op)
+        :_handshake(handshake), _op(op), _start(SHS_PROBE_ENABLED(crypto_op) ? probeNanos() : 0) { }
+
+        ~CryptoOpProbe() {
+            if (_start)
+                SHS_PROBE(crypto_op, _handshake, _op, probeNanos() - _start);
+        }
+    private:
+        const void* _handshake;
+        const char* _op;
+        uint64_t    _start;
+    };
+
+}
@@ -0,0 +1,306 @@
+//
+// ResumableStream.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#include "ResumableStream.hh"
+#include "monocypher/base.hh"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace snej::shs {
+    using namespace std;
+
+    static constexpr size_t kAckEveryFrames = 16;
+    static constexpr size_t kAckEveryBytes  = 32 * 1024;
+
+
+    static inline void writeUint32At(uint8_t *dst, uint32_t n) {
+        for (int i = 3; i >= 0; --i, n >>= 8)
+            dst[i] = uint8_t(n);
+    }
+
+    static inline uint32_t readUint32At(const uint8_t *src) {
+        return (uint32_t(src[0]) << 24) | (uint32_t(src[1]) << 16) | (uint32_t(src[2]) << 8) | src[3];
+    }
+
+    static inline void writeUint64At(uint8_t *dst, uint64_t n) {
+        for (int i = 7; i >= 0; --i, n >>= 8)
+            dst[i] = uint8_t(n);
+    }
+
+    static inline uint64_t readUint64At(const uint8_t *src) {
+        return (uint64_t(readUint32At(src)) << 32) | readUint32At(src + 4);
+    }
+
+
+    // Derives a value from a session key and a label, with keyed BLAKE2b.
+    static void derive(SessionKey const& key, const char *label, uint8_t *out, size_t outSize) {
+        monocypher::c::crypto_blake2b_keyed(out, outSize, key.data(), key.size(),
+                                            (const uint8_t*)label, strlen(label));
+    }
+
+
+    ResumableStream::ResumableStream(Session const& session, Protocol protocol, size_t capacity)
+    :_encryptor(session, protocol)
+    ,_decryptor(session, protocol)
+    ,_capacity(capacity)
+    ,_scratch(EncryptoBox::kMaxMessageSize)
+    {
+        if (capacity < kMinCapacity)
+            throw invalid_argument("ResumableStream capacity is too small");
+        if (protocol == CryptoBox::Compressed)
+            throw invalid_argument("ResumableStream doesn't support the Compressed protocol");
+        // Each side authenticates its resume messages with a key derived from its encryption key;
+        // the peer derives the same one from its decryption key.
+        derive(session.encryptionKey, "SecretHandshake resume key", _resumeKey.data(), _resumeKey.size());
+        derive(session.decryptionKey, "SecretHandshake resume key", _peerResumeKey.data(), _peerResumeKey.size());
+        derive(session.encryptionKey, "SecretHandshake resume ID", _id.data(), _id.size());
+        derive(session.decryptionKey, "SecretHandshake resume ID", _peerID.data(), _peerID.size());
+    }
+
+
+    ResumableStream::~ResumableStream() {
+        monocypher::wipe(_resumeKey.data(), _resumeKey.size());
+        monocypher::wipe(_peerResumeKey.data(), _peerResumeKey.size());
+    }
+
+
+#pragma mark - SENDING:
+
+
+    size_t ResumableStream::writableBytes() const {
+        return _capacity > _unackedBytes ? _capacity - _unackedBytes : 0;
+    }
+
+
+    size_t ResumableStream::write(const void *data, size_t size) {
+        auto src = (const uint8_t*)data;
+        size_t written = 0;
+        while (written < size) {
+            size_t room = writableBytes();
+            if (room <= _encryptor.encryptedSize(1))
+                break;
+            size_t chunk = min({size - written,
+                                EncryptoBox::kMaxFramePayload,
+                                room - _encryptor.encryptedSize(1)});
+            queueFrame(kDataFrame, src + written, chunk);
+            written += chunk;
+        }
+        return written;
+    }
+
+
+    // Encrypts a frame consisting of a type byte followed by the data, and adds it to `_unacked`.
+    void ResumableStream::queueFrame(FrameType type, const void *data, size_t size) {
+        vector<uint8_t> frame(_encryptor.encryptedSize(1 + size));
+        size_t payloadOffset = _encryptor.encryptedSize(0);
+        frame[payloadOffset] = type;
+        ::memcpy(&frame[payloadOffset + 1], data, size);
+        output_buffer out = {frame.data(), frame.size()};
+        if (_encryptor.encrypt({&frame[payloadOffset], 1 + size}, out) != Success)
+            throw logic_error("ResumableStream encryption failed");
+        _unackedBytes += frame.size();
+        _unacked.push_back(std::move(frame));
+    }
+
+
+    void ResumableStream::sendAck() {
+        uint8_t count[8];
+        writeUint64At(count, _framesReceived);
+        queueFrame(kAckFrame, count, sizeof(count));
+        _framesAcked = _framesReceived;
+        _bytesSinceAck = 0;
+    }
+
+
+    input_data ResumableStream::outgoingData() const {
+        if (_resumeMessageSent < kResumeMessageSize)
+            return {&_resumeMessage[_resumeMessageSent], kResumeMessageSize - _resumeMessageSent};
+        else if (_awaitingResume || _sendIndex >= _unacked.size())
+            return {nullptr, 0};
+        auto &frame = _unacked[_sendIndex];
+        return {&frame[_sendOffset], frame.size() - _sendOffset};
+    }
+
+
+    void ResumableStream::didSend(size_t byteCount) {
+        if (byteCount > outgoingData().size)
+            throw invalid_argument("ResumableStream::didSend: too many bytes");
+        if (_resumeMessageSent < kResumeMessageSize) {
+            _resumeMessageSent += byteCount;
+        } else if (byteCount > 0) {
+            _sendOffset += byteCount;
+            if (_sendOffset == _unacked[_sendIndex].size()) {
+                ++_sendIndex;
+                _sendOffset = 0;
+            }
+        }
+    }
+
+
+    // Called when the peer says how many frames it's received. Frees the ones it has.
+    bool ResumableStream::handleAck(uint64_t framesReceived) {
+        if (framesReceived > _firstUnacked + _unacked.size())
+            return false;                                   // can't ack frames never sent!
+        while (_firstUnacked < framesReceived) {
+            _unackedBytes -= _unacked.front().size();
+            _unacked.pop_front();
+            ++_firstUnacked;
+            if (_sendIndex > 0)
+                --_sendIndex;
+            else
+                _sendOffset = 0;
+        }
+        return true;
+    }
+
+
+#pragma mark - RECEIVING:
+
+
+    bool ResumableStream::received(const void *data, size_t size) {
+        auto src = (const uint8_t*)data;
+        _input.insert(_input.end(), src, src + size);
+        size_t pos = 0;
+        if (_awaitingResume) {
+            if (_input.size() < kResumeMessageSize)
+                return true;
+            if (!receivedResumeMessage(_input.data()))
+                return false;
+            pos = kResumeMessageSize;
+        }
+
+        bool ok = true;
+        while (true) {
+            input_data in = {_input.data() + pos, _input.size() - pos};
+            output_buffer out = {_scratch.data(), _scratch.size()};
+            status_t status = _decryptor.decrypt(in, out);
+            if (status == IncompleteInput) {
+                break;
+            } else if (status != Success || out.size == 0) {
+                ok = false;
+                break;
+            }
+            size_t frameSize = (_input.size() - pos) - in.size;
+            pos += frameSize;
+            ++_framesReceived;
+            _bytesSinceAck += frameSize;
+
+            auto payload = _scratch.data();
+            if (payload[0] == kDataFrame) {
+                _readable.insert(_readable.end(), payload + 1, payload + out.size);
+            } else if (payload[0] == kAckFrame && out.size == 9) {
+                if (!handleAck(readUint64At(payload + 1))) {
+                    ok = false;
+                    break;
+                }
+            } else {
+                ok = false;
+                break;
+            }
+        }
+        _input.erase(_input.begin(), _input.begin() + pos);
+
+        if (_framesReceived - _framesAcked >= kAckEveryFrames || _bytesSinceAck >= kAckEveryBytes)
+            sendAck();
+        return ok;
+    }
+
+
+    size_t ResumableStream::read(void *dst, size_t maxSize) {
+        size_t n = min(maxSize, readableBytes());
+        ::memcpy(dst, &_readable[_readableStart], n);
+        _readableStart += n;
+        if (_readableStart == _readable.size()) {
+            _readable.clear();
+            _readableStart = 0;
+        } else if (_readableStart >= 65536 && _readableStart >= _readable.size() / 2) {
+            _readable.erase(_readable.begin(), _readable.begin() + _readableStart);
+            _readableStart = 0;
+        }
+        return n;
+    }
+
+
+#pragma mark - RECONNECTING:
+
+
+    // A resume message is: the sender's resume ID (16 bytes), the reconnect count (32-bit BE),
+    // the number of frames the sender has received (64-bit BE), and a 16-byte BLAKE2b MAC of
+    // the preceding fields, keyed with the sender's resume key. The reconnect count keeps an
+    // old resume message from being replayed on a later reconnect: it has to be greater than
+    // the last one accepted. (Not equal to ours, since a reconnect attempt may fail before
+    // reaching the peer, leaving one side with more attempts than the other.)
+
+    std::array<uint8_t,16> ResumableStream::resumeTag(SessionKey const& key,
+                                                      const uint8_t *message) const
+    {
+        std::array<uint8_t,16> tag;
+        monocypher::c::crypto_blake2b_keyed(tag.data(), tag.size(), key.data(), key.size(),
+                                            message, kResumeMessageSize - tag.size());
+        return tag;
+    }
+
+
+    void ResumableStream::reconnect() {
+        ++_attempt;
+        _input.clear();
+        _sendIndex = _sendOffset = 0;
+        _awaitingResume = true;
+
+        uint8_t *msg = _resumeMessage.data();
+        ::memcpy(msg, _id.data(), _id.size());
+        writeUint32At(msg + 16, _attempt);
+        writeUint64At(msg + 20, _framesReceived);
+        auto tag = resumeTag(_resumeKey, msg);
+        ::memcpy(msg + 28, tag.data(), tag.size());
+        _resumeMessageSent = 0;
+    }
+
+
+    bool ResumableStream::receivedResumeMessage(const uint8_t *msg) {
+        auto tag = resumeTag(_peerResumeKey, msg);
+        if (monocypher::c::crypto_verify16(tag.data(), msg + 28) != 0
+                || ::memcmp(msg, _peerID.data(), _peerID.size()) != 0
+                || readUint32At(msg + 16) <= _peerAttempt)
+            return false;
+        // Forget the frames the peer has, and resend the rest:
+        if (!handleAck(readUint64At(msg + 20)))
+            return false;
+        _peerAttempt = readUint32At(msg + 16);
+        _sendIndex = _sendOffset = 0;
+        _awaitingResume = false;
+        return true;
+    }
+
+
+    ResumableStream::ResumeID ResumableStream::resumeIDOf(const void *resumeMessage) {
+        ResumeID id;
+        ::memcpy(id.data(), resumeMessage, id.size());
+        return id;
+    }
+
+}
@@ -0,0 +1,229 @@
+//
+// SealedMessage.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#include "SealedMessage.hh"
+#include "shs.hh"
+#include "drbg.hh"
+#include "SecretProfiler_Internal.hh"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace snej::shs {
+    using namespace impl;
+    using compact_key   = monocypher::session::key;
+    using session_nonce = monocypher::session::nonce;
+    using kx_public_key = key_exchange::public_key;
+    using kx_shared_secret = key_exchange::shared_secret;
+    using input_bytes   = monocypher::input_bytes;
+    using sha256        = monocypher::ext::sha256;
+
+    static_assert(sizeof(SessionKey) == sizeof(compact_key));
+
+    // A sealed message is ep | MAC | ciphertext, where the plaintext is Ap | sig | message.
+    static constexpr size_t kEphemeralSize = sizeof(kx_public_key);
+    static constexpr size_t kMACSize       = 16;
+    static constexpr size_t kSenderSize    = sizeof(public_key) + sizeof(signature);
+
+    static_assert(MessageSealer::kOverhead == kEphemeralSize + kMACSize + kSenderSize);
+
+
+    static inline sha256 hash(input_bytes in) {
+        SHS_PROFILE_SPAN("sha256");
+        return sha256::create(in);
+    }
+
+    // key = hash(K | e·B | ep | Bp)
+    static inline sha256 sealKey(app_id const& K, kx_shared_secret const& eB,
+                                 kx_public_key const& ep, public_key const& Bp) {
+        return hash(K | eB | ep | Bp);
+    }
+
+
+#pragma mark - SEALER:
+
+
+    status_t MessageSealer::seal(PublicKey const& recipient, input_data in, output_buffer &out) {
+        size_t sealedSize = this->sealedSize(in.size);
+        if (out.size < sealedSize)
+            return OutTooSmall;
+        SHS_PROFILE_SPAN("seal");
+        app_id K(_context.appID);
+        signing_key A(_context.keyPair.signingKey);
+        public_key Ap(_context.keyPair.publicKey);
+        public_key Bp(recipient);
+
+        // Make an ephemeral key-pair:
+        key_exchange::secret_key secret;
+        drbg::randomize(secret.data(), secret.size());
+        key_exchange e(secret);
+        kx_public_key ep = SHS_PROFILED("x25519-public-key", e.get_public_key());
+
+        // Assemble the plaintext Ap | sign[A](K | Bp | ep | hash(message)) | message where its
+        // ciphertext will go, then encrypt it in place:
+        auto dst = (uint8_t*)out.data;
+        uint8_t *plaintext = dst + kEphemeralSize + kMACSize;
+        auto sig = SHS_PROFILED("ed25519-sign", A.sign(K | Bp | ep | hash({in.data, in.size})));
+        ::memcpy(plaintext, Ap.data(), sizeof(Ap));
+        ::memcpy(plaintext + sizeof(Ap), sig.data(), sizeof(sig));
+        ::memcpy(plaintext + kSenderSize, in.data, in.size);
+
+        kx_shared_secret eB = SHS_PROFILED("x25519", e * Bp.for_key_exchange<monocypher::X25519_Raw>());
+        auto key = sealKey(K, eB, ep, Bp);
+        // (A zero nonce is safe because the key, derived from a new ephemeral key, is only
+        // used once.)
+        ((compact_key&)key).box(session_nonce(0),
+                                {plaintext, kSenderSize + in.size},
+                                {dst + kEphemeralSize, sealedSize - kEphemeralSize});
+        ::memcpy(dst, ep.data(), kEphemeralSize);
+        monocypher::wipe(&key, sizeof(key));
+        out.size = sealedSize;
+        return Success;
+    }
+
+
+#pragma mark - OPENER:
+
+
+    MessageOpener::MessageOpener(Context const& context)
+    :_context(context)
+    {
+        // Convert my Ed25519 signing key to X25519 once, instead of for every message:
+        auto kx = signing_key(context.keyPair.signingKey).as_key_exchange<monocypher::X25519_Raw>();
+        auto secret = kx.get_secret_key();
+        ::memcpy(_kxSecret.data(), secret.data(), _kxSecret.size());
+        monocypher::wipe(&secret, sizeof(secret));
+    }
+
+
+    MessageOpener::~MessageOpener() {
+        monocypher::wipe(_kxSecret.data(), _kxSecret.size());
+    }
+
+
+    status_t MessageOpener::open(input_data in, output_buffer &out, PublicKey *outSender) const {
+        std::vector<uint8_t> scratch;
+        return open(in, out, outSender, scratch);
+    }
+
+
+    status_t MessageOpener::open(input_data in, output_buffer &out, PublicKey *outSender,
+                                 std::vector<uint8_t> &scratch) const
+    {
+        if (in.size < MessageSealer::kOverhead)
+            return IncompleteInput;
+        size_t messageSize = in.size - MessageSealer::kOverhead;
+        if (out.size < messageSize)
+            return OutTooSmall;
+        SHS_PROFILE_SPAN("openSealed");
+        auto src = (const uint8_t*)in.data;
+        app_id K(_context.appID);
+        public_key Bp(_context.keyPair.publicKey);
+        key_exchange B{key_exchange::secret_key(byte_array<32>(_kxSecret))};
+        auto &ep = *(const kx_public_key*)src;
+
+        // Decrypt Ap | sig | message into `scratch`:
+        kx_shared_secret eB = SHS_PROFILED("x25519", B * ep);
+        auto key = sealKey(K, eB, ep, Bp);
+        scratch.resize(kSenderSize + messageSize);
+        auto opened = ((compact_key&)key).unbox(session_nonce(0),
+                                                {src + kEphemeralSize, in.size - kEphemeralSize},
+                                                {scratch.data(), scratch.size()});
+        monocypher::wipe(&key, sizeof(key));
+        if (opened.size != scratch.size())
+            return CorruptData;
+
+        // Check the sender's signature of K | Bp | ep | hash(message):
+        auto &Ap  = *(const public_key*)&scratch[0];
+        auto &sig = *(const signature*)&scratch[sizeof(public_key)];
+        const uint8_t *message = &scratch[kSenderSize];
+        if (_preAuth && !_preAuth(Ap))
+            return CorruptData;
+        if (!SHS_PROFILED("ed25519-check", Ap.check(sig, K | Bp | ep | hash({message, messageSize}))))
+            return CorruptData;
+
+        ::memcpy(out.data, message, messageSize);
+        out.size = messageSize;
+        if (outSender)
+            ::memcpy(outSender->data(), Ap.data(), sizeof(Ap));
+        return Success;
+    }
+
+
+    size_t MessageOpener::openAll(input_data const messages[], size_t count,
+                                  output_buffer &out,
+                                  Result results[],
+                                  unsigned threads) const
+    {
+        // Each message's opened size is known in advance, so first assign each its space in
+        // `out`; then the messages can be opened in any order, by any thread.
+        auto dst = (uint8_t*)out.data;
+        size_t used = 0;
+        bool full = false;
+        for (size_t i = 0; i < count; ++i) {
+            size_t inSize = messages[i].size;
+            size_t size = inSize - std::min(inSize, MessageSealer::kOverhead);
+            if (inSize < MessageSealer::kOverhead) {
+                results[i] = {IncompleteInput, {nullptr, 0}, {}};
+            } else if (full || size > out.size - used) {
+                results[i] = {OutTooSmall, {nullptr, 0}, {}};
+                full = true;    // (so the caller can retry the rest in order)
+            } else {
+                results[i] = {Success, {dst + used, size}, {}};
+                used += size;
+            }
+        }
+        out.size = used;
+
+        std::atomic<size_t> next = 0;
+        auto work = [&] {
+            std::vector<uint8_t> scratch;
+            for (size_t i; (i = next++) < count; ) {
+                Result &result = results[i];
+                if (result.status != Success)
+                    continue;
+                output_buffer msgOut = {(void*)result.message.data, result.message.size};
+                result.status = open(messages[i], msgOut, &result.sender, scratch);
+                if (result.status != Success)
+                    result.message = {nullptr, 0};
+            }
+        };
+
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = unsigned(std::min(size_t(threads), count));
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < threads; ++t)
+            workers.emplace_back(work);
+        work();
+        for (auto &worker : workers)
+            worker.join();
+
+        return std::count_if(results, results + count,
+                             [](Result const& r) {return r.status == Success;});
+    }
+
+}
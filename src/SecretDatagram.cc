@@ -0,0 +1,165 @@
+//
+// SecretDatagram.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#include "SecretDatagram.hh"
+#include "monocypher/encryption.hh"
+#include <algorithm>
+#include <stdexcept>
+
+namespace snej::shs {
+    using compact_key   = monocypher::session::key;
+    using session_nonce = monocypher::session::nonce;
+
+    static_assert(sizeof(SessionKey) == sizeof(compact_key));
+    static_assert(sizeof(Nonce)      == sizeof(session_nonce));
+
+    static constexpr size_t kSequenceSize = 8;
+
+
+    static inline void writeUint64At(uint8_t *dst, uint64_t n) {
+        for (int i = 7; i >= 0; --i) {
+            dst[i] = uint8_t(n);
+            n >>= 8;
+        }
+    }
+
+    static inline uint64_t readUint64At(const uint8_t *src) {
+        uint64_t n = 0;
+        for (int i = 0; i < 8; ++i)
+            n = (n << 8) | src[i];
+        return n;
+    }
+
+
+    DatagramCrypto::DatagramCrypto(SessionKey const& key, Nonce const& nonce)
+    :_nonce(nonce)
+    {
+        // Use a separate key for datagrams, so their nonces can't collide with the stream's:
+        static constexpr char kLabel[] = "SecretHandshake datagram key";
+        monocypher::c::crypto_blake2b_keyed(_key.data(), _key.size(),
+                                            key.data(), key.size(),
+                                            (const uint8_t*)kLabel, sizeof(kLabel) - 1);
+    }
+
+
+    DatagramCrypto::~DatagramCrypto() {
+        monocypher::wipe((void*)&_key, sizeof(_key));
+    }
+
+
+    // Adds the sequence number to the session nonce. The addition is little-endian, like the
+    // nonce's `++` operator.
+    Nonce DatagramCrypto::nonceFor(uint64_t sequence) const {
+        Nonce nonce = _nonce;
+        unsigned carry = 0;
+        for (size_t i = 0; i < nonce.size(); ++i) {
+            unsigned sum = nonce[i] + unsigned(sequence & 0xFF) + carry;
+            nonce[i] = uint8_t(sum);
+            carry = sum >> 8;
+            sequence >>= 8;
+        }
+        return nonce;
+    }
+
+
+    status_t DatagramEncryptor::encrypt(input_data in, output_buffer &out) {
+        size_t encSize = encryptedSize(in.size);
+        if (out.size < encSize)
+            return OutTooSmall;
+        if (_nextSequence == UINT64_MAX)
+            throw std::logic_error("DatagramEncryptor sequence numbers exhausted");
+        uint64_t sequence = _nextSequence++;
+
+        auto dst = (uint8_t*)out.data;
+        auto &key = (const compact_key&)_key;
+        Nonce n = nonceFor(sequence);
+        auto &nonce = (session_nonce&)n;
+        key.box(nonce, {in.data, in.size}, {dst + kSequenceSize, encSize - kSequenceSize});
+        writeUint64At(dst, sequence);
+        out.size = encSize;
+        return Success;
+    }
+
+
+    status_t DatagramDecryptor::decrypt(input_data in, output_buffer &out, uint64_t *outSequence) {
+        if (in.size < kOverhead)
+            return IncompleteInput;
+        size_t payloadSize = in.size - kOverhead;
+        if (out.size < payloadSize)
+            return OutTooSmall;
+
+        auto src = (const uint8_t*)in.data;
+        uint64_t sequence = readUint64At(src);
+        if (isReplay(sequence)) {
+            ++_replays;
+            return CorruptData;
+        }
+        // Only update the window after the MAC is verified, so forgeries can't move it:
+        auto &key = (const compact_key&)_key;
+        Nonce n = nonceFor(sequence);
+        auto &nonce = (session_nonce&)n;
+        if (key.unbox(nonce, {src + kSequenceSize, in.size - kSequenceSize},
+                      {out.data, out.size}).size != payloadSize)
+            return CorruptData;
+        markReceived(sequence);
+        out.size = payloadSize;
+        if (outSequence)
+            *outSequence = sequence;
+        return Success;
+    }
+
+
+#pragma mark - REPLAY WINDOW:
+
+
+    // The window is a ring of 64-bit blocks, indexed by `sequence / 64`. (This is the scheme in
+    // RFC 6479.) When the highest sequence advances into a new block, the blocks it skips over
+    // are cleared. The window always covers at least `kWindowSize` sequences behind the highest.
+
+    bool DatagramDecryptor::isReplay(uint64_t sequence) const {
+        if (sequence >= _nextSequence)
+            return false;                                       // newer than any seen
+        if (_nextSequence - sequence > kWindowSize)
+            return true;                                        // too old to tell
+        uint64_t block = _bitmap[(sequence / 64) % kBlocks];
+        return (block >> (sequence % 64)) & 1;
+    }
+
+
+    void DatagramDecryptor::markReceived(uint64_t sequence) {
+        if (sequence >= _nextSequence) {
+            if (_nextSequence > 0) {
+                uint64_t oldBlock = (_nextSequence - 1) / 64, newBlock = sequence / 64;
+                uint64_t n = std::min(newBlock - oldBlock, uint64_t(kBlocks));
+                for (uint64_t i = 1; i <= n; ++i)
+                    _bitmap[(oldBlock + i) % kBlocks] = 0;
+            }
+            _nextSequence = sequence + 1;
+        }
+        _bitmap[(sequence / 64) % kBlocks] |= uint64_t(1) << (sequence % 64);
+    }
+
+}
@@ -25,6 +25,9 @@
 
 #include "SecretHandshake.hh"
 #include "SecretHandshake_Internal.hh"
+#include "SecretMetrics_Internal.hh"
+#include "Probes.hh"
+#include "drbg.hh"
 #include "shs.hh"
 #include "monocypher/signatures.hh"
 #include <cstring>
@@ -34,18 +37,6 @@
 namespace snej::shs {
 
 
-    void (*LogCallback)(LogLevel, const char* format, va_list args);
-
-    void _Log(LogLevel level, const char*format, ...) noexcept {
-        if (LogCallback) {
-            va_list args;
-            va_start(args, format);
-            LogCallback(level, format, args);
-            va_end(args);
-        }
-    }
-
-
     KeyPair::KeyPair(SigningKey const& sk)
     :signingKey(sk)
     ,publicKey(impl::signing_key(sk).get_public_key())
@@ -53,7 +44,9 @@ namespace snej::shs {
     
 
     KeyPair KeyPair::generate() {
-        return KeyPair(impl::key_pair::generate());
+        impl::signing_key seed;
+        impl::drbg::randomize(seed.data(), seed.size());
+        return KeyPair(impl::key_pair(seed));
     }
 
 
@@ -77,12 +70,21 @@ namespace snej::shs {
 #pragma mark - HANDSHAKE:
 
 
-    Handshake::Handshake(Context const& context)
+    Handshake::Handshake(Context const& context, bool deferKeys)
     :_context(context)
-    ,_impl(std::make_unique<impl::handshake>(impl::app_id(context.appID),
-                                            impl::signing_key(context.keyPair.signingKey),
-                                            impl::public_key(context.keyPair.publicKey)))
-    { }
+    {
+        if (!deferKeys)
+            _impl = std::make_unique<impl::handshake>(impl::app_id(context.appID),
+                                                      impl::signing_key(context.keyPair.signingKey),
+                                                      impl::public_key(context.keyPair.publicKey));
+        if (impl::metrics::enabled()) {
+            impl::metrics::handshakeStarted();
+            _startTime = _stepStartTime = impl::metrics::nowMicros();
+        }
+        SHS_PROBE(handshake_start, this);
+        if (SHS_PROBE_ENABLED(handshake_step) || SHS_PROBE_ENABLED(handshake_done))
+            _probeStartTime = _probeStepStartTime = impl::probeNanos();
+    }
 
 
     Handshake::~Handshake() = default;
@@ -90,16 +92,32 @@ namespace snej::shs {
 
     void Handshake::nextStep() {
         assert(_step > Failed && _step < Finished);
+        if (_startTime && impl::metrics::enabled()) {
+            uint64_t now = impl::metrics::nowMicros();
+            impl::metrics::handshakeStepCompleted(_step - 1, now - _stepStartTime);
+            _stepStartTime = now;
+            if (_step + 1 == Finished)
+                impl::metrics::handshakeSucceeded(now - _startTime);
+        }
+        if (SHS_PROBE_ENABLED(handshake_step) || SHS_PROBE_ENABLED(handshake_done)) {
+            // (If the tracer attached mid-handshake, the durations aren't known yet.)
+            uint64_t now = impl::probeNanos();
+            if (_probeStepStartTime)
+                SHS_PROBE(handshake_step, this, int(_step), now - _probeStepStartTime);
+            if (_probeStartTime && _step + 1 == Finished)
+                SHS_PROBE(handshake_done, this, now - _probeStartTime);
+            _probeStepStartTime = now;
+        }
         _step = Step(_step + 1);
         if (_step == Finished)
-            Log(info, "Successful handshake!");
+            Log(info, succeeded, 0);
     }
 
 
     std::pair<void*, size_t> Handshake::bytesToRead() {
         size_t needed = byteCountNeeded();
         if (needed > 0)
-            Log(debug, "Step %d/4: Awaiting %zu bytes...", _step, needed);
+            Log(debug, awaitingBytes, needed);
         _inputBuffer.resize(needed);
         return {_inputBuffer.data(), needed};
     }
@@ -109,26 +127,33 @@ namespace snej::shs {
         if (_inputBuffer.size() != byteCountNeeded())
             throw std::logic_error("Unexpected call to Handshake::readCompleted");
         if (_receivedBytes(_inputBuffer.data())) {
-            Log(debug, "Step %d OK", _step);
+            Log(debug, stepOK, 0);
             nextStep();
             _inputBuffer.clear();
             return true;
         } else {
-            Log(err, "Received invalid data in step %d; HANDSHAKE FAILED", _step);
-            failed();
+            failed(LogEventType::invalidData);
             return false;
         }
     }
 
 
     void Handshake::readFailed() {
-        Log(err, "Unexpected EOF at step %d; HANDSHAKE FAILED", _step);
-        failed();
+        SHS_PROBE(handshake_eof, this, int(_step));
+        failed(LogEventType::unexpectedEOF);
     }
 
 
-    void Handshake::failed() {
+    void Handshake::failed(LogEventType why) {
         _error = (_step < ClientAuth) ? Error::ProtocolError : Error::AuthError;
+        switch (why) {
+            case LogEventType::unexpectedEOF:         Log(err, unexpectedEOF, 0); break;
+            case LogEventType::authorizationRejected: Log(err, authorizationRejected, 0); break;
+            default:                                  Log(err, invalidData, 0); break;
+        }
+        if (impl::metrics::enabled() && _step > Failed && _step < Finished)
+            impl::metrics::handshakeFailed(_error - ProtocolError, _step - 1);
+        SHS_PROBE(handshake_failed, this, int(_step), int(_error));
         _step = Failed;
     }
 
@@ -144,7 +169,7 @@ namespace snej::shs {
         _inputBuffer.insert(_inputBuffer.end(), (uint8_t*)src, (uint8_t*)src + count);
         if (_inputBuffer.size() < needed) {
             // Wait for more bytes:
-            Log(debug, "Received %zu bytes; waiting...", count);
+            Log(debug, receivedPartial, count);
         } else {
             // Buffer has enough bytes, so consume it:
             readCompleted();
@@ -159,7 +184,7 @@ namespace snej::shs {
         if (_outputBuffer.empty())
             _fillOutputBuffer(_outputBuffer);
         if (!_outputBuffer.empty())
-            Log(debug, "Step %d/4: Sending %zu bytes...", _step, _outputBuffer.size());
+            Log(debug, sendingBytes, _outputBuffer.size());
         return {_outputBuffer.data(), _outputBuffer.size()};
     }
 
@@ -167,7 +192,7 @@ namespace snej::shs {
     void Handshake::sendCompleted() {
         if (_outputBuffer.empty())
             throw std::logic_error("Unexpected call to Handshake::sendCompleted");
-        Log(debug, "Send completed");
+        Log(debug, sendCompleted, 0);
         _outputBuffer.clear();
         nextStep();
     }
@@ -187,10 +212,10 @@ namespace snej::shs {
         _outputBuffer.erase(_outputBuffer.begin(), _outputBuffer.begin() + count);
         if (_outputBuffer.empty()) {
             // Write is complete:
-            Log(debug, "Send completed");
+            Log(debug, sendCompleted, 0);
             nextStep();
         } else {
-            Log(debug, "Sent %zu bytes...", count);
+            Log(debug, sentPartial, count);
         }
         return count;
     }
@@ -205,6 +230,7 @@ namespace snej::shs {
                           (impl::session_key&)session.decryptionKey,
                           (impl::nonce&)session.decryptionNonce,
                           (impl::public_key&)session.peerPublicKey);
+        session.appID = _impl->getAppID();
         return session;
     }
 
@@ -273,6 +299,138 @@ namespace snej::shs {
     }
 
 
+#pragma mark - COOKIE JAR:
+
+
+    CookieJar::CookieJar(Context const& context, clock::duration rotationInterval)
+    :_context(context)
+    ,_interval(rotationInterval)
+    {
+        // Fill both slots, so the "previous" secret isn't a known value:
+        _rotate();
+        _rotate();
+    }
+
+
+    CookieJar::~CookieJar() {
+        monocypher::wipe(_secrets, sizeof(_secrets));
+    }
+
+
+    void CookieJar::rotate() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _rotate();
+    }
+
+
+    void CookieJar::_rotate() {
+        ++_epoch;
+        impl::drbg::randomize(_secrets[_epoch & 1].data(), sizeof(Secret));
+        _used[_epoch & 1].clear();
+        _rotatedAt = clock::now();
+    }
+
+
+    // Rotates if the interval has elapsed; twice if there was no rotation in the last interval
+    // either, so that the previous secret expires too.
+    void CookieJar::_update() {
+        auto elapsed = clock::now() - _rotatedAt;
+        if (elapsed >= _interval) {
+            _rotate();
+            if (elapsed >= 2 * _interval)
+                _rotate();
+        }
+    }
+
+
+    uint64_t CookieJar::currentSecret(Secret &secret) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _update();
+        secret = _secrets[_epoch & 1];
+        return _epoch;
+    }
+
+
+    bool CookieJar::secretForEpoch(uint64_t epoch, Secret &secret) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _update();
+        if (epoch != _epoch && epoch + 1 != _epoch)
+            return false;
+        secret = _secrets[epoch & 1];
+        return true;
+    }
+
+
+    bool CookieJar::firstUse(uint64_t epoch, const uint8_t *clientEphemeralKey) {
+        // Ephemeral public keys are random, so 64 bits of one are plenty to identify it.
+        uint64_t id;
+        ::memcpy(&id, clientEphemeralKey, sizeof(id));
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (epoch != _epoch && epoch + 1 != _epoch)
+            return false;
+        return _used[epoch & 1].insert(id).second;
+    }
+
+
+#pragma mark - CONTEXT SET:
+
+
+    struct ContextSet::Tenant {
+        Context                 context;
+        impl::challenge_matcher matcher;
+
+        explicit Tenant(Context const& c)   :context(c), matcher(impl::app_id(c.appID)) { }
+    };
+
+
+    ContextSet::ContextSet() = default;
+    ContextSet::~ContextSet() = default;
+
+
+    ContextSet::ContextSet(std::vector<Context> const& contexts) {
+        for (auto &context : contexts)
+            add(context);
+    }
+
+
+    void ContextSet::add(Context const& context) {
+        if (find(context.appID))
+            throw std::invalid_argument("ContextSet already has a Context with that AppID");
+        _tenants.push_back(std::make_unique<Tenant>(context));
+    }
+
+
+    size_t ContextSet::size() const {
+        return _tenants.size();
+    }
+
+
+    Context const& ContextSet::operator[](size_t i) const {
+        return _tenants.at(i)->context;
+    }
+
+
+    Context const* ContextSet::find(AppID const& appID) const {
+        for (auto &tenant : _tenants) {
+            if (tenant->context.appID == appID)
+                return &tenant->context;
+        }
+        return nullptr;
+    }
+
+
+    Context const* ContextSet::findForChallenge(const void *challenge, size_t size) const {
+        if (size != sizeof(impl::ChallengeData))
+            return nullptr;
+        auto &challengeData = *(impl::ChallengeData const*)challenge;
+        for (auto &tenant : _tenants) {
+            if (tenant->matcher.matches(challengeData))
+                return &tenant->context;
+        }
+        return nullptr;
+    }
+
+
 #pragma mark - SERVER:
 
 
@@ -284,6 +442,26 @@ namespace snej::shs {
     { }
 
 
+    ServerHandshake::ServerHandshake(std::shared_ptr<CookieJar> cookieJar)
+    :Handshake(cookieJar->context(), true)
+    ,_cookieJar(std::move(cookieJar))
+    { }
+
+
+    static Context const& firstContext(ContextSet const& contexts) {
+        if (contexts.size() == 0)
+            throw std::invalid_argument("ServerHandshake needs at least one Context");
+        return contexts[0];
+    }
+
+
+    // The base class's context is just a placeholder until the client's challenge arrives.
+    ServerHandshake::ServerHandshake(std::shared_ptr<ContextSet const> contexts)
+    :Handshake(firstContext(*contexts), true)
+    ,_contexts(std::move(contexts))
+    { }
+
+
     size_t ServerHandshake::byteCountNeeded() {
         switch (_step) {
             case ClientChallenge:  return sizeof(impl::ChallengeData);
@@ -296,23 +474,106 @@ namespace snej::shs {
     bool ServerHandshake::_receivedBytes(const uint8_t *bytes) {
         switch (_step) {
             case ClientChallenge:
+                if (_cookieJar) {
+                    // In cookie mode just remember the challenge; it's processed in ClientAuth.
+                    auto &challenge = *(impl::ChallengeData*)bytes;
+                    if (!impl::handshake::isValidChallenge(impl::app_id(_context.appID), challenge))
+                        return false;
+                    ::memcpy(_cookieChallenge.data(), bytes, sizeof(_cookieChallenge));
+                    return true;
+                }
+                if (_contexts) {
+                    // In multi-tenant mode, find the Context whose AppID the client used:
+                    Context const* context = _contexts->findForChallenge(bytes,
+                                                                sizeof(impl::ChallengeData));
+                    if (!context)
+                        return false;
+                    _impl = std::make_unique<impl::handshake>(
+                                            impl::app_id(context->appID),
+                                            impl::signing_key(context->keyPair.signingKey),
+                                            impl::public_key(context->keyPair.publicKey));
+                }
                 return _impl->verifyChallenge(*(impl::ChallengeData*)bytes);
-            case ClientAuth:  
-                return _impl->verifyClientAuth(*(impl::ClientAuthData*)bytes)
-                    && (!_clientAuth || _clientAuth(_impl->getPeerPublicKey()));
+            case ClientAuth: {
+                if (_cookieJar && !recreateCookieHandshake())
+                    return false;
+                impl::handshake::key_filter preAuth;
+                if (_clientPreAuth)
+                    preAuth = [this](impl::public_key const& key) {return _clientPreAuth(key);};
+                if (!_impl->verifyClientAuth(*(impl::ClientAuthData*)bytes, preAuth))
+                    return false;
+                if (_cookieJar && !_cookieJar->firstUse(_cookieEpoch, &_cookieChallenge[32]))
+                    return false;   // replayed handshake
+                if (_clientAuth && !_clientAuth(_impl->getPeerPublicKey()))
+                    return false;
+                if (_asyncAuth) {
+                    _authPending = true;
+                    Log(debug, awaitingAuthorization, 0);
+                }
+                return true;
+            }
             default:
                 return false;
         }
     }
 
 
+    // In cookie mode, creates the crypto state that a normal server would have created
+    // by now, using the ephemeral key derived from the epoch's secret.
+    bool ServerHandshake::recreateCookieHandshake() {
+        CookieJar::Secret secret;
+        if (!_cookieJar->secretForEpoch(_cookieEpoch, secret))
+            return false;   // too old
+        auto &challenge = (impl::ChallengeData&)_cookieChallenge;
+        _impl = std::make_unique<impl::handshake>(
+                        impl::app_id(_context.appID),
+                        impl::signing_key(_context.keyPair.signingKey),
+                        impl::public_key(_context.keyPair.publicKey),
+                        impl::handshake::cookieEphemeralKey((impl::byte_array<32>&)secret,
+                                                            challenge),
+                        (impl::handshake::kx_public_key&)_cookieEphemeralKey);
+        monocypher::wipe(&secret, sizeof(secret));
+        return _impl->verifyChallenge(challenge);
+    }
+
+
+    PublicKey ServerHandshake::clientPublicKey() const {
+        if (!_authPending)
+            throw std::logic_error("ServerHandshake::clientPublicKey called while not pending");
+        return _impl->getPeerPublicKey();
+    }
+
+
+    void ServerHandshake::resumeAuthorization(bool allow) {
+        if (!_authPending)
+            throw std::logic_error("Unexpected call to ServerHandshake::resumeAuthorization");
+        _authPending = false;
+        if (!allow)
+            failed(LogEventType::authorizationRejected);
+    }
+
+
     void ServerHandshake::_fillOutputBuffer(std::vector<uint8_t> &output) {
         switch (_step) {
             case ServerChallenge:
-                spaceFor<impl::ChallengeData>(output) = _impl->createServerChallenge();
+                if (_cookieJar) {
+                    CookieJar::Secret secret;
+                    _cookieEpoch = _cookieJar->currentSecret(secret);
+                    auto b = impl::handshake::cookieEphemeralKey((impl::byte_array<32>&)secret,
+                                                    (impl::ChallengeData&)_cookieChallenge);
+                    monocypher::wipe(&secret, sizeof(secret));
+                    // Save the public key, so `recreateCookieHandshake` needn't recompute it:
+                    auto bp = b.get_public_key();
+                    ::memcpy(_cookieEphemeralKey.data(), &bp, sizeof(_cookieEphemeralKey));
+                    spaceFor<impl::ChallengeData>(output) = impl::handshake::createChallenge(
+                                            impl::app_id(_context.appID), bp);
+                } else {
+                    spaceFor<impl::ChallengeData>(output) = _impl->createServerChallenge();
+                }
                 break;
             case ServerAck:
-                spaceFor<impl::ServerAckData>(output) = _impl->createServerAck();
+                if (!_authPending)
+                    spaceFor<impl::ServerAckData>(output) = _impl->createServerAck();
                 break;
             default:
                 break;
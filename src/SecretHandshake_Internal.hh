@@ -25,12 +25,39 @@
 
 #pragma once
 #include "SecretHandshakeTypes.hh"
+#include <atomic>
 
-namespace snej::shs {
+#ifndef SHS_MIN_LOG_LEVEL
+/// The lowest `LogLevel` (as an int) whose events are compiled in at all. By default `trace`
+/// and `debug` events are only compiled into debug builds.
+#   ifdef NDEBUG
+#       define SHS_MIN_LOG_LEVEL 2
+#   else
+#       define SHS_MIN_LOG_LEVEL 0
+#   endif
+#endif
 
-    void _Log(LogLevel, const char* format, ...) noexcept shs_printflike(2,3);
+namespace snej::shs::impl {
 
-#define Log(LEVEL, FMT, ...) \
-    do { if (LogCallback) _Log(LogLevel::LEVEL, FMT, ## __VA_ARGS__); } while (false)
+    extern std::atomic<LogLevel> gLogLevel;
+
+    /// True if events of this level should be logged.
+    static inline bool shouldLog(LogLevel level) {
+        return level >= gLogLevel.load(std::memory_order_relaxed);
+    }
+
+    /// Delivers an event to the async sink or the callbacks, if any.
+    void logEvent(LogEvent const&) noexcept;
 
 }
+
+/// Logs a `LogEvent` from a Handshake method. BYTES is the byte count, if any.
+/// The level check comes before anything else, and levels below SHS_MIN_LOG_LEVEL compile away.
+#define Log(LEVEL, TYPE, BYTES) \
+    do { \
+        if constexpr (int(LogLevel::LEVEL) >= SHS_MIN_LOG_LEVEL) { \
+            if (impl::shouldLog(LogLevel::LEVEL)) \
+                impl::logEvent({this, LogLevel::LEVEL, LogEventType::TYPE, \
+                                uint8_t(_step), uint8_t(_error), uint32_t(BYTES)}); \
+        } \
+    } while (false)
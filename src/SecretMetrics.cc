@@ -0,0 +1,290 @@
+//
+// SecretMetrics.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#include "SecretMetrics.hh"
+#include "SecretMetrics_Internal.hh"
+#include "SecretHandshakeTypes.hh"
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+const uint32_t SHSMetrics_BucketBoundsMicros[SHS_METRICS_BUCKETS - 1] = {
+    10, 25, 50, 100, 250, 500, 1'000, 2'500, 5'000, 10'000, 25'000, 50'000, 100'000, 250'000,
+    1'000'000
+};
+
+namespace snej::shs::impl::metrics {
+    using namespace std;
+
+    atomic<bool> gEnabled = false;
+
+    static constexpr size_t kShards = 16;
+
+
+    struct Histogram {
+        atomic<uint64_t> buckets[SHS_METRICS_BUCKETS];
+        atomic<uint64_t> count;
+        atomic<uint64_t> sumMicros;
+
+        void record(uint64_t micros) {
+            // (Bounds are inclusive, so find the first bound >= micros)
+            auto b = lower_bound(begin(SHSMetrics_BucketBoundsMicros), end(SHSMetrics_BucketBoundsMicros),
+                                 micros);
+            buckets[b - begin(SHSMetrics_BucketBoundsMicros)].fetch_add(1, memory_order_relaxed);
+            count.fetch_add(1, memory_order_relaxed);
+            sumMicros.fetch_add(micros, memory_order_relaxed);
+        }
+
+        void addTo(SHSHistogram &h) const {
+            for (size_t i = 0; i < SHS_METRICS_BUCKETS; ++i)
+                h.buckets[i] += buckets[i].load(memory_order_relaxed);
+            h.count += count.load(memory_order_relaxed);
+            h.sumMicros += sumMicros.load(memory_order_relaxed);
+        }
+
+        void reset() {
+            for (auto &b : buckets)
+                b.store(0, memory_order_relaxed);
+            count.store(0, memory_order_relaxed);
+            sumMicros.store(0, memory_order_relaxed);
+        }
+    };
+
+
+    // One set of counters. Each thread updates one of `kShards` of these, each in its own cache
+    // lines, so threads rarely contend for a counter.
+    struct alignas(64) Shard {
+        atomic<uint64_t> handshakesStarted;
+        atomic<uint64_t> handshakesSucceeded;
+        atomic<uint64_t> handshakesFailed[2][SHS_METRICS_STEPS];
+        Histogram        stepLatency[SHS_METRICS_STEPS];
+        Histogram        handshakeLatency;
+        atomic<uint64_t> framesEncrypted, bytesEncrypted;
+        atomic<uint64_t> framesDecrypted, bytesDecrypted;
+        atomic<uint64_t> decryptionFailures;
+    };
+
+    static Shard sShards[kShards];          // (static storage is zero-initialized)
+    static atomic<unsigned> sNextShard = 0;
+
+
+    static Shard& myShard() {
+        static thread_local Shard &tShard = sShards[sNextShard++ % kShards];
+        return tShard;
+    }
+
+    static inline void increment(atomic<uint64_t> &counter, uint64_t n = 1) {
+        counter.fetch_add(n, memory_order_relaxed);
+    }
+
+
+    uint64_t nowMicros() {
+        auto now = chrono::steady_clock::now().time_since_epoch();
+        return uint64_t(chrono::duration_cast<chrono::microseconds>(now).count());
+    }
+
+    void handshakeStarted()                     {increment(myShard().handshakesStarted);}
+    void handshakeSucceeded(uint64_t micros) {
+        auto &shard = myShard();
+        increment(shard.handshakesSucceeded);
+        shard.handshakeLatency.record(micros);
+    }
+    void handshakeStepCompleted(int step, uint64_t micros) {
+        myShard().stepLatency[step].record(micros);
+    }
+    void handshakeFailed(int error, int step)   {increment(myShard().handshakesFailed[error][step]);}
+
+    void frameEncrypted(size_t size) {
+        auto &shard = myShard();
+        increment(shard.framesEncrypted);
+        increment(shard.bytesEncrypted, size);
+    }
+    void frameDecrypted(size_t size) {
+        auto &shard = myShard();
+        increment(shard.framesDecrypted);
+        increment(shard.bytesDecrypted, size);
+    }
+    void decryptionFailed()                     {increment(myShard().decryptionFailures);}
+
+
+    static SHSMetrics snapshot() {
+        SHSMetrics m = {};
+        for (Shard const& shard : sShards) {
+            auto get = [](atomic<uint64_t> const& counter) {return counter.load(memory_order_relaxed);};
+            m.handshakesStarted   += get(shard.handshakesStarted);
+            m.handshakesSucceeded += get(shard.handshakesSucceeded);
+            for (int e = 0; e < 2; ++e)
+                for (int s = 0; s < SHS_METRICS_STEPS; ++s)
+                    m.handshakesFailed[e][s] += get(shard.handshakesFailed[e][s]);
+            for (int s = 0; s < SHS_METRICS_STEPS; ++s)
+                shard.stepLatency[s].addTo(m.stepLatency[s]);
+            shard.handshakeLatency.addTo(m.handshakeLatency);
+            m.framesEncrypted     += get(shard.framesEncrypted);
+            m.bytesEncrypted      += get(shard.bytesEncrypted);
+            m.framesDecrypted     += get(shard.framesDecrypted);
+            m.bytesDecrypted      += get(shard.bytesDecrypted);
+            m.decryptionFailures  += get(shard.decryptionFailures);
+        }
+        return m;
+    }
+
+
+    static void reset() {
+        for (Shard &shard : sShards) {
+            shard.handshakesStarted = 0;
+            shard.handshakesSucceeded = 0;
+            for (auto &byError : shard.handshakesFailed)
+                for (auto &counter : byError)
+                    counter = 0;
+            for (auto &h : shard.stepLatency)
+                h.reset();
+            shard.handshakeLatency.reset();
+            shard.framesEncrypted = shard.bytesEncrypted = 0;
+            shard.framesDecrypted = shard.bytesDecrypted = 0;
+            shard.decryptionFailures = 0;
+        }
+    }
+
+}
+
+
+namespace snej::shs {
+    using namespace std;
+
+    void Metrics::enable(bool enabled)              {impl::metrics::gEnabled = enabled;}
+    bool Metrics::enabled()                         {return impl::metrics::enabled();}
+    Metrics::Snapshot Metrics::snapshot()           {return impl::metrics::snapshot();}
+    void Metrics::reset()                           {impl::metrics::reset();}
+
+
+#pragma mark - PROMETHEUS:
+
+
+    static void appendf(string &out, const char *format, ...) shs_printflike(2, 3);
+
+    static void appendf(string &out, const char *format, ...) {
+        char buf[256];
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(buf, sizeof(buf), format, args);
+        va_end(args);
+        out.append(buf, min(size_t(max(n, 0)), sizeof(buf) - 1));
+    }
+
+    static void appendHeader(string &out, const char *name, const char *type, const char *help) {
+        appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    }
+
+    static void appendCounter(string &out, const char *name, const char *help, uint64_t value) {
+        appendHeader(out, name, "counter", help);
+        appendf(out, "%s %" PRIu64 "\n", name, value);
+    }
+
+    static void appendHistogram(string &out, const char *name, const char *labels,
+                                SHSHistogram const& h)
+    {
+        // Prometheus buckets are cumulative, and measured in seconds:
+        const char *sep = labels[0] ? "," : "";
+        uint64_t total = 0;
+        for (size_t i = 0; i < SHS_METRICS_BUCKETS; ++i) {
+            total += h.buckets[i];
+            if (i < SHS_METRICS_BUCKETS - 1)
+                appendf(out, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, labels, sep,
+                        SHSMetrics_BucketBoundsMicros[i] / 1e6, total);
+            else
+                appendf(out, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, sep, total);
+        }
+        const char *open = labels[0] ? "{" : "", *close = labels[0] ? "}" : "";
+        appendf(out, "%s_sum%s%s%s %g\n", name, open, labels, close, h.sumMicros / 1e6);
+        appendf(out, "%s_count%s%s%s %" PRIu64 "\n", name, open, labels, close, h.count);
+    }
+
+
+    string Metrics::prometheusText(Snapshot const& m) {
+        static constexpr const char* kErrorNames[2] = {"protocol", "auth"};
+        static constexpr const char* kStepNames[SHS_METRICS_STEPS] = {
+            "client_challenge", "server_challenge", "client_auth", "server_ack"};
+        string out;
+        appendCounter(out, "shs_handshakes_started_total", "Handshakes started.",
+                      m.handshakesStarted);
+        appendCounter(out, "shs_handshakes_succeeded_total", "Handshakes completed successfully.",
+                      m.handshakesSucceeded);
+
+        appendHeader(out, "shs_handshakes_failed_total", "counter",
+                     "Handshakes failed, by error and step.");
+        for (int e = 0; e < 2; ++e)
+            for (int s = 0; s < SHS_METRICS_STEPS; ++s)
+                appendf(out, "shs_handshakes_failed_total{error=\"%s\",step=\"%s\"} %" PRIu64 "\n",
+                        kErrorNames[e], kStepNames[s], m.handshakesFailed[e][s]);
+
+        appendHeader(out, "shs_handshake_step_duration_seconds", "histogram",
+                     "Time taken by each handshake step.");
+        for (int s = 0; s < SHS_METRICS_STEPS; ++s) {
+            string labels = string("step=\"") + kStepNames[s] + "\"";
+            appendHistogram(out, "shs_handshake_step_duration_seconds", labels.c_str(),
+                            m.stepLatency[s]);
+        }
+        appendHeader(out, "shs_handshake_duration_seconds", "histogram",
+                     "Time taken by successful handshakes.");
+        appendHistogram(out, "shs_handshake_duration_seconds", "", m.handshakeLatency);
+
+        appendCounter(out, "shs_frames_encrypted_total", "Frames encrypted.", m.framesEncrypted);
+        appendCounter(out, "shs_bytes_encrypted_total", "Cleartext bytes encrypted.",
+                      m.bytesEncrypted);
+        appendCounter(out, "shs_frames_decrypted_total", "Frames decrypted.", m.framesDecrypted);
+        appendCounter(out, "shs_bytes_decrypted_total", "Cleartext bytes decrypted.",
+                      m.bytesDecrypted);
+        appendCounter(out, "shs_decryption_failures_total",
+                      "Frames that failed to decrypt because they were corrupt or forged.",
+                      m.decryptionFailures);
+        return out;
+    }
+
+}
+
+
+#pragma mark - C GLUE:
+
+
+using namespace snej::shs;
+
+void SHSMetrics_SetEnabled(bool enabled)        {Metrics::enable(enabled);}
+bool SHSMetrics_IsEnabled(void)                 {return Metrics::enabled();}
+void SHSMetrics_GetSnapshot(SHSMetrics *m)      {*m = Metrics::snapshot();}
+void SHSMetrics_Reset(void)                     {Metrics::reset();}
+
+size_t SHSMetrics_WritePrometheusText(const SHSMetrics *m, char *buffer, size_t bufferSize) {
+    std::string text = Metrics::prometheusText(*m);
+    if (bufferSize > 0) {
+        size_t n = std::min(text.size(), bufferSize - 1);
+        ::memcpy(buffer, text.data(), n);
+        buffer[n] = '\0';
+    }
+    return text.size();
+}
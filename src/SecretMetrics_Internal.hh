@@ -0,0 +1,39 @@
+//
+// SecretMetrics_Internal.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#ifndef SHS_METRICS
+/// If this is false, metrics collection is compiled out entirely.
+#define SHS_METRICS 1
+#endif
+
+namespace snej::shs::impl::metrics {
+
+    extern std::atomic<bool> gEnabled;
+
+    /// True if metrics should be recorded. Callers should check this first, so the cost is only
+    /// a relaxed load and a branch when metrics are off.
+    static inline bool enabled() {
+        return SHS_METRICS && gEnabled.load(std::memory_order_relaxed);
+    }
+
+    /// The current time, for measuring latencies.
+    uint64_t nowMicros();
+
+    void handshakeStarted();
+    void handshakeStepCompleted(int step, uint64_t micros);     // step is 0..3
+    void handshakeSucceeded(uint64_t micros);
+    void handshakeFailed(int error, int step);                  // error is 0..1, step is 0..3
+
+    void frameEncrypted(size_t size);
+    void frameDecrypted(size_t size);
+    void decryptionFailed();
+
+}
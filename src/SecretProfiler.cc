@@ -0,0 +1,239 @@
+//
+// SecretProfiler.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#include "SecretProfiler.hh"
+#include "SecretProfiler_Internal.hh"
+#include "SecretHandshakeTypes.hh"
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace snej::shs::impl::profiler {
+    using namespace std;
+
+    thread_local Span* tCurrentSpan = nullptr;
+
+
+    struct SpanRecord {
+        const char* name;
+        uint64_t    start, end;
+    };
+
+    struct Stat {
+        const char* name;
+        uint64_t    count, ticks, selfTicks;
+    };
+
+
+    // A thread's recorded spans and per-name statistics. Only its own thread writes to it.
+    struct ThreadBuffer {
+        static constexpr size_t kMaxStats = 64;
+
+        explicit ThreadBuffer(unsigned id)
+        :threadID(id)
+        ,spans(new SpanRecord[Profiler::kMaxSpansPerThread])
+        { }
+
+        Stat* statFor(const char *name) {
+            // Names are string literals, so comparing pointers is enough to find a match:
+            for (size_t i = 0; i < statCount; ++i) {
+                if (stats[i].name == name)
+                    return &stats[i];
+            }
+            if (statCount == kMaxStats)
+                return nullptr;
+            stats[statCount] = {name, 0, 0, 0};
+            return &stats[statCount++];
+        }
+
+        void reset() {
+            spanCount = 0;
+            statCount = 0;
+        }
+
+        unsigned const              threadID;
+        unique_ptr<SpanRecord[]>    spans;
+        size_t                      spanCount = 0;
+        Stat                        stats[kMaxStats];
+        size_t                      statCount = 0;
+    };
+
+
+    // All threads' buffers. They're kept after their threads exit, so their spans can be read.
+    struct Registry {
+        mutex                           bufferMutex;
+        vector<shared_ptr<ThreadBuffer>> buffers;
+        uint64_t                        startTicks = ticks();
+        chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+
+        // The number of ticks per microsecond, measured since the registry was created.
+        double ticksPerMicro() {
+            uint64_t t = ticks();
+            auto elapsed = chrono::steady_clock::now() - startTime;
+            double micros = chrono::duration<double, micro>(elapsed).count();
+            return (micros > 0) ? (t - startTicks) / micros : 1.0;
+        }
+    };
+
+    static Registry& registry() {
+        static Registry* sRegistry = new Registry;  // (never freed, since threads may outlive it)
+        return *sRegistry;
+    }
+
+    // Ensures the tick rate is measured over the whole run, not from the first export:
+    [[maybe_unused]] static Registry &sInitRegistry = registry();
+
+
+    static ThreadBuffer& myBuffer() {
+        static thread_local shared_ptr<ThreadBuffer> tBuffer;
+        if (!tBuffer) {
+            Registry &reg = registry();
+            unique_lock<mutex> lock(reg.bufferMutex);
+            tBuffer = make_shared<ThreadBuffer>(unsigned(reg.buffers.size() + 1));
+            reg.buffers.push_back(tBuffer);
+        }
+        return *tBuffer;
+    }
+
+
+    void endSpan(Span const& span, uint64_t end) noexcept {
+        ThreadBuffer &buf = myBuffer();
+        uint64_t duration = end - span._start;
+        if (Stat *stat = buf.statFor(span._name)) {
+            stat->count++;
+            stat->ticks += duration;
+            stat->selfTicks += duration - span._childTicks;
+        }
+        if (buf.spanCount < Profiler::kMaxSpansPerThread)
+            buf.spans[buf.spanCount++] = {span._name, span._start, end};
+    }
+
+
+    shs_printflike(2, 3)
+    static void appendf(string &out, const char *format, ...) {
+        char buf[256];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(buf, sizeof(buf), format, args);
+        va_end(args);
+        out += buf;
+    }
+
+}
+
+
+namespace snej::shs {
+    using namespace std;
+    using namespace impl::profiler;
+
+
+    bool Profiler::available() {
+        return SHS_PROFILE;
+    }
+
+
+    void Profiler::reset() {
+        Registry &reg = registry();
+        unique_lock<mutex> lock(reg.bufferMutex);
+        for (auto &buf : reg.buffers)
+            buf->reset();
+    }
+
+
+    string Profiler::chromeTraceJSON() {
+        Registry &reg = registry();
+        unique_lock<mutex> lock(reg.bufferMutex);
+        double ticksPerMicro = reg.ticksPerMicro();
+        uint64_t origin = UINT64_MAX;
+        for (auto &buf : reg.buffers) {
+            for (size_t i = 0; i < buf->spanCount; ++i)
+                origin = std::min(origin, buf->spans[i].start);
+        }
+
+        // Each span is a "complete event" (ph=X); the viewer nests them by their times.
+        string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        const char *separator = "\n";
+        for (auto &buf : reg.buffers) {
+            for (size_t i = 0; i < buf->spanCount; ++i) {
+                SpanRecord const& span = buf->spans[i];
+                appendf(json, "%s{\"name\":\"%s\",\"cat\":\"shs\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                              "\"ts\":%.3f,\"dur\":%.3f}",
+                        separator, span.name, buf->threadID,
+                        (span.start - origin) / ticksPerMicro,
+                        (span.end - span.start) / ticksPerMicro);
+                separator = ",\n";
+            }
+        }
+        json += "\n]}\n";
+        return json;
+    }
+
+
+    string Profiler::summaryTable() {
+        Registry &reg = registry();
+        unique_lock<mutex> lock(reg.bufferMutex);
+        double ticksPerMicro = reg.ticksPerMicro();
+
+        // Combine the threads' stats. (The same name may be a different literal in each file.)
+        map<string, Stat> totals;
+        uint64_t totalSelfTicks = 0;
+        for (auto &buf : reg.buffers) {
+            for (size_t i = 0; i < buf->statCount; ++i) {
+                Stat const& stat = buf->stats[i];
+                Stat &total = totals[stat.name];
+                total.count += stat.count;
+                total.ticks += stat.ticks;
+                total.selfTicks += stat.selfTicks;
+                totalSelfTicks += stat.selfTicks;
+            }
+        }
+        vector<pair<string,Stat>> rows(totals.begin(), totals.end());
+        sort(rows.begin(), rows.end(), [](auto &a, auto &b) {
+            return a.second.selfTicks > b.second.selfTicks;
+        });
+
+        string table;
+        appendf(table, "%-24s %10s %12s %12s %7s %12s\n",
+                "span", "calls", "total ms", "self ms", "self %", "mean usec");
+        for (auto &[name, stat] : rows) {
+            appendf(table, "%-24s %10" PRIu64 " %12.3f %12.3f %6.1f%% %12.3f\n",
+                    name.c_str(), stat.count,
+                    stat.ticks / ticksPerMicro / 1000.0,
+                    stat.selfTicks / ticksPerMicro / 1000.0,
+                    100.0 * stat.selfTicks / std::max(totalSelfTicks, uint64_t(1)),
+                    stat.ticks / ticksPerMicro / std::max(stat.count, uint64_t(1)));
+        }
+        return table;
+    }
+
+}
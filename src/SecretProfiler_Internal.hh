@@ -0,0 +1,77 @@
+//
+// SecretProfiler_Internal.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include <cstdint>
+#include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+#   include <x86intrin.h>
+#endif
+
+#ifndef SHS_PROFILE
+/// If true, the library records profiling spans; see `Profiler` in SecretProfiler.hh.
+#define SHS_PROFILE 0
+#endif
+
+#if SHS_PROFILE
+    /// Records a span named NAME (a string literal) from here to the end of the scope.
+#   define SHS_PROFILE_SPAN(NAME)       snej::shs::impl::profiler::Span _profileSpan(NAME)
+    /// Evaluates an expression inside a span named NAME, and returns its value.
+#   define SHS_PROFILED(NAME, EXPR)     ([&]() -> decltype(auto) {SHS_PROFILE_SPAN(NAME); return EXPR;}())
+#else
+#   define SHS_PROFILE_SPAN(NAME)       do { } while (false)
+#   define SHS_PROFILED(NAME, EXPR)     (EXPR)
+#endif
+
+namespace snej::shs::impl::profiler {
+
+    /// A timestamp in arbitrary units: the CPU cycle counter if possible, else nanoseconds.
+    static inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#elif defined(__aarch64__)
+        uint64_t t;
+        __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+        return t;
+#else
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+#endif
+    }
+
+    class Span;
+    extern thread_local Span* tCurrentSpan;
+
+    void endSpan(Span const&, uint64_t end) noexcept;
+
+    /// Records the time between its construction and destruction, on the current thread.
+    class Span {
+    public:
+        explicit Span(const char *name) noexcept
+        :_name(name), _parent(tCurrentSpan) {
+            tCurrentSpan = this;
+            _start = ticks();
+        }
+
+        ~Span() {
+            uint64_t end = ticks();
+            tCurrentSpan = _parent;
+            if (_parent)
+                _parent->_childTicks += end - _start;
+            endSpan(*this, end);
+        }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+        const char* const   _name;
+        Span* const         _parent;
+        uint64_t            _start;
+        uint64_t            _childTicks = 0;    // Time spent in nested spans
+    };
+
+}
@@ -25,8 +25,15 @@
 //
 
 #include "SecretStream.hh"
+#include "ByteRing.hh"
+#include "SecretMetrics_Internal.hh"
+#include "Probes.hh"
+#include "SecretProfiler_Internal.hh"
+#include "aes256gcm.hh"
 #include "shs.hh"
+#include "compression.hh"
 #include "monocypher/encryption.hh"
+#include <algorithm>
 #include <stdexcept>
 #include <cstring>
 #include <cassert>
@@ -69,23 +76,162 @@ namespace snej::shs {
     }
 
 
+    // AES-GCM takes a 96-bit IV, so derive one from the 192-bit session nonce by XORing its two
+    // halves together. Incrementing the nonce only changes one half, so every frame still gets a
+    // unique IV.
+    static inline std::array<uint8_t,12> gcmIV(Nonce const& nonce) {
+        std::array<uint8_t,12> iv;
+        for (size_t i = 0; i < iv.size(); ++i)
+            iv[i] = nonce[i] ^ nonce[i + 12];
+        return iv;
+    }
+
+
+    // MACOnly authenticates a frame with Poly1305, over the size prefix and the cleartext body.
+    // As in ChaCha20-Poly1305, the one-time Poly1305 key is the first 32 bytes of the XChaCha20
+    // keystream for the session key and the frame's nonce.
+    static void macOnlyTag(SessionKey const& key, Nonce const& nonce,
+                           const uint8_t *sizePrefix, const uint8_t *body, size_t bodySize,
+                           uint8_t mac[16])
+    {
+        using namespace monocypher::c;
+        uint8_t oneTimeKey[32];
+        crypto_chacha20_x(oneTimeKey, nullptr, sizeof(oneTimeKey), key.data(), nonce.data(), 0);
+        crypto_poly1305_ctx ctx;
+        crypto_poly1305_init(&ctx, oneTimeKey);
+        crypto_poly1305_update(&ctx, sizePrefix, 2);
+        crypto_poly1305_update(&ctx, body, bodySize);
+        crypto_poly1305_final(&ctx, mac);
+        monocypher::wipe(oneTimeKey, sizeof(oneTimeKey));
+    }
+
+
+    // A `Compressed` frame has the same layout as Compact, but its encrypted payload is:
+    //     codec (1 byte) | message                                        if codec is Uncompressed
+    //     codec (1 byte) | message size (16 bits) | compressed message    otherwise
+    static constexpr size_t kCompressedHeaderSize = 3;
+
+    // Messages smaller than this are sent uncompressed without trying:
+    static constexpr size_t kMinCompressibleSize = 64;
+
+    // After a message fails to compress, this many are sent uncompressed before trying again:
+    static constexpr unsigned kCompressionBackoff = 8;
+
+
+    static size_t compress(CryptoBox::Codec codec, const uint8_t *src, size_t size,
+                           uint8_t *dst, size_t dstCapacity) {
+        SHS_PROFILE_SPAN("compress");
+        switch (codec) {
+            case CryptoBox::LZ4:  return impl::lz4::compress(src, size, dst, dstCapacity);
+            case CryptoBox::Zstd: return impl::zstd::compress(src, size, dst, dstCapacity);
+            default:              return 0;
+        }
+    }
+
+    static intptr_t decompress(uint8_t codec, const uint8_t *src, size_t size,
+                               uint8_t *dst, size_t dstCapacity) {
+        SHS_PROFILE_SPAN("decompress");
+        switch (codec) {
+            case CryptoBox::LZ4:  return impl::lz4::decompress(src, size, dst, dstCapacity);
+            case CryptoBox::Zstd: return impl::zstd::decompress(src, size, dst, dstCapacity);
+            default:              return -1;
+        }
+    }
+
+
+    bool CryptoBox::codecAvailable(Codec codec) {
+        switch (codec) {
+            case Uncompressed:
+            case LZ4:   return true;
+            case Zstd:  return impl::zstd::available();
+            default:    return false;
+        }
+    }
+
+
     size_t CryptoBox::encryptedSize(size_t inputSize) {
         static_assert(sizeof(CryptoBox::BoxStreamHeader) == 2 + sizeof(MAC));
 
         if (_protocol == BoxStream)
             return sizeof(BoxStreamHeader) + sizeof(MAC) + inputSize;
+        else if (_protocol == Compressed)
+            return 2 + sizeof(MAC) + 1 + inputSize;     // Maximum; it's smaller if compressed
         else
             return 2 + sizeof(MAC) + inputSize;
     }
 
 
+    size_t CryptoBox::maxMessageSize() const {
+        // A Compressed payload has a codec byte, and its size has to fit in 16 bits:
+        return (_protocol == Compressed) ? EncryptoBox::kMaxMessageSize - 1
+                                         : EncryptoBox::kMaxMessageSize;
+    }
+
+
+    CryptoBox::CryptoBox(SessionKey const& key, Nonce const& nonce, Protocol protocol)
+    :_key(key)
+    ,_nonce(nonce)
+    ,_protocol(protocol)
+    { }
+
+
     CryptoBox::~CryptoBox() {
         monocypher::wipe((void*)&_key, sizeof(_key));
     }
 
 
+    bool CryptoBox::aesIsHardwareAccelerated() {
+        return impl::aes256gcm::hardwareAccelerated();
+    }
+
+
+    impl::aes256gcm& CryptoBox::aes() {
+        if (!_aes)
+            _aes = std::make_unique<impl::aes256gcm>(_key.data());
+        return *_aes;
+    }
+
+
+    void EncryptoBox::setCodec(Codec codec) {
+        if (!codecAvailable(codec))
+            throw std::invalid_argument("Compression codec is not available");
+        _codec = codec;
+    }
+
+
+    // Builds the cleartext payload of a `Compressed` frame in `_scratch`.
+    input_data EncryptoBox::compressPayload(input_data in) {
+        auto src = (const uint8_t*)in.data;
+        _scratch.resize(1 + in.size);               // Big enough for either form
+        uint8_t *payload = _scratch.data();
+        size_t compressedSize = 0;
+        if (_codec != Uncompressed && in.size >= kMinCompressibleSize) {
+            if (_skipCompression > 0) {
+                --_skipCompression;
+            } else {
+                // Only use the compressed form if it saves at least 1/16 of the size; giving the
+                // compressor a smaller capacity lets it give up early on incompressible data.
+                size_t capacity = in.size - in.size / 16 - (kCompressedHeaderSize - 1);
+                compressedSize = compress(_codec, src, in.size,
+                                          payload + kCompressedHeaderSize, capacity);
+                if (compressedSize == 0)
+                    _skipCompression = kCompressionBackoff;
+            }
+        }
+        if (compressedSize > 0) {
+            payload[0] = _codec;
+            writeUint16At(payload + 1, in.size);
+            return {payload, kCompressedHeaderSize + compressedSize};
+        } else {
+            payload[0] = Uncompressed;
+            ::memcpy(payload + 1, src, in.size);
+            return {payload, 1 + in.size};
+        }
+    }
+
+
     status_t EncryptoBox::encrypt(input_data in, output_buffer &out) {
-        if (in.size > 0xFFFF)
+        if (in.size > maxMessageSize())
             throw std::invalid_argument("CryptoBox message too large");
         size_t encSize = encryptedSize(in.size);
         if (out.size < encSize)
@@ -96,6 +242,7 @@ namespace snej::shs {
         auto dst = (uint8_t*)out.data;
         auto &nonce = (session_nonce&)_nonce;
         if (_protocol == BoxStream) {
+            SHS_PROFILE_SPAN("encrypt BoxStream");
             // Create a header buffer that starts with the cleartext length:
             auto &key = (const box_stream_key&)_key;
             BoxStreamHeader header;
@@ -107,13 +254,47 @@ namespace snej::shs {
             // Now encrypt the header and put it at the start of the output:
             key.box(nonce, {&header, sizeof(header)}, {dst, encSize});
             ++nonce;
+        } else if (_protocol == AES256GCM) {
+            // Same layout as Compact: plaintext_size + tag + ciphertext. The size is authenticated
+            // as additional data. Move the plaintext into place first, since `in` may overlap `out`.
+            SHS_PROFILE_SPAN("encrypt AES256GCM");
+            static constexpr size_t kHeaderSize = 2 + sizeof(MAC);
+            ::memmove(dst + kHeaderSize, in.data, in.size);
+            writeUint16At(dst, in.size);
+            aes().seal(gcmIV(_nonce).data(), dst, 2,
+                       dst + kHeaderSize, in.size, dst + kHeaderSize,
+                       dst + 2);
+            ++nonce;
+        } else if (_protocol == MACOnly) {
+            // Same layout as Compact, except the body is left in cleartext.
+            SHS_PROFILE_SPAN("encrypt MACOnly");
+            static constexpr size_t kHeaderSize = 2 + sizeof(MAC);
+            ::memmove(dst + kHeaderSize, in.data, in.size);
+            writeUint16At(dst, in.size);
+            macOnlyTag(_key, _nonce, dst, dst + kHeaderSize, in.size, dst + 2);
+            ++nonce;
+        } else if (_protocol == Compressed) {
+            // Like Compact, but the boxed payload is (maybe) compressed. `in` may overlap `out`,
+            // but the payload is assembled in `_scratch`, so that's OK.
+            input_data payload = compressPayload(in);
+            SHS_PROFILE_SPAN("encrypt Compressed");
+            auto &key = (const compact_key&)_key;
+            encSize = 2 + sizeof(MAC) + payload.size;
+            key.box(nonce, {payload.data, payload.size}, {dst + 2, encSize - 2});
+            ++nonce;
+            writeUint16At(dst, payload.size);
+            out.size = encSize;
         } else {
             // Simpler protocol -- just plaintext_size + box
+            SHS_PROFILE_SPAN("encrypt Compact");
             auto &key = (const compact_key&)_key;
             key.box(nonce, {in.data, in.size}, {dst + 2, encSize - 2});
             ++nonce;
             writeUint16At(dst, in.size);
         }
+        if (impl::metrics::enabled())
+            impl::metrics::frameEncrypted(in.size);
+        SHS_PROBE(frame_encrypt, this, in.size, encSize);
         return Success;
     }
 
@@ -124,6 +305,7 @@ namespace snej::shs {
         static constexpr size_t kPrefixSize = sizeof(MAC) + sizeof(BoxStreamHeader);
         if (in.size < kPrefixSize)
             return {IncompleteInput, 0, kPrefixSize};
+        SHS_PROFILE_SPAN("decrypt BoxStream header");
         // The nonce has to be incremented first, because on the sending side the header was the
         // second thing to be encrypted. But leave the session's nonce alone for now.
         auto &key = (const box_stream_key&)_key;
@@ -152,6 +334,14 @@ namespace snej::shs {
             if (in.size < 2)
                 return {IncompleteInput, 0, 2};
             size_t decryptedSize = readUint16At((const uint8_t*)in.data);
+            if (_protocol == Compressed) {
+                // The size field is that of the payload, which includes a codec byte. The real
+                // size is encrypted, so return the most it can be:
+                if (decryptedSize == 0)
+                    return {CorruptData, 0, 0};
+                size_t encSize = 2 + sizeof(MAC) + decryptedSize;
+                return {Success, std::max(decryptedSize - 1, _maxDecompressedSize), encSize};
+            }
             return {Success, decryptedSize, encryptedSize(decryptedSize)};
         }
     }
@@ -163,6 +353,22 @@ namespace snej::shs {
 
 
     status_t DecryptoBox::decrypt(input_data &in, output_buffer &out) {
+        size_t inSize = in.size;
+        status_t status = _decrypt(in, out);
+        if (status != IncompleteInput)
+            SHS_PROBE(frame_decrypt, this, inSize - in.size, (status == Success ? out.size : 0),
+                      int(status));
+        if (impl::metrics::enabled()) {
+            if (status == Success)
+                impl::metrics::frameDecrypted(out.size);
+            else if (status == CorruptData)
+                impl::metrics::decryptionFailed();
+        }
+        return status;
+    }
+
+
+    status_t DecryptoBox::_decrypt(input_data &in, output_buffer &out) {
         auto src = (const uint8_t*)in.data;
         PeekResult r;
         auto &nonce = (session_nonce&)_nonce;
@@ -176,6 +382,7 @@ namespace snej::shs {
             if (out.size < r.decryptedSize)
                 return OutTooSmall;
 
+            SHS_PROFILE_SPAN("decrypt BoxStream");
             auto &key = (const box_stream_key&)_key;
             if (!key.unlock(nonce, header.mac,
                             {src + sizeof(MAC) + sizeof(header), r.decryptedSize},    // ciphertext
@@ -188,12 +395,31 @@ namespace snej::shs {
                 return r.status;
             if (in.size < r.encryptedSize)
                 return IncompleteInput;
-            if (out.size < r.decryptedSize)
+            if (_protocol == Compressed) {
+                // (This checks the output size itself, since `r.decryptedSize` is only a maximum.)
+                if (status_t status = decryptCompressed(src, r, out); status != Success)
+                    return status;
+            } else if (out.size < r.decryptedSize) {
                 return OutTooSmall;
-
-            auto &key = (const compact_key&)_key;
-            if (key.unbox(nonce, {src + 2, r.encryptedSize - 2}, {out.data, out.size}).size != r.decryptedSize)
-                return CorruptData;
+            } else if (_protocol == AES256GCM) {
+                SHS_PROFILE_SPAN("decrypt AES256GCM");
+                if (!aes().open(gcmIV(_nonce).data(), src, 2,
+                                src + 2 + sizeof(MAC), r.decryptedSize, out.data,
+                                src + 2))
+                    return CorruptData;
+            } else if (_protocol == MACOnly) {
+                SHS_PROFILE_SPAN("decrypt MACOnly");
+                uint8_t mac[sizeof(MAC)];
+                macOnlyTag(_key, _nonce, src, src + 2 + sizeof(MAC), r.decryptedSize, mac);
+                if (monocypher::c::crypto_verify16(mac, src + 2) != 0)
+                    return CorruptData;
+                ::memmove(out.data, src + 2 + sizeof(MAC), r.decryptedSize);
+            } else {
+                SHS_PROFILE_SPAN("decrypt Compact");
+                auto &key = (const compact_key&)_key;
+                if (key.unbox(nonce, {src + 2, r.encryptedSize - 2}, {out.data, out.size}).size != r.decryptedSize)
+                    return CorruptData;
+            }
         }
         ++nonce;
         out.size = r.decryptedSize;
@@ -203,6 +429,193 @@ namespace snej::shs {
     }
 
 
+    // Decrypts a `Compressed` frame's payload into `_scratch`, then decompresses it into `out`.
+    // Sets `r.decryptedSize` to the real size. Doesn't increment the nonce.
+    status_t DecryptoBox::decryptCompressed(const uint8_t *src, PeekResult &r,
+                                            output_buffer &out)
+    {
+        SHS_PROFILE_SPAN("decrypt Compressed");
+        size_t payloadSize = r.encryptedSize - 2 - sizeof(MAC);
+        _scratch.resize(payloadSize);
+        const uint8_t *payload = _scratch.data();
+        auto &key = (const compact_key&)_key;
+        auto &nonce = (session_nonce&)_nonce;
+        if (key.unbox(nonce, {src + 2, r.encryptedSize - 2}, {_scratch.data(), payloadSize}).size
+                != payloadSize)
+            return CorruptData;
+
+        if (payload[0] == Uncompressed) {
+            r.decryptedSize = payloadSize - 1;
+            if (out.size < r.decryptedSize)
+                return OutTooSmall;
+            ::memcpy(out.data, payload + 1, r.decryptedSize);
+            return Success;
+        }
+
+        if (payloadSize < kCompressedHeaderSize || !codecAvailable(Codec(payload[0])))
+            return CorruptData;
+        r.decryptedSize = readUint16At(payload + 1);
+        if (r.decryptedSize > _maxDecompressedSize)
+            return CorruptData;                     // Don't let the sender make us allocate
+        if (out.size < r.decryptedSize)
+            return OutTooSmall;
+        intptr_t size = decompress(payload[0],
+                                   payload + kCompressedHeaderSize,
+                                   payloadSize - kCompressedHeaderSize,
+                                   (uint8_t*)out.data, r.decryptedSize);
+        if (size != intptr_t(r.decryptedSize))
+            return CorruptData;
+        return Success;
+    }
+
+
+#pragma mark - LARGE MESSAGES:
+
+
+    // The last byte of every frame's payload written by `encryptMessage`:
+    static constexpr uint8_t kFinalFrame = 0, kMoreFrames = 1;
+
+
+    size_t EncryptoBox::encryptedMessageSize(size_t inputSize) {
+        size_t framePayload = maxMessageSize() - 1;
+        size_t frames = std::max(size_t(1), (inputSize + framePayload - 1) / framePayload);
+        return inputSize + frames * encryptedSize(1);
+    }
+
+
+    status_t EncryptoBox::encryptMessage(input_data in, output_buffer &out) {
+        size_t encSize = encryptedMessageSize(in.size);
+        if (out.size < encSize)
+            return OutTooSmall;
+        size_t overhead = encryptedSize(0);
+        size_t framePayload = maxMessageSize() - 1;
+        auto src = (const uint8_t*)in.data;
+        auto dst = (uint8_t*)out.data;
+        size_t remaining = in.size;
+        do {
+            size_t chunk = std::min(remaining, framePayload);
+            remaining -= chunk;
+            // Assemble the payload where its ciphertext will go, then encrypt it in place:
+            uint8_t *payload = dst + overhead;
+            ::memcpy(payload, src, chunk);
+            payload[chunk] = remaining > 0 ? kMoreFrames : kFinalFrame;
+            output_buffer frame = {dst, overhead + chunk + 1};
+            _UNUSED auto status = encrypt({payload, chunk + 1}, frame);
+            assert(status == Success);
+            src += chunk;
+            dst += frame.size;
+        } while (remaining > 0);
+        out.size = dst - (uint8_t*)out.data;    // (less than `encSize` if frames were compressed)
+        return Success;
+    }
+
+
+    void MessageReassembler::setBuffer(output_buffer buffer) {
+        _callerBuffer = buffer;
+        _data = nullptr;
+        _size = 0;
+        _complete = false;
+    }
+
+
+    uint8_t* MessageReassembler::reserve(size_t size) {
+        if (_callerBuffer.data)
+            return (size <= _callerBuffer.size) ? (uint8_t*)_callerBuffer.data : nullptr;
+        if (_buffer.capacity() == 0 && !_pool.empty()) {
+            _buffer = std::move(_pool.back());
+            _pool.pop_back();
+        }
+        if (_buffer.size() < size)
+            _buffer.resize(size);
+        return _buffer.data();
+    }
+
+
+    status_t MessageReassembler::receive(input_data &in) {
+        if (_complete) {
+            _complete = false;
+            _size = 0;
+        }
+        while (true) {
+            auto peek = _decryptor.peek(in);
+            if (peek.status != Success)
+                return peek.status;
+            else if (in.size < peek.encryptedSize)
+                return IncompleteInput;
+            else if (peek.decryptedSize == 0)
+                return CorruptData;     // Every frame ends with a flag byte
+
+            uint8_t *frame;
+            output_buffer frameOut;
+            if (_decryptor.protocol() != CryptoBox::Compressed) {
+                if (_size + peek.decryptedSize - 1 > _maxMessageSize)
+                    return OutTooSmall;
+                _data = reserve(_size + peek.encryptedSize);
+                if (!_data)
+                    return OutTooSmall;
+
+                // Copy the frame to the end of the message, and decrypt it in place:
+                frame = _data + _size;
+                ::memcpy(frame, in.data, peek.encryptedSize);
+                input_data frameIn = {frame, peek.encryptedSize};
+                frameOut = {frame, peek.encryptedSize};
+                if (status_t status = _decryptor.decrypt(frameIn, frameOut); status != Success)
+                    return status;
+                in.data = (const uint8_t*)in.data + peek.encryptedSize;
+                in.size -= peek.encryptedSize;
+            } else {
+                // A compressed frame expands, so decrypt it straight from the input. Its
+                // `decryptedSize` is only a maximum, so check the real size afterwards.
+                size_t room = peek.decryptedSize;
+                if (_callerBuffer.data)
+                    room = std::min(room, _callerBuffer.size - _size);
+                _data = reserve(_size + room);
+                if (!_data)
+                    return OutTooSmall;
+                frame = _data + _size;
+                frameOut = {frame, room};
+                if (status_t status = _decryptor.decrypt(in, frameOut); status != Success)
+                    return status;
+                if (frameOut.size == 0)
+                    return CorruptData;
+                else if (_size + frameOut.size - 1 > _maxMessageSize)
+                    return OutTooSmall;
+            }
+
+            // Strip the flag byte; the next frame will be copied over it:
+            uint8_t flag = frame[frameOut.size - 1];
+            _size += frameOut.size - 1;
+            if (flag == kFinalFrame) {
+                _complete = true;
+                return Success;
+            } else if (flag != kMoreFrames) {
+                return CorruptData;
+            }
+        }
+    }
+
+
+    std::vector<uint8_t> MessageReassembler::takeMessage() {
+        if (!_complete || _callerBuffer.data)
+            throw std::logic_error("MessageReassembler has no message to take");
+        std::vector<uint8_t> message;
+        message.swap(_buffer);
+        message.resize(_size);
+        _data = nullptr;
+        _size = 0;
+        _complete = false;
+        return message;
+    }
+
+
+    void MessageReassembler::recycle(std::vector<uint8_t> &&buffer) {
+        if (_pool.size() < kMaxPooledBuffers) {
+            buffer.clear();
+            _pool.push_back(std::move(buffer));
+        }
+    }
+
+
 #pragma mark - CRYPTOSTREAM:
 
 
@@ -233,14 +646,23 @@ namespace snej::shs {
     }
 
 
+    void EncryptionStream::setMaxMessageSize(size_t maxSize) {
+        assert(maxSize > 0);
+        _maxMessageSize = std::min(maxSize, _encryptor.maxMessageSize());
+    }
+
+
     void EncryptionStream::pushPartial(const void *data, size_t size) {
-        // Append data to the buffer. The unprocessed data can only grow to 64KB (kMaxMessageSize),
-        // so if there's more data than that, flush periodically.
+        // Append data to the buffer. The unprocessed data can only grow to `_maxMessageSize`
+        // (at most 64KB), so if there's more data than that, flush periodically.
         auto begin = (const uint8_t*)data;
         while (size > 0) {
-            size_t maxSize = EncryptoBox::kMaxMessageSize - (_buffer.size() - _processedBytes);
+            size_t maxSize = _maxMessageSize - (_buffer.size() - _processedBytes);
             size_t chunk = std::min(size, maxSize);
+            size_t capacity = _buffer.capacity();
             _buffer.insert(_buffer.end(), begin, begin + chunk);
+            if (_buffer.capacity() != capacity)
+                SHS_PROBE(stream_grow, this, capacity, _buffer.capacity());
             size -= chunk;
             if (size > 0) {
                 begin += chunk;
@@ -250,10 +672,37 @@ namespace snej::shs {
     }
 
 
+    output_buffer EncryptionStream::reserve(size_t size) {
+        // The unprocessed data can't grow beyond `_maxMessageSize`, so flush if necessary:
+        size_t pending = _buffer.size() - _processedBytes;
+        if (pending + size > _maxMessageSize)
+            flush();
+        size = std::min(size, _maxMessageSize);
+        size_t start = _buffer.size(), capacity = _buffer.capacity();
+        _buffer.resize(start + size);
+        if (_buffer.capacity() != capacity)
+            SHS_PROBE(stream_grow, this, capacity, _buffer.capacity());
+        _reservedBytes = size;
+        return {&_buffer[start], size};
+    }
+
+
+    void EncryptionStream::commit(size_t size) {
+        if (size > _reservedBytes)
+            throw std::logic_error("EncryptionStream::commit: size is larger than reserved");
+        _buffer.resize(_buffer.size() - (_reservedBytes - size));
+        _reservedBytes = 0;
+    }
+
+
     void EncryptionStream::flush() {
         size_t msgSize = _buffer.size() - _processedBytes;
         if (msgSize > 0) {
+            SHS_PROFILE_SPAN("EncryptionStream::flush");
+            size_t capacity = _buffer.capacity();
             _buffer.resize(_processedBytes + _encryptor.encryptedSize(msgSize));
+            if (_buffer.capacity() != capacity)
+                SHS_PROBE(stream_grow, this, capacity, _buffer.capacity());
             input_data in = {&_buffer[_processedBytes], msgSize};
             output_buffer out = {(void*)in.data, _buffer.size() - _processedBytes};
             _UNUSED auto status = _encryptor.encrypt(in, out);
@@ -265,24 +714,74 @@ namespace snej::shs {
 
 
     bool DecryptionStream::push(const void *data, size_t size) {
+        SHS_PROFILE_SPAN("DecryptionStream::push");
         // Append data to the buffer:
         auto begin = (const uint8_t*)data;
+        size_t capacity = _buffer.capacity();
         _buffer.insert(_buffer.end(), begin, begin + size);
+        if (_buffer.capacity() != capacity)
+            SHS_PROBE(stream_grow, this, capacity, _buffer.capacity());
+        return decryptBuffer();
+    }
+
+
+    output_buffer DecryptionStream::reserve(size_t size) {
+        size_t start = _buffer.size(), capacity = _buffer.capacity();
+        _buffer.resize(start + size);
+        if (_buffer.capacity() != capacity)
+            SHS_PROBE(stream_grow, this, capacity, _buffer.capacity());
+        _reservedBytes = size;
+        return {&_buffer[start], size};
+    }
+
+
+    bool DecryptionStream::commit(size_t size) {
+        if (size > _reservedBytes)
+            throw std::logic_error("DecryptionStream::commit: size is larger than reserved");
+        _buffer.resize(_buffer.size() - (_reservedBytes - size));
+        _reservedBytes = 0;
+        return decryptBuffer();
+    }
+
+
+    // Where to decrypt the frame at the start of `in`: in place, except that a `Compressed` frame
+    // expands, so it's decompressed into `_expanded` instead.
+    output_buffer DecryptionStream::decryptionSpace(input_data in) {
+        if (_decryptor.protocol() != CryptoBox::Compressed)
+            return {(void*)in.data, in.size};
+        _expanded.resize(EncryptoBox::kMaxMessageSize);
+        return {_expanded.data(), _expanded.size()};
+    }
+
+
+    // Decrypts as many complete frames in the buffer as possible.
+    bool DecryptionStream::decryptBuffer() {
+        if (_frameVisitor)
+            return pushFrames();
 
         while (true) {
             // See if there's enough to decrypt:
-            output_buffer out = {nullptr, _buffer.size() - _processedBytes};
-            if (out.size > 0)
-                out.data = &_buffer[_processedBytes];
-            input_data in = {out.data, out.size};
+            input_data in = {nullptr, _buffer.size() - _processedBytes};
+            if (in.size > 0)
+                in.data = &_buffer[_processedBytes];
+            output_buffer out = decryptionSpace(in);
             switch (_decryptor.decrypt(in, out)) {
-                case Success:
+                case Success: {
+                    auto frameStart = _buffer.begin() + _processedBytes;
+                    auto frameEnd = _buffer.begin() + ((uint8_t*)in.data - _buffer.data());
+                    if (out.data == (void*)&*frameStart) {
+                        // Decrypting the data shortened it, so cut out the remaining space:
+                        _buffer.erase(frameStart + out.size, frameEnd);
+                    } else {
+                        // Replace the frame with its decompressed contents:
+                        auto data = (const uint8_t*)out.data;
+                        frameStart = _buffer.erase(frameStart, frameEnd);
+                        _buffer.insert(frameStart, data, data + out.size);
+                    }
                     _processedBytes += out.size;
-                    // Decrypting the data shortened it, so cut out the remaining space:
-                    _buffer.erase(_buffer.begin() + _processedBytes,
-                                  _buffer.begin() + ((uint8_t*)in.data - _buffer.data()));
                     // Continue the `while` loop, in case there's another complete message:
                     break;
+                }
                 case IncompleteInput:
                     return true;    // Done
                 case CorruptData:
@@ -294,6 +793,33 @@ namespace snej::shs {
     }
 
 
+    void DecryptionStream::setFrameVisitor(FrameVisitor visitor) {
+        if (_processedBytes > 0)
+            throw std::logic_error("DecryptionStream has unread data");
+        _frameVisitor = std::move(visitor);
+    }
+
+
+    bool DecryptionStream::pushFrames() {
+        // In frame-visitor mode `_processedBytes` stays 0. Each frame is decrypted in place and
+        // handed to the visitor, and the consumed frames are removed from the buffer at the end.
+        input_data in = {_buffer.data(), _buffer.size()};
+        bool ok = true;
+        while (in.size > 0) {
+            output_buffer out = decryptionSpace(in);
+            status_t status = _decryptor.decrypt(in, out);
+            if (status == Success) {
+                _frameVisitor({out.data, out.size});
+            } else {
+                ok = (status == IncompleteInput);
+                break;
+            }
+        }
+        _buffer.erase(_buffer.begin(), _buffer.end() - in.size);
+        return ok;
+    }
+
+
     bool DecryptionStream::close() {
         bool ok = _buffer.size() == _processedBytes;
         _buffer.clear();
@@ -301,6 +827,278 @@ namespace snej::shs {
         return ok;
     }
 
+
+#pragma mark - SPSC STREAMS:
+
+
+    static std::unique_ptr<ByteRing> makeStreamRing(size_t capacity) {
+        // The ring has to be able to hold the largest possible decrypted message:
+        if (capacity <= EncryptoBox::kMaxMessageSize)
+            throw std::invalid_argument("SPSC stream capacity must be at least 64KB");
+        return std::make_unique<ByteRing>(capacity);
+    }
+
+
+    SPSCEncryptionStream::SPSCEncryptionStream(Session const& session, Protocol protocol,
+                                               size_t capacity)
+    :_encryptor(session, protocol)
+    ,_ring(makeStreamRing(capacity))
+    { }
+
+    SPSCEncryptionStream::~SPSCEncryptionStream() = default;
+
+
+    size_t SPSCEncryptionStream::push(const void *data, size_t size) {
+        // Don't bother writing a tiny message just because that's all the room left;
+        // the consumer will free up more space soon.
+        static constexpr size_t kMinPartialMessage = 1024;
+
+        auto begin = (const uint8_t*)data;
+        size_t overhead = _encryptor.encryptedSize(0);
+        size_t total = 0;
+        while (size > 0) {
+            size_t space = _ring->spaceAvailable();
+            if (space <= overhead)
+                break;
+            size_t chunk = std::min({size, space - overhead, _encryptor.maxMessageSize()});
+            if (chunk < size && chunk < kMinPartialMessage)
+                break;
+            size_t encSize = overhead + chunk;
+
+            // Encrypt directly into the ring if there's contiguous space, else go through
+            // `_scratch` so the message can wrap around the end of the ring:
+            input_data in = {begin, chunk};
+            output_buffer out = _ring->writable();
+            bool direct = (out.size >= encSize);
+            if (!direct) {
+                _scratch.resize(encSize);
+                out = {_scratch.data(), _scratch.size()};
+            }
+            _UNUSED auto status = _encryptor.encrypt(in, out);
+            assert(status == Success && out.size <= encSize);   // (less if compressed)
+            if (direct)
+                _ring->commit(out.size);
+            else
+                _ring->write(out.data, out.size);
+
+            begin += chunk;
+            size -= chunk;
+            total += chunk;
+        }
+        return total;
+    }
+
+
+    input_data SPSCEncryptionStream::availableData() const  {return _ring->readable();}
+    size_t SPSCEncryptionStream::bytesAvailable() const     {return _ring->bytesAvailable();}
+    size_t SPSCEncryptionStream::pull(void *dst, size_t size) {return _ring->read(dst, size);}
+
+    size_t SPSCEncryptionStream::skip(size_t maxSize) {
+        size_t n = std::min(maxSize, _ring->bytesAvailable());
+        _ring->consume(n);
+        return n;
+    }
+
+
+    SPSCDecryptionStream::SPSCDecryptionStream(Session const& session, Protocol protocol,
+                                               size_t capacity)
+    :_decryptor(session, protocol)
+    ,_ring(makeStreamRing(capacity))
+    { }
+
+    SPSCDecryptionStream::~SPSCDecryptionStream() = default;
+
+
+    bool SPSCDecryptionStream::push(const void *data, size_t size) {
+        auto begin = (const uint8_t*)data;
+        _pending.insert(_pending.end(), begin, begin + size);
+        return decryptPending();
+    }
+
+
+    bool SPSCDecryptionStream::decryptPending() {
+        bool ok = true;
+        while (_pendingStart < _pending.size()) {
+            input_data in = {&_pending[_pendingStart], _pending.size() - _pendingStart};
+            auto peek = _decryptor.peek(in);
+            if (peek.status == CorruptData) {
+                ok = false;
+                break;
+            } else if (peek.status != Success || in.size < peek.encryptedSize) {
+                break;      // Incomplete message
+            } else if (_ring->spaceAvailable() < peek.decryptedSize) {
+                break;      // No room yet; wait for the consumer
+            }
+
+            // Decrypt directly into the ring if there's contiguous space, else go through
+            // `_scratch` so the message can wrap around the end of the ring:
+            output_buffer out = _ring->writable();
+            bool direct = (out.size >= peek.decryptedSize);
+            if (!direct) {
+                _scratch.resize(peek.decryptedSize);
+                out = {_scratch.data(), _scratch.size()};
+            }
+            if (_decryptor.decrypt(in, out) != Success) {
+                ok = false;
+                break;
+            }
+            if (direct)
+                _ring->commit(out.size);
+            else
+                _ring->write(out.data, out.size);
+            _pendingStart = _pending.size() - in.size;
+        }
+
+        // Reclaim the space used by consumed ciphertext, once it's worth the memmove:
+        if (_pendingStart == _pending.size()) {
+            _pending.clear();
+            _pendingStart = 0;
+        } else if (_pendingStart > _pending.size() / 2) {
+            _pending.erase(_pending.begin(), _pending.begin() + _pendingStart);
+            _pendingStart = 0;
+        }
+        return ok;
+    }
+
+
+    input_data SPSCDecryptionStream::availableData() const  {return _ring->readable();}
+    size_t SPSCDecryptionStream::bytesAvailable() const     {return _ring->bytesAvailable();}
+    size_t SPSCDecryptionStream::pull(void *dst, size_t size) {return _ring->read(dst, size);}
+
+    size_t SPSCDecryptionStream::skip(size_t maxSize) {
+        size_t n = std::min(maxSize, _ring->bytesAvailable());
+        _ring->consume(n);
+        return n;
+    }
+
+
+#pragma mark - PROTOCOL NEGOTIATION:
+
+
+    // The offer message, before encryption, is:
+    //     "SHSN" | version | flags | supported-protocols bitmask (16 bits) | max message size (16)
+    static constexpr uint8_t kOfferMagic[4]  = {'S', 'H', 'S', 'N'};
+    static constexpr uint8_t kOfferVersion   = 1;
+    static constexpr uint8_t kOfferFastAES   = 0x01;     // flag: AES is hardware accelerated
+    static constexpr size_t  kOfferSize      = 10;
+
+    // Scuttlebutt's box-stream spec limits message bodies to 4KB.
+    static constexpr size_t  kLegacyMaxMessageSize = 4096;
+
+
+    ProtocolNegotiator::ProtocolNegotiator(Session const& session,
+                                           Role role,
+                                           std::vector<Protocol> const& protocols,
+                                           size_t maxMessageSize)
+    :_session(session)
+    ,_decryptor(session, CryptoBox::BoxStream)
+    ,_role(role)
+    ,_protocolMask(0)
+    ,_fastAES(CryptoBox::aesIsHardwareAccelerated())
+    ,_maxMessageSize(std::min(maxMessageSize, EncryptoBox::kMaxMessageSize))
+    {
+        for (Protocol p : protocols)
+            _protocolMask |= 1u << p;
+        // The server waits to see whether the client negotiates, before sending anything:
+        if (_role == Client)
+            makeOffer();
+    }
+
+
+    void ProtocolNegotiator::makeOffer() {
+        uint8_t offer[kOfferSize];
+        memcpy(&offer[0], kOfferMagic, sizeof(kOfferMagic));
+        offer[4] = kOfferVersion;
+        offer[5] = _fastAES ? kOfferFastAES : 0;
+        writeUint16At(&offer[6], _protocolMask);
+        writeUint16At(&offer[8], _maxMessageSize);
+
+        EncryptoBox encryptor(_session, CryptoBox::BoxStream);
+        _offer.resize(encryptor.encryptedSize(kOfferSize));
+        output_buffer out = {_offer.data(), _offer.size()};
+        _UNUSED auto status = encryptor.encrypt({offer, kOfferSize}, out);
+        assert(status == Success);
+        assert(_offer.size() == kEncryptedOfferSize);
+        _session.encryptionNonce = encryptor.nonce();
+    }
+
+
+    status_t ProtocolNegotiator::assumeLegacyPeer() {
+        // Only a server can fall back, since a client's offer has already been sent, and a
+        // legacy server would have read it as data.
+        if (_role != Server || !(_protocolMask & (1u << CryptoBox::BoxStream)))
+            return CorruptData;
+        _peerIsLegacy = true;
+        _protocol = CryptoBox::BoxStream;
+        _maxMessageSize = std::min(_maxMessageSize, kLegacyMaxMessageSize);
+        return Success;
+    }
+
+
+    status_t ProtocolNegotiator::peerIsSilent() {
+        return assumeLegacyPeer();
+    }
+
+
+    status_t ProtocolNegotiator::receivedBytes(input_data &in) {
+        auto peek = _decryptor.peek(in);
+        if (peek.status != Success)
+            return peek.status;
+        if (in.size < peek.encryptedSize)
+            return IncompleteInput;
+
+        uint8_t offer[kOfferSize];
+        bool isOffer = false;
+        input_data frame = in;
+        if (peek.decryptedSize == kOfferSize) {
+            output_buffer out = {offer, sizeof(offer)};
+            if (_decryptor.decrypt(frame, out) != Success)
+                return CorruptData;
+            isOffer = memcmp(offer, kOfferMagic, sizeof(kOfferMagic)) == 0
+                   && offer[4] == kOfferVersion;
+        }
+
+        if (!isOffer) {
+            // Peer sent some other message first, so assume it's a legacy peer. Leave `in` and the
+            // decryption nonce alone, so the DecryptionStream will decrypt this message as data.
+            if (_peerIsLegacy)
+                return Success;     // (after `peerIsSilent`: the first frame is data, as expected)
+            return assumeLegacyPeer();
+        } else if (_peerIsLegacy) {
+            // An offer that arrived after `peerIsSilent` gave up on the client; too late:
+            return CorruptData;
+        }
+
+        if (_role == Server)
+            makeOffer();    // (before `_maxMessageSize` is lowered to the client's)
+        unsigned common = _protocolMask & readUint16At(&offer[6]);
+        size_t peerMaxSize = readUint16At(&offer[8]);
+        if (common == 0 || peerMaxSize == 0)
+            return CorruptData;
+        bool fastAES = _fastAES && (offer[5] & kOfferFastAES);
+
+        // Pick the fastest protocol in common. (MACOnly and Compressed are only in common if
+        // both peers explicitly asked for them, in which case they win.)
+        static constexpr Protocol kFastAESOrder[] = {
+            CryptoBox::MACOnly, CryptoBox::Compressed,
+            CryptoBox::AES256GCM, CryptoBox::Compact, CryptoBox::BoxStream};
+        static constexpr Protocol kSlowAESOrder[] = {
+            CryptoBox::MACOnly, CryptoBox::Compressed,
+            CryptoBox::Compact, CryptoBox::BoxStream, CryptoBox::AES256GCM};
+        for (Protocol p : (fastAES ? kFastAESOrder : kSlowAESOrder)) {
+            if (common & (1u << p)) {
+                _protocol = p;
+                break;
+            }
+        }
+        _maxMessageSize = std::min(_maxMessageSize, peerMaxSize);
+        if (_protocol == CryptoBox::Compressed)
+            _maxMessageSize = std::min(_maxMessageSize, EncryptoBox::kMaxMessageSize - 1);
+        _session.decryptionNonce = _decryptor.nonce();
+        in = frame;
+        return Success;
+    }
+
 }
 
 
@@ -317,6 +1115,7 @@ static inline auto external(DecryptoBox *box) {return (SHSDecryptoBox*)box;}
 
 static inline auto internal(SHSEncryptoBox *box) {return (EncryptoBox*)box;}
 static inline auto internal(SHSDecryptoBox *box) {return (DecryptoBox*)box;}
+static inline auto internal(SHSMessageReassembler *r) {return (MessageReassembler*)r;}
 
 static inline auto& internal(SHSInputBuffer const& buf) {return (input_data const&)buf;}
 static inline auto& internal(SHSInputBuffer *buf) {return (input_data&)*buf;}
@@ -331,6 +1130,10 @@ void SHSEncryptoBox_Free(SHSEncryptoBox *box) {
     delete internal(box);
 }
 
+bool SHSCryptoBox_AESIsHardwareAccelerated(void) {
+    return CryptoBox::aesIsHardwareAccelerated();
+}
+
 size_t SHSEncryptoBox_GetEncryptedSize(SHSEncryptoBox *box, size_t inputSize) {
     return internal(box)->encryptedSize(inputSize);
 
@@ -340,6 +1143,37 @@ SHSStatus SHSEncryptoBox_Encrypt(SHSEncryptoBox *box, SHSInputBuffer in, SHSOutp
     return (SHSStatus)internal(box)->encrypt(internal(in), internal(out));
 }
 
+size_t SHSEncryptoBox_EncryptMany(SHSEncryptoBox *box,
+                                  const SHSInputBuffer messages[], size_t count,
+                                  SHSOutputBuffer *out,
+                                  SHSBatchResult results[])
+{
+    auto dst = (uint8_t*)out->dst;
+    size_t used = 0, n;
+    for (n = 0; n < count; ++n) {
+        output_buffer frame = {dst + used, out->size - used};
+        auto status = internal(box)->encrypt(internal(messages[n]), frame);
+        if (results)
+            results[n] = {SHSStatus(status), {frame.data, frame.size}};
+        if (status != snej::shs::Success) {
+            if (results)
+                results[n].data = {};
+            break;
+        }
+        used += frame.size;
+    }
+    out->size = used;
+    return n;
+}
+
+size_t SHSEncryptoBox_GetEncryptedMessageSize(SHSEncryptoBox *box, size_t inputSize) {
+    return internal(box)->encryptedMessageSize(inputSize);
+}
+
+SHSStatus SHSEncryptoBox_EncryptMessage(SHSEncryptoBox *box, SHSInputBuffer in, SHSOutputBuffer* out) {
+    return (SHSStatus)internal(box)->encryptMessage(internal(in), internal(out));
+}
+
 SHSDecryptoBox* SHSDecryptoBox_Create(const SHSSession *session, SHSCryptoBoxProtocol protocol) {
     return external( new DecryptoBox(*(Session*)session, (CryptoBox::Protocol)protocol));
 }
@@ -362,3 +1196,153 @@ SHSPeekResult  SHSDecryptoBox_Peek(SHSDecryptoBox *box, SHSInputBuffer in) {
 SHSStatus SHSDecryptoBox_Decrypt(SHSDecryptoBox *box, SHSInputBuffer *in, SHSOutputBuffer *out) {
     return (SHSStatus) internal(box)->decrypt(internal(in), internal(out));
 }
+
+size_t SHSDecryptoBox_DecryptAll(SHSDecryptoBox *box,
+                                 SHSInputBuffer *in,
+                                 SHSOutputBuffer *out,
+                                 SHSBatchResult results[], size_t maxResults)
+{
+    auto dst = (uint8_t*)out->dst;
+    size_t used = 0, n;
+    for (n = 0; n < maxResults; ++n) {
+        output_buffer msg = {dst + used, out->size - used};
+        auto status = internal(box)->decrypt(internal(in), msg);
+        if (status != snej::shs::Success) {
+            results[n] = {SHSStatus(status), {}};
+            break;
+        }
+        results[n] = {SHSStatus(status), {msg.data, msg.size}};
+        used += msg.size;
+    }
+    out->size = used;
+    return n;
+}
+
+SHSMessageReassembler* SHSMessageReassembler_Create(const SHSSession *session,
+                                                    SHSCryptoBoxProtocol protocol,
+                                                    size_t maxMessageSize)
+{
+    auto r = new MessageReassembler(*(Session*)session, (CryptoBox::Protocol)protocol,
+                                    maxMessageSize);
+    return (SHSMessageReassembler*)r;
+}
+
+void SHSMessageReassembler_Free(SHSMessageReassembler *r) {
+    delete internal(r);
+}
+
+void SHSMessageReassembler_SetBuffer(SHSMessageReassembler *r, SHSOutputBuffer buffer) {
+    internal(r)->setBuffer(internal(&buffer));
+}
+
+SHSStatus SHSMessageReassembler_Receive(SHSMessageReassembler *r, SHSInputBuffer *in) {
+    return (SHSStatus) internal(r)->receive(internal(in));
+}
+
+SHSInputBuffer SHSMessageReassembler_GetMessage(SHSMessageReassembler *r) {
+    input_data message = internal(r)->message();
+    return {message.data, message.size};
+}
+
+
+static inline auto internal(SHSEncryptionStream *s) {return (EncryptionStream*)s;}
+static inline auto internal(SHSDecryptionStream *s) {return (DecryptionStream*)s;}
+
+static inline SHSInputBuffer external(input_data data)      {return {data.data, data.size};}
+static inline SHSOutputBuffer external(output_buffer buf)   {return {buf.data, buf.size};}
+
+
+SHSEncryptionStream* SHSEncryptionStream_Create(const SHSSession *session,
+                                                SHSCryptoBoxProtocol protocol)
+{
+    auto s = new EncryptionStream(*(Session*)session, (CryptoBox::Protocol)protocol);
+    return (SHSEncryptionStream*)s;
+}
+
+void SHSEncryptionStream_Free(SHSEncryptionStream *s) {
+    delete internal(s);
+}
+
+void SHSEncryptionStream_SetMaxMessageSize(SHSEncryptionStream *s, size_t maxSize) {
+    internal(s)->setMaxMessageSize(maxSize);
+}
+
+void SHSEncryptionStream_Push(SHSEncryptionStream *s, const void *data, size_t size) {
+    internal(s)->push(data, size);
+}
+
+void SHSEncryptionStream_PushPartial(SHSEncryptionStream *s, const void *data, size_t size) {
+    internal(s)->pushPartial(data, size);
+}
+
+SHSOutputBuffer SHSEncryptionStream_Reserve(SHSEncryptionStream *s, size_t size) {
+    return external(internal(s)->reserve(size));
+}
+
+void SHSEncryptionStream_Commit(SHSEncryptionStream *s, size_t size) {
+    internal(s)->commit(size);
+}
+
+void SHSEncryptionStream_Flush(SHSEncryptionStream *s) {
+    internal(s)->flush();
+}
+
+size_t SHSEncryptionStream_BytesAvailable(SHSEncryptionStream *s) {
+    return internal(s)->bytesAvailable();
+}
+
+SHSInputBuffer SHSEncryptionStream_AvailableData(SHSEncryptionStream *s) {
+    return external(internal(s)->availableData());
+}
+
+size_t SHSEncryptionStream_Skip(SHSEncryptionStream *s, size_t size) {
+    return internal(s)->skip(size);
+}
+
+size_t SHSEncryptionStream_Pull(SHSEncryptionStream *s, void *dst, size_t maxSize) {
+    return internal(s)->pull(dst, maxSize);
+}
+
+
+SHSDecryptionStream* SHSDecryptionStream_Create(const SHSSession *session,
+                                                SHSCryptoBoxProtocol protocol)
+{
+    auto s = new DecryptionStream(*(Session*)session, (CryptoBox::Protocol)protocol);
+    return (SHSDecryptionStream*)s;
+}
+
+void SHSDecryptionStream_Free(SHSDecryptionStream *s) {
+    delete internal(s);
+}
+
+bool SHSDecryptionStream_Push(SHSDecryptionStream *s, const void *data, size_t size) {
+    return internal(s)->push(data, size);
+}
+
+SHSOutputBuffer SHSDecryptionStream_Reserve(SHSDecryptionStream *s, size_t size) {
+    return external(internal(s)->reserve(size));
+}
+
+bool SHSDecryptionStream_Commit(SHSDecryptionStream *s, size_t size) {
+    return internal(s)->commit(size);
+}
+
+bool SHSDecryptionStream_Close(SHSDecryptionStream *s) {
+    return internal(s)->close();
+}
+
+size_t SHSDecryptionStream_BytesAvailable(SHSDecryptionStream *s) {
+    return internal(s)->bytesAvailable();
+}
+
+SHSInputBuffer SHSDecryptionStream_AvailableData(SHSDecryptionStream *s) {
+    return external(internal(s)->availableData());
+}
+
+size_t SHSDecryptionStream_Skip(SHSDecryptionStream *s, size_t size) {
+    return internal(s)->skip(size);
+}
+
+size_t SHSDecryptionStream_Pull(SHSDecryptionStream *s, void *dst, size_t maxSize) {
+    return internal(s)->pull(dst, maxSize);
+}
@@ -0,0 +1,521 @@
+//
+// aes256gcm.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#include "aes256gcm.hh"
+#include <algorithm>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#  define SHS_AESNI 1
+#  include <immintrin.h>
+#  define AESNI_TARGET __attribute__((target("aes,pclmul,ssse3")))
+#else
+#  define SHS_AESNI 0
+#endif
+
+
+namespace snej::shs::impl {
+    using namespace std;
+
+    static constexpr int kRounds = 14;      // AES-256
+
+    static bool sDisableHW = false;
+
+
+    static inline void wipe(void *p, size_t size) {
+        // (Volatile pointer keeps the compiler from optimizing away the stores.)
+        auto vp = (volatile uint8_t*)p;
+        while (size-- > 0)
+            *vp++ = 0;
+    }
+
+    static inline uint64_t load64be(const uint8_t *p) {
+        uint64_t n = 0;
+        for (int i = 0; i < 8; ++i)
+            n = (n << 8) | p[i];
+        return n;
+    }
+
+    static inline void store64be(uint8_t *p, uint64_t n) {
+        for (int i = 7; i >= 0; --i, n >>= 8)
+            p[i] = uint8_t(n);
+    }
+
+    // Increments the last 32 bits of a counter block, big-endian (GCM's `inc32` function.)
+    static inline void inc32(uint8_t block[16]) {
+        for (int i = 15; i >= 12; --i)
+            if (++block[i] != 0)
+                break;
+    }
+
+
+#pragma mark - PORTABLE AES:
+
+
+    // Applies the AES S-box to `n` bytes (n <= 64) in constant time.
+    // The bytes are transposed into eight 64-bit "bit planes", the S-box is evaluated as the
+    // Boyar-Peralta boolean circuit on all of them at once, then they're transposed back.
+    static void subBytes(uint8_t *bytes, size_t n) {
+        uint64_t q[8] = {};
+        for (size_t j = 0; j < n; ++j)
+            for (int b = 0; b < 8; ++b)
+                q[b] |= uint64_t((bytes[j] >> b) & 1) << j;
+
+        uint64_t x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4],
+                 x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+
+        // Top linear transformation:
+        uint64_t y14 = x3 ^ x5,     y13 = x0 ^ x6,      y9  = x0 ^ x3,      y8  = x0 ^ x5;
+        uint64_t t0  = x1 ^ x2,     y1  = t0 ^ x7,      y4  = y1 ^ x3,      y12 = y13 ^ y14;
+        uint64_t y2  = y1 ^ x0,     y5  = y1 ^ x6,      y3  = y5 ^ y8,      t1  = x4 ^ y12;
+        uint64_t y15 = t1 ^ x5,     y20 = t1 ^ x1,      y6  = y15 ^ x7,     y10 = y15 ^ t0;
+        uint64_t y11 = y20 ^ y9,    y7  = x7 ^ y11,     y17 = y10 ^ y11,    y19 = y10 ^ y8;
+        uint64_t y16 = t0 ^ y11,    y21 = y13 ^ y16,    y18 = x0 ^ y16;
+
+        // Non-linear section:
+        uint64_t t2  = y12 & y15,   t3  = y3 & y6,      t4  = t3 ^ t2,      t5  = y4 & x7;
+        uint64_t t6  = t5 ^ t2,     t7  = y13 & y16,    t8  = y5 & y1,      t9  = t8 ^ t7;
+        uint64_t t10 = y2 & y7,     t11 = t10 ^ t7,     t12 = y9 & y11,     t13 = y14 & y17;
+        uint64_t t14 = t13 ^ t12,   t15 = y8 & y10,     t16 = t15 ^ t12,    t17 = t4 ^ t14;
+        uint64_t t18 = t6 ^ t16,    t19 = t9 ^ t14,     t20 = t11 ^ t16,    t21 = t17 ^ y20;
+        uint64_t t22 = t18 ^ y19,   t23 = t19 ^ y21,    t24 = t20 ^ y18;
+
+        uint64_t t25 = t21 ^ t22,   t26 = t21 & t23,    t27 = t24 ^ t26,    t28 = t25 & t27;
+        uint64_t t29 = t28 ^ t22,   t30 = t23 ^ t24,    t31 = t22 ^ t26,    t32 = t31 & t30;
+        uint64_t t33 = t32 ^ t24,   t34 = t23 ^ t33,    t35 = t27 ^ t33,    t36 = t24 & t35;
+        uint64_t t37 = t36 ^ t34,   t38 = t27 ^ t36,    t39 = t29 & t38,    t40 = t25 ^ t39;
+
+        uint64_t t41 = t40 ^ t37,   t42 = t29 ^ t33,    t43 = t29 ^ t40,    t44 = t33 ^ t37;
+        uint64_t t45 = t42 ^ t41;
+        uint64_t z0  = t44 & y15,   z1  = t37 & y6,     z2  = t33 & x7,     z3  = t43 & y16;
+        uint64_t z4  = t40 & y1,    z5  = t29 & y7,     z6  = t42 & y11,    z7  = t45 & y17;
+        uint64_t z8  = t41 & y10,   z9  = t44 & y12,    z10 = t37 & y3,     z11 = t33 & y4;
+        uint64_t z12 = t43 & y13,   z13 = t40 & y5,     z14 = t29 & y2,     z15 = t42 & y9;
+        uint64_t z16 = t45 & y14,   z17 = t41 & y8;
+
+        // Bottom linear transformation:
+        uint64_t t46 = z15 ^ z16,   t47 = z10 ^ z11,    t48 = z5 ^ z13,     t49 = z9 ^ z10;
+        uint64_t t50 = z2 ^ z12,    t51 = z2 ^ z5,      t52 = z7 ^ z8,      t53 = z0 ^ z3;
+        uint64_t t54 = z6 ^ z7,     t55 = z16 ^ z17,    t56 = z12 ^ t48,    t57 = t50 ^ t53;
+        uint64_t t58 = z4 ^ t46,    t59 = z3 ^ t54,     t60 = t46 ^ t57,    t61 = z14 ^ t57;
+        uint64_t t62 = t52 ^ t58,   t63 = t49 ^ t58,    t64 = z4 ^ t59,     t65 = t61 ^ t62;
+        uint64_t t66 = z1 ^ t63;
+        uint64_t s0  = t59 ^ t63,   s6  = t56 ^ ~t62,   s7  = t48 ^ ~t60,   t67 = t64 ^ t65;
+        uint64_t s3  = t53 ^ t66,   s4  = t51 ^ t66,    s5  = t47 ^ t65,    s1  = t64 ^ ~s3;
+        uint64_t s2  = t55 ^ ~t67;
+
+        q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3; q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+
+        for (size_t j = 0; j < n; ++j) {
+            uint8_t byte = 0;
+            for (int b = 0; b < 8; ++b)
+                byte |= uint8_t(((q[b] >> j) & 1) << b);
+            bytes[j] = byte;
+        }
+    }
+
+
+    static inline uint8_t xtime(uint8_t x) {
+        return uint8_t((x << 1) ^ (0x1B & -(x >> 7)));
+    }
+
+
+    // Encrypts up to 4 blocks at once (sharing each round's bitsliced S-box evaluation.)
+    static void softEncryptBlocks(const uint8_t roundKeys[15][16],
+                                  const uint8_t *in, uint8_t *out, size_t nBlocks)
+    {
+        uint8_t s[64];
+        size_t n = 16 * nBlocks;
+        for (size_t i = 0; i < n; ++i)
+            s[i] = in[i] ^ roundKeys[0][i % 16];
+        for (int round = 1; round <= kRounds; ++round) {
+            subBytes(s, n);
+            for (size_t blk = 0; blk < n; blk += 16) {
+                uint8_t *st = &s[blk];
+                // ShiftRows: row r is rotated left by r columns. (State is column-major.)
+                uint8_t t[16];
+                for (int c = 0; c < 4; ++c)
+                    for (int r = 0; r < 4; ++r)
+                        t[r + 4*c] = st[r + 4*((c + r) % 4)];
+                // MixColumns (skipped in the final round):
+                if (round < kRounds) {
+                    for (int c = 0; c < 4; ++c) {
+                        uint8_t *col = &t[4*c];
+                        uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+                        uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+                        col[0] ^= all ^ xtime(a0 ^ a1);
+                        col[1] ^= all ^ xtime(a1 ^ a2);
+                        col[2] ^= all ^ xtime(a2 ^ a3);
+                        col[3] ^= all ^ xtime(a3 ^ a0);
+                    }
+                }
+                for (int i = 0; i < 16; ++i)
+                    st[i] = t[i] ^ roundKeys[round][i];
+            }
+        }
+        memcpy(out, s, n);
+        wipe(s, sizeof(s));
+    }
+
+
+    static void expandKey(const uint8_t key[32], uint8_t roundKeys[15][16]) {
+        static constexpr uint8_t kRcon[7] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40};
+        auto w = &roundKeys[0][0];          // 60 32-bit words
+        memcpy(w, key, 32);
+        for (int i = 8; i < 60; ++i) {
+            uint8_t temp[4];
+            memcpy(temp, &w[4*(i-1)], 4);
+            if (i % 8 == 0) {
+                uint8_t t0 = temp[0];
+                temp[0] = temp[1]; temp[1] = temp[2]; temp[2] = temp[3]; temp[3] = t0;
+                subBytes(temp, 4);
+                temp[0] ^= kRcon[i/8 - 1];
+            } else if (i % 8 == 4) {
+                subBytes(temp, 4);
+            }
+            for (int j = 0; j < 4; ++j)
+                w[4*i + j] = w[4*(i-8) + j] ^ temp[j];
+        }
+    }
+
+
+#pragma mark - PORTABLE GHASH:
+
+
+    // Multiplies X by H in GF(2^128), in constant time. Both are big-endian (hi, lo) pairs.
+    static void softGFMul(uint64_t x[2], uint64_t const h[2]) {
+        uint64_t zh = 0, zl = 0, vh = h[0], vl = h[1];
+        for (int i = 0; i < 128; ++i) {
+            uint64_t bit = (i < 64) ? (x[0] >> (63 - i)) : (x[1] >> (127 - i));
+            uint64_t mask = -(bit & 1);
+            zh ^= vh & mask;
+            zl ^= vl & mask;
+            uint64_t lsbMask = -(vl & 1);
+            vl = (vl >> 1) | (vh << 63);
+            vh = (vh >> 1) ^ (0xE100000000000000ull & lsbMask);
+        }
+        x[0] = zh;
+        x[1] = zl;
+    }
+
+
+    static void softGHashBlocks(uint64_t x[2], uint64_t const h[2],
+                                const uint8_t *data, size_t size)
+    {
+        while (size > 0) {
+            uint8_t block[16] = {};
+            size_t n = min(size, sizeof(block));
+            memcpy(block, data, n);
+            x[0] ^= load64be(&block[0]);
+            x[1] ^= load64be(&block[8]);
+            softGFMul(x, h);
+            data += n;
+            size -= n;
+        }
+    }
+
+
+#pragma mark - AES-NI:
+
+
+#if SHS_AESNI
+
+    static bool cpuHasAESNI() {
+        static const bool sHas = __builtin_cpu_supports("aes")
+                              && __builtin_cpu_supports("pclmul")
+                              && __builtin_cpu_supports("ssse3");
+        return sHas;
+    }
+
+
+    AESNI_TARGET
+    static inline __m128i byteSwap(__m128i x) {
+        return _mm_shuffle_epi8(x, _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15));
+    }
+
+
+    AESNI_TARGET
+    static inline __m128i hwEncrypt(__m128i const rk[15], __m128i x) {
+        x = _mm_xor_si128(x, rk[0]);
+        for (int i = 1; i < kRounds; ++i)
+            x = _mm_aesenc_si128(x, rk[i]);
+        return _mm_aesenclast_si128(x, rk[kRounds]);
+    }
+
+
+    AESNI_TARGET
+    static void hwEncryptBlock(const uint8_t roundKeys[15][16], const uint8_t in[16],
+                               uint8_t out[16])
+    {
+        __m128i rk[15];
+        for (int i = 0; i <= kRounds; ++i)
+            rk[i] = _mm_load_si128((const __m128i*)roundKeys[i]);
+        _mm_storeu_si128((__m128i*)out, hwEncrypt(rk, _mm_loadu_si128((const __m128i*)in)));
+    }
+
+
+    // CTR-mode encryption, four blocks at a time so the AESENC pipelines stay full.
+    AESNI_TARGET
+    static void hwCTR(const uint8_t roundKeys[15][16], uint8_t counter[16],
+                      const uint8_t *in, size_t size, uint8_t *out)
+    {
+        __m128i rk[15];
+        for (int i = 0; i <= kRounds; ++i)
+            rk[i] = _mm_load_si128((const __m128i*)roundKeys[i]);
+        while (size >= 64) {
+            __m128i b[4];
+            for (int j = 0; j < 4; ++j) {
+                b[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)counter), rk[0]);
+                inc32(counter);
+            }
+            for (int i = 1; i < kRounds; ++i)
+                for (int j = 0; j < 4; ++j)
+                    b[j] = _mm_aesenc_si128(b[j], rk[i]);
+            for (int j = 0; j < 4; ++j) {
+                b[j] = _mm_aesenclast_si128(b[j], rk[kRounds]);
+                __m128i p = _mm_loadu_si128((const __m128i*)(in + 16*j));
+                _mm_storeu_si128((__m128i*)(out + 16*j), _mm_xor_si128(p, b[j]));
+            }
+            in += 64; out += 64; size -= 64;
+        }
+        while (size > 0) {
+            alignas(16) uint8_t ks[16];
+            _mm_store_si128((__m128i*)ks, hwEncrypt(rk, _mm_loadu_si128((const __m128i*)counter)));
+            inc32(counter);
+            size_t n = min(size, sizeof(ks));
+            for (size_t i = 0; i < n; ++i)
+                out[i] = in[i] ^ ks[i];
+            in += n; out += n; size -= n;
+        }
+    }
+
+
+    // Carry-less multiplication in GF(2^128) of two byte-reflected values, with reduction.
+    // (From Intel's "Carry-Less Multiplication and Its Usage for Computing the GCM Mode".)
+    AESNI_TARGET
+    static __m128i hwGFMul(__m128i a, __m128i b) {
+        __m128i t3 = _mm_clmulepi64_si128(a, b, 0x00);
+        __m128i t4 = _mm_clmulepi64_si128(a, b, 0x10);
+        __m128i t5 = _mm_clmulepi64_si128(a, b, 0x01);
+        __m128i t6 = _mm_clmulepi64_si128(a, b, 0x11);
+        t4 = _mm_xor_si128(t4, t5);
+        t5 = _mm_slli_si128(t4, 8);
+        t4 = _mm_srli_si128(t4, 8);
+        t3 = _mm_xor_si128(t3, t5);
+        t6 = _mm_xor_si128(t6, t4);
+        // Shift the 256-bit product left by one bit:
+        __m128i t7 = _mm_srli_epi32(t3, 31);
+        __m128i t8 = _mm_srli_epi32(t6, 31);
+        t3 = _mm_slli_epi32(t3, 1);
+        t6 = _mm_slli_epi32(t6, 1);
+        __m128i t9 = _mm_srli_si128(t7, 12);
+        t8 = _mm_slli_si128(t8, 4);
+        t7 = _mm_slli_si128(t7, 4);
+        t3 = _mm_or_si128(t3, t7);
+        t6 = _mm_or_si128(t6, t8);
+        t6 = _mm_or_si128(t6, t9);
+        // Reduce modulo x^128 + x^7 + x^2 + x + 1:
+        t7 = _mm_slli_epi32(t3, 31);
+        t8 = _mm_slli_epi32(t3, 30);
+        t9 = _mm_slli_epi32(t3, 25);
+        t7 = _mm_xor_si128(t7, t8);
+        t7 = _mm_xor_si128(t7, t9);
+        t8 = _mm_srli_si128(t7, 4);
+        t7 = _mm_slli_si128(t7, 12);
+        t3 = _mm_xor_si128(t3, t7);
+        __m128i t2 = _mm_srli_epi32(t3, 1);
+        t4 = _mm_srli_epi32(t3, 2);
+        t5 = _mm_srli_epi32(t3, 7);
+        t2 = _mm_xor_si128(t2, t4);
+        t2 = _mm_xor_si128(t2, t5);
+        t2 = _mm_xor_si128(t2, t8);
+        t3 = _mm_xor_si128(t3, t2);
+        return _mm_xor_si128(t6, t3);
+    }
+
+
+    AESNI_TARGET
+    static __m128i hwGHashBlocks(__m128i x, __m128i h, const uint8_t *data, size_t size) {
+        while (size >= 16) {
+            __m128i block = byteSwap(_mm_loadu_si128((const __m128i*)data));
+            x = hwGFMul(_mm_xor_si128(x, block), h);
+            data += 16;
+            size -= 16;
+        }
+        if (size > 0) {
+            alignas(16) uint8_t block[16] = {};
+            memcpy(block, data, size);
+            x = hwGFMul(_mm_xor_si128(x, byteSwap(_mm_load_si128((const __m128i*)block))), h);
+        }
+        return x;
+    }
+
+
+    AESNI_TARGET
+    static void hwGHash(const uint8_t hBytes[16], uint8_t tag[16],
+                        const uint8_t *ad, size_t adSize, const uint8_t *ct, size_t ctSize)
+    {
+        __m128i h = byteSwap(_mm_load_si128((const __m128i*)hBytes));
+        __m128i x = _mm_setzero_si128();
+        x = hwGHashBlocks(x, h, ad, adSize);
+        x = hwGHashBlocks(x, h, ct, ctSize);
+        alignas(16) uint8_t lengths[16];
+        store64be(&lengths[0], uint64_t(adSize) * 8);
+        store64be(&lengths[8], uint64_t(ctSize) * 8);
+        x = hwGHashBlocks(x, h, lengths, 16);
+        _mm_storeu_si128((__m128i*)tag, byteSwap(x));
+    }
+
+#else
+    static bool cpuHasAESNI() {return false;}
+#endif // SHS_AESNI
+
+
+#pragma mark - AES256GCM CLASS:
+
+
+    bool aes256gcm::hardwareAccelerated() {
+        return cpuHasAESNI();
+    }
+
+
+    void aes256gcm::disableHardwareAcceleration(bool disable) {
+        sDisableHW = disable;
+    }
+
+
+    aes256gcm::aes256gcm(const uint8_t key[kKeySize])
+    :_hw(cpuHasAESNI() && !sDisableHW)
+    {
+        expandKey(key, _roundKeys);
+        uint8_t zero[16] = {};
+        encryptBlock(zero, _h);
+    }
+
+
+    aes256gcm::~aes256gcm() {
+        wipe(_roundKeys, sizeof(_roundKeys));
+        wipe(_h, sizeof(_h));
+    }
+
+
+    void aes256gcm::encryptBlock(const uint8_t in[16], uint8_t out[16]) const {
+#if SHS_AESNI
+        if (_hw)
+            return hwEncryptBlock(_roundKeys, in, out);
+#endif
+        softEncryptBlocks(_roundKeys, in, out, 1);
+    }
+
+
+    void aes256gcm::ctr(const uint8_t iv[kIVSize], const uint8_t *in, size_t size,
+                        uint8_t *out) const
+    {
+        // Counter starts at inc32(J0), where J0 = IV | 00000001.
+        uint8_t counter[16] = {};
+        memcpy(counter, iv, kIVSize);
+        counter[15] = 2;
+#if SHS_AESNI
+        if (_hw)
+            return hwCTR(_roundKeys, counter, in, size, out);
+#endif
+        while (size > 0) {
+            uint8_t ctrBlocks[64], ks[64];
+            size_t nBlocks = min<size_t>(4, (size + 15) / 16);
+            for (size_t j = 0; j < nBlocks; ++j) {
+                memcpy(&ctrBlocks[16*j], counter, 16);
+                inc32(counter);
+            }
+            softEncryptBlocks(_roundKeys, ctrBlocks, ks, nBlocks);
+            size_t n = min(size, 16 * nBlocks);
+            for (size_t i = 0; i < n; ++i)
+                out[i] = in[i] ^ ks[i];
+            in += n; out += n; size -= n;
+        }
+    }
+
+
+    void aes256gcm::ghash(uint8_t tag[16], const uint8_t *ad, size_t adSize,
+                          const uint8_t *ct, size_t ctSize) const
+    {
+#if SHS_AESNI
+        if (_hw)
+            return hwGHash(_h, tag, ad, adSize, ct, ctSize);
+#endif
+        uint64_t h[2] = {load64be(&_h[0]), load64be(&_h[8])};
+        uint64_t x[2] = {0, 0};
+        softGHashBlocks(x, h, ad, adSize);
+        softGHashBlocks(x, h, ct, ctSize);
+        uint8_t lengths[16];
+        store64be(&lengths[0], uint64_t(adSize) * 8);
+        store64be(&lengths[8], uint64_t(ctSize) * 8);
+        softGHashBlocks(x, h, lengths, 16);
+        store64be(&tag[0], x[0]);
+        store64be(&tag[8], x[1]);
+        wipe(h, sizeof(h));
+    }
+
+
+    void aes256gcm::seal(const uint8_t iv[kIVSize],
+                         const void *ad, size_t adSize,
+                         const void *in, size_t size,
+                         void *out,
+                         uint8_t tag[kTagSize]) const
+    {
+        ctr(iv, (const uint8_t*)in, size, (uint8_t*)out);
+        ghash(tag, (const uint8_t*)ad, adSize, (const uint8_t*)out, size);
+        // Tag = GHASH ^ E(K, J0):
+        uint8_t j0[16] = {}, ekj0[16];
+        memcpy(j0, iv, kIVSize);
+        j0[15] = 1;
+        encryptBlock(j0, ekj0);
+        for (int i = 0; i < 16; ++i)
+            tag[i] ^= ekj0[i];
+    }
+
+
+    bool aes256gcm::open(const uint8_t iv[kIVSize],
+                         const void *ad, size_t adSize,
+                         const void *in, size_t size,
+                         void *out,
+                         const uint8_t tag[kTagSize]) const
+    {
+        // Verify the tag before decrypting anything:
+        uint8_t expected[16], j0[16] = {}, ekj0[16];
+        ghash(expected, (const uint8_t*)ad, adSize, (const uint8_t*)in, size);
+        memcpy(j0, iv, kIVSize);
+        j0[15] = 1;
+        encryptBlock(j0, ekj0);
+        uint8_t diff = 0;
+        for (int i = 0; i < 16; ++i)
+            diff |= uint8_t(expected[i] ^ ekj0[i] ^ tag[i]);
+        if (diff != 0)
+            return false;
+        ctr(iv, (const uint8_t*)in, size, (uint8_t*)out);
+        return true;
+    }
+
+}
@@ -0,0 +1,67 @@
+//
+// aes256gcm.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace snej::shs::impl {
+
+    /// AES-256-GCM authenticated encryption (NIST SP 800-38D), with a 96-bit IV and 128-bit tag.
+    ///
+    /// On x86 CPUs that support the AES-NI and PCLMULQDQ instructions (as reported by cpuid),
+    /// these are used. Otherwise it falls back to a portable implementation that is constant-time
+    /// (bitsliced S-box, no secret-dependent table lookups or branches), but much slower.
+    class aes256gcm {
+    public:
+        static constexpr size_t kKeySize = 32;
+        static constexpr size_t kIVSize  = 12;
+        static constexpr size_t kTagSize = 16;
+
+        /// Expands the key. The object can then be used for any number of messages, as long as
+        /// each one uses a different IV.
+        explicit aes256gcm(const uint8_t key[kKeySize]);
+        ~aes256gcm();
+
+        aes256gcm(const aes256gcm&) = delete;
+        aes256gcm& operator=(const aes256gcm&) = delete;
+
+        /// Encrypts `size` bytes from `in` to `out` (which may be the same address), authenticating
+        /// it and the additional data `ad`, and writes the tag to `tag`.
+        void seal(const uint8_t iv[kIVSize],
+                  const void *ad, size_t adSize,
+                  const void *in, size_t size,
+                  void *out,
+                  uint8_t tag[kTagSize]) const;
+
+        /// Verifies the tag and decrypts `size` bytes from `in` to `out` (which may be the same
+        /// address.) Returns false, and writes nothing, if the tag doesn't match.
+        [[nodiscard]]
+        bool open(const uint8_t iv[kIVSize],
+                  const void *ad, size_t adSize,
+                  const void *in, size_t size,
+                  void *out,
+                  const uint8_t tag[kTagSize]) const;
+
+        /// True if this CPU has AES-NI and PCLMULQDQ, so the fast implementation will be used.
+        static bool hardwareAccelerated();
+
+        /// Forces use of the portable implementation, even if the CPU supports AES-NI.
+        /// Only affects objects constructed afterwards. Intended for tests and benchmarks.
+        static void disableHardwareAcceleration(bool disable);
+
+    private:
+        void ghash(uint8_t tag[16], const uint8_t *ad, size_t adSize,
+                   const uint8_t *ct, size_t ctSize) const;
+        void ctr(const uint8_t iv[kIVSize], const uint8_t *in, size_t size, uint8_t *out) const;
+        void encryptBlock(const uint8_t in[16], uint8_t out[16]) const;
+
+        alignas(16) uint8_t _roundKeys[15][16];   // Expanded AES-256 key schedule
+        alignas(16) uint8_t _h[16];               // GHASH key, E(K, 0^128)
+        bool                _hw;                  // Use AES-NI + PCLMULQDQ?
+    };
+
+}
@@ -0,0 +1,215 @@
+//
+// compression.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#include "compression.hh"
+#include <algorithm>
+#include <cstring>
+
+#if SHS_ZSTD
+#include <zstd.h>
+#endif
+
+namespace snej::shs::impl {
+
+    namespace lz4 {
+
+        // Constants from the LZ4 block format spec:
+        static constexpr size_t kMinMatch     = 4;     // Shortest match
+        static constexpr size_t kLastLiterals = 5;     // Last 5 bytes are always literals
+        static constexpr size_t kMFLimit      = 12;    // Last match must start >= 12 bytes before end
+        static constexpr size_t kMaxOffset    = 0xFFFF;
+
+        static constexpr unsigned kHashBits = 12;
+
+
+        static inline uint32_t read32(const uint8_t *p) {
+            uint32_t v;
+            ::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        static inline unsigned hash(uint32_t seq) {
+            return (seq * 2654435761u) >> (32 - kHashBits);
+        }
+
+        // Writes the extra bytes of a literal or match length that overflowed its 4-bit field.
+        static inline uint8_t* writeLength(uint8_t *op, size_t len) {
+            for (; len >= 255; len -= 255)
+                *op++ = 255;
+            *op++ = uint8_t(len);
+            return op;
+        }
+
+        // Writes a sequence: a token, literals, then a match unless `matchLen` is 0 (the last
+        // sequence.) Returns the new output pointer, or nullptr if it might not fit.
+        static uint8_t* writeSequence(uint8_t *op, uint8_t *oend,
+                                      const uint8_t *lit, size_t litLen,
+                                      size_t offset, size_t matchLen)
+        {
+            size_t maxSize = 1 + litLen + (litLen / 255 + 1);
+            if (matchLen)
+                maxSize += 2 + (matchLen / 255 + 1);
+            if (maxSize > size_t(oend - op))
+                return nullptr;
+
+            uint8_t *token = op++;
+            uint8_t t = uint8_t(std::min(litLen, size_t(15)) << 4);
+            if (litLen >= 15)
+                op = writeLength(op, litLen - 15);
+            ::memcpy(op, lit, litLen);
+            op += litLen;
+            if (matchLen) {
+                *op++ = uint8_t(offset);
+                *op++ = uint8_t(offset >> 8);
+                size_t ml = matchLen - kMinMatch;
+                t |= uint8_t(std::min(ml, size_t(15)));
+                if (ml >= 15)
+                    op = writeLength(op, ml - 15);
+            }
+            *token = t;
+            return op;
+        }
+
+
+        size_t compress(const uint8_t *src, size_t size, uint8_t *dst, size_t dstCapacity) {
+            uint8_t *op = dst, *oend = dst + dstCapacity;
+            const uint8_t *ip = src, *anchor = src, *end = src + size;
+            if (size > kMFLimit) {
+                uint32_t table[1 << kHashBits] = {};    // hash of 4 bytes -> offset from src
+                const uint8_t *mfLimit = end - kMFLimit, *matchLimit = end - kLastLiterals;
+                while (ip < mfLimit) {
+                    uint32_t seq = read32(ip);
+                    unsigned h = hash(seq);
+                    const uint8_t *ref = src + table[h];
+                    table[h] = uint32_t(ip - src);
+                    if (ref < ip && size_t(ip - ref) <= kMaxOffset && read32(ref) == seq) {
+                        size_t len = kMinMatch;
+                        while (ip + len < matchLimit && ip[len] == ref[len])
+                            ++len;
+                        op = writeSequence(op, oend, anchor, ip - anchor, ip - ref, len);
+                        if (!op)
+                            return 0;
+                        ip += len;
+                        anchor = ip;
+                    } else {
+                        // Step faster the longer we go without a match, so incompressible
+                        // data doesn't cost a hash lookup per byte:
+                        ip += 1 + ((ip - anchor) >> 6);
+                    }
+                }
+            }
+            op = writeSequence(op, oend, anchor, end - anchor, 0, 0);
+            return op ? size_t(op - dst) : 0;
+        }
+
+
+        intptr_t decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dstCapacity) {
+            const uint8_t *ip = src, *iend = src + size;
+            uint8_t *op = dst, *oend = dst + dstCapacity;
+
+            // Reads the extra bytes of a length, adding them to `len`. False on truncated input.
+            auto readLength = [&](size_t &len) -> bool {
+                uint8_t b;
+                do {
+                    if (ip >= iend)
+                        return false;
+                    b = *ip++;
+                    len += b;
+                } while (b == 255);
+                return true;
+            };
+
+            while (ip < iend) {
+                unsigned token = *ip++;
+
+                size_t litLen = token >> 4;
+                if (litLen == 15 && !readLength(litLen))
+                    return -1;
+                if (litLen > size_t(iend - ip) || litLen > size_t(oend - op))
+                    return -1;
+                ::memcpy(op, ip, litLen);
+                ip += litLen;
+                op += litLen;
+                if (ip == iend)
+                    return op - dst;                // The last sequence has no match
+
+                if (iend - ip < 2)
+                    return -1;
+                size_t offset = ip[0] | (size_t(ip[1]) << 8);
+                ip += 2;
+                if (offset == 0 || offset > size_t(op - dst))
+                    return -1;
+                size_t matchLen = token & 15;
+                if (matchLen == 15 && !readLength(matchLen))
+                    return -1;
+                matchLen += kMinMatch;
+                if (matchLen > size_t(oend - op))
+                    return -1;
+                const uint8_t *ref = op - offset;
+                if (offset >= matchLen) {
+                    ::memcpy(op, ref, matchLen);
+                } else {
+                    for (size_t i = 0; i < matchLen; ++i)    // overlapping copy repeats a pattern
+                        op[i] = ref[i];
+                }
+                op += matchLen;
+            }
+            return -1;                              // Empty input, or it ended with a match
+        }
+    }
+
+
+    namespace zstd {
+
+#if SHS_ZSTD
+        static constexpr int kLevel = 3;
+
+        bool available() {return true;}
+
+        size_t compress(const uint8_t *src, size_t size, uint8_t *dst, size_t dstCapacity) {
+            // Reuse a context per thread; creating one per call is costly.
+            struct Context {
+                ZSTD_CCtx *cctx = ZSTD_createCCtx();
+                ~Context() {ZSTD_freeCCtx(cctx);}
+            };
+            static thread_local Context sContext;
+            size_t result = ZSTD_compressCCtx(sContext.cctx, dst, dstCapacity, src, size, kLevel);
+            return ZSTD_isError(result) ? 0 : result;
+        }
+
+        intptr_t decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dstCapacity) {
+            size_t result = ZSTD_decompress(dst, dstCapacity, src, size);
+            return ZSTD_isError(result) ? -1 : intptr_t(result);
+        }
+#else
+        bool available() {return false;}
+
+        size_t compress(const uint8_t*, size_t, uint8_t*, size_t)       {return 0;}
+        intptr_t decompress(const uint8_t*, size_t, uint8_t*, size_t)   {return -1;}
+#endif
+    }
+
+}
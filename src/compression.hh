@@ -0,0 +1,42 @@
+//
+// compression.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace snej::shs::impl {
+
+    /// Compression of a single block (up to 64KB) in the LZ4 block format, as used by the
+    /// `Compressed` stream protocol. The format is LZ4's, so other LZ4 implementations can read
+    /// it, but this is a small self-contained greedy compressor, not the reference code.
+    namespace lz4 {
+
+        /// Compresses `size` bytes from `src` into `dst`.
+        /// Returns the compressed size, or 0 if it doesn't fit in `dstCapacity` bytes;
+        /// so passing a capacity smaller than `size` gives up early on incompressible data.
+        size_t compress(const uint8_t *src, size_t size, uint8_t *dst, size_t dstCapacity);
+
+        /// Decompresses `size` bytes from `src` into `dst`, never writing past `dstCapacity`.
+        /// Returns the decompressed size, or -1 if the input is invalid or too large to fit.
+        intptr_t decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dstCapacity);
+    }
+
+
+    /// Zstandard compression of a single block. Only available if built with SHS_ZSTD.
+    namespace zstd {
+
+        /// True if zstd support is compiled in; if not, the other functions always fail.
+        bool available();
+
+        /// Same API as `lz4::compress`.
+        size_t compress(const uint8_t *src, size_t size, uint8_t *dst, size_t dstCapacity);
+
+        /// Same API as `lz4::decompress`.
+        intptr_t decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dstCapacity);
+    }
+
+}
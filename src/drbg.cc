@@ -0,0 +1,139 @@
+//
+// drbg.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#include "drbg.hh"
+#include "monocypher/base.hh"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+namespace snej::shs::impl {
+    using namespace std;
+    using namespace monocypher::c;
+
+    static constexpr size_t kKeySize    = 32;
+    static constexpr size_t kBufferSize = 512;     // Includes the next key
+
+    static atomic<bool>     sUseOS = SHS_USE_OS_RANDOM;
+    static atomic<uint64_t> sOSRequests = 0;
+    static atomic<unsigned> sForkGeneration = 0;    // Incremented in a child process after fork
+
+
+    static void osRandomize(void *dst, size_t size) {
+        ++sOSRequests;
+        monocypher::randomize(dst, size);
+    }
+
+
+    namespace {
+        struct generator {
+            uint8_t  key[kKeySize];
+            uint8_t  buffer[kBufferSize];
+            size_t   pos = kBufferSize;             // Start of unused bytes in `buffer`
+            uint64_t sinceSeed = 0;                 // Bytes output since last reseed
+            unsigned forkGeneration = 0;
+            bool     seeded = false;
+
+            ~generator() {
+                monocypher::wipe(key, sizeof(key));
+                monocypher::wipe(buffer, sizeof(buffer));
+            }
+
+            void reseed() {
+                // Hash the new seed together with the old key, so the new key is no weaker than
+                // either of them:
+                uint8_t seed[kKeySize];
+                osRandomize(seed, sizeof(seed));
+                if (seeded)
+                    crypto_blake2b_keyed(key, kKeySize, seed, sizeof(seed), key, kKeySize);
+                else
+                    ::memcpy(key, seed, kKeySize);
+                monocypher::wipe(seed, sizeof(seed));
+                monocypher::wipe(buffer, sizeof(buffer));
+                pos = kBufferSize;
+                sinceSeed = 0;
+                forkGeneration = sForkGeneration;
+                seeded = true;
+            }
+
+            void refill() {
+                // Fast key erasure: the first bytes of keystream immediately become the new key.
+                static constexpr uint8_t kNonce[8] = {};
+                crypto_chacha20_djb(buffer, nullptr, kBufferSize, key, kNonce, 0);
+                ::memcpy(key, buffer, kKeySize);
+                monocypher::wipe(buffer, kKeySize);
+                pos = kKeySize;
+            }
+
+            void randomize(uint8_t *dst, size_t size) {
+                if (!seeded || forkGeneration != sForkGeneration || sinceSeed >= drbg::kReseedInterval)
+                    reseed();
+                while (size > 0) {
+                    if (pos == kBufferSize)
+                        refill();
+                    size_t n = min(size, kBufferSize - pos);
+                    ::memcpy(dst, &buffer[pos], n);
+                    monocypher::wipe(&buffer[pos], n);
+                    pos += n;
+                    dst += n;
+                    size -= n;
+                    sinceSeed += n;
+                }
+            }
+        };
+    }
+
+
+    static void registerForkHandler() {
+#ifndef _WIN32
+        static bool sRegistered = [] {
+            ::pthread_atfork(nullptr, nullptr, [] {++sForkGeneration;});
+            return true;
+        }();
+        (void)sRegistered;
+#endif
+    }
+
+
+    void drbg::randomize(void *dst, size_t size) {
+        if (sUseOS) {
+            osRandomize(dst, size);
+        } else {
+            registerForkHandler();
+            static thread_local generator tGenerator;
+            tGenerator.randomize((uint8_t*)dst, size);
+        }
+    }
+
+
+    void drbg::useOSRandomness(bool useOS)  {sUseOS = useOS;}
+    uint64_t drbg::osRequestCount()         {return sOSRequests;}
+
+}
@@ -0,0 +1,49 @@
+//
+// drbg.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#ifndef SHS_USE_OS_RANDOM
+/// If this is true, all random bytes come directly from the OS, instead of from a per-thread
+/// generator seeded by it. (This can also be changed at runtime; see `drbg::useOSRandomness`.)
+#define SHS_USE_OS_RANDOM 0
+#endif
+
+namespace snej::shs::impl {
+
+    /// The source of all random bytes used by the library: a per-thread "fast-key-erasure"
+    /// random generator (see <https://blog.cr.yp.to/20170723-random.html>).
+    ///
+    /// Each thread has a ChaCha20 key, seeded from the OS. To generate random bytes it fills a
+    /// buffer with ChaCha20 keystream, immediately replaces the key with the first 32 bytes of
+    /// it, and hands out the rest, wiping each byte from the buffer as it's used. So the state
+    /// never contains anything that could reveal earlier output.
+    ///
+    /// Each generator reseeds from the OS after every `kReseedInterval` bytes, and in a child
+    /// process after `fork`, so parent and child don't produce the same bytes.
+    ///
+    /// This saves a system call (`getrandom`, or a lock in `arc4random`) per handshake, which
+    /// matters at high connection rates.
+    class drbg {
+    public:
+        /// Number of output bytes after which a thread's generator reseeds itself from the OS.
+        static constexpr size_t kReseedInterval = 1 << 20;
+
+        /// Fills `dst` with cryptographically secure random bytes.
+        static void randomize(void *dst, size_t size);
+
+        /// If true, `randomize` takes its bytes directly from the OS instead. Initially
+        /// `SHS_USE_OS_RANDOM`.
+        static void useOSRandomness(bool);
+
+        /// The number of times random bytes have been requested from the OS (each of which is
+        /// typically a system call) by any thread. For tests and benchmarks.
+        static uint64_t osRequestCount();
+    };
+
+}
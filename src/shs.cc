@@ -25,7 +25,11 @@
 //
 
 #include "shs.hh"
+#include "drbg.hh"
+#include "Probes.hh"
+#include "SecretProfiler_Internal.hh"
 #include "monocypher/ext/sha512.hh"
+#include <cstring>
 
 /* Follow along with CheatSheet.md! The variable names here follow the same terminology. */
 
@@ -50,6 +54,7 @@ namespace snej::shs::impl {
     // Algorithms, named as in the mathematical description:
 
     static monocypher::ext::sha256 hash(input_bytes in) {
+        SHS_PROFILE_SPAN("sha256");
         return monocypher::ext::sha256::create(in);
     }
 
@@ -57,6 +62,7 @@ namespace snej::shs::impl {
 
     static inline sha512256 hmac(byte_array<32> const& key, input_bytes in) {
         // (HMAC-SHA-512-256 is just the first 256 bits of HMAC-SHA-512.)
+        SHS_PROFILE_SPAN("hmac-sha512");
         auto h = monocypher::hash<monocypher::SHA512>::createMAC(in, key);
         return reinterpret_cast<sha512256&>(h.range<0, 32>());
     }
@@ -74,12 +80,14 @@ namespace snej::shs::impl {
     byte_array<InputSize+16> box(box_key const& key, byte_array<InputSize> const& plaintext) {
         // This hardcodes an all-zeroes nonce, which is only safe because the protocol uses each
         // key only once!
+        SHS_PROFILE_SPAN("box");
         return key.box<InputSize+16>(monocypher::session::nonce(0), plaintext);
     }
 
     template <size_t InputSize>
     optional<byte_array<InputSize-16>> unbox(box_key const& key,
                                              byte_array<InputSize> const& ciphertext) {
+        SHS_PROFILE_SPAN("unbox");
         byte_array<InputSize-16> output;
         if (!key.unbox(monocypher::session::nonce(0), ciphertext, output))
             return nullopt;
@@ -89,10 +97,12 @@ namespace snej::shs::impl {
 
     // Overload `*` for Curve25519 scalar multiplication with Ed25519 keys:
     static inline kx_shared_secret operator* (signing_key const& k, kx_public_key const& pk) {
+        SHS_PROFILE_SPAN("x25519");
         return k.as_key_exchange<monocypher::X25519_Raw>() * pk;
     }
 
     static inline kx_shared_secret operator* (key_exchange const& k, public_key const& pk) {
+        SHS_PROFILE_SPAN("x25519");
         return k * pk.for_key_exchange<monocypher::X25519_Raw>();
     }
 
@@ -100,14 +110,47 @@ namespace snej::shs::impl {
 #pragma mark - COMMON CODE:
 
 
+    static key_exchange newEphemeralKey() {
+        SHS_PROFILE_SPAN("newEphemeralKey");
+        key_exchange::secret_key secret;
+        drbg::randomize(secret.data(), secret.size());
+        return key_exchange(secret);
+    }
+
+
     handshake::handshake(app_id const& appID,
                          signing_key const& signingKey,
                          public_key const& publicKey)
     :_K(appID)
     ,_X(signingKey)
     ,_Xp(publicKey)
-    ,_x()  // randomized
-    ,_xp(_x.get_public_key())
+    ,_x(newEphemeralKey())
+    ,_xp(SHS_PROFILED("x25519-public-key", _x.get_public_key()))
+    { }
+
+
+    handshake::handshake(app_id const& appID,
+                         signing_key const& signingKey,
+                         public_key const& publicKey,
+                         key_exchange const& ephemeralKey)
+    :_K(appID)
+    ,_X(signingKey)
+    ,_Xp(publicKey)
+    ,_x(ephemeralKey)
+    ,_xp(SHS_PROFILED("x25519-public-key", _x.get_public_key()))
+    { }
+
+
+    handshake::handshake(app_id const& appID,
+                         signing_key const& signingKey,
+                         public_key const& publicKey,
+                         key_exchange const& ephemeralKey,
+                         kx_public_key const& ephemeralPublicKey)
+    :_K(appID)
+    ,_X(signingKey)
+    ,_Xp(publicKey)
+    ,_x(ephemeralKey)
+    ,_xp(ephemeralPublicKey)
     { }
 
 
@@ -119,12 +162,41 @@ namespace snej::shs::impl {
 
     // hmac[K](xp) | xp
     ChallengeData handshake::createChallenge() {
-        return hmac(_K, _xp) | _xp;
+        CryptoOpProbe probe(this, "createChallenge");
+        SHS_PROFILE_SPAN("createChallenge");
+        return createChallenge(_K, _xp);
+    }
+
+
+    ChallengeData handshake::createChallenge(app_id const& K, kx_public_key const& xp) {
+        return hmac(K, xp) | xp;
+    }
+
+
+    bool handshake::isValidChallenge(app_id const& K, ChallengeData const& challenge) {
+        auto &challengeHmac   = challenge.range<0,                 sizeof(sha512256)>();
+        auto &challengePubKey = challenge.range<sizeof(sha512256), sizeof(kx_public_key)>();
+        return challengeHmac == hmac(K, challengePubKey);
+    }
+
+
+    // b = hmac[secret](client challenge)
+    key_exchange handshake::cookieEphemeralKey(byte_array<32> const& secret,
+                                               ChallengeData const& clientChallenge)
+    {
+        SHS_PROFILE_SPAN("cookieEphemeralKey");
+        auto h = hmac(secret, clientChallenge);
+        key_exchange::secret_key b;
+        ::memcpy(b.data(), h.data(), b.size());
+        monocypher::wipe(&h, sizeof(h));
+        return key_exchange(b);
     }
 
 
     // hmac[K](yp) | yp
     bool handshake::verifyChallenge(ChallengeData const& challenge) {
+        CryptoOpProbe probe(this, "verifyChallenge");
+        SHS_PROFILE_SPAN("verifyChallenge");
         // Unpack hmac[K](yp) and yp:
         auto &challengeHmac   = challenge.range<0,                 sizeof(sha512256)>();
         auto &challengePubKey = challenge.range<sizeof(sha512256), sizeof(kx_public_key)>();
@@ -133,7 +205,7 @@ namespace snej::shs::impl {
             return false;
         // Now we know yp, the peer's ephemeral public key:
         _yp = kx_public_key(challengePubKey);
-        _ab = _x * *_yp;
+        _ab = SHS_PROFILED("x25519", _x * *_yp);
         _hashab = hash(*_ab);
         return true;
     }
@@ -145,6 +217,8 @@ namespace snej::shs::impl {
                                nonce       & decryptionNonce,
                                public_key  & peerPublicKey)
     {
+        CryptoOpProbe probe(this, "getOutcome");
+        SHS_PROFILE_SPAN("getOutcome");
         auto boxKeyHash = hash(_serverAckKey.value());
         // hash(hash(hash(K | a_s * b_p | a_s * B_p | A_s * b_p)) | Y_p):
         encryptionKey = session_key(hash(boxKeyHash | _Yp.value()));
@@ -189,9 +263,11 @@ namespace snej::shs::impl {
 
     // box[K | a·b | a·B](H)
     ClientAuthData handshake::createClientAuth() {
+        CryptoOpProbe probe(this, "createClientAuth");
+        SHS_PROFILE_SPAN("createClientAuth");
         WITH_CLIENT_VARS
         // Compute H = sign[A](K | Bp | hash(a·b)) | Ap
-        _H = A.sign(_K | Bp | _hashab.value()) | Ap;
+        _H = SHS_PROFILED("ed25519-sign", A.sign(_K | Bp | _hashab.value())) | Ap;
         // Return box[K | a·b | a·B](H)
         _Ab = A * bp;
         _aB = a * Bp;
@@ -202,11 +278,14 @@ namespace snej::shs::impl {
 
     // ack = box[K | a·b | a·B | A·b](sign[B](K | H | hash(a·b)))
     bool handshake::verifyServerAck(ServerAckData const& ack) {
+        CryptoOpProbe probe(this, "verifyServerAck");
+        SHS_PROFILE_SPAN("verifyServerAck");
         WITH_CLIENT_VARS
         // Unbox, producing the signature.
         // Then verify it's the true signature of K | H | hash(a·b).
         if (auto sig = unbox(serverAckKey(), ack))
-            return Bp.check((signature&)*sig, (_K | _H.value() | _hashab.value()));
+            return SHS_PROFILED("ed25519-check",
+                                Bp.check((signature&)*sig, (_K | _H.value() | _hashab.value())));
         else
             return false;
     }
@@ -225,7 +304,9 @@ namespace snej::shs::impl {
 
 
     // auth = box[K | a·b | a·B](H)   ... where H = sign[A](K | Bp | hash(a·b)) | Ap
-    bool handshake::verifyClientAuth(ClientAuthData const& auth) {
+    bool handshake::verifyClientAuth(ClientAuthData const& auth, key_filter const& preAuthorize) {
+        CryptoOpProbe probe(this, "verifyClientAuth");
+        SHS_PROFILE_SPAN("verifyClientAuth");
         WITH_SERVER_VARS
         _aB = B * ap;           // because a·Bp == ap·B == B·ap
         _H = unbox(clientAuthKey(), auth);
@@ -235,16 +316,63 @@ namespace snej::shs::impl {
         // Split H into `Ap` and `sign[A](K | Bp | hash(a·b))`
         auto &sig = (signature&)_H->range<0,sizeof(signature)>();
         Ap = public_key(_H->range<sizeof(signature), sizeof(public_key)>());
+        // Ap isn't authenticated yet, but rejecting it now saves the costliest work below:
+        if (preAuthorize && !preAuthorize(*Ap))
+            return false;
         _Ab = b * *Ap;           // because A·bp == Ap·b == b·Ap
         // Verify the signature:
-        return Ap->check(sig, _K | Bp | _hashab.value());
+        return SHS_PROFILED("ed25519-check", Ap->check(sig, _K | Bp | _hashab.value()));
     }
 
 
     // box[K | a·b | a·B | A·b](sign[B](K | H | hash(a·b)))
     ServerAckData handshake::createServerAck() {
+        CryptoOpProbe probe(this, "createServerAck");
+        SHS_PROFILE_SPAN("createServerAck");
         WITH_SERVER_VARS
-        return box(serverAckKey(), B.sign(_K | _H.value() | _hashab.value()));
+        return box(serverAckKey(),
+                   SHS_PROFILED("ed25519-sign", B.sign(_K | _H.value() | _hashab.value())));
+    }
+
+
+
+#pragma mark - CHALLENGE MATCHER:
+
+
+    challenge_matcher::challenge_matcher(app_id const& K) {
+        // HMAC(K, m) = H((K ^ opad) | H((K ^ ipad) | m)), where K is zero-padded to 128 bytes.
+        uint8_t pad[128];
+        auto start = [&](monocypher::c::crypto_sha512_ctx &ctx, uint8_t padByte) {
+            ::memset(pad, padByte, sizeof(pad));
+            for (size_t i = 0; i < K.size(); ++i)
+                pad[i] ^= K[i];
+            monocypher::c::crypto_sha512_init(&ctx);
+            monocypher::c::crypto_sha512_update(&ctx, pad, sizeof(pad));
+        };
+        start(_inner, 0x36);
+        start(_outer, 0x5c);
+        monocypher::wipe(pad, sizeof(pad));
+    }
+
+
+    challenge_matcher::~challenge_matcher() {
+        monocypher::wipe(&_inner, sizeof(_inner));
+        monocypher::wipe(&_outer, sizeof(_outer));
+    }
+
+
+    bool challenge_matcher::matches(ChallengeData const& challenge) const {
+        auto &challengeHmac   = challenge.range<0,                 sizeof(sha512256)>();
+        auto &challengePubKey = challenge.range<sizeof(sha512256), sizeof(kx_public_key)>();
+        uint8_t digest[64];
+        auto ctx = _inner;
+        monocypher::c::crypto_sha512_update(&ctx, challengePubKey.data(), challengePubKey.size());
+        monocypher::c::crypto_sha512_final(&ctx, digest);
+        ctx = _outer;
+        monocypher::c::crypto_sha512_update(&ctx, digest, sizeof(digest));
+        monocypher::c::crypto_sha512_final(&ctx, digest);
+        // (HMAC-SHA-512-256 is just the first 256 bits of HMAC-SHA-512.)
+        return ::memcmp(digest, challengeHmac.data(), sizeof(sha512256)) == 0;
     }
 
 }
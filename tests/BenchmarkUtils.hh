@@ -0,0 +1,246 @@
+//
+// BenchmarkUtils.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include "SecretHandshake.hh"
+#include "SecretStream.hh"
+#include "SecretProfiler.hh"
+#include "monocypher/base.hh"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+// Utilities shared by the benchmark test cases.
+
+namespace snej::shs::bench {
+    using namespace std;
+
+    /// Simple wall-clock stopwatch.
+    class Stopwatch {
+    public:
+        Stopwatch()                 :_start(clock::now()) { }
+        double elapsed() const      {return chrono::duration<double>(clock::now() - _start).count();}
+    private:
+        using clock = chrono::steady_clock;
+        clock::time_point _start;
+    };
+
+
+    /// A pair of Sessions whose keys & nonces match up, as though from a handshake.
+    struct BenchSessions {
+        Session session1, session2;
+
+        BenchSessions() {
+            monocypher::randomize(session1.encryptionKey.data(), 32);
+            monocypher::randomize(session1.encryptionNonce.data(), 24);
+            monocypher::randomize(session1.decryptionKey.data(), 32);
+            monocypher::randomize(session1.decryptionNonce.data(), 24);
+            session2.encryptionKey   = session1.decryptionKey;
+            session2.encryptionNonce = session1.decryptionNonce;
+            session2.decryptionKey   = session1.encryptionKey;
+            session2.decryptionNonce = session1.encryptionNonce;
+        }
+    };
+
+
+    inline const char* protocolName(CryptoBox::Protocol p) {
+        switch (p) {
+            case CryptoBox::Compact:    return "Compact";
+            case CryptoBox::BoxStream:  return "BoxStream";
+            case CryptoBox::AES256GCM:  return "AES256GCM";
+            case CryptoBox::MACOnly:    return "MACOnly";
+            case CryptoBox::Compressed: return "Compressed";
+        }
+        return "?";
+    }
+
+
+    /// Returns `size` bytes of JSON-like text: records with repetitive keys but varying values,
+    /// typical of RPC traffic. It's generated from a fixed seed, so it's the same every time.
+    inline string jsonCorpus(size_t size) {
+        static constexpr const char* kNames[] = {"alice", "bob", "carol", "dave", "erin",
+                                                 "frank", "grace", "heidi"};
+        static constexpr const char* kStates[] = {"pending", "active", "suspended", "closed"};
+        mt19937 rng(1234);
+        string text = "[";
+        for (int id = 1; text.size() < size; ++id) {
+            text += "{\"id\":" + to_string(id)
+                 +  ",\"user\":\"" + kNames[rng() % 8] + to_string(rng() % 1000) + "\""
+                 +  ",\"status\":\"" + kStates[rng() % 4] + "\""
+                 +  ",\"balance\":" + to_string(rng() % 100000) + "." + to_string(rng() % 100)
+                 +  ",\"tags\":[\"" + kNames[rng() % 8] + "\",\"" + kStates[rng() % 4] + "\"]"
+                 +  ",\"updated\":\"2024-0" + to_string(1 + rng() % 9) + "-1"
+                 +  to_string(rng() % 10) + "T12:" + to_string(10 + rng() % 50) + ":00Z\"},\n";
+        }
+        text.resize(size);
+        return text;
+    }
+
+
+    /// Returns a connected pair of TCP sockets over the loopback interface.
+    inline pair<int,int> loopbackSockets() {
+        int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+        REQUIRE(listener >= 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addrLen = sizeof(addr);
+        REQUIRE(::bind(listener, (sockaddr*)&addr, addrLen) == 0);
+        REQUIRE(::listen(listener, 1) == 0);
+        REQUIRE(::getsockname(listener, (sockaddr*)&addr, &addrLen) == 0);
+        int client = ::socket(AF_INET, SOCK_STREAM, 0);
+        REQUIRE(::connect(client, (sockaddr*)&addr, addrLen) == 0);
+        int server = ::accept(listener, nullptr, nullptr);
+        REQUIRE(server >= 0);
+        ::close(listener);
+        return {client, server};
+    }
+
+
+    /// Writes all the data to a socket. (Doesn't use REQUIRE, since Catch isn't thread-safe.)
+    inline bool writeAll(int fd, const void *data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n <= 0)
+                return false;
+            data = (const uint8_t*)data + n;
+            size -= n;
+        }
+        return true;
+    }
+
+
+    /// If the library was built with SHS_PROFILE, prints the profiler's summary table, writes its
+    /// spans as a Chrome trace file `<name>.json` in the current directory, and resets it.
+    inline void dumpProfile(const char *name) {
+        if (!Profiler::available())
+            return;
+        cerr << "Profile of " << name << ":\n" << Profiler::summaryTable();
+        string path = string(name) + ".json";
+        ofstream(path) << Profiler::chromeTraceJSON();
+        cerr << "Wrote trace to " << path << endl;
+        Profiler::reset();
+    }
+
+
+    /// Runs a handshake between two Handshake objects in memory, returning true if it succeeds.
+    /// (Doesn't use REQUIRE, since Catch isn't thread-safe.)
+    inline bool runHandshake(Handshake &client, Handshake &server) {
+        Handshake *src = &client, *dst = &server;
+        uint8_t buf[256];
+        for (int turns = 0; turns < 4; ++turns) {
+            intptr_t n = src->copyBytesToSend(buf, sizeof(buf));
+            if (n <= 0 || dst->receivedBytes(buf, n) != n)
+                return false;
+            swap(src, dst);
+        }
+        return client.finished() && server.finished();
+    }
+
+
+    /// Sends `totalBytes` over a loopback TCP connection through an EncryptionStream, with
+    /// another thread reading and decrypting, and returns the throughput in MB/sec.
+    inline double loopbackThroughput(CryptoBox::Protocol protocol, size_t chunkSize, size_t totalBytes) {
+        BenchSessions s;
+        auto [sender, receiver] = loopbackSockets();
+
+        Stopwatch st;
+        thread reader([&, receiver = receiver] {
+            DecryptionStream dec(s.session2, protocol);
+            vector<uint8_t> buf(65536);
+            size_t received = 0;
+            while (received < totalBytes) {
+                ssize_t n = ::read(receiver, buf.data(), buf.size());
+                if (n <= 0 || !dec.push(buf.data(), n))
+                    break;
+                while (size_t pulled = dec.pull(buf.data(), buf.size()))
+                    received += pulled;
+            }
+        });
+
+        EncryptionStream enc(s.session1, protocol);
+        vector<uint8_t> chunk(chunkSize, 'x');
+        for (size_t sent = 0; sent < totalBytes; sent += chunkSize) {
+            enc.push(chunk.data(), chunk.size());
+            auto cipher = enc.availableData();
+            REQUIRE(writeAll(sender, cipher.data, cipher.size));
+            enc.skip(cipher.size);
+        }
+        reader.join();
+        double mbps = totalBytes / 1.0e6 / st.elapsed();
+        ::close(sender);
+        ::close(receiver);
+        return mbps;
+    }
+
+
+    /// Measures the average round-trip time, in microseconds, of sending a `messageSize`-byte
+    /// message over a loopback TCP connection through an EncryptionStream, and having another
+    /// thread decrypt it and send it back.
+    inline double loopbackLatency(CryptoBox::Protocol protocol, size_t messageSize, int count) {
+        BenchSessions s;
+        auto [client, server] = loopbackSockets();
+
+        // Reads one message from `fd` and returns its plaintext:
+        auto receive = [](int fd, DecryptionStream &dec, vector<uint8_t> &buf, size_t size) {
+            size_t got = 0;
+            while (got < size) {
+                if (dec.bytesAvailable() == 0) {
+                    uint8_t cipher[4096];
+                    ssize_t n = ::read(fd, cipher, sizeof(cipher));
+                    if (n <= 0 || !dec.push(cipher, n))
+                        return false;
+                }
+                got += dec.pull(&buf[got], size - got);
+            }
+            return true;
+        };
+
+        thread echo([&, server = server] {
+            EncryptionStream enc(s.session2, protocol);
+            DecryptionStream dec(s.session2, protocol);
+            vector<uint8_t> buf(messageSize);
+            for (int i = 0; i < count; ++i) {
+                if (!receive(server, dec, buf, messageSize))
+                    break;
+                enc.push(buf.data(), buf.size());
+                auto cipher = enc.availableData();
+                if (!writeAll(server, cipher.data, cipher.size))
+                    break;
+                enc.skip(cipher.size);
+            }
+        });
+
+        EncryptionStream enc(s.session1, protocol);
+        DecryptionStream dec(s.session1, protocol);
+        vector<uint8_t> buf(messageSize, 'x');
+        Stopwatch st;
+        for (int i = 0; i < count; ++i) {
+            enc.push(buf.data(), buf.size());
+            auto cipher = enc.availableData();
+            REQUIRE(writeAll(client, cipher.data, cipher.size));
+            enc.skip(cipher.size);
+            REQUIRE(receive(client, dec, buf, messageSize));
+        }
+        double usec = st.elapsed() * 1.0e6 / count;
+        echo.join();
+        ::close(client);
+        ::close(server);
+        return usec;
+    }
+
+}
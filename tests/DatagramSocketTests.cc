@@ -0,0 +1,147 @@
+//
+// DatagramSocketTests.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+
+// (This file is only built on Linux.)
+
+#include "DatagramSocket.hh"
+#include "BenchmarkUtils.hh"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <set>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+using namespace std;
+using namespace snej::shs;
+using namespace snej::shs::bench;
+
+
+namespace {
+
+    /// Sits between two datagram socketpairs, forwarding datagrams from one to the other while
+    /// dropping, duplicating and reordering some of them.
+    class LossyShim {
+    public:
+        LossyShim(int inFD, int outFD)      :_in(inFD), _out(outFD) { }
+
+        /// Reads all the datagrams waiting on the input socket, and forwards them, more or less.
+        /// After each datagram it sends, it calls `afterSend` so the receiver can keep up.
+        template <class FN>
+        void forward(FN afterSend) {
+            uint8_t buf[2048];
+            ssize_t n;
+            while ((n = ::recv(_in, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+                _held.emplace_back(buf, buf + n);
+            shuffle(_held.begin(), _held.end(), _rng);
+            // Keep a few for later, so they arrive after newer ones:
+            size_t keep = min(_held.size(), size_t(_rng() % 4));
+            for (size_t i = keep; i < _held.size(); ++i) {
+                unsigned dice = _rng() % 20;
+                if (dice == 0) {
+                    ++dropped;
+                    continue;
+                }
+                int copies = (dice == 1) ? 2 : 1;
+                for (int c = 0; c < copies; ++c) {
+                    REQUIRE(::send(_out, _held[i].data(), _held[i].size(), 0) == ssize_t(_held[i].size()));
+                    afterSend();
+                }
+            }
+            _held.resize(keep);
+        }
+
+        size_t dropped = 0;
+
+    private:
+        int _in, _out;
+        vector<vector<uint8_t>> _held;
+        mt19937 _rng {9876};
+    };
+
+}
+
+
+TEST_CASE("DatagramSocket over lossy link", "[SecretHandshake]") {
+    BenchSessions sessions;
+    int senderFDs[2], receiverFDs[2];
+    REQUIRE(::socketpair(AF_UNIX, SOCK_DGRAM, 0, senderFDs) == 0);
+    REQUIRE(::socketpair(AF_UNIX, SOCK_DGRAM, 0, receiverFDs) == 0);
+    REQUIRE(::fcntl(receiverFDs[1], F_SETFL, O_NONBLOCK) == 0);
+
+    DatagramSocket sender(senderFDs[0], sessions.session1);
+    DatagramSocket receiver(receiverFDs[1], sessions.session2);
+    LossyShim shim(senderFDs[1], receiverFDs[0]);
+
+    set<uint64_t> received;
+    size_t duplicates = 0;
+    auto receive = [&] {
+        char payloads[4][DatagramSocket::kDefaultMaxPayload];
+        output_buffer buffers[4];
+        uint64_t sequences[4];
+        for (int i = 0; i < 4; ++i)
+            buffers[i] = {payloads[i], sizeof(payloads[i])};
+        size_t n = receiver.receive(buffers, 4, sequences);
+        for (size_t i = 0; i < n; ++i) {
+            CHECK(string(payloads[i], buffers[i].size) == "Datagram #" + to_string(sequences[i]));
+            if (!received.insert(sequences[i]).second)
+                ++duplicates;
+        }
+    };
+
+    // Send in batches of 8, which is less than the socketpair's default queue length:
+    static constexpr size_t kBatches = 200, kBatchSize = 8;
+    for (size_t batch = 0; batch < kBatches; ++batch) {
+        string payloads[kBatchSize];
+        input_data inputs[kBatchSize];
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            payloads[i] = "Datagram #" + to_string(batch * kBatchSize + i);
+            inputs[i] = {payloads[i].data(), payloads[i].size()};
+        }
+        REQUIRE(sender.send(inputs, kBatchSize) == kBatchSize);
+        shim.forward(receive);
+    }
+    receive();
+
+    size_t total = kBatches * kBatchSize;
+    cerr << "Sent " << total << ", shim dropped " << shim.dropped << ", received "
+         << received.size() << ", receiver dropped " << receiver.droppedCount() << endl;
+    CHECK(duplicates == 0);
+    CHECK(shim.dropped > 0);
+    CHECK(receiver.droppedCount() > 0);         // the duplicates
+    // Everything the shim didn't drop arrived, except up to 3 it's still holding:
+    CHECK(received.size() + shim.dropped <= total);
+    CHECK(received.size() + shim.dropped >= total - 3);
+    CHECK(*received.rbegin() < total);
+
+    ::close(senderFDs[1]);
+    ::close(receiverFDs[0]);
+}
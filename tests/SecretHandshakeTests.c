@@ -18,11 +18,18 @@
 
 #include "SecretHandshake.h"
 #include "SecretStream.h"
+#include "SecretMetrics.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
 bool test_C_Handshake(void);
 bool test_C_HandshakeWrongServerKey(void);
+bool test_C_Metrics(void);
+bool test_C_Streams(void);
+bool test_C_BatchedCrypto(void);
+void bench_C_BatchedCrypto(void);
 
 
 static bool sTestResult;
@@ -72,6 +79,23 @@ static bool sendFromTo(SHSHandshake *src, SHSHandshake *dst, size_t expectedCoun
 }
 
 
+// Runs a handshake between a new client and server, returning their sessions.
+static bool getSessions(SHSSession *clientSession, SHSSession *serverSession) {
+    HandshakeTest test;
+    initHandshakeTest(&test);
+    bool ok = sendFromTo(test.client, test.server,  64)
+           && sendFromTo(test.server, test.client,  64)
+           && sendFromTo(test.client, test.server, 112)
+           && sendFromTo(test.server, test.client,  80);
+    if (ok) {
+        *clientSession = SHSHandshake_GetSession(test.client);
+        *serverSession = SHSHandshake_GetSession(test.server);
+    }
+    freeHandshakeTest(&test);
+    return ok;
+}
+
+
 bool test_C_Handshake(void) {
     sTestResult = true;
     HandshakeTest test;
@@ -96,6 +120,8 @@ bool test_C_Handshake(void) {
 
     CHECK(EqualStructs(serverSession.peerPublicKey   , test.clientKey.publicKey));
     CHECK(EqualStructs(clientSession.peerPublicKey   , test.serverKey.publicKey));
+    CHECK(EqualStructs(serverSession.appID           , test.appID));
+    CHECK(EqualStructs(clientSession.appID           , test.appID));
 
     SHSSession_Erase(&serverSession);
     SHSSession_Erase(&clientSession);
@@ -124,3 +150,259 @@ bool test_C_HandshakeWrongServerKey(void) {
     freeHandshakeTest(&test);
     return sTestResult;
 }
+
+
+bool test_C_Metrics(void) {
+    sTestResult = true;
+    SHSMetrics_SetEnabled(true);
+    SHSMetrics_Reset();
+    HandshakeTest test;
+    initHandshakeTest(&test);
+    REQUIRE(sendFromTo(test.client, test.server,  64));
+    REQUIRE(sendFromTo(test.server, test.client,  64));
+    REQUIRE(sendFromTo(test.client, test.server, 112));
+    REQUIRE(sendFromTo(test.server, test.client,  80));
+    freeHandshakeTest(&test);
+    SHSMetrics_SetEnabled(false);
+
+    SHSMetrics metrics;
+    SHSMetrics_GetSnapshot(&metrics);
+    CHECK(metrics.handshakesStarted == 2);
+    CHECK(metrics.handshakesSucceeded == 2);
+    CHECK(metrics.handshakeLatency.count == 2);
+
+    char text[100];
+    size_t len = SHSMetrics_WritePrometheusText(&metrics, text, sizeof(text));
+    CHECK(len > sizeof(text));
+    CHECK(strlen(text) == sizeof(text) - 1);
+    CHECK(strncmp(text, "# HELP shs_handshakes_started_total", 35) == 0);
+    return sTestResult;
+}
+
+
+bool test_C_Streams(void) {
+    sTestResult = true;
+    SHSSession clientSession, serverSession;
+    REQUIRE(getSessions(&clientSession, &serverSession));
+
+    SHSEncryptionStream *enc = SHSEncryptionStream_Create(&clientSession, Compact);
+    SHSDecryptionStream *dec = SHSDecryptionStream_Create(&serverSession, Compact);
+
+    // Copying API:
+    SHSEncryptionStream_Push(enc, "Hello, ", 7);
+    SHSEncryptionStream_PushPartial(enc, "world", 5);
+    SHSEncryptionStream_PushPartial(enc, "!", 1);
+    CHECK(SHSEncryptionStream_BytesAvailable(enc) == 7 + 18);
+    SHSEncryptionStream_Flush(enc);
+    CHECK(SHSEncryptionStream_BytesAvailable(enc) == 7 + 18 + 6 + 18);
+    char cipher[200];
+    size_t cipherSize = SHSEncryptionStream_Pull(enc, cipher, sizeof(cipher));
+    CHECK(cipherSize == 7 + 18 + 6 + 18);
+    CHECK(SHSEncryptionStream_BytesAvailable(enc) == 0);
+
+    CHECK(SHSDecryptionStream_Push(dec, cipher, 10));
+    CHECK(SHSDecryptionStream_BytesAvailable(dec) == 0);
+    CHECK(SHSDecryptionStream_Push(dec, cipher + 10, cipherSize - 10));
+    char plain[100];
+    size_t plainSize = SHSDecryptionStream_Pull(dec, plain, sizeof(plain));
+    CHECK(plainSize == 13);
+    CHECK(memcmp(plain, "Hello, world!", 13) == 0);
+
+    // Zero-copy API: write cleartext into the encryptor's buffer, and ciphertext into the
+    // decryptor's buffer (as though reading from a socket), then read the results in place:
+    SHSOutputBuffer space = SHSEncryptionStream_Reserve(enc, 100);
+    CHECK(space.size == 100);
+    memcpy(space.dst, "Zero copy", 9);
+    SHSEncryptionStream_Commit(enc, 9);
+    SHSEncryptionStream_Flush(enc);
+    SHSInputBuffer ciphertext = SHSEncryptionStream_AvailableData(enc);
+    CHECK(ciphertext.size == 9 + 18);
+
+    SHSOutputBuffer socketSpace = SHSDecryptionStream_Reserve(dec, 4096);
+    CHECK(socketSpace.size == 4096);
+    memcpy(socketSpace.dst, ciphertext.src, ciphertext.size);
+    CHECK(SHSDecryptionStream_Commit(dec, ciphertext.size));
+    CHECK(SHSEncryptionStream_Skip(enc, ciphertext.size) == 9 + 18);
+
+    SHSInputBuffer cleartext = SHSDecryptionStream_AvailableData(dec);
+    CHECK(cleartext.size == 9);
+    CHECK(memcmp(cleartext.src, "Zero copy", 9) == 0);
+    CHECK(SHSDecryptionStream_Skip(dec, 100) == 9);
+    CHECK(SHSDecryptionStream_BytesAvailable(dec) == 0);
+    CHECK(SHSDecryptionStream_Close(dec));
+
+    // Corrupt data:
+    SHSEncryptionStream_Push(enc, "tampered", 8);
+    cipherSize = SHSEncryptionStream_Pull(enc, cipher, sizeof(cipher));
+    cipher[cipherSize - 1] ^= 1;
+    socketSpace = SHSDecryptionStream_Reserve(dec, cipherSize);
+    memcpy(socketSpace.dst, cipher, cipherSize);
+    CHECK(!SHSDecryptionStream_Commit(dec, cipherSize));
+
+    SHSEncryptionStream_Free(enc);
+    SHSDecryptionStream_Free(dec);
+    SHSSession_Erase(&serverSession);
+    SHSSession_Erase(&clientSession);
+    return sTestResult;
+}
+
+
+bool test_C_BatchedCrypto(void) {
+    sTestResult = true;
+    SHSSession clientSession, serverSession;
+    REQUIRE(getSessions(&clientSession, &serverSession));
+    SHSEncryptoBox *enc = SHSEncryptoBox_Create(&clientSession, Compact);
+    SHSDecryptoBox *dec = SHSDecryptoBox_Create(&serverSession, Compact);
+
+    static const char* const kWords[5] = {"one", "two", "three", "four", "five"};
+    SHSInputBuffer messages[5];
+    for (int i = 0; i < 5; i++) {
+        messages[i].src = kWords[i];
+        messages[i].size = strlen(kWords[i]);
+    }
+
+    // Encrypt into a buffer that only has room for the first three frames:
+    char cipher[200];
+    SHSBatchResult results[6];
+    SHSOutputBuffer out = {cipher, 3 * 18 + 3 + 3 + 5};
+    size_t n = SHSEncryptoBox_EncryptMany(enc, messages, 5, &out, results);
+    CHECK(n == 3);
+    CHECK(out.size == 3 * 18 + 3 + 3 + 5);
+    CHECK(results[0].status == Success);
+    CHECK(results[0].data.src == cipher);
+    CHECK(results[0].data.size == 18 + 3);
+    CHECK(results[2].status == Success);
+    CHECK(results[2].data.src == cipher + 2 * 18 + 6);
+    CHECK(results[3].status == OutTooSmall);
+    size_t cipherSize = out.size;
+
+    // Encrypt the rest:
+    out.dst = cipher + cipherSize;
+    out.size = sizeof(cipher) - cipherSize;
+    n = SHSEncryptoBox_EncryptMany(enc, messages + 3, 2, &out, NULL);
+    CHECK(n == 2);
+    cipherSize += out.size;
+    CHECK(cipherSize == 5 * 18 + 3 + 3 + 5 + 4 + 4);
+
+    // Decrypt, with the input ending partway through the fourth frame:
+    char plain[100];
+    SHSInputBuffer in = {cipher, cipherSize - 25};
+    out.dst = plain;
+    out.size = sizeof(plain);
+    n = SHSDecryptoBox_DecryptAll(dec, &in, &out, results, 6);
+    CHECK(n == 3);
+    CHECK(out.size == 3 + 3 + 5);
+    CHECK(results[3].status == IncompleteInput);
+    CHECK(in.src == cipher + 3 * 18 + 3 + 3 + 5);
+    for (size_t i = 0; i < n; i++) {
+        CHECK(results[i].status == Success);
+        CHECK(results[i].data.size == messages[i].size);
+        CHECK(memcmp(results[i].data.src, messages[i].src, messages[i].size) == 0);
+    }
+
+    // Now the rest, but with an output buffer too small for the last message:
+    in.size = cipher + cipherSize - (char*)in.src;
+    out.size = 4 + 3;
+    n = SHSDecryptoBox_DecryptAll(dec, &in, &out, results, 6);
+    CHECK(n == 1);
+    CHECK(out.size == 4);
+    CHECK(results[0].data.size == 4);
+    CHECK(memcmp(results[0].data.src, "four", 4) == 0);
+    CHECK(results[1].status == OutTooSmall);
+    CHECK(in.size == 18 + 4);
+
+    // Corrupt the last message:
+    ((char*)in.src)[in.size - 1] ^= 1;
+    out.size = sizeof(plain);
+    n = SHSDecryptoBox_DecryptAll(dec, &in, &out, results, 6);
+    CHECK(n == 0);
+    CHECK(out.size == 0);
+    CHECK(results[0].status == CorruptData);
+    CHECK(in.size == 18 + 4);
+
+    SHSEncryptoBox_Free(enc);
+    SHSDecryptoBox_Free(dec);
+    SHSSession_Erase(&serverSession);
+    SHSSession_Erase(&clientSession);
+    return sTestResult;
+}
+
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+// Encrypts and decrypts 1MB of small messages, the way a language binding would: either one
+// call per message, or one call per batch. Reports the calls made per MB and the throughput.
+void bench_C_BatchedCrypto(void) {
+    enum {kTotalSize = 1 << 20, kCipherCapacity = 3 * kTotalSize, kBatchSize = 64};
+    static const size_t kSizes[] = {16, 64, 256, 1024};
+    SHSSession clientSession, serverSession;
+    if (!getSessions(&clientSession, &serverSession))
+        return;
+    uint8_t *cleartext = calloc(kTotalSize, 1);
+    uint8_t *ciphertext = malloc(kCipherCapacity);
+    uint8_t *decrypted = malloc(kTotalSize);
+    SHSInputBuffer *messages = malloc(kTotalSize / 16 * sizeof(SHSInputBuffer));
+    SHSBatchResult results[kBatchSize];
+
+    for (int batched = 0; batched <= 1; batched++) {
+        for (size_t s = 0; s < sizeof(kSizes) / sizeof(kSizes[0]); s++) {
+            size_t msgSize = kSizes[s], count = kTotalSize / msgSize;
+            for (size_t i = 0; i < count; i++) {
+                messages[i].src = cleartext + i * msgSize;
+                messages[i].size = msgSize;
+            }
+            SHSEncryptoBox *enc = SHSEncryptoBox_Create(&clientSession, Compact);
+            SHSDecryptoBox *dec = SHSDecryptoBox_Create(&serverSession, Compact);
+            size_t calls = 0, cipherSize = 0, plainSize = 0;
+            double start = now();
+
+            for (size_t i = 0; i < count; ) {
+                SHSOutputBuffer out = {ciphertext + cipherSize, kCipherCapacity - cipherSize};
+                if (batched) {
+                    size_t n = count - i < kBatchSize ? count - i : kBatchSize;
+                    n = SHSEncryptoBox_EncryptMany(enc, messages + i, n, &out, results);
+                    if (n == 0)
+                        break;
+                    i += n;
+                } else {
+                    if (SHSEncryptoBox_Encrypt(enc, messages[i], &out) != Success)
+                        break;
+                    i++;
+                }
+                cipherSize += out.size;
+                calls++;
+            }
+            SHSInputBuffer in = {ciphertext, cipherSize};
+            while (in.size > 0) {
+                SHSOutputBuffer out = {decrypted + plainSize, kTotalSize - plainSize};
+                if (batched) {
+                    if (SHSDecryptoBox_DecryptAll(dec, &in, &out, results, kBatchSize) == 0)
+                        break;
+                } else if (SHSDecryptoBox_Decrypt(dec, &in, &out) != Success) {
+                    break;
+                }
+                plainSize += out.size;
+                calls++;
+            }
+
+            double elapsed = now() - start;
+            fprintf(stderr, "  %-8s %5zu-byte messages: %7zu calls/MB, %8.1f MB/sec%s\n",
+                    (batched ? "batched" : "single"), msgSize, calls,
+                    2.0 * kTotalSize / elapsed / 1.0e6,
+                    (plainSize == count * msgSize ? "" : "  (FAILED)"));
+            SHSEncryptoBox_Free(enc);
+            SHSDecryptoBox_Free(dec);
+        }
+    }
+
+    free(messages);
+    free(decrypted);
+    free(ciphertext);
+    free(cleartext);
+    SHSSession_Erase(&serverSession);
+    SHSSession_Erase(&clientSession);
+}
@@ -25,10 +25,29 @@
 //
 
 #include "SecretHandshake.hh"
+#include "AuthorizedKeySet.hh"
 #include "SecretStream.hh"
+#include "SecretDatagram.hh"
+#include "SealedMessage.hh"
+#include "ResumableStream.hh"
+#include "SecretMetrics.hh"
+#include "SecretProfiler.hh"
+#include "SecretHandshake_Internal.hh"    // for SHS_MIN_LOG_LEVEL
+#include "AsyncLogSink.hh"
+#include "BenchmarkUtils.hh"
+#include "ByteRing.hh"
+#include "compression.hh"
 #include "monocypher/base.hh"
 #include "hexString.hh"
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include "catch.hpp"
 
@@ -130,6 +149,152 @@ TEST_CASE_METHOD(HandshakeTest, "Handshake with wrong server key", "[SecretHands
 }
 
 
+
+TEST_CASE_METHOD(HandshakeTest, "Handshake with client pre-authorizer", "[SecretHandshake]") {
+    bool authorized = GENERATE(false, true);
+    std::vector<PublicKey> keys {KeyPair::generate().publicKey};
+    if (authorized)
+        keys.push_back(clientKey.publicKey);
+    AuthorizedKeySet keySet(keys);
+    int preAuthCalls = 0, authCalls = 0;
+    server.setClientPreAuthorizer([&](PublicKey const& key) {
+        ++preAuthCalls;
+        return keySet.contains(key);
+    });
+    server.setClientAuthorizer([&](PublicKey const& key) {
+        ++authCalls;
+        return true;
+    });
+
+    CHECK(sendFromTo(client, server,  64));
+    CHECK(sendFromTo(server, client,  64));
+    CHECK(sendFromTo(client, server, 112) == authorized);
+    CHECK(preAuthCalls == 1);
+    if (authorized) {
+        // The post-signature authorizer still runs:
+        CHECK(authCalls == 1);
+        CHECK(sendFromTo(server, client,  80));
+        CHECK(server.session().peerPublicKey == clientKey.publicKey);
+    } else {
+        // Rejected before the signature check, so the authorizer is never called:
+        CHECK(authCalls == 0);
+        CHECK(server.error() == Handshake::AuthError);
+    }
+}
+
+
+TEST_CASE_METHOD(HandshakeTest, "Handshake with async authorization", "[SecretHandshake]") {
+    bool allow = GENERATE(false, true);
+    server.setAsyncAuthorization(true);
+    CHECK(sendFromTo(client, server,  64));
+    CHECK(sendFromTo(server, client,  64));
+    CHECK(!server.authorizationPending());
+    CHECK(sendFromTo(client, server, 112));
+
+    // Now the server pauses, with nothing to read or send, until it gets a decision:
+    CHECK(server.authorizationPending());
+    CHECK(server.clientPublicKey() == clientKey.publicKey);
+    CHECK(server.bytesToSend().second == 0);
+    CHECK(server.bytesToRead().second == 0);
+    CHECK(!server.finished());
+    CHECK(!server.error());
+
+    server.resumeAuthorization(allow);
+    CHECK(!server.authorizationPending());
+    if (allow) {
+        CHECK(sendFromTo(server, client,  80));
+        CHECK(server.finished());
+        CHECK(client.finished());
+    } else {
+        CHECK(server.error() == Handshake::AuthError);
+        CHECK(server.bytesToSend().second == 0);
+    }
+    CHECK_THROWS_AS(server.resumeAuthorization(true), std::logic_error);
+}
+
+TEST_CASE_METHOD(HandshakeTest, "Handshake in cookie mode", "[SecretHandshake]") {
+    auto jar = std::make_shared<CookieJar>(Context{"App", serverKey});
+    ServerHandshake cookieServer(jar);
+    int rotations = GENERATE(0, 1, 2);
+
+    // Keep copies of the client's messages:
+    auto challenge = client.bytesToSend();
+    vector<uint8_t> challengeBytes((uint8_t*)challenge.first,
+                                   (uint8_t*)challenge.first + challenge.second);
+    CHECK(sendFromTo(client, cookieServer,  64));
+    CHECK(sendFromTo(cookieServer, client,  64));
+    auto auth = client.bytesToSend();
+    vector<uint8_t> authBytes((uint8_t*)auth.first, (uint8_t*)auth.first + auth.second);
+
+    // The secret may rotate once during the handshake, but not twice:
+    for (int i = 0; i < rotations; ++i)
+        jar->rotate();
+    if (rotations == 2) {
+        CHECK(!sendFromTo(client, cookieServer, 112));
+        CHECK(cookieServer.error() == Handshake::AuthError);
+        return;
+    }
+    CHECK(sendFromTo(client, cookieServer, 112));
+    CHECK(sendFromTo(cookieServer, client,  80));
+    REQUIRE(cookieServer.finished());
+    REQUIRE(client.finished());
+
+    Session clientSession = client.session(), serverSession = cookieServer.session();
+    CHECK(clientSession.encryptionKey   == serverSession.decryptionKey);
+    CHECK(clientSession.decryptionKey   == serverSession.encryptionKey);
+    CHECK(serverSession.peerPublicKey   == clientKey.publicKey);
+
+    // Replaying the client's messages produces the same ServerChallenge, but is rejected:
+    ServerHandshake replayServer(jar);
+    CHECK(replayServer.receivedBytes(challengeBytes.data(), challengeBytes.size()) == 64);
+    CHECK(replayServer.bytesToSend().second == 64);
+    replayServer.sendCompleted();
+    CHECK(replayServer.receivedBytes(authBytes.data(), authBytes.size()) == -1);
+    CHECK(replayServer.error() == Handshake::AuthError);
+
+    // A challenge with a different AppID is rejected without further ado:
+    ClientHandshake otherApp({"OtherApp", clientKey}, serverKey.publicKey);
+    ServerHandshake otherServer(jar);
+    CHECK(!sendFromTo(otherApp, otherServer, 64));
+    CHECK(otherServer.error() == Handshake::ProtocolError);
+}
+
+
+TEST_CASE("Multi-tenant handshake", "[SecretHandshake]") {
+    KeyPair clientKey = KeyPair::generate();
+    vector<Context> contexts;
+    for (int i = 0; i < 5; ++i)
+        contexts.emplace_back(("App" + std::to_string(i)).c_str(), KeyPair::generate());
+    auto contextSet = std::make_shared<ContextSet>(contexts);
+    CHECK(contextSet->size() == 5);
+    CHECK_THROWS_AS(contextSet->add(Context("App3", KeyPair::generate())), std::invalid_argument);
+
+    auto handshake = [&](Context const& clientContext, PublicKey const& serverKey) -> bool {
+        HandshakeTest t;
+        ServerHandshake server(contextSet);
+        ClientHandshake client(clientContext, serverKey);
+        if (!t.sendFromTo(client, server, 64)) {
+            CHECK(server.error() == Handshake::ProtocolError);
+            return false;
+        }
+        CHECK(t.sendFromTo(server, client,  64));
+        CHECK(t.sendFromTo(client, server, 112));
+        CHECK(t.sendFromTo(server, client,  80));
+        REQUIRE(server.finished());
+        Session session = server.session();
+        CHECK(session.peerPublicKey == clientKey.publicKey);
+        CHECK(session.appID == clientContext.appID);
+        CHECK(contextSet->find(session.appID)->keyPair.publicKey == serverKey);
+        return true;
+    };
+
+    for (auto &context : contexts)
+        CHECK(handshake(Context(context.appID, clientKey), context.keyPair.publicKey));
+    // Unknown AppID:
+    CHECK(!handshake(Context("App5", clientKey), contexts[0].keyPair.publicKey));
+}
+
+
 extern "C" {
     bool test_C_Handshake(void);
     bool test_C_HandshakeWrongServerKey(void);
@@ -165,7 +330,8 @@ using getSizeResult = std::pair<status_t, size_t>;
 
 
 TEST_CASE_METHOD(SessionTest, "Encrypted Messages", "[SecretHandshake]") {
-    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream);
+    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream, CryptoBox::AES256GCM,
+                             CryptoBox::MACOnly);
     EncryptoBox box1(session1, protocol);
     DecryptoBox box2(session2, protocol);
     cerr << "\t---- protocol=" << int(protocol) << endl;
@@ -229,8 +395,197 @@ TEST_CASE_METHOD(SessionTest, "Encrypted Messages", "[SecretHandshake]") {
 }
 
 
+TEST_CASE_METHOD(SessionTest, "MAC-Only Messages", "[SecretHandshake]") {
+    EncryptoBox box1(session1, CryptoBox::MACOnly);
+    DecryptoBox box2(session2, CryptoBox::MACOnly);
+
+    constexpr const char *kCleartext = "Beware the ides of March. We attack at dawn.";
+    input_data inClear = {kCleartext, strlen(kCleartext)};
+    uint8_t cipherBuf[256] = {};
+    output_buffer outCipher = {cipherBuf, sizeof(cipherBuf)};
+    REQUIRE(box1.encrypt(inClear, outCipher) == Success);
+    CHECK(outCipher.size == 18 + inClear.size);
+    // The message is not encrypted:
+    CHECK(memcmp(&cipherBuf[18], kCleartext, inClear.size) == 0);
+
+    // Tampering with the body, size or MAC is detected:
+    for (size_t i : {size_t(1), size_t(5), size_t(20), outCipher.size - 1}) {
+        uint8_t clearBuf[256];
+        cipherBuf[i] ^= 0x01;
+        input_data inCipher = {cipherBuf, outCipher.size};
+        output_buffer outClear = {clearBuf, sizeof(clearBuf)};
+        CHECK(box2.decrypt(inCipher, outClear) != Success);
+        cipherBuf[i] ^= 0x01;
+    }
+
+    uint8_t clearBuf[256];
+    input_data inCipher = {cipherBuf, outCipher.size};
+    output_buffer outClear = {clearBuf, sizeof(clearBuf)};
+    CHECK(box2.decrypt(inCipher, outClear) == Success);
+    CHECK(outClear.size == inClear.size);
+    CHECK(memcmp(kCleartext, outClear.data, outClear.size) == 0);
+
+    // A replayed message is rejected, since the nonce has moved on:
+    inCipher = {cipherBuf, outCipher.size};
+    outClear = {clearBuf, sizeof(clearBuf)};
+    CHECK(box2.decrypt(inCipher, outClear) == CorruptData);
+}
+
+
+TEST_CASE("LZ4", "[SecretHandshake]") {
+    using namespace snej::shs::impl;
+    mt19937 rng(5678);
+    string random(5000, 0);
+    for (auto &c : random)
+        c = char(rng());
+    vector<string> inputs = {"", "x", "hello world!", "hello world!!", string(1000, 'a'),
+                             "abcabcabcabcabcabcabcabcabcabcabcabcabc", random,
+                             bench::jsonCorpus(20000), bench::jsonCorpus(65535)};
+    for (string const& input : inputs) {
+        auto src = (const uint8_t*)input.data();
+        vector<uint8_t> compressed(input.size() + input.size() / 255 + 16);
+        size_t size = lz4::compress(src, input.size(), compressed.data(), compressed.size());
+        REQUIRE(size > 0);
+        if (input.size() > 10000) {
+            CHECK(size < input.size() / 2);
+        }
+
+        vector<uint8_t> output(input.size());
+        CHECK(lz4::decompress(compressed.data(), size, output.data(), output.size())
+              == intptr_t(input.size()));
+        CHECK(memcmp(output.data(), input.data(), input.size()) == 0);
+        if (input.size() > 0) {
+            // Output too small:
+            CHECK(lz4::decompress(compressed.data(), size, output.data(), output.size() - 1) == -1);
+        }
+        // Truncated input:
+        CHECK(lz4::decompress(compressed.data(), size - 1, output.data(), output.size()) == -1);
+    }
+
+    // Incompressible data doesn't fit in less than its size:
+    vector<uint8_t> compressed(random.size());
+    CHECK(lz4::compress((const uint8_t*)random.data(), random.size(),
+                        compressed.data(), compressed.size() - 16) == 0);
+
+    // Corrupted input never writes out of bounds:
+    string input = bench::jsonCorpus(4000);
+    compressed.resize(input.size());
+    size_t size = lz4::compress((const uint8_t*)input.data(), input.size(),
+                                compressed.data(), compressed.size());
+    REQUIRE(size > 0);
+    for (int i = 0; i < 1000; ++i) {
+        vector<uint8_t> corrupt(compressed.begin(), compressed.begin() + size);
+        corrupt[rng() % size] ^= uint8_t(1 + rng() % 255);
+        vector<uint8_t> output(input.size() + 64, 0xEE);
+        intptr_t n = lz4::decompress(corrupt.data(), size, output.data(), input.size());
+        CHECK(n <= intptr_t(input.size()));
+        CHECK(all_of(output.begin() + input.size(), output.end(), [](uint8_t b) {return b == 0xEE;}));
+    }
+
+    // A match can't reach back before the start of the output:
+    const uint8_t kBadOffset[] = {0x14, 'a', 0x05, 0x00, 0x50, 'a','a','a','a','a'};
+    uint8_t output[100];
+    CHECK(lz4::decompress(kBadOffset, sizeof(kBadOffset), output, sizeof(output)) == -1);
+}
+
+
+TEST_CASE_METHOD(SessionTest, "Compressed Messages", "[SecretHandshake]") {
+    auto codec = GENERATE(CryptoBox::LZ4, CryptoBox::Zstd);
+    if (!CryptoBox::codecAvailable(codec)) {
+        CHECK_THROWS_AS(EncryptoBox(session1, CryptoBox::Compressed).setCodec(codec),
+                        std::invalid_argument);
+        return;
+    }
+    cerr << "\t---- codec=" << int(codec) << endl;
+    EncryptoBox box1(session1, CryptoBox::Compressed);
+    box1.setCodec(codec);
+    DecryptoBox box2(session2, CryptoBox::Compressed);
+    CHECK(box1.maxMessageSize() == 65534);
+
+    auto roundTrip = [&](string const& message) -> size_t {
+        vector<uint8_t> cipher(box1.encryptedSize(message.size()));
+        output_buffer out = {cipher.data(), cipher.size()};
+        REQUIRE(box1.encrypt({message.data(), message.size()}, out) == Success);
+        CHECK(out.size <= box1.encryptedSize(message.size()));
+
+        auto peek = box2.peek({cipher.data(), out.size});
+        CHECK(peek.status == Success);
+        CHECK(peek.encryptedSize == out.size);
+        CHECK(peek.decryptedSize >= message.size());
+
+        vector<uint8_t> clear(message.size() + 10);
+        input_data in = {cipher.data(), out.size};
+        output_buffer clearOut = {clear.data(), message.size() - (message.size() > 0)};
+        if (message.size() > 0) {
+            // Too small an output buffer doesn't consume anything:
+            CHECK(box2.decrypt(in, clearOut) == OutTooSmall);
+            CHECK(in.size == out.size);
+        }
+        clearOut.size = clear.size();
+        REQUIRE(box2.decrypt(in, clearOut) == Success);
+        CHECK(in.size == 0);
+        CHECK(clearOut.size == message.size());
+        CHECK(memcmp(clear.data(), message.data(), message.size()) == 0);
+        return out.size;
+    };
+
+    string json = bench::jsonCorpus(10000);
+    size_t size = roundTrip(json);
+    CHECK(size < json.size() / 2);
+    cerr << "\tCompressed " << json.size() << " bytes of JSON to " << size << endl;
+
+    // Short messages aren't compressed:
+    CHECK(roundTrip("") == box1.encryptedSize(0));
+    CHECK(roundTrip("Hello") == box1.encryptedSize(5));
+
+    // Incompressible data is sent as-is; and so are the next few messages, without trying:
+    string random(10000, 0);
+    monocypher::randomize(random.data(), random.size());
+    CHECK(roundTrip(random) == box1.encryptedSize(random.size()));
+    for (int i = 0; i < 8; ++i)
+        CHECK(roundTrip(json) == box1.encryptedSize(json.size()));
+    CHECK(roundTrip(json) < json.size() / 2);
+
+    // The largest message:
+    string big = bench::jsonCorpus(65534);
+    roundTrip(big);
+    big += "!";
+    output_buffer out = {nullptr, 0};
+    CHECK_THROWS_AS(box1.encrypt({big.data(), big.size()}, out), std::invalid_argument);
+
+    // A message larger than the decompression limit is rejected:
+    box2.setMaxDecompressedSize(9999);
+    vector<uint8_t> cipher(box1.encryptedSize(json.size()));
+    out = {cipher.data(), cipher.size()};
+    REQUIRE(box1.encrypt({json.data(), json.size()}, out) == Success);
+    vector<uint8_t> clear(65536);
+    input_data in = {cipher.data(), out.size};
+    output_buffer clearOut = {clear.data(), clear.size()};
+    CHECK(box2.decrypt(in, clearOut) == CorruptData);
+}
+
+
+TEST_CASE_METHOD(SessionTest, "Compressed Messages Tampering", "[SecretHandshake]") {
+    EncryptoBox box1(session1, CryptoBox::Compressed);
+    DecryptoBox box2(session2, CryptoBox::Compressed);
+    string json = bench::jsonCorpus(1000);
+    vector<uint8_t> cipher(box1.encryptedSize(json.size()));
+    output_buffer out = {cipher.data(), cipher.size()};
+    REQUIRE(box1.encrypt({json.data(), json.size()}, out) == Success);
+    for (size_t i : {size_t(1), size_t(5), size_t(20), out.size - 1}) {
+        vector<uint8_t> clear(65536);
+        cipher[i] ^= 0x01;
+        input_data in = {cipher.data(), out.size};
+        output_buffer clearOut = {clear.data(), clear.size()};
+        CHECK(box2.decrypt(in, clearOut) != Success);
+        cipher[i] ^= 0x01;
+    }
+}
+
+
 TEST_CASE_METHOD(SessionTest, "Encrypted Messages Overlapping Buffers", "[SecretHandshake]") {
-    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream);
+    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream, CryptoBox::AES256GCM,
+                             CryptoBox::MACOnly);
     EncryptoBox box1(session1, protocol);
     DecryptoBox box2(session2, protocol);
     cerr << "\t---- protocol=" << int(protocol) << endl;
@@ -259,7 +614,8 @@ TEST_CASE_METHOD(SessionTest, "Encrypted Messages Overlapping Buffers", "[Secret
 
 
 TEST_CASE_METHOD(SessionTest, "Decryption Stream", "[SecretHandshake]") {
-    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream);
+    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream, CryptoBox::AES256GCM,
+                             CryptoBox::MACOnly);
     size_t kEncOverhead = 18 + (protocol == CryptoBox::BoxStream) * 16;
     cerr << "\t---- protocol=" << int(protocol) << endl;
 
@@ -325,7 +681,8 @@ TEST_CASE_METHOD(SessionTest, "Decryption Stream", "[SecretHandshake]") {
 
 
 TEST_CASE_METHOD(SessionTest, "Decryption Stream large data", "[SecretHandshake]") {
-    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream);
+    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream, CryptoBox::AES256GCM,
+                             CryptoBox::MACOnly);
     size_t kEncOverhead = 18 + (protocol == CryptoBox::BoxStream) * 16;
     cerr << "\t---- protocol=" << int(protocol) << endl;
 
@@ -390,3 +747,1108 @@ TEST_CASE_METHOD(SessionTest, "Decryption Stream large data", "[SecretHandshake]
     CHECK(bytesRead == 70000);
     CHECK(memcmp(gotMessage.data(), &message[30000], bytesRead) == 0);
 }
+
+
+TEST_CASE_METHOD(SessionTest, "Protocol Negotiation", "[SecretHandshake]") {
+    ProtocolNegotiator neg1(session1, ProtocolNegotiator::Client,
+                            {CryptoBox::Compact, CryptoBox::BoxStream,
+                             CryptoBox::AES256GCM, CryptoBox::MACOnly});
+    ProtocolNegotiator neg2(session2, ProtocolNegotiator::Server,
+                            {CryptoBox::BoxStream, CryptoBox::Compact}, 1000);
+
+    // The client sends its offer; the server has nothing to send until it's received it:
+    auto offer1 = neg1.bytesToSend();
+    CHECK(offer1.size == ProtocolNegotiator::kEncryptedOfferSize);
+    CHECK(neg2.bytesToSend().size == 0);
+    vector<uint8_t> wire1((uint8_t*)offer1.data, (uint8_t*)offer1.data + offer1.size);
+
+    // neg2 receives the offer in two pieces:
+    input_data in = {wire1.data(), 5};
+    CHECK(neg2.receivedBytes(in) == IncompleteInput);
+    CHECK(neg2.bytesToSend().size == 0);
+    in = {wire1.data(), wire1.size()};
+    REQUIRE(neg2.receivedBytes(in) == Success);
+    CHECK(in.size == 0);
+
+    // Then it replies with its own offer, followed immediately by some data:
+    auto offer2 = neg2.bytesToSend();
+    REQUIRE(offer2.size == offer1.size);
+    EncryptionStream enc2(neg2.session(), neg2.protocol());
+    enc2.push("Hi", 2);
+    auto data2 = enc2.availableData();
+    vector<uint8_t> wire2((uint8_t*)offer2.data, (uint8_t*)offer2.data + offer2.size);
+    wire2.insert(wire2.end(), (uint8_t*)data2.data, (uint8_t*)data2.data + data2.size);
+    in = {wire2.data(), wire2.size()};
+    REQUIRE(neg1.receivedBytes(in) == Success);
+    CHECK(in.size == data2.size);
+
+    CHECK(neg1.protocol() == CryptoBox::Compact);   // (MACOnly isn't used unless both want it)
+    CHECK(neg2.protocol() == CryptoBox::Compact);
+    CHECK(neg1.maxMessageSize() == 1000);
+    CHECK(neg2.maxMessageSize() == 1000);
+    CHECK(!neg1.peerIsLegacy());
+    CHECK(!neg2.peerIsLegacy());
+
+    // Now the streams work with the negotiated sessions:
+    DecryptionStream dec1(neg1.session(), neg1.protocol());
+    REQUIRE(dec1.push(in.data, in.size));
+    char clearBuf[10];
+    CHECK(dec1.pull(clearBuf, sizeof(clearBuf)) == 2);
+    CHECK(memcmp(clearBuf, "Hi", 2) == 0);
+
+    EncryptionStream enc(neg1.session(), neg1.protocol());
+    DecryptionStream dec(neg2.session(), neg2.protocol());
+    enc.push("Hello", 5);
+    auto cipher = enc.availableData();
+    REQUIRE(dec.push(cipher.data, cipher.size));
+    CHECK(dec.pull(clearBuf, sizeof(clearBuf)) == 5);
+    CHECK(memcmp(clearBuf, "Hello", 5) == 0);
+}
+
+
+TEST_CASE_METHOD(SessionTest, "Protocol Negotiation With Legacy Peer", "[SecretHandshake]") {
+    // The legacy client just sends BoxStream data:
+    EncryptionStream legacyEnc(session2, CryptoBox::BoxStream);
+    legacyEnc.push("Hello", 5);
+    auto cipher = legacyEnc.availableData();
+
+    SECTION("Legacy client") {
+        ProtocolNegotiator neg1(session1, ProtocolNegotiator::Server,
+                                {CryptoBox::Compact, CryptoBox::BoxStream});
+        input_data in = cipher;
+        REQUIRE(neg1.receivedBytes(in) == Success);
+        CHECK(neg1.peerIsLegacy());
+        CHECK(neg1.protocol() == CryptoBox::BoxStream);
+        CHECK(neg1.bytesToSend().size == 0);    // Nothing is sent to a legacy peer
+        CHECK(in.size == cipher.size);          // Message was not consumed
+
+        DecryptionStream dec(neg1.session(), neg1.protocol());
+        REQUIRE(dec.push(in.data, in.size));
+        char clearBuf[10];
+        CHECK(dec.pull(clearBuf, sizeof(clearBuf)) == 5);
+        CHECK(memcmp(clearBuf, "Hello", 5) == 0);
+
+        // A server that doesn't support BoxStream fails with a legacy peer:
+        ProtocolNegotiator neg3(session1, ProtocolNegotiator::Server, {CryptoBox::Compact});
+        in = cipher;
+        CHECK(neg3.receivedBytes(in) == CorruptData);
+    }
+    SECTION("Silent legacy client") {
+        // The legacy client waits for the server to send first, so the server times out:
+        ProtocolNegotiator neg1(session1, ProtocolNegotiator::Server,
+                                {CryptoBox::Compact, CryptoBox::BoxStream});
+        REQUIRE(neg1.peerIsSilent() == Success);
+        CHECK(neg1.peerIsLegacy());
+        CHECK(neg1.protocol() == CryptoBox::BoxStream);
+        CHECK(neg1.bytesToSend().size == 0);
+
+        // The server's data is readable by the legacy client:
+        EncryptionStream enc(neg1.session(), neg1.protocol());
+        enc.push("Hello", 5);
+        auto data = enc.availableData();
+        DecryptionStream legacyDec(session2, CryptoBox::BoxStream);
+        REQUIRE(legacyDec.push(data.data, data.size));
+        char clearBuf[10];
+        CHECK(legacyDec.pull(clearBuf, sizeof(clearBuf)) == 5);
+
+        // The client's first frame is checked; it's data, so it's not consumed:
+        input_data in = cipher;
+        REQUIRE(neg1.receivedBytes(in) == Success);
+        CHECK(in.size == cipher.size);
+
+        ProtocolNegotiator neg3(session1, ProtocolNegotiator::Server, {CryptoBox::Compact});
+        CHECK(neg3.peerIsSilent() == CorruptData);
+    }
+    SECTION("Late offer") {
+        // A negotiating client's offer arrives after the server gave up waiting. It's rejected,
+        // instead of being decrypted as data:
+        ProtocolNegotiator server(session1, ProtocolNegotiator::Server,
+                                  {CryptoBox::Compact, CryptoBox::BoxStream});
+        ProtocolNegotiator client(session2, ProtocolNegotiator::Client,
+                                  {CryptoBox::Compact, CryptoBox::BoxStream});
+        REQUIRE(server.peerIsSilent() == Success);
+        input_data in = client.bytesToSend();
+        CHECK(server.receivedBytes(in) == CorruptData);
+    }
+    SECTION("Legacy server") {
+        // A client can't fall back, since the legacy server got its offer as data:
+        ProtocolNegotiator neg1(session1, ProtocolNegotiator::Client,
+                                {CryptoBox::Compact, CryptoBox::BoxStream});
+        input_data in = cipher;
+        CHECK(neg1.receivedBytes(in) == CorruptData);
+        CHECK(neg1.peerIsSilent() == CorruptData);
+    }
+}
+
+
+TEST_CASE("ByteRing", "[SecretHandshake]") {
+    ByteRing ring(16);
+    CHECK(ring.capacity() == 16);
+    CHECK(ring.spaceAvailable() == 16);
+    CHECK(ring.bytesAvailable() == 0);
+
+    CHECK(ring.write("abcdefghijkl", 12) == 12);
+    char buf[20];
+    CHECK(ring.read(buf, 10) == 10);
+    CHECK(memcmp(buf, "abcdefghij", 10) == 0);
+    // Now the free space wraps around the end:
+    CHECK(ring.spaceAvailable() == 14);
+    CHECK(ring.writable().size == 4);
+    CHECK(ring.write("mnopqrstuvwxyz!!", 16) == 14);
+    CHECK(ring.spaceAvailable() == 0);
+    CHECK(ring.readable().size == 6);
+    CHECK(ring.read(buf, sizeof(buf)) == 16);
+    CHECK(memcmp(buf, "klmnopqrstuvwxyz", 16) == 0);
+    CHECK(ring.bytesAvailable() == 0);
+
+    CHECK_THROWS_AS(ByteRing(100), std::invalid_argument);
+}
+
+
+TEST_CASE("ByteRing Threads", "[SecretHandshake]") {
+    static constexpr size_t kTotal = 10'000'000;
+    ByteRing ring(4096);
+    thread producer([&] {
+        uint8_t n = 0;
+        for (size_t sent = 0; sent < kTotal; ) {
+            output_buffer out = ring.writable();
+            size_t count = std::min(out.size, kTotal - sent);
+            for (size_t i = 0; i < count; ++i)
+                ((uint8_t*)out.data)[i] = n++;
+            ring.commit(count);
+            sent += count;
+        }
+    });
+    uint8_t expected = 0;
+    bool ok = true;
+    for (size_t received = 0; received < kTotal; ) {
+        input_data in = ring.readable();
+        for (size_t i = 0; i < in.size; ++i)
+            ok = ok && (((const uint8_t*)in.data)[i] == expected++);
+        ring.consume(in.size);
+        received += in.size;
+    }
+    producer.join();
+    CHECK(ok);
+}
+
+
+TEST_CASE_METHOD(SessionTest, "SPSC Streams", "[SecretHandshake]") {
+    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream, CryptoBox::AES256GCM,
+                             CryptoBox::MACOnly, CryptoBox::Compressed);
+    cerr << "\t---- protocol=" << int(protocol) << endl;
+    static constexpr size_t kTotal = 3'000'000;
+    vector<uint8_t> message(kTotal);
+    for (size_t i = 0; i < kTotal; ++i)
+        message[i] = uint8_t(i * 7 + (i >> 16));
+
+    // Three threads: one encrypts, one passes the ciphertext along, and this one reads the
+    // cleartext. The rings are small so they fill up and wrap around.
+    SPSCEncryptionStream enc(session1, protocol, 1 << 17);
+    SPSCDecryptionStream dec(session2, protocol, 1 << 17);
+    atomic<bool> done = false, corrupt = false;
+    thread producer([&] {
+        for (size_t sent = 0; sent < kTotal && !corrupt; ) {
+            size_t n = enc.push(&message[sent], std::min(kTotal - sent, size_t(10000)));
+            if (n == 0)
+                this_thread::yield();
+            sent += n;
+        }
+    });
+    thread io([&] {
+        while (!done) {
+            bool ok;
+            input_data cipher = enc.availableData();
+            if (cipher.size > 0) {
+                ok = dec.push(cipher.data, cipher.size);
+                enc.skip(cipher.size);
+            } else {
+                ok = dec.decryptPending();
+                this_thread::yield();
+            }
+            if (!ok) {
+                corrupt = true;
+                break;
+            }
+        }
+    });
+
+    vector<uint8_t> received(kTotal);
+    size_t total = 0;
+    while (total < kTotal && !corrupt) {
+        size_t n = dec.pull(&received[total], kTotal - total);
+        if (n == 0)
+            this_thread::yield();
+        total += n;
+    }
+    done = true;
+    producer.join();
+    io.join();
+    CHECK(!corrupt);
+    CHECK(total == kTotal);
+    CHECK(received == message);
+    CHECK(dec.close());
+}
+
+
+TEST_CASE_METHOD(SessionTest, "Large Messages", "[SecretHandshake]") {
+    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream, CryptoBox::AES256GCM,
+                             CryptoBox::MACOnly);
+    cerr << "\t---- protocol=" << int(protocol) << endl;
+    EncryptoBox box1(session1, protocol);
+    MessageReassembler reassembler(session2, protocol, 1 << 20);
+    size_t overhead = box1.encryptedSize(0);
+
+    // Encrypt a series of messages into one buffer:
+    vector<vector<uint8_t>> messages;
+    vector<uint8_t> cipher;
+    for (size_t size : {0, 100, 65534, 65535, 200000, 1 << 20}) {
+        vector<uint8_t> message(size);
+        for (size_t i = 0; i < size; ++i)
+            message[i] = uint8_t(i * 7 + (i >> 16));
+        size_t encSize = box1.encryptedMessageSize(size);
+        size_t frames = max(size_t(1), (size + 65533) / 65534);
+        CHECK(encSize == size + frames * (overhead + 1));
+        size_t pos = cipher.size();
+        cipher.resize(pos + encSize);
+        output_buffer out = {&cipher[pos], encSize - 1};
+        CHECK(box1.encryptMessage({message.data(), message.size()}, out) == OutTooSmall);
+        out.size = encSize;
+        REQUIRE(box1.encryptMessage({message.data(), message.size()}, out) == Success);
+        CHECK(out.size == encSize);
+        messages.push_back(move(message));
+    }
+
+    // Feed the ciphertext to the reassembler in arbitrary pieces, keeping the unconsumed part:
+    size_t next = 0, pos = 0;
+    vector<uint8_t> pending;
+    vector<uint8_t> recycled;
+    while (pos < cipher.size()) {
+        size_t n = std::min(cipher.size() - pos, size_t(12345));
+        pending.insert(pending.end(), &cipher[pos], &cipher[pos + n]);
+        pos += n;
+        input_data in = {pending.data(), pending.size()};
+        status_t status;
+        while ((status = reassembler.receive(in)) == Success) {
+            REQUIRE(next < messages.size());
+            input_data msg = reassembler.message();
+            REQUIRE(msg.size == messages[next].size());
+            CHECK(memcmp(msg.data, messages[next].data(), msg.size) == 0);
+            if (next == 2) {
+                // Take one message's buffer and give it back:
+                vector<uint8_t> taken = reassembler.takeMessage();
+                CHECK(taken == messages[next]);
+                reassembler.recycle(move(taken));
+            }
+            ++next;
+        }
+        REQUIRE(status == IncompleteInput);
+        pending.erase(pending.begin(), pending.end() - in.size);
+    }
+    CHECK(next == messages.size());
+    CHECK(pending.empty());
+}
+
+
+TEST_CASE_METHOD(SessionTest, "Large Messages Limits", "[SecretHandshake]") {
+    EncryptoBox box1(session1);
+    size_t overhead = box1.encryptedSize(1);
+    vector<uint8_t> message(100'000, 'x');
+    vector<uint8_t> cipher(box1.encryptedMessageSize(message.size()));
+    output_buffer out = {cipher.data(), cipher.size()};
+    REQUIRE(box1.encryptMessage({message.data(), message.size()}, out) == Success);
+
+    SECTION("Max size") {
+        MessageReassembler reassembler(session2, CryptoBox::Compact, 99'999);
+        input_data in = {cipher.data(), cipher.size()};
+        CHECK(reassembler.receive(in) == OutTooSmall);
+    }
+    SECTION("Caller's buffer") {
+        MessageReassembler reassembler(session2);
+        vector<uint8_t> buffer(message.size() + overhead);
+        reassembler.setBuffer({buffer.data(), buffer.size() - 1});
+        input_data in = {cipher.data(), cipher.size()};
+        CHECK(reassembler.receive(in) == OutTooSmall);
+
+        MessageReassembler reassembler2(session2);
+        reassembler2.setBuffer({buffer.data(), buffer.size()});
+        in = {cipher.data(), cipher.size()};
+        REQUIRE(reassembler2.receive(in) == Success);
+        CHECK(in.size == 0);
+        CHECK(reassembler2.message().data == buffer.data());
+        CHECK(reassembler2.message().size == message.size());
+        CHECK(memcmp(buffer.data(), message.data(), message.size()) == 0);
+    }
+    SECTION("Bad flag") {
+        // A plain frame whose last byte isn't a valid flag:
+        EncryptoBox box(session1);
+        vector<uint8_t> frame(box.encryptedSize(5));
+        output_buffer frameOut = {frame.data(), frame.size()};
+        REQUIRE(box.encrypt({"Hello", 5}, frameOut) == Success);
+        MessageReassembler reassembler(session2);
+        input_data in = {frame.data(), frame.size()};
+        CHECK(reassembler.receive(in) == CorruptData);
+    }
+}
+
+
+TEST_CASE_METHOD(SessionTest, "Decryption Stream Frame Visitor", "[SecretHandshake]") {
+    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream, CryptoBox::AES256GCM,
+                             CryptoBox::MACOnly, CryptoBox::Compressed);
+    cerr << "\t---- protocol=" << int(protocol) << endl;
+    EncryptionStream enc(session1, protocol);
+    DecryptionStream dec(session2, protocol);
+
+    // Each push to the EncryptionStream is one frame:
+    vector<string> messages;
+    for (int i = 0; i < 100; ++i)
+        messages.push_back(string(1 + i * 37 % 1000, char('A' + i % 26)));
+    for (auto &message : messages)
+        enc.push(message.data(), message.size());
+    vector<uint8_t> cipher(enc.bytesAvailable());
+    enc.pull(cipher.data(), cipher.size());
+
+    vector<string> received;
+    dec.setFrameVisitor([&](input_data frame) {
+        received.emplace_back((const char*)frame.data, frame.size);
+    });
+    // Push the ciphertext in pieces that don't line up with frames:
+    for (size_t pos = 0; pos < cipher.size(); ) {
+        size_t n = std::min(cipher.size() - pos, size_t(777));
+        REQUIRE(dec.push(&cipher[pos], n));
+        pos += n;
+    }
+    CHECK(received == messages);
+    CHECK(dec.bytesAvailable() == 0);
+    CHECK(dec.close());
+
+    // Switch back to byte-stream mode:
+    dec.setFrameVisitor(nullptr);
+    enc.push("Hello", 5);
+    auto data = enc.availableData();
+    REQUIRE(dec.push(data.data, data.size));
+    CHECK(dec.bytesAvailable() == 5);
+    CHECK_THROWS_AS(dec.setFrameVisitor([](input_data) { }), std::logic_error);
+}
+
+
+TEST_CASE_METHOD(SessionTest, "Compressed Streams", "[SecretHandshake]") {
+    string json = bench::jsonCorpus(500'000);
+
+    SECTION("Byte stream") {
+        EncryptionStream enc(session1, CryptoBox::Compressed);
+        DecryptionStream dec(session2, CryptoBox::Compressed);
+        CHECK(enc.maxMessageSize() == 65534);
+        size_t cipherSize = 0;
+        string received;
+        for (size_t pos = 0; pos < json.size(); ) {
+            size_t n = std::min(json.size() - pos, size_t(1 + pos % 100'000));
+            enc.push(&json[pos], n);
+            pos += n;
+            auto cipher = enc.availableData();
+            cipherSize += cipher.size;
+            // Push the ciphertext in pieces that don't line up with frames:
+            for (size_t i = 0; i < cipher.size; i += 5000)
+                REQUIRE(dec.push((const uint8_t*)cipher.data + i, std::min(cipher.size - i, size_t(5000))));
+            enc.skip(cipher.size);
+            auto clear = dec.availableData();
+            received.append((const char*)clear.data, clear.size);
+            dec.skip(clear.size);
+        }
+        CHECK(received == json);
+        CHECK(dec.close());
+        CHECK(cipherSize < json.size() / 2);
+    }
+    SECTION("Large messages") {
+        EncryptoBox box1(session1, CryptoBox::Compressed);
+        vector<uint8_t> cipher(box1.encryptedMessageSize(json.size()));
+        output_buffer out = {cipher.data(), cipher.size()};
+        REQUIRE(box1.encryptMessage({json.data(), json.size()}, out) == Success);
+        CHECK(out.size < json.size() / 2);
+
+        MessageReassembler reassembler(session2, CryptoBox::Compressed);
+        input_data in = {cipher.data(), out.size};
+        REQUIRE(reassembler.receive(in) == Success);
+        CHECK(in.size == 0);
+        auto message = reassembler.message();
+        CHECK(string((const char*)message.data, message.size) == json);
+
+        // The caller's buffer only needs to hold the message:
+        MessageReassembler reassembler2(session2, CryptoBox::Compressed);
+        vector<uint8_t> buffer(json.size() + 1);
+        reassembler2.setBuffer({buffer.data(), buffer.size()});
+        in = {cipher.data(), out.size};
+        REQUIRE(reassembler2.receive(in) == Success);
+        CHECK(memcmp(buffer.data(), json.data(), json.size()) == 0);
+
+        MessageReassembler reassembler3(session2, CryptoBox::Compressed, json.size() - 1);
+        in = {cipher.data(), out.size};
+        CHECK(reassembler3.receive(in) == OutTooSmall);
+    }
+    SECTION("Negotiated") {
+        ProtocolNegotiator neg1(session1, ProtocolNegotiator::Client,
+                                {CryptoBox::Compact, CryptoBox::Compressed});
+        ProtocolNegotiator neg2(session2, ProtocolNegotiator::Server,
+                                {CryptoBox::Compressed, CryptoBox::Compact, CryptoBox::AES256GCM});
+        input_data in = neg1.bytesToSend();
+        REQUIRE(neg2.receivedBytes(in) == Success);
+        in = neg2.bytesToSend();
+        REQUIRE(neg1.receivedBytes(in) == Success);
+        CHECK(neg1.protocol() == CryptoBox::Compressed);
+        CHECK(neg2.protocol() == CryptoBox::Compressed);
+        CHECK(neg1.maxMessageSize() == 65534);
+
+        ProtocolNegotiator neg3(session1, ProtocolNegotiator::Client, {CryptoBox::Compact});
+        ProtocolNegotiator neg4(session2, ProtocolNegotiator::Server,
+                                {CryptoBox::Compressed, CryptoBox::Compact});
+        in = neg3.bytesToSend();
+        REQUIRE(neg4.receivedBytes(in) == Success);
+        CHECK(neg4.protocol() == CryptoBox::Compact);
+    }
+    CHECK_THROWS_AS(ResumableStream(session1, CryptoBox::Compressed), std::invalid_argument);
+}
+
+
+TEST_CASE_METHOD(SessionTest, "Datagrams", "[SecretHandshake]") {
+    DatagramEncryptor enc(session1);
+    DatagramDecryptor dec(session2);
+
+    // Encrypt some datagrams:
+    static constexpr size_t kCount = 2000;
+    vector<vector<uint8_t>> datagrams;
+    for (size_t i = 0; i < kCount; ++i) {
+        string payload = "Datagram #" + std::to_string(i);
+        vector<uint8_t> datagram(DatagramCrypto::encryptedSize(payload.size()));
+        output_buffer out = {datagram.data(), datagram.size()};
+        REQUIRE(enc.encrypt({payload.data(), payload.size()}, out) == Success);
+        CHECK(out.size == datagram.size());
+        datagrams.push_back(std::move(datagram));
+    }
+    CHECK(enc.nextSequence() == kCount);
+
+    auto decrypt = [&](size_t i) -> status_t {
+        char payload[100];
+        output_buffer out = {payload, sizeof(payload)};
+        uint64_t sequence;
+        status_t status = dec.decrypt({datagrams[i].data(), datagrams[i].size()}, out, &sequence);
+        if (status == Success) {
+            CHECK(sequence == i);
+            CHECK(string(payload, out.size) == "Datagram #" + std::to_string(i));
+        }
+        return status;
+    };
+
+    // Decrypt them shuffled within groups of 100, and skip every 10th one:
+    vector<size_t> order;
+    for (size_t i = 0; i < kCount; ++i)
+        order.push_back(i);
+    std::mt19937 rng(12345);
+    for (size_t i = 0; i < kCount; i += 100)
+        std::shuffle(&order[i], &order[i + 100], rng);
+    for (size_t i : order) {
+        if (i % 10 != 3)
+            CHECK(decrypt(i) == Success);
+    }
+    CHECK(dec.replaysRejected() == 0);
+
+    // Replays are rejected:
+    CHECK(decrypt(kCount - 1) == CorruptData);
+    CHECK(decrypt(kCount - 100) == CorruptData);
+    CHECK(dec.replaysRejected() == 2);
+    // A late datagram within the window is accepted, but not one older than the window:
+    CHECK(decrypt(1993) == Success);
+    CHECK(decrypt(1033) == CorruptData);
+    CHECK(dec.replaysRejected() == 3);
+
+    // Altering the sequence number or the ciphertext is detected:
+    auto &dg = datagrams[1983];
+    dg[6] ^= 0x10;      // sequence += 4096
+    CHECK(decrypt(1983) == CorruptData);
+    dg[6] ^= 0x10;
+    dg[30] ^= 1;
+    CHECK(decrypt(1983) == CorruptData);
+    dg[30] ^= 1;
+    CHECK(decrypt(1983) == Success);
+    CHECK(dec.replaysRejected() == 3);
+
+    // Skip ahead 1000 datagrams, then decrypt one in place:
+    uint8_t buf[DatagramCrypto::encryptedSize(5)];
+    for (size_t i = 0; i < 1000; ++i) {
+        output_buffer out = {buf, sizeof(buf)};
+        enc.encrypt({"x", 1}, out);
+    }
+    memcpy(buf + DatagramCrypto::kOverhead, "Hello", 5);
+    output_buffer out = {buf, sizeof(buf)};
+    REQUIRE(enc.encrypt({buf + DatagramCrypto::kOverhead, 5}, out) == Success);
+    output_buffer plain = {buf, sizeof(buf)};
+    uint64_t sequence;
+    REQUIRE(dec.decrypt({buf, sizeof(buf)}, plain, &sequence) == Success);
+    CHECK(sequence == kCount + 1000);
+    CHECK(string((char*)buf, plain.size) == "Hello");
+    // Now the earlier ones are all too old:
+    CHECK(decrypt(1973) == CorruptData);
+}
+
+
+TEST_CASE("Sealed Messages", "[SecretHandshake]") {
+    Context alice("SealedTest", KeyPair::generate());
+    Context bob("SealedTest", KeyPair::generate());
+    Context carol("SealedTest", KeyPair::generate());
+    MessageSealer sealer(alice);
+    MessageOpener opener(bob);
+
+    auto seal = [&](string const& message, PublicKey const& recipient) {
+        vector<uint8_t> sealed(MessageSealer::sealedSize(message.size()));
+        output_buffer out = {sealed.data(), sealed.size() - 1};
+        CHECK(sealer.seal(recipient, {message.data(), message.size()}, out) == OutTooSmall);
+        out.size = sealed.size();
+        REQUIRE(sealer.seal(recipient, {message.data(), message.size()}, out) == Success);
+        CHECK(out.size == sealed.size());
+        return sealed;
+    };
+
+    string message = "Beware the ides of March. We attack at dawn.";
+    vector<uint8_t> sealed = seal(message, bob.keyPair.publicKey);
+    CHECK(sealed != seal(message, bob.keyPair.publicKey));    // new ephemeral key each time
+
+    char clear[100];
+    PublicKey sender;
+    output_buffer out = {clear, message.size() - 1};
+    CHECK(opener.open({sealed.data(), sealed.size()}, out, &sender) == OutTooSmall);
+    out = {clear, sizeof(clear)};
+    CHECK(opener.open({sealed.data(), MessageSealer::kOverhead - 1}, out) == IncompleteInput);
+    REQUIRE(opener.open({sealed.data(), sealed.size()}, out, &sender) == Success);
+    CHECK(string(clear, out.size) == message);
+    CHECK(sender == alice.keyPair.publicKey);
+
+    // An empty message:
+    vector<uint8_t> empty = seal("", bob.keyPair.publicKey);
+    out = {clear, sizeof(clear)};
+    CHECK(opener.open({empty.data(), empty.size()}, out) == Success);
+    CHECK(out.size == 0);
+
+    // Tampering is detected:
+    for (size_t i : {size_t(0), size_t(40), size_t(100), sealed.size() - 1}) {
+        sealed[i] ^= 0x01;
+        out = {clear, sizeof(clear)};
+        CHECK(opener.open({sealed.data(), sealed.size()}, out) == CorruptData);
+        sealed[i] ^= 0x01;
+    }
+
+    // Only the recipient, using the same AppID, can open it:
+    out = {clear, sizeof(clear)};
+    CHECK(MessageOpener(carol).open({sealed.data(), sealed.size()}, out) == CorruptData);
+    Context otherApp("OtherApp", KeyPair(bob.keyPair.signingKey));
+    CHECK(MessageOpener(otherApp).open({sealed.data(), sealed.size()}, out) == CorruptData);
+
+    // The pre-authorizer can reject the sender:
+    opener.setSenderPreAuthorizer([&](PublicKey const& key) {return key != alice.keyPair.publicKey;});
+    CHECK(opener.open({sealed.data(), sealed.size()}, out) == CorruptData);
+    opener.setSenderPreAuthorizer([&](PublicKey const& key) {return key == alice.keyPair.publicKey;});
+    CHECK(opener.open({sealed.data(), sealed.size()}, out) == Success);
+}
+
+
+TEST_CASE("Sealed Messages Batch", "[SecretHandshake]") {
+    unsigned threads = GENERATE(1, 4);
+    cerr << "\t---- threads=" << threads << endl;
+    Context alice("SealedTest", KeyPair::generate());
+    Context bob("SealedTest", KeyPair::generate());
+    MessageSealer sealer(alice);
+    MessageOpener opener(bob);
+
+    static constexpr size_t kCount = 200;
+    vector<string> messages;
+    vector<vector<uint8_t>> sealed;
+    vector<input_data> inputs;
+    size_t totalSize = 0;
+    for (size_t i = 0; i < kCount; ++i) {
+        messages.push_back(string(i * 13 % 300, char('a' + i % 26)));
+        sealed.emplace_back(MessageSealer::sealedSize(messages[i].size()));
+        output_buffer out = {sealed[i].data(), sealed[i].size()};
+        REQUIRE(sealer.seal(bob.keyPair.publicKey, {messages[i].data(), messages[i].size()},
+                            out) == Success);
+        totalSize += messages[i].size();
+    }
+    sealed[10][50] ^= 0x80;                         // corrupt one message
+    sealed[20].resize(MessageSealer::kOverhead - 1);// truncate another
+    for (auto &s : sealed)
+        inputs.push_back({s.data(), s.size()});
+
+    // Leave room for all but the last two messages (the truncated one takes no space):
+    size_t tailSize = messages[kCount - 2].size() + messages[kCount - 1].size();
+    vector<uint8_t> buffer(totalSize - messages[20].size() - tailSize);
+    output_buffer out = {buffer.data(), buffer.size()};
+    vector<MessageOpener::Result> results(kCount);
+    size_t opened = opener.openAll(inputs.data(), kCount, out, results.data(), threads);
+    CHECK(opened == kCount - 4);
+    CHECK(out.size <= buffer.size());
+    for (size_t i = 0; i < kCount; ++i) {
+        auto &r = results[i];
+        if (i == 10) {
+            CHECK(r.status == CorruptData);
+        } else if (i == 20) {
+            CHECK(r.status == IncompleteInput);
+        } else if (i >= kCount - 2) {
+            CHECK(r.status == OutTooSmall);
+        } else {
+            REQUIRE(r.status == Success);
+            CHECK(string((const char*)r.message.data, r.message.size) == messages[i]);
+            CHECK(r.sender == alice.keyPair.publicKey);
+        }
+    }
+}
+
+
+TEST_CASE_METHOD(SessionTest, "Resumable Stream", "[SecretHandshake]") {
+    auto protocol = GENERATE(CryptoBox::Compact, CryptoBox::BoxStream);
+    cerr << "\t---- protocol=" << int(protocol) << endl;
+    ResumableStream a(session1, protocol), b(session2, protocol);
+
+    vector<uint8_t> dataA(3'000'000), dataB(1'000'000);
+    for (size_t i = 0; i < dataA.size(); ++i)
+        dataA[i] = uint8_t(i * 7 + (i >> 13));
+    for (size_t i = 0; i < dataB.size(); ++i)
+        dataB[i] = uint8_t(i * 13 + (i >> 11));
+
+    int fds[2];
+    auto connect = [&] {
+        REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        for (int fd : fds)
+            REQUIRE(::fcntl(fd, F_SETFL, O_NONBLOCK) == 0);
+    };
+
+    struct Peer {
+        ResumableStream &stream;
+        vector<uint8_t> const& data;
+        size_t written = 0;
+        vector<uint8_t> got;
+    };
+    Peer peerA {a, dataA}, peerB {b, dataB};
+
+    // Writes, sends, receives and reads as much as possible without blocking:
+    auto pump = [&](Peer &peer, int fd) {
+        peer.written += peer.stream.write(&peer.data[peer.written],
+                                          std::min(peer.data.size() - peer.written, size_t(50'000)));
+        CHECK(peer.stream.unacknowledgedBytes() <= (1 << 20) + 1000);  // acks may go over
+        for (input_data out; (out = peer.stream.outgoingData()).size > 0; ) {
+            ssize_t n = ::send(fd, out.data, out.size, 0);
+            if (n <= 0)
+                break;
+            peer.stream.didSend(n);
+        }
+        uint8_t buf[32768];
+        ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n > 0)
+            REQUIRE(peer.stream.received(buf, n));
+        size_t readable = peer.stream.readableBytes();
+        peer.got.resize(peer.got.size() + readable);
+        peer.stream.read(&peer.got[peer.got.size() - readable], readable);
+    };
+
+    // Transfer data both ways, force-closing the connection every so often:
+    connect();
+    int reconnects = 0;
+    for (int i = 1; peerB.got.size() < dataA.size() || peerA.got.size() < dataB.size(); ++i) {
+        REQUIRE(i < 100000);
+        pump(peerA, fds[0]);
+        pump(peerB, fds[1]);
+        if (i % 11 == 0 && reconnects < 6) {
+            ::close(fds[0]);
+            ::close(fds[1]);
+            a.reconnect();
+            if (reconnects == 3) {
+                // This attempt fails before `b` gets the resume message, so `a` tries again,
+                // and ends up having reconnected once more than `b`:
+                connect();
+                pump(peerA, fds[0]);
+                ::close(fds[0]);
+                ::close(fds[1]);
+                a.reconnect();
+            }
+            b.reconnect();
+            connect();
+            ++reconnects;
+        }
+    }
+    ::close(fds[0]);
+    ::close(fds[1]);
+    CHECK(reconnects == 6);
+    CHECK(!a.isResuming());
+    CHECK(!b.isResuming());
+    CHECK(peerB.got == dataA);
+    CHECK(peerA.got == dataB);
+
+    // A resume message from a stream with a different session is rejected:
+    SessionTest otherSessions;
+    ResumableStream c(otherSessions.session1, protocol);
+    a.reconnect();
+    c.reconnect();
+    auto msg = c.outgoingData();
+    REQUIRE(msg.size == ResumableStream::kResumeMessageSize);
+    CHECK(ResumableStream::resumeIDOf(msg.data) != a.peerResumeID());
+    CHECK(!a.received(msg.data, msg.size));
+
+    // So is a stale one, that was already accepted:
+    b.reconnect();
+    auto staleMsg = b.outgoingData();
+    vector<uint8_t> stale((uint8_t*)staleMsg.data, (uint8_t*)staleMsg.data + staleMsg.size);
+    a.reconnect();
+    CHECK(ResumableStream::resumeIDOf(stale.data()) == a.peerResumeID());
+    REQUIRE(a.received(stale.data(), stale.size()));
+    CHECK(!a.isResuming());
+    a.reconnect();
+    CHECK(!a.received(stale.data(), stale.size()));
+}
+
+
+TEST_CASE("Metrics", "[SecretHandshake]") {
+    Metrics::enable(true);
+    Metrics::reset();
+    {
+        // A successful handshake, and one where the client has the wrong server key:
+        HandshakeTest good;
+        REQUIRE(good.sendFromTo(good.client, good.server,  64));
+        REQUIRE(good.sendFromTo(good.server, good.client,  64));
+        REQUIRE(good.sendFromTo(good.client, good.server, 112));
+        REQUIRE(good.sendFromTo(good.server, good.client,  80));
+
+        HandshakeTest bad;
+        PublicKey badServerKey = bad.serverKey.publicKey;
+        badServerKey[17]++;
+        ClientHandshake badClient({"App", bad.clientKey}, badServerKey);
+        CHECK(bad.sendFromTo(badClient, bad.server,  64));
+        CHECK(bad.sendFromTo(bad.server, badClient,  64));
+        CHECK(!bad.sendFromTo(badClient, bad.server, 112));
+
+        // Some frames, one of them corrupted:
+        Session session = good.client.session();
+        EncryptoBox enc(session);
+        DecryptoBox dec(good.server.session());
+        uint8_t frame[100], plain[100];
+        for (int i = 0; i < 3; ++i) {
+            output_buffer out = {frame, sizeof(frame)};
+            REQUIRE(enc.encrypt({"hello", 5}, out) == Success);
+            if (i == 2)
+                frame[out.size - 1] ^= 1;
+            input_data in = {frame, out.size};
+            output_buffer result = {plain, sizeof(plain)};
+            CHECK(dec.decrypt(in, result) == (i < 2 ? Success : CorruptData));
+        }
+    }
+    Metrics::Snapshot m = Metrics::snapshot();
+    Metrics::enable(false);
+
+    CHECK(m.handshakesStarted == 5);        // (2 servers, 3 clients)
+    CHECK(m.handshakesSucceeded == 2);
+    CHECK(m.handshakesFailed[1][2] == 1);   // server's AuthError in client-auth step
+    CHECK(m.stepLatency[0].count == 4);     // (client & server of both handshakes)
+    CHECK(m.stepLatency[3].count == 2);
+    CHECK(m.handshakeLatency.count == 2);
+    CHECK(m.framesEncrypted == 3);
+    CHECK(m.bytesEncrypted == 15);
+    CHECK(m.framesDecrypted == 2);
+    CHECK(m.bytesDecrypted == 10);
+    CHECK(m.decryptionFailures == 1);
+
+    string text = Metrics::prometheusText(m);
+    CHECK(text.find("\nshs_handshakes_succeeded_total 2\n") != string::npos);
+    CHECK(text.find("\nshs_handshakes_failed_total{error=\"auth\",step=\"client_auth\"} 1\n") != string::npos);
+    CHECK(text.find("\nshs_handshake_duration_seconds_bucket{le=\"+Inf\"} 2\n") != string::npos);
+    CHECK(text.find("\nshs_handshake_duration_seconds_count 2\n") != string::npos);
+    CHECK(text.find("\nshs_decryption_failures_total 1\n") != string::npos);
+
+    // Nothing is recorded while disabled:
+    HandshakeTest more;
+    CHECK(Metrics::snapshot().handshakesStarted == 5);
+}
+
+
+static PublicKey randomKey(std::mt19937_64 &rng) {
+    PublicKey key;
+    for (auto &b : key)
+        b = uint8_t(rng());
+    return key;
+}
+
+TEST_CASE("AuthorizedKeySet", "[SecretHandshake]") {
+    bool bloomFilter = GENERATE(false, true);
+    std::mt19937_64 rng(12345);
+    std::vector<PublicKey> keys(10000), others(10000);
+    for (auto &key : keys)
+        key = randomKey(rng);
+    for (auto &key : others)
+        key = randomKey(rng);
+
+    AuthorizedKeySet empty;
+    CHECK(empty.size() == 0);
+    CHECK(!empty.contains(keys[0]));
+
+    // Duplicates and the zero key aren't stored:
+    auto withExtras = keys;
+    withExtras.push_back(keys[17]);
+    withExtras.push_back(PublicKey{});
+    AuthorizedKeySet keySet(withExtras, bloomFilter);
+    CHECK(keySet.size() == keys.size());
+    CHECK(!keySet.contains(PublicKey{}));
+    CHECK(std::all_of(keys.begin(), keys.end(), [&](auto &k) {return keySet.contains(k);}));
+    CHECK(std::none_of(others.begin(), others.end(), [&](auto &k) {return keySet.contains(k);}));
+
+    // Reset:
+    keySet.reset(others, bloomFilter);
+    CHECK(keySet.size() == others.size());
+    CHECK(keySet.contains(others[0]));
+    CHECK(!keySet.contains(keys[0]));
+
+    // Save to a file and load it:
+    std::string path = "/tmp/shs_authorized_keys";
+    AuthorizedKeySet::writeFile(path, keys, bloomFilter);
+    keySet.loadFile(path);
+    CHECK(keySet.size() == keys.size());
+    CHECK(std::all_of(keys.begin(), keys.end(), [&](auto &k) {return keySet.contains(k);}));
+    CHECK(!keySet.contains(others[0]));
+
+    // Rewriting the file doesn't affect the loaded set until it's reloaded:
+    AuthorizedKeySet::writeFile(path, others, bloomFilter);
+    CHECK(keySet.contains(keys[0]));
+    keySet.loadFile(path);
+    CHECK(keySet.contains(others[0]));
+    CHECK(!keySet.contains(keys[0]));
+
+    ::unlink(path.c_str());
+
+    // Invalid files:
+    std::string badPath = "/tmp/shs_not_authorized_keys";
+    int fd = ::open(badPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    REQUIRE(fd >= 0);
+    CHECK(::write(fd, "not a key-set file, no sirree", 29) == 29);
+    ::close(fd);
+    CHECK_THROWS_AS(keySet.loadFile(badPath), std::runtime_error);
+    CHECK(keySet.contains(others[0]));      // unchanged
+    ::unlink(badPath.c_str());
+    CHECK_THROWS_AS(keySet.loadFile(badPath), std::system_error);
+}
+
+
+TEST_CASE("AuthorizedKeySet Reload While Reading", "[SecretHandshake]") {
+    std::mt19937_64 rng(6789);
+    std::vector<PublicKey> keys(1000);
+    for (auto &key : keys)
+        key = randomKey(rng);
+    std::vector<PublicKey> half(keys.begin(), keys.begin() + 500);
+    AuthorizedKeySet keySet(keys);
+
+    // Readers look up keys in the first half, which are in every version of the set, while the
+    // set is repeatedly replaced. (Catch isn't thread-safe, so the threads just count errors.)
+    std::atomic<bool> stop = false;
+    std::atomic<int> misses = 0;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&] {
+            while (!stop) {
+                for (size_t i = 0; i < half.size(); ++i)
+                    if (!keySet.contains(half[i]))
+                        ++misses;
+            }
+        });
+    }
+    for (int i = 0; i < 200; ++i)
+        keySet.reset((i % 2) ? keys : half);
+    stop = true;
+    for (auto &t : readers)
+        t.join();
+    CHECK(misses == 0);
+    CHECK(keySet.size() == keys.size());
+}
+
+extern "C" {
+    bool test_C_Metrics(void);
+}
+
+TEST_CASE("C Metrics", "[SecretHandshake]") {
+    CHECK(test_C_Metrics());
+}
+
+
+extern "C" {
+    bool test_C_Streams(void);
+}
+
+TEST_CASE("C Streams", "[SecretHandshake]") {
+    CHECK(test_C_Streams());
+}
+
+
+extern "C" {
+    bool test_C_BatchedCrypto(void);
+}
+
+TEST_CASE("C Batched Crypto", "[SecretHandshake]") {
+    CHECK(test_C_BatchedCrypto());
+}
+
+
+static mutex sLogMutex;
+static vector<LogEvent> sLogEvents;
+
+static void recordLogEvent(LogEvent const& event) {
+    unique_lock<mutex> lock(sLogMutex);
+    sLogEvents.push_back(event);
+}
+
+static size_t countLogEvents(LogEventType type) {
+    unique_lock<mutex> lock(sLogMutex);
+    return count_if(sLogEvents.begin(), sLogEvents.end(),
+                    [&](LogEvent const& e) {return e.type == type;});
+}
+
+static void runHandshake() {
+    HandshakeTest t;
+    REQUIRE(t.sendFromTo(t.client, t.server,  64));
+    REQUIRE(t.sendFromTo(t.server, t.client,  64));
+    REQUIRE(t.sendFromTo(t.client, t.server, 112));
+    REQUIRE(t.sendFromTo(t.server, t.client,  80));
+}
+
+
+TEST_CASE("Logging", "[SecretHandshake]") {
+    sLogEvents.clear();
+    LogEventCallback = recordLogEvent;
+    LogLevel savedLevel = logLevel();
+
+    SECTION("Info") {
+        CHECK(savedLevel == LogLevel::info);
+        runHandshake();
+        CHECK(sLogEvents.size() == 2);
+        CHECK(countLogEvents(LogEventType::succeeded) == 2);
+    }
+    SECTION("Debug") {
+        setLogLevel(LogLevel::debug);
+        runHandshake();
+        if (SHS_MIN_LOG_LEVEL <= int(LogLevel::debug)) {
+            CHECK(countLogEvents(LogEventType::awaitingBytes) == 4);
+            CHECK(countLogEvents(LogEventType::sendingBytes) == 4);
+            CHECK(countLogEvents(LogEventType::stepOK) == 4);
+            LogEvent const& e = sLogEvents[0];
+            CHECK(e.level == LogLevel::debug);
+            CHECK(e.type == LogEventType::sendingBytes);
+            CHECK(e.step == 1);
+            CHECK(e.byteCount == 64);
+            char message[100];
+            e.format(message, sizeof(message));
+            CHECK(string(message) == "Step 1/4: Sending 64 bytes...");
+        } else {
+            CHECK(sLogEvents.size() == 2);
+        }
+    }
+    SECTION("Failure") {
+        HandshakeTest t;
+        PublicKey badServerKey = t.serverKey.publicKey;
+        badServerKey[17]++;
+        ClientHandshake badClient({"App", t.clientKey}, badServerKey);
+        CHECK(t.sendFromTo(badClient, t.server,  64));
+        CHECK(t.sendFromTo(t.server, badClient,  64));
+        CHECK(!t.sendFromTo(badClient, t.server, 112));
+        REQUIRE(sLogEvents.size() == 1);
+        LogEvent const& e = sLogEvents[0];
+        CHECK(e.handshake == &t.server);
+        CHECK(e.level == LogLevel::err);
+        CHECK(e.type == LogEventType::invalidData);
+        CHECK(e.step == 3);
+        CHECK(e.error == Handshake::AuthError);
+    }
+    SECTION("Rejected authorization") {
+        HandshakeTest t;
+        t.server.setAsyncAuthorization(true);
+        CHECK(t.sendFromTo(t.client, t.server,  64));
+        CHECK(t.sendFromTo(t.server, t.client,  64));
+        CHECK(t.sendFromTo(t.client, t.server, 112));
+        t.server.resumeAuthorization(false);
+        REQUIRE(sLogEvents.size() == 1);
+        LogEvent const& e = sLogEvents[0];
+        CHECK(e.level == LogLevel::err);
+        CHECK(e.type == LogEventType::authorizationRejected);
+        CHECK(e.error == Handshake::AuthError);
+        char message[100];
+        e.format(message, sizeof(message));
+        CHECK(string(message) == "Client key was not authorized; HANDSHAKE FAILED");
+    }
+    SECTION("Off") {
+        setLogLevel(LogLevel::off);
+        runHandshake();
+        CHECK(sLogEvents.empty());
+    }
+    SECTION("Legacy callback") {
+        LogEventCallback = nullptr;
+        static string sMessage;
+        LogCallback = [](LogLevel level, const char *format, va_list args) {
+            char buf[100];
+            vsnprintf(buf, sizeof(buf), format, args);
+            sMessage = buf;
+        };
+        runHandshake();
+        LogCallback = nullptr;
+        CHECK(sMessage == "Successful handshake!");
+    }
+
+    LogEventCallback = nullptr;
+    setLogLevel(savedLevel);
+}
+
+
+TEST_CASE("Async Log Sink", "[SecretHandshake]") {
+    static constexpr int kThreads = 4, kHandshakesPerThread = 25;
+    sLogEvents.clear();
+    atomic<int> handled = 0;
+    thread::id sinkThread;
+    {
+        AsyncLogSink sink([&](LogEvent const& event) {
+            sinkThread = this_thread::get_id();
+            ++handled;
+        });
+        CHECK_THROWS_AS(AsyncLogSink(), logic_error);
+
+        vector<thread> threads;
+        for (int i = 0; i < kThreads; ++i) {
+            threads.emplace_back([] {
+                for (int j = 0; j < kHandshakesPerThread; ++j) {
+                    HandshakeTest t;
+                    bench::runHandshake(t.client, t.server);
+                }
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+        sink.flush();
+        CHECK(handled + sink.droppedCount() == 2 * kThreads * kHandshakesPerThread);
+        CHECK(sinkThread != this_thread::get_id());
+    }
+
+    // Without a handler it uses the regular callback, on its own thread:
+    LogEventCallback = recordLogEvent;
+    {
+        AsyncLogSink sink;
+        runHandshake();
+    }
+    LogEventCallback = nullptr;
+    CHECK(countLogEvents(LogEventType::succeeded) == 2);
+}
+
+
+TEST_CASE("Profiler", "[SecretHandshake]") {
+    Profiler::reset();
+    runHandshake();
+    string json = Profiler::chromeTraceJSON();
+    string table = Profiler::summaryTable();
+    CHECK(json.find("\"traceEvents\":[") != string::npos);
+    if (Profiler::available()) {
+        CHECK(json.find("{\"name\":\"verifyClientAuth\",\"cat\":\"shs\",\"ph\":\"X\"") != string::npos);
+        for (const char *name : {"x25519 ", "ed25519-sign ", "ed25519-check ", "sha256 ",
+                                 "hmac-sha512 ", "createClientAuth "})
+            CHECK(table.find(string("\n") + name) != string::npos);
+    } else {
+        CHECK(json.find("\"ph\"") == string::npos);
+    }
+    Profiler::reset();
+    CHECK(Profiler::chromeTraceJSON().find("\"ph\"") == string::npos);
+}
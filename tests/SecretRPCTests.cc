@@ -29,7 +29,12 @@
 
 #include "SecretConnection.hh"
 #include "SecretRPC.hh"
+#include "SHSMessageStream.hh"
+#include <capnp/serialize-async.h>
 #include <kj/async-io.h>
+#include <chrono>
+#include <cstring>
+#include <functional>
 #include <iostream>
 
 #include "catch.hpp"
@@ -96,3 +101,147 @@ TEST_CASE("SecretConnection", "[SecretHandshake]") {
         CHECK( result.wait(waitScope) == false );
     }
 }
+
+
+
+TEST_CASE("SecretConnection async authorizer", "[SecretHandshake]") {
+    bool allow = GENERATE(true, false);
+    static AppID kAppID = Context::appIDFromString("SecretRPCTests");
+    Context clientContext{kAppID, KeyPair::generate()};
+    Context serverContext{kAppID, KeyPair::generate()};
+    ClientWrapper clientWrapper(clientContext, serverContext.keyPair.publicKey);
+    ServerWrapper serverWrapper(serverContext, nullptr);
+    clientWrapper.setIsSocket(false);
+    serverWrapper.setIsSocket(false);
+
+    // The authorizer's decision arrives later, as though from a database lookup:
+    kj::Maybe<kj::Own<kj::PromiseFulfiller<bool>>> fulfiller;
+    PublicKey askedAbout = {};
+    serverWrapper.setAsyncAuthorizer([&](PublicKey const& key) {
+        askedAbout = key;
+        auto paf = kj::newPromiseAndFulfiller<bool>();
+        fulfiller = kj::mv(paf.fulfiller);
+        return kj::mv(paf.promise);
+    });
+
+    kj::EventLoop loop;
+    kj::WaitScope waitScope(loop);
+    kj::TwoWayPipe pipe = kj::newTwoWayPipe();
+    auto clientConn = clientWrapper.wrap(kj::mv(pipe.ends[0]))
+                        .then([](auto&&) {return true;}, [](kj::Exception) {return false;})
+                        .eagerlyEvaluate(nullptr);
+    auto serverConn = serverWrapper.wrap(kj::mv(pipe.ends[1]))
+                        .then([](auto&&) {return true;}, [](kj::Exception) {return false;})
+                        .eagerlyEvaluate(nullptr);
+
+    // Run the event loop until the server is waiting for the decision; the loop isn't blocked:
+    waitScope.poll();
+    REQUIRE(fulfiller != nullptr);
+    CHECK(askedAbout == clientContext.keyPair.publicKey);
+    CHECK(!clientConn.poll(waitScope));
+    KJ_ASSERT_NONNULL(fulfiller)->fulfill(kj::cp(allow));
+
+    CHECK(serverConn.wait(waitScope) == allow);
+    CHECK(clientConn.wait(waitScope) == allow);
+}
+
+namespace {
+
+    /// Runs the handshake on both ends of a pipe, returning a pair of connected message streams.
+    /// If `messageStream` is false, they're capnp's byte-stream `AsyncIoMessageStream`s on top of
+    /// regular wrapped streams, whose ownership is passed to `streams`.
+    pair<kj::Own<capnp::MessageStream>,kj::Own<capnp::MessageStream>>
+    connectMessageStreams(bool messageStream, kj::WaitScope &waitScope,
+                          vector<kj::Own<kj::AsyncIoStream>> &streams)
+    {
+        static AppID kAppID = Context::appIDFromString("SecretRPCTests");
+        Context clientContext{kAppID, KeyPair::generate()};
+        Context serverContext{kAppID, KeyPair::generate()};
+        ClientWrapper clientWrapper(clientContext, serverContext.keyPair.publicKey);
+        ServerWrapper serverWrapper(serverContext, nullptr);
+        clientWrapper.setIsSocket(false);
+        serverWrapper.setIsSocket(false);
+
+        kj::TwoWayPipe pipe = kj::newTwoWayPipe();
+        if (messageStream) {
+            auto client = clientWrapper.wrapMessageStream(kj::mv(pipe.ends[0])).eagerlyEvaluate(nullptr);
+            auto server = serverWrapper.wrapMessageStream(kj::mv(pipe.ends[1])).eagerlyEvaluate(nullptr);
+            kj::Own<capnp::MessageStream> c = client.wait(waitScope), s = server.wait(waitScope);
+            return {kj::mv(c), kj::mv(s)};
+        } else {
+            auto client = clientWrapper.wrap(kj::mv(pipe.ends[0])).eagerlyEvaluate(nullptr);
+            auto server = serverWrapper.wrap(kj::mv(pipe.ends[1])).eagerlyEvaluate(nullptr);
+            streams.push_back(client.wait(waitScope));
+            streams.push_back(server.wait(waitScope));
+            return {kj::heap<capnp::AsyncIoMessageStream>(*streams[0]),
+                    kj::heap<capnp::AsyncIoMessageStream>(*streams[1])};
+        }
+    }
+
+}
+
+
+TEST_CASE("SHSMessageStream", "[SecretHandshake]") {
+    TestExceptionCallback xcb;
+    kj::EventLoop loop;
+    kj::WaitScope waitScope(loop);
+    vector<kj::Own<kj::AsyncIoStream>> streams;
+    auto streamPair = connectMessageStreams(true, waitScope, streams);
+    auto &client = streamPair.first, &server = streamPair.second;
+
+    // A small message, and one big enough to need several frames:
+    for (size_t size : {5, 300'000}) {
+        capnp::MallocMessageBuilder builder;
+        auto data = builder.getRoot<capnp::AnyPointer>().initAs<capnp::Data>(unsigned(size));
+        for (size_t i = 0; i < size; ++i)
+            data[i] = kj::byte(i * 7 + (i >> 16));
+        auto writePromise = client->writeMessage(builder).eagerlyEvaluate(nullptr);
+        auto reader = server->readMessage().wait(waitScope);
+        writePromise.wait(waitScope);
+
+        auto received = reader->getRoot<capnp::AnyPointer>().getAs<capnp::Data>();
+        REQUIRE(received.size() == size);
+        CHECK(memcmp(received.begin(), data.begin(), size) == 0);
+    }
+
+    // Then EOF:
+    client->end().wait(waitScope);
+    CHECK(server->tryReadMessage().wait(waitScope) == nullptr);
+}
+
+
+TEST_CASE("Benchmark SHSMessageStream vs byte stream", "[.benchmark]") {
+    static constexpr int kCount = 100'000;
+    for (bool messageStream : {true, false}) {
+        kj::EventLoop loop;
+        kj::WaitScope waitScope(loop);
+        vector<kj::Own<kj::AsyncIoStream>> streams;
+        auto streamPair = connectMessageStreams(messageStream, waitScope, streams);
+        auto &client = streamPair.first, &server = streamPair.second;
+
+        // A small message, typical of an RPC call or return:
+        capnp::MallocMessageBuilder builder;
+        builder.getRoot<capnp::AnyPointer>().setAs<capnp::Text>("getWidget(17, \"frobozz\")");
+
+        auto start = chrono::steady_clock::now();
+        std::function<kj::Promise<void>(int)> writeLoop = [&](int i) -> kj::Promise<void> {
+            if (i == kCount)
+                return kj::READY_NOW;
+            return client->writeMessage(builder).then([&, i] {return writeLoop(i + 1);});
+        };
+        std::function<kj::Promise<void>(int)> readLoop = [&](int i) -> kj::Promise<void> {
+            if (i == kCount)
+                return kj::READY_NOW;
+            return server->readMessage().then([&, i](kj::Own<capnp::MessageReader>&&) {
+                return readLoop(i + 1);
+            });
+        };
+        auto writing = writeLoop(0).eagerlyEvaluate(nullptr);
+        readLoop(0).wait(waitScope);
+        writing.wait(waitScope);
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        fprintf(stderr, "  %-24s %8.0f messages/sec\n",
+                (messageStream ? "SHSMessageStream:" : "byte-stream wrapper:"),
+                kCount / elapsed.count());
+    }
+}
@@ -0,0 +1,626 @@
+//
+// SecretStreamBenchmarks.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+// These benchmarks are tagged `[.benchmark]`, so they don't run by default.
+// To run them:  `SecretHandshakeTests "[benchmark]"`
+// (Build with optimization, or the numbers are meaningless.)
+
+#include "BenchmarkUtils.hh"
+#include "aes256gcm.hh"
+#include "AuthorizedKeySet.hh"
+#include "AsyncLogSink.hh"
+#include "SealedMessage.hh"
+#include "SecretMetrics.hh"
+#include "shs.hh"
+#include <atomic>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HAVE_MALLINFO2 1
+#endif
+
+#include "catch.hpp"
+
+using namespace std;
+using namespace snej::shs;
+using namespace snej::shs::bench;
+
+
+namespace {
+
+    /// Pushes `totalBytes` through an EncryptionStream and DecryptionStream in `chunkSize` writes,
+    /// and returns the throughput in MB/sec.
+    double streamThroughput(CryptoBox::Protocol protocol, size_t chunkSize, size_t totalBytes) {
+        BenchSessions s;
+        EncryptionStream enc(s.session1, protocol);
+        DecryptionStream dec(s.session2, protocol);
+        vector<uint8_t> chunk(chunkSize, 'x'), received(chunkSize);
+
+        Stopwatch st;
+        for (size_t sent = 0; sent < totalBytes; sent += chunkSize) {
+            enc.push(chunk.data(), chunk.size());
+            auto cipher = enc.availableData();
+            REQUIRE(dec.push(cipher.data, cipher.size));
+            enc.skip(cipher.size);
+            while (dec.pull(received.data(), received.size()) > 0) { }
+        }
+        return totalBytes / 1.0e6 / st.elapsed();
+    }
+
+
+    /// Sends `count` messages of `messageSize` bytes, each as one frame, and returns the
+    /// nanoseconds per message. If `frames` is true, they're received with a frame visitor;
+    /// otherwise each message has a 4-byte length prefix, and the receiver re-parses the
+    /// byte stream.
+    double messageOverhead(bool frames, size_t messageSize, size_t count) {
+        static constexpr size_t kBatch = 64;   // Messages encrypted per "network write"
+        BenchSessions s;
+        EncryptionStream enc(s.session1);
+        DecryptionStream dec(s.session2);
+        vector<uint8_t> message(4 + messageSize, 'x');
+        message[0] = message[1] = 0;
+        message[2] = uint8_t(messageSize >> 8);
+        message[3] = uint8_t(messageSize);
+        size_t received = 0, receivedBytes = 0;
+        vector<uint8_t> pending;      // Byte-stream mode's partial message
+
+        if (frames) {
+            dec.setFrameVisitor([&](input_data frame) {
+                ++received;
+                receivedBytes += frame.size;
+            });
+        }
+
+        Stopwatch st;
+        for (size_t sent = 0; sent < count; ) {
+            for (size_t i = 0; i < kBatch && sent < count; ++i, ++sent) {
+                if (frames)
+                    enc.push(&message[4], messageSize);
+                else
+                    enc.push(message.data(), message.size());
+            }
+            auto cipher = enc.availableData();
+            REQUIRE(dec.push(cipher.data, cipher.size));
+            enc.skip(cipher.size);
+            if (!frames) {
+                // Re-parse the length prefixes, buffering any incomplete message:
+                auto avail = dec.availableData();
+                pending.insert(pending.end(), (const uint8_t*)avail.data,
+                               (const uint8_t*)avail.data + avail.size);
+                dec.skip(avail.size);
+                size_t pos = 0;
+                while (pending.size() - pos >= 4) {
+                    auto p = &pending[pos];
+                    size_t len = (size_t(p[0]) << 24) | (size_t(p[1]) << 16)
+                               | (size_t(p[2]) << 8) | p[3];
+                    if (pending.size() - pos < 4 + len)
+                        break;
+                    ++received;
+                    receivedBytes += len;
+                    pos += 4 + len;
+                }
+                pending.erase(pending.begin(), pending.begin() + pos);
+            }
+        }
+        double elapsed = st.elapsed();
+        CHECK(received == count);
+        CHECK(receivedBytes == count * messageSize);
+        return elapsed * 1.0e9 / count;
+    }
+
+
+    /// Has one thread push `totalBytes` into an encryption stream in `chunkSize` writes, while
+    /// another thread reads the ciphertext, using either an `SPSCEncryptionStream` or an
+    /// `EncryptionStream` guarded by a mutex. Returns the throughput in MB/sec.
+    double twoThreadThroughput(bool lockFree, size_t chunkSize, size_t totalBytes) {
+        BenchSessions s;
+        SPSCEncryptionStream spsc(s.session1);
+        EncryptionStream locked(s.session1);
+        mutex lock;
+        vector<uint8_t> chunk(chunkSize, 'x');
+        atomic<bool> done = false;
+
+        Stopwatch st;
+        thread consumer([&] {
+            vector<uint8_t> buf(65536);
+            while (true) {
+                size_t n;
+                if (lockFree) {
+                    n = spsc.skip(spsc.availableData().size);
+                } else {
+                    unique_lock<mutex> lk(lock);
+                    n = locked.pull(buf.data(), buf.size());
+                }
+                if (n == 0) {
+                    if (done)
+                        break;
+                    this_thread::yield();
+                }
+            }
+        });
+        for (size_t sent = 0; sent < totalBytes; sent += chunkSize) {
+            if (lockFree) {
+                for (size_t n = 0; n < chunkSize; ) {
+                    size_t pushed = spsc.push(&chunk[n], chunkSize - n);
+                    if (pushed == 0)
+                        this_thread::yield();
+                    n += pushed;
+                }
+            } else {
+                unique_lock<mutex> lk(lock);
+                locked.push(chunk.data(), chunk.size());
+            }
+        }
+        done = true;
+        consumer.join();
+        return totalBytes / 1.0e6 / st.elapsed();
+    }
+
+}
+
+
+TEST_CASE("Benchmark stream protocols", "[.benchmark]") {
+    static constexpr size_t kTotal = 256 << 20;
+    cerr << "AES hardware acceleration: "
+         << (CryptoBox::aesIsHardwareAccelerated() ? "yes" : "no") << endl;
+    for (size_t chunkSize : {64, 1024, 16384, 65535}) {
+        for (auto protocol : {CryptoBox::Compact, CryptoBox::BoxStream, CryptoBox::AES256GCM,
+                              CryptoBox::MACOnly}) {
+            double mbps = streamThroughput(protocol, chunkSize, kTotal);
+            fprintf(stderr, "  %-10s %6zu-byte writes: %8.1f MB/sec\n",
+                    protocolName(protocol), chunkSize, mbps);
+        }
+    }
+}
+
+
+TEST_CASE("Benchmark metrics overhead", "[.benchmark]") {
+    // Small writes make the per-frame cost of metrics as visible as possible:
+    static constexpr size_t kTotal = 64 << 20;
+    for (size_t chunkSize : {64, 1024}) {
+        Metrics::enable(false);
+        double offMBps = streamThroughput(CryptoBox::Compact, chunkSize, kTotal);
+        Metrics::enable(true);
+        double onMBps = streamThroughput(CryptoBox::Compact, chunkSize, kTotal);
+        Metrics::enable(false);
+        fprintf(stderr, "  %6zu-byte writes: metrics off %8.1f MB/sec, on %8.1f MB/sec (%+.1f%%)\n",
+                chunkSize, offMBps, onMBps, (onMBps / offMBps - 1.0) * 100.0);
+    }
+}
+
+
+// Runs `count` handshakes in memory, and returns the average time of each in microseconds.
+static double handshakeMicros(int count) {
+    KeyPair serverKey = KeyPair::generate(), clientKey = KeyPair::generate();
+    Stopwatch st;
+    for (int i = 0; i < count; ++i) {
+        ServerHandshake server({"App", serverKey});
+        ClientHandshake client({"App", clientKey}, serverKey.publicKey);
+        REQUIRE(runHandshake(client, server));
+    }
+    return st.elapsed() * 1.0e6 / count;
+}
+
+
+TEST_CASE("Benchmark logging overhead", "[.benchmark]") {
+    static constexpr int kCount = 2000;
+    auto report = [](const char *what) {
+        fprintf(stderr, "  %-32s %8.2f us/handshake\n", what, handshakeMicros(kCount));
+    };
+    LogLevel savedLevel = logLevel();
+
+    report("no callback");
+    LogCallback = [](LogLevel, const char *format, va_list args) {
+        char message[100];
+        vsnprintf(message, sizeof(message), format, args);
+    };
+    setLogLevel(LogLevel::debug);
+    report("string callback, debug level");
+    setLogLevel(LogLevel::info);
+    report("string callback, info level");
+    LogCallback = nullptr;
+
+    LogEventCallback = [](LogEvent const& event) {
+        char message[100];
+        event.format(message, sizeof(message));
+    };
+    report("event callback, info level");
+    {
+        AsyncLogSink sink;
+        report("async sink, info level");
+    }
+    LogEventCallback = nullptr;
+    setLogLevel(savedLevel);
+}
+
+
+TEST_CASE("Benchmark profile of handshakes and frames", "[.benchmark]") {
+    // Build with SHS_PROFILE to get results from this.
+    if (!Profiler::available())
+        cerr << "(The library wasn't built with SHS_PROFILE, so there's nothing to show.)\n";
+    KeyPair serverKey = KeyPair::generate(), clientKey = KeyPair::generate();
+    auto handshake = [&] {
+        ServerHandshake server({"App", serverKey});
+        ClientHandshake client({"App", clientKey}, serverKey.publicKey);
+        REQUIRE(runHandshake(client, server));
+        return make_pair(client.session(), server.session());
+    };
+
+    // One handshake, then some frames of each protocol, for a flame chart:
+    Profiler::reset();
+    auto [clientSession, serverSession] = handshake();
+    for (auto protocol : {CryptoBox::Compact, CryptoBox::BoxStream, CryptoBox::AES256GCM,
+                          CryptoBox::MACOnly}) {
+        EncryptoBox enc(clientSession, protocol);
+        DecryptoBox dec(serverSession, protocol);
+        uint8_t frame[1100], plain[1024] = {};
+        for (int i = 0; i < 10; ++i) {
+            output_buffer out = {frame, sizeof(frame)};
+            REQUIRE(enc.encrypt({plain, sizeof(plain)}, out) == Success);
+            input_data in = {frame, out.size};
+            output_buffer result = {plain, sizeof(plain)};
+            REQUIRE(dec.decrypt(in, result) == Success);
+        }
+    }
+    dumpProfile("shs_profile_one_handshake");
+
+    // Many handshakes, for the summary table:
+    for (int i = 0; i < 1000; ++i)
+        handshake();
+    dumpProfile("shs_profile_handshakes");
+}
+
+
+TEST_CASE("Benchmark frame visitor vs byte stream", "[.benchmark]") {
+    static constexpr size_t kTotal = 64 << 20;
+    for (size_t messageSize : {16, 100, 1000, 10000}) {
+        size_t count = std::min(kTotal / messageSize, size_t(1'000'000));
+        double framesNs = messageOverhead(true, messageSize, count);
+        double streamNs = messageOverhead(false, messageSize, count);
+        fprintf(stderr, "  %6zu-byte messages: frame visitor %8.1f ns/msg, byte stream %8.1f ns/msg\n",
+                messageSize, framesNs, streamNs);
+    }
+}
+
+
+TEST_CASE("Benchmark SPSC vs mutex streams", "[.benchmark]") {
+    static constexpr size_t kTotal = 256 << 20;
+    for (size_t chunkSize : {64, 1024, 16384}) {
+        double spscMBps = twoThreadThroughput(true, chunkSize, kTotal);
+        double mutexMBps = twoThreadThroughput(false, chunkSize, kTotal);
+        fprintf(stderr, "  %6zu-byte writes: SPSC %8.1f MB/sec, mutex %8.1f MB/sec\n",
+                chunkSize, spscMBps, mutexMBps);
+    }
+}
+
+
+TEST_CASE("Benchmark loopback MACOnly vs Compact", "[.benchmark]") {
+    static constexpr size_t kTotal = 256 << 20;
+    for (size_t chunkSize : {1024, 16384, 65535}) {
+        for (auto protocol : {CryptoBox::Compact, CryptoBox::MACOnly}) {
+            double mbps = loopbackThroughput(protocol, chunkSize, kTotal);
+            fprintf(stderr, "  loopback %-10s %6zu-byte writes: %8.1f MB/sec\n",
+                    protocolName(protocol), chunkSize, mbps);
+        }
+    }
+}
+
+
+TEST_CASE("Benchmark AES-256-GCM portable vs AES-NI", "[.benchmark]") {
+    static constexpr size_t kTotal = 16 << 20;
+    uint8_t key[32] = {}, iv[12] = {}, tag[16];
+    vector<uint8_t> buf(16384);
+    for (bool portable : {false, true}) {
+        if (!portable && !impl::aes256gcm::hardwareAccelerated())
+            continue;
+        impl::aes256gcm::disableHardwareAcceleration(portable);
+        impl::aes256gcm gcm(key);
+        impl::aes256gcm::disableHardwareAcceleration(false);
+        Stopwatch st;
+        for (size_t n = 0; n < kTotal; n += buf.size())
+            gcm.seal(iv, nullptr, 0, buf.data(), buf.size(), buf.data(), tag);
+        fprintf(stderr, "  AES-256-GCM (%s): %8.1f MB/sec\n",
+                (portable ? "portable" : "AES-NI"), kTotal / 1.0e6 / st.elapsed());
+    }
+}
+
+
+// Runs `count` handshakes from a client that isn't in `keySet`, and returns the average CPU time
+// the server spends rejecting each, in microseconds. If `preAuth` is true the set is checked
+// before the client's signature is verified, else after.
+static double rejectedHandshakeMicros(AuthorizedKeySet const& keySet, bool preAuth, int count) {
+    KeyPair serverKey = KeyPair::generate(), clientKey = KeyPair::generate();
+    double seconds = 0;
+    uint8_t buf[256];
+    for (int i = 0; i < count; ++i) {
+        Stopwatch st1;
+        auto server = make_unique<ServerHandshake>(Context{"App", serverKey});
+        if (preAuth)
+            server->setClientPreAuthorizer(keySet.authorizer());
+        else
+            server->setClientAuthorizer(keySet.authorizer());
+        seconds += st1.elapsed();
+
+        ClientHandshake client({"App", clientKey}, serverKey.publicKey);
+        intptr_t n = client.copyBytesToSend(buf, sizeof(buf));
+        Stopwatch st2;
+        server->receivedBytes(buf, n);
+        n = server->copyBytesToSend(buf, sizeof(buf));
+        seconds += st2.elapsed();
+        client.receivedBytes(buf, n);
+        n = client.copyBytesToSend(buf, sizeof(buf));
+        Stopwatch st3;
+        server->receivedBytes(buf, n);
+        seconds += st3.elapsed();
+        REQUIRE(server->error() == Handshake::AuthError);
+    }
+    return seconds * 1.0e6 / count;
+}
+
+
+TEST_CASE("Benchmark rejected handshakes and AuthorizedKeySet", "[.benchmark]") {
+    mt19937_64 rng(42);
+    auto randomKeys = [&](size_t n) {
+        vector<PublicKey> keys(n);
+        for (auto &key : keys)
+            for (auto &b : key)
+                b = uint8_t(rng());
+        return keys;
+    };
+
+    AuthorizedKeySet bigSet(randomKeys(1'000'000));
+    static constexpr int kHandshakes = 1000;
+    fprintf(stderr, "  rejecting after signature check:  %8.2f us/handshake\n",
+            rejectedHandshakeMicros(bigSet, false, kHandshakes));
+    fprintf(stderr, "  rejecting before signature check: %8.2f us/handshake\n",
+            rejectedHandshakeMicros(bigSet, true, kHandshakes));
+
+    auto absent = randomKeys(1'000'000);
+    for (size_t size : {1'000, 1'000'000, 4'000'000}) {
+        auto keys = randomKeys(size);
+        for (bool bloom : {false, true}) {
+            AuthorizedKeySet keySet(keys, bloom);
+            size_t hits = 0;
+            Stopwatch st1;
+            for (auto &key : keys)
+                hits += keySet.contains(key);
+            double presentNs = st1.elapsed() * 1.0e9 / keys.size();
+            Stopwatch st2;
+            for (auto &key : absent)
+                hits += keySet.contains(key);
+            double absentNs = st2.elapsed() * 1.0e9 / absent.size();
+            CHECK(hits == keys.size());
+            fprintf(stderr, "  %7zu keys, %-9s lookup: present %6.1f ns, absent %6.1f ns\n",
+                    size, (bloom ? "Bloom" : "no Bloom"), presentNs, absentNs);
+        }
+    }
+
+    // Lookups from several threads at once, which shouldn't slow each other down:
+    AuthorizedKeySet keySet(randomKeys(1'000'000));
+    for (unsigned nThreads : {1u, 2u, 4u, 8u}) {
+        atomic<size_t> hits = 0;
+        Stopwatch st;
+        vector<thread> threads;
+        for (unsigned t = 0; t < nThreads; ++t) {
+            threads.emplace_back([&] {
+                size_t myHits = 0;
+                for (auto &key : absent)
+                    myHits += keySet.contains(key);
+                hits += myHits;
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+        double ns = st.elapsed() * 1.0e9 / absent.size();
+        CHECK(hits == 0);
+        fprintf(stderr, "  %2u threads looking up concurrently: %6.1f ns/lookup per thread\n",
+                nThreads, ns);
+    }
+}
+
+static size_t heapInUse() {
+#ifdef HAVE_MALLINFO2
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+
+// Simulates a flood of connections that send a ClientChallenge, receive the ServerChallenge,
+// then go silent. Returns the CPU time and heap memory per connection.
+static pair<double,double> abandonedConnectionCost(Context const& context, bool cookieMode,
+                                                   bool sendChallenge, int count)
+{
+    KeyPair clientKey = KeyPair::generate();
+    ClientHandshake client({context.appID, clientKey}, context.keyPair.publicKey);
+    auto toSend = client.bytesToSend();
+    vector<uint8_t> challenge((uint8_t*)toSend.first, (uint8_t*)toSend.first + toSend.second);
+
+    auto jar = make_shared<CookieJar>(context);
+    vector<unique_ptr<ServerHandshake>> servers;
+    servers.reserve(count);
+    size_t heapBefore = heapInUse();
+    Stopwatch st;
+    for (int i = 0; i < count; ++i) {
+        auto server = cookieMode ? make_unique<ServerHandshake>(jar)
+                                 : make_unique<ServerHandshake>(context);
+        if (sendChallenge) {
+            server->receivedBytes(challenge.data(), challenge.size());
+            server->bytesToSend();
+            server->sendCompleted();
+        }
+        servers.push_back(std::move(server));
+    }
+    double micros = st.elapsed() * 1.0e6 / count;
+    double bytes = double(heapInUse() - heapBefore) / count;
+    return {micros, bytes};
+}
+
+
+TEST_CASE("Benchmark abandoned connections in cookie mode", "[.benchmark]") {
+    Context context("App", KeyPair::generate());
+    static constexpr int kConnections = 10000;
+    for (bool sendChallenge : {false, true}) {
+        for (bool cookieMode : {false, true}) {
+            auto [micros, bytes] = abandonedConnectionCost(context, cookieMode, sendChallenge,
+                                                           kConnections);
+            fprintf(stderr, "  %-8s server, abandoned %-23s %7.2f us, %6.0f bytes/connection\n",
+                    (cookieMode ? "cookie" : "standard"),
+                    (sendChallenge ? "after ServerChallenge:" : "before ClientChallenge:"),
+                    micros, bytes);
+        }
+    }
+}
+
+TEST_CASE("Benchmark multi-tenant dispatch", "[.benchmark]") {
+    static constexpr int kReps = 2000;
+    KeyPair clientKey = KeyPair::generate();
+    for (size_t nTenants : {1, 16, 256}) {
+        ContextSet contexts;
+        for (size_t i = 0; i < nTenants; ++i)
+            contexts.add(Context(("App" + to_string(i)).c_str(), KeyPair::generate()));
+        // The worst case is the last tenant's challenge, or an unknown AppID:
+        ClientHandshake client({contexts[nTenants - 1].appID, clientKey}, {});
+        auto challenge = client.bytesToSend();
+        auto &challengeData = *(impl::ChallengeData const*)challenge.first;
+
+        Stopwatch st1;
+        for (int i = 0; i < kReps; ++i) {
+            bool found = false;
+            for (size_t t = 0; t < nTenants && !found; ++t)
+                found = impl::handshake::isValidChallenge(impl::app_id(contexts[t].appID),
+                                                          challengeData);
+            CHECK(found);
+        }
+        double fullMicros = st1.elapsed() * 1.0e6 / kReps;
+
+        Stopwatch st2;
+        for (int i = 0; i < kReps; ++i)
+            CHECK(contexts.findForChallenge(challenge.first, challenge.second));
+        double precomputedMicros = st2.elapsed() * 1.0e6 / kReps;
+
+        fprintf(stderr, "  %3zu tenants: full HMAC per tenant %8.2f us, precomputed %8.2f us"
+                        " (%.2f us/tenant)\n",
+                nTenants, fullMicros, precomputedMicros, precomputedMicros / nTenants);
+    }
+}
+
+
+TEST_CASE("Benchmark Compressed protocol", "[.benchmark]") {
+    // Sends a JSON-like corpus through an EncryptionStream and DecryptionStream, and reports
+    // the bytes on the wire and the CPU time per MB on each side.
+    static constexpr size_t kTotal = 64 << 20;
+    string corpus = jsonCorpus(1 << 20);
+    struct Config {const char *name; CryptoBox::Protocol protocol; CryptoBox::Codec codec;};
+    for (size_t chunkSize : {1024, 16384, 65534}) {
+        for (Config config : {Config{"Compact", CryptoBox::Compact, CryptoBox::Uncompressed},
+                              Config{"LZ4",     CryptoBox::Compressed, CryptoBox::LZ4},
+                              Config{"Zstd",    CryptoBox::Compressed, CryptoBox::Zstd}}) {
+            if (!CryptoBox::codecAvailable(config.codec))
+                continue;
+            BenchSessions s;
+            EncryptionStream enc(s.session1, config.protocol);
+            DecryptionStream dec(s.session2, config.protocol);
+            if (config.protocol == CryptoBox::Compressed)
+                enc.setCodec(config.codec);
+            vector<uint8_t> received(chunkSize);
+            size_t wireBytes = 0;
+            clock_t encTime = 0, decTime = 0;
+            for (size_t sent = 0; sent < kTotal; sent += chunkSize) {
+                size_t pos = sent % (corpus.size() - chunkSize);
+                clock_t t0 = clock();
+                enc.push(&corpus[pos], chunkSize);
+                auto cipher = enc.availableData();
+                clock_t t1 = clock();
+                REQUIRE(dec.push(cipher.data, cipher.size));
+                while (dec.pull(received.data(), received.size()) > 0) { }
+                decTime += clock() - t1;
+                encTime += t1 - t0;
+                wireBytes += cipher.size;
+                enc.skip(cipher.size);
+            }
+            double mb = kTotal / 1.0e6;
+            fprintf(stderr, "  %-8s %6zu-byte writes: %5.1f%% on the wire, "
+                            "encrypt %6.2f ms/MB, decrypt %6.2f ms/MB\n",
+                    config.name, chunkSize, 100.0 * wireBytes / kTotal,
+                    1000.0 * encTime / CLOCKS_PER_SEC / mb, 1000.0 * decTime / CLOCKS_PER_SEC / mb);
+        }
+    }
+}
+
+
+TEST_CASE("Benchmark sealed messages batch open", "[.benchmark]") {
+    // A server draining a queue of small sealed messages, opened one at a time vs. in batches
+    // on several threads:
+    static constexpr size_t kCount = 2000, kSize = 200;
+    Context sender("SealedBench", KeyPair::generate());
+    Context server("SealedBench", KeyPair::generate());
+    MessageSealer sealer(sender);
+    MessageOpener opener(server);
+
+    vector<uint8_t> message(kSize, 'x');
+    vector<vector<uint8_t>> sealed(kCount, vector<uint8_t>(MessageSealer::sealedSize(kSize)));
+    vector<input_data> inputs;
+    Stopwatch st;
+    for (auto &s : sealed) {
+        output_buffer out = {s.data(), s.size()};
+        REQUIRE(sealer.seal(server.keyPair.publicKey, {message.data(), kSize}, out) == Success);
+        inputs.push_back({s.data(), s.size()});
+    }
+    fprintf(stderr, "  seal:                  %8.0f messages/sec\n", kCount / st.elapsed());
+
+    vector<uint8_t> buffer(kCount * kSize);
+    st = Stopwatch();
+    for (auto &in : inputs) {
+        output_buffer out = {buffer.data(), kSize};
+        REQUIRE(opener.open(in, out) == Success);
+    }
+    fprintf(stderr, "  open one at a time:    %8.0f messages/sec\n", kCount / st.elapsed());
+
+    vector<MessageOpener::Result> results(kCount);
+    unsigned cores = max(1u, thread::hardware_concurrency());
+    for (unsigned threads : {1u, 2u, 4u, cores}) {
+        output_buffer out = {buffer.data(), buffer.size()};
+        st = Stopwatch();
+        REQUIRE(opener.openAll(inputs.data(), kCount, out, results.data(), threads) == kCount);
+        fprintf(stderr, "  openAll, %2u threads:   %8.0f messages/sec\n",
+                threads, kCount / st.elapsed());
+    }
+}
+
+
+extern "C" {
+    void bench_C_BatchedCrypto(void);
+}
+
+TEST_CASE("Benchmark C batched encrypt/decrypt", "[.benchmark]") {
+    bench_C_BatchedCrypto();
+}
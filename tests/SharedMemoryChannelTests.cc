@@ -0,0 +1,217 @@
+//
+// SharedMemoryChannelTests.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+// (This file is only built on Linux.)
+
+#include "SharedMemoryChannel.hh"
+#include "BenchmarkUtils.hh"
+#include <cstring>
+#include <thread>
+#include <sys/socket.h>
+
+#include "catch.hpp"
+
+using namespace std;
+using namespace snej::shs;
+using namespace snej::shs::bench;
+
+
+namespace {
+
+    /// Two SharedMemoryChannels connected to each other, over a Unix-domain socketpair.
+    struct ChannelPair {
+        KeyPair serverKey = KeyPair::generate(), clientKey = KeyPair::generate();
+        unique_ptr<SharedMemoryChannel> server, client;
+
+        explicit ChannelPair(SharedMemoryChannel::Options const& options = {},
+                             ServerHandshake::ClientAuthorizer auth = nullptr)
+        {
+            int fds[2];
+            REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+            thread serverThread([&] {
+                server = SharedMemoryChannel::accept(fds[1], {"App", serverKey}, auth, options);
+                if (!server)
+                    ::close(fds[1]);
+            });
+            client = SharedMemoryChannel::connect(fds[0], {"App", clientKey},
+                                                  serverKey.publicKey, options);
+            if (!client)
+                ::close(fds[0]);
+            serverThread.join();
+        }
+    };
+
+
+    /// Reads exactly `size` bytes, or fewer at EOF.
+    size_t readFully(SharedMemoryChannel &channel, void *dst, size_t size) {
+        size_t total = 0;
+        while (total < size) {
+            size_t n = channel.read((uint8_t*)dst + total, size - total);
+            if (n == 0)
+                break;
+            total += n;
+        }
+        return total;
+    }
+
+}
+
+
+TEST_CASE("SharedMemoryChannel", "[SecretHandshake][SharedMemory]") {
+    ChannelPair pair;
+    REQUIRE(pair.client);
+    REQUIRE(pair.server);
+    CHECK(pair.server->peerPublicKey() == pair.clientKey.publicKey);
+    CHECK(pair.client->peerPublicKey() == pair.serverKey.publicKey);
+    CHECK(pair.client->protocol() == CryptoBox::Compact);
+
+    // Small messages each way:
+    char buf[100];
+    REQUIRE(pair.client->write("Hello", 5));
+    CHECK(readFully(*pair.server, buf, 5) == 5);
+    CHECK(memcmp(buf, "Hello", 5) == 0);
+    REQUIRE(pair.server->write("Goodbye", 7));
+    CHECK(readFully(*pair.client, buf, 7) == 7);
+    CHECK(memcmp(buf, "Goodbye", 7) == 0);
+
+    // Send much more than the ring can hold, so the writer has to block and the ring wraps:
+    vector<uint8_t> message(5'000'000);
+    for (size_t i = 0; i < message.size(); ++i)
+        message[i] = uint8_t(i * 7 + (i >> 16));
+    thread writer([&] {
+        pair.client->write(message.data(), message.size());
+        pair.client->close();
+    });
+    vector<uint8_t> received(message.size());
+    CHECK(readFully(*pair.server, received.data(), received.size()) == message.size());
+    writer.join();
+    CHECK(received == message);
+
+    // Then EOF:
+    CHECK(pair.server->read(buf, sizeof(buf)) == 0);
+    CHECK(!pair.server->write("?", 1));
+}
+
+
+TEST_CASE("SharedMemoryChannel negotiates MACOnly", "[SecretHandshake][SharedMemory]") {
+    SharedMemoryChannel::Options options;
+    options.protocols = {CryptoBox::Compact, CryptoBox::MACOnly};
+    ChannelPair pair(options);
+    REQUIRE(pair.client);
+    REQUIRE(pair.server);
+    CHECK(pair.client->protocol() == CryptoBox::MACOnly);
+    CHECK(pair.server->protocol() == CryptoBox::MACOnly);
+
+    char buf[10];
+    REQUIRE(pair.server->write("Hello", 5));
+    CHECK(readFully(*pair.client, buf, 5) == 5);
+    CHECK(memcmp(buf, "Hello", 5) == 0);
+}
+
+
+TEST_CASE("SharedMemoryChannel unauthorized client", "[SecretHandshake][SharedMemory]") {
+    ChannelPair pair({}, [](PublicKey const&) {return false;});
+    CHECK(!pair.server);
+    CHECK(!pair.client);
+}
+
+
+TEST_CASE("Benchmark shared memory vs loopback TCP", "[.benchmark]") {
+    static constexpr size_t kTotal = 256 << 20;
+    static constexpr int kRoundTrips = 20000;
+
+    for (size_t chunkSize : {1024, 16384, 65535}) {
+        ChannelPair pair;
+        REQUIRE(pair.client);
+        vector<uint8_t> chunk(chunkSize, 'x');
+        Stopwatch st;
+        thread reader([&] {
+            vector<uint8_t> buf(65536);
+            size_t received = 0;
+            while (received < kTotal) {
+                size_t n = pair.server->read(buf.data(), buf.size());
+                if (n == 0)
+                    break;
+                received += n;
+            }
+        });
+        for (size_t sent = 0; sent < kTotal; sent += chunkSize)
+            REQUIRE(pair.client->write(chunk.data(), chunk.size()));
+        reader.join();
+        double shmMBps = kTotal / 1.0e6 / st.elapsed();
+        double tcpMBps = loopbackThroughput(CryptoBox::Compact, chunkSize, kTotal);
+        fprintf(stderr, "  %6zu-byte writes: shared memory %8.1f MB/sec, TCP %8.1f MB/sec\n",
+                chunkSize, shmMBps, tcpMBps);
+    }
+
+    {
+        // Latency: ping-pong a 64-byte message.
+        ChannelPair pair;
+        REQUIRE(pair.client);
+        thread echo([&] {
+            char buf[64];
+            for (int i = 0; i < kRoundTrips; ++i) {
+                if (readFully(*pair.server, buf, sizeof(buf)) != sizeof(buf)
+                        || !pair.server->write(buf, sizeof(buf)))
+                    break;
+            }
+        });
+        char buf[64] = {};
+        Stopwatch st;
+        for (int i = 0; i < kRoundTrips; ++i) {
+            REQUIRE(pair.client->write(buf, sizeof(buf)));
+            REQUIRE(readFully(*pair.client, buf, sizeof(buf)) == sizeof(buf));
+        }
+        double shmUsec = st.elapsed() * 1.0e6 / kRoundTrips;
+        echo.join();
+        double tcpUsec = loopbackLatency(CryptoBox::Compact, 64, kRoundTrips);
+        fprintf(stderr, "  64-byte round trip: shared memory %6.2f usec, TCP %6.2f usec\n",
+                shmUsec, tcpUsec);
+    }
+}
+
+
+TEST_CASE("SharedMemoryChannel close from another thread", "[SecretHandshake][SharedMemory]") {
+    ChannelPair pair;
+    REQUIRE(pair.client);
+    REQUIRE(pair.server);
+
+    // Closing the channel wakes up its reader, blocked on another thread:
+    size_t bytesRead = 1;
+    thread reader([&] {
+        char buf[10];
+        bytesRead = pair.server->read(buf, sizeof(buf));
+    });
+    this_thread::sleep_for(chrono::milliseconds(50));
+    pair.server->close();
+    reader.join();
+    CHECK(bytesRead == 0);
+    CHECK(!pair.server->write("?", 1));
+
+    // And the peer sees EOF:
+    char buf[10];
+    CHECK(pair.client->read(buf, sizeof(buf)) == 0);
+}
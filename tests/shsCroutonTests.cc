@@ -26,6 +26,8 @@
 
 #include "SecretHandshakeStream.hh"
 #include "crouton/Crouton.hh"
+#include <chrono>
+#include <iomanip>
 #include <iostream>
 
 #include "catch.hpp"
@@ -75,3 +77,292 @@ TEST_CASE("SecretHandshakeStream", "[SecretHandshake]") {
 }
 
 
+
+
+TEST_CASE("SecretHandshakeStream async authorizer", "[SecretHandshake]") {
+    using SecretHandshakeStream = snej::shs::crouton::SecretHandshakeStream;
+
+    // A delegate whose authorization takes a while, as though it were querying a database:
+    struct SlowDelegate : public SecretHandshakeStream::Delegate {
+        bool allow;
+        PublicKey askedAbout = {};
+        ASYNC<bool> authorizeSecretHandshakeAsync(PublicKey const& key) override {
+            askedAbout = key;
+            AWAIT Timer::sleep(0.05);
+            RETURN allow;
+        }
+    };
+
+    bool allow = GENERATE(true, false);
+    RunCoroutine([&]() -> Future<void> {
+        AppID app          = Context::appIDFromString("SecretHandshakeStream");
+        KeyPair clientKeys = KeyPair::generate();
+        KeyPair serverKeys = KeyPair::generate();
+        Context clientCtx {app, clientKeys};
+        Context serverCtx {app, serverKeys};
+        auto [clientSock, serverSock] = io::LocalSocket::createPair();
+
+        SecretHandshakeStream clientStream(clientSock, clientCtx, &serverKeys.publicKey);
+        SecretHandshakeStream serverStream(serverSock, serverCtx, nullptr);
+        SlowDelegate delegate;
+        delegate.allow = allow;
+        serverStream.setDelegate(&delegate);
+
+        auto f1 = clientStream.open();
+        auto f2 = serverStream.open();
+        Result<void> r1 = AWAIT NoThrow(std::move(f1));
+        Result<void> r2 = AWAIT NoThrow(std::move(f2));
+        CHECK(delegate.askedAbout == clientKeys.publicKey);
+        CHECK(r2.ok() == allow);
+        CHECK(r1.ok() == allow);
+        if (allow) {
+            AWAIT clientStream.close();
+            AWAIT serverStream.close();
+        }
+        RETURN noerror;
+    });
+}
+
+
+static Future<void> connectClient(Context ctx, PublicKey serverKey, uint16_t port) {
+    snej::shs::crouton::SecretHandshakeSocket socket(ctx, serverKey);
+    socket.bind("127.0.0.1", port);
+    AWAIT socket.open();
+    AWAIT socket.stream()->close();
+    RETURN noerror;
+}
+
+
+TEST_CASE("SecretHandshakeServer stress test", "[SecretHandshake]") {
+    using SecretHandshakeServer = snej::shs::crouton::SecretHandshakeServer;
+    static constexpr uint16_t kPort = 34561;
+    static constexpr size_t kClients = 500, kMaxConcurrent = 32;
+
+    RunCoroutine([&]() -> Future<void> {
+        AppID app          = Context::appIDFromString("SecretHandshakeServer");
+        KeyPair serverKeys = KeyPair::generate();
+        SecretHandshakeServer server({app, serverKeys}, kPort, "127.0.0.1");
+        server.setMaxConcurrentHandshakes(kMaxConcurrent);
+        size_t maxActive = 0, accepted = 0;
+        server.setClientAuthorizer([&](PublicKey const&) -> ASYNC<bool> {
+            maxActive = std::max(maxActive, server.activeHandshakes());
+            RETURN true;
+        });
+        server.listen([&](std::shared_ptr<snej::shs::crouton::SecretHandshakeStream> stream) {
+            ++accepted;
+            (void)stream->close();
+        });
+
+        KeyPair clientKeys = KeyPair::generate();
+        auto start = chrono::steady_clock::now();
+        vector<Future<void>> clients;
+        for (size_t i = 0; i < kClients; ++i)
+            clients.push_back(connectClient({app, clientKeys}, serverKeys.publicKey, kPort));
+        for (auto &client : clients)
+            AWAIT client;
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+        CHECK(server.handshakesSucceeded() == kClients);
+        CHECK(server.handshakesFailed() == 0);
+        CHECK(accepted == kClients);
+        CHECK(maxActive <= kMaxConcurrent);
+        cerr << kClients << " concurrent clients: " << (kClients / elapsed.count())
+             << " handshakes/sec\n";
+
+        // A client that connects but never sends anything gets timed out:
+        server.setStepTimeout(0.1);
+        auto silent = io::ISocket::newSocket(false);
+        silent->bind("127.0.0.1", kPort);
+        AWAIT silent->open();
+        AWAIT Timer::sleep(0.5);
+        CHECK(server.handshakesFailed() == 1);
+        CHECK(server.activeHandshakes() == 0);
+        AWAIT silent->stream()->close();
+
+        server.close();
+        RETURN noerror;
+    });
+}
+
+
+TEST_CASE("SecretHandshakeServer timeouts and backlog", "[SecretHandshake]") {
+    using SecretHandshakeServer = snej::shs::crouton::SecretHandshakeServer;
+    static constexpr uint16_t kPort = 34562;
+
+    RunCoroutine([&]() -> Future<void> {
+        AppID app          = Context::appIDFromString("SecretHandshakeServer");
+        KeyPair serverKeys = KeyPair::generate();
+        KeyPair clientKeys = KeyPair::generate();
+        SecretHandshakeServer server({app, serverKeys}, kPort, "127.0.0.1");
+        server.setStepTimeout(0.1);
+        server.setProtocols({CryptoBox::Compact, CryptoBox::BoxStream}, true);
+        bool slowAuthorizer = false;
+        server.setClientAuthorizer([&](PublicKey const&) -> ASYNC<bool> {
+            if (slowAuthorizer)
+                AWAIT Timer::sleep(1.0);
+            RETURN true;
+        });
+        server.listen([&](std::shared_ptr<snej::shs::crouton::SecretHandshakeStream> stream) {
+            (void)stream->close();
+        });
+
+        // A client that finishes the handshake but never sends its protocol offer:
+        {
+            auto sock = io::ISocket::newSocket(false);
+            sock->bind("127.0.0.1", kPort);
+            AWAIT sock->open();
+            snej::shs::crouton::SecretHandshake handshake({app, clientKeys}, &serverKeys.publicKey);
+            AWAIT handshake.handshake(sock->stream());
+            AWAIT Timer::sleep(0.5);
+            CHECK(server.handshakesFailed() == 1);
+            CHECK(server.activeHandshakes() == 0);
+            AWAIT sock->stream()->close();
+        }
+
+        // An authorizer that takes too long:
+        {
+            slowAuthorizer = true;
+            Result<void> r = AWAIT NoThrow(connectClient({app, clientKeys}, serverKeys.publicKey, kPort));
+            CHECK(!r.ok());
+            AWAIT Timer::sleep(0.2);
+            CHECK(server.handshakesFailed() == 2);
+            CHECK(server.activeHandshakes() == 0);
+            slowAuthorizer = false;
+        }
+
+        // Connections beyond the backlog are closed right away:
+        {
+            server.setMaxConcurrentHandshakes(1);
+            server.setMaxWaitingConnections(1);
+            vector<decltype(io::ISocket::newSocket(false))> socks;
+            for (int i = 0; i < 3; ++i) {
+                socks.push_back(io::ISocket::newSocket(false));
+                socks.back()->bind("127.0.0.1", kPort);
+                AWAIT socks.back()->open();
+            }
+            AWAIT Timer::sleep(0.05);
+            CHECK(server.activeHandshakes() == 1);
+            CHECK(server.connectionsWaiting() == 1);
+            CHECK(server.connectionsRejected() == 1);
+            // The others time out in turn:
+            AWAIT Timer::sleep(0.5);
+            CHECK(server.activeHandshakes() == 0);
+            CHECK(server.connectionsWaiting() == 0);
+            CHECK(server.handshakesFailed() == 4);
+            for (auto &sock : socks)
+                (void)sock->stream()->close();
+        }
+
+        server.close();
+        RETURN noerror;
+    });
+}
+
+
+// Runs ping-pong and bulk transfers between two streams with the given read-ahead and write
+// queue settings, checking the data. If `report` is true, logs the timings.
+static Future<void> exchangeData(size_t readAhead, size_t writesInFlight,
+                                 size_t pings, size_t chunks, bool report)
+{
+    using SecretHandshakeStream = snej::shs::crouton::SecretHandshakeStream;
+    static constexpr size_t kPingSize = 64, kChunkSize = 16 * 1024;
+
+    AppID app          = Context::appIDFromString("SecretHandshakeStream");
+    KeyPair clientKeys = KeyPair::generate();
+    KeyPair serverKeys = KeyPair::generate();
+    auto [clientSock, serverSock] = io::LocalSocket::createPair();
+    auto client = make_shared<SecretHandshakeStream>(clientSock, Context{app, clientKeys},
+                                                     &serverKeys.publicKey);
+    auto server = make_shared<SecretHandshakeStream>(serverSock, Context{app, serverKeys},
+                                                     nullptr);
+    for (auto &stream : {client, server}) {
+        stream->setReadAhead(readAhead);
+        stream->setMaxWritesInFlight(writesInFlight);
+    }
+    auto f1 = client->open();
+    auto f2 = server->open();
+    AWAIT f1;
+    AWAIT f2;
+
+    // Ping-pong: the server echoes each message back.
+    auto echo = [](shared_ptr<SecretHandshakeStream> stream, size_t pings) -> Future<void> {
+        char buf[kPingSize];
+        for (size_t i = 0; i < pings; ++i) {
+            size_t n = AWAIT stream->read(MutableBytes{buf, sizeof(buf)});
+            if (n < sizeof(buf))
+                break;
+            AWAIT stream->write(ConstBytes{buf, n});
+        }
+        RETURN noerror;
+    }(server, pings);
+    char ping[kPingSize] = "ping", pong[kPingSize];
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < pings; ++i) {
+        AWAIT client->write(ConstBytes{ping, sizeof(ping)});
+        size_t n = AWAIT client->read(MutableBytes{pong, sizeof(pong)});
+        REQUIRE(n == sizeof(pong));
+    }
+    chrono::duration<double> pingTime = chrono::steady_clock::now() - start;
+    AWAIT echo;
+    CHECK(memcmp(ping, pong, sizeof(ping)) == 0);
+
+    // Bulk: the client sends a stream of chunks, which the server reads and checks.
+    auto sink = [](shared_ptr<SecretHandshakeStream> stream, size_t chunks) -> Future<void> {
+        size_t total = 0;
+        bool ok = true;
+        while (total < kChunkSize * chunks) {
+            ConstBytes bytes = AWAIT stream->readNoCopy();
+            if (bytes.empty())
+                break;
+            for (size_t i = 0; i < bytes.size(); ++i, ++total)
+                ok = ok && (bytes.data()[i] == uint8_t(total / kChunkSize + total));
+        }
+        CHECK(ok);
+        CHECK(total == kChunkSize * chunks);
+        RETURN noerror;
+    }(server, chunks);
+    vector<uint8_t> chunk(kChunkSize);
+    start = chrono::steady_clock::now();
+    for (size_t c = 0; c < chunks; ++c) {
+        for (size_t i = 0; i < kChunkSize; ++i)
+            chunk[i] = uint8_t(c + c * kChunkSize + i);
+        AWAIT client->write(ConstBytes{chunk.data(), chunk.size()});
+    }
+    AWAIT sink;
+    chrono::duration<double> bulkTime = chrono::steady_clock::now() - start;
+
+    if (report) {
+        cerr << "read-ahead " << setw(6) << readAhead << ", " << writesInFlight
+             << " writes in flight: ping-pong " << fixed << setprecision(1)
+             << (pingTime.count() * 1e6 / pings) << " us/round trip, bulk "
+             << (kChunkSize * chunks / bulkTime.count() / 1e6) << " MB/sec\n";
+    }
+
+    AWAIT client->close();
+    AWAIT server->close();
+    RETURN noerror;
+}
+
+
+TEST_CASE("SecretHandshakeStream read-ahead and write queue", "[SecretHandshake]") {
+    for (size_t readAhead : {0, 256 * 1024}) {
+        for (size_t writesInFlight : {1, 8}) {
+            RunCoroutine([&]() -> Future<void> {
+                return exchangeData(readAhead, writesInFlight, 20, 20, false);
+            });
+        }
+    }
+}
+
+
+// Measures ping-pong latency and bulk throughput with different read-ahead and write-queue
+// settings, over a local socket pair.
+TEST_CASE("Benchmark SecretHandshakeStream read-ahead and write queue", "[.benchmark]") {
+    for (size_t readAhead : {0, 256 * 1024}) {
+        for (size_t writesInFlight : {1, 8}) {
+            RunCoroutine([&]() -> Future<void> {
+                return exchangeData(readAhead, writesInFlight, 2000, 1000, true);
+            });
+        }
+    }
+}
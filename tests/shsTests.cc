@@ -17,8 +17,16 @@
 //
 
 #include "shs.hh"
+#include "aes256gcm.hh"
+#include "drbg.hh"
 #include "hexString.hh"
+#include <chrono>
 #include <iostream>
+#include <thread>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 #include "catch.hpp"        // https://github.com/catchorg/Catch2
 
 // `SHS_TESTS_COMPARE_C` controls whether to test that shs.cc produces the same results as an
@@ -206,3 +214,130 @@ TEST_CASE("shs Cpp vs C", "[SecretHandshake]") {
     REQUIRE(clientDecNonce   == serverEncNonce);
     REQUIRE(clientPK         == serverPeerPubKey);
 }
+
+
+template <size_t SIZE>
+static byte_array<SIZE> fromHex(const char *hex) {
+    byte_array<SIZE> result;
+    for (size_t i = 0; i < SIZE; ++i) {
+        unsigned b;
+        sscanf(hex + 2*i, "%2x", &b);
+        result[i] = uint8_t(b);
+    }
+    return result;
+}
+
+
+TEST_CASE("AES-256-GCM", "[SecretHandshake]") {
+    // NIST GCM spec test case 16:
+    auto key        = fromHex<32>("feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308");
+    auto plaintext  = fromHex<60>("d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d"
+                                  "8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39");
+    auto ad         = fromHex<20>("feedfacedeadbeeffeedfacedeadbeefabaddad2");
+    auto iv         = fromHex<12>("cafebabefacedbaddecaf888");
+    auto ciphertext = fromHex<60>("522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd"
+                                  "2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662");
+    auto tag        = fromHex<16>("76fc6ece0f4e1768cddf8853bb2d551b");
+
+    // Test both the AES-NI and portable implementations (if this CPU has AES-NI):
+    bool portable = GENERATE(false, true);
+    if (!portable && !aes256gcm::hardwareAccelerated())
+        return;
+    cout << "\t---- " << (portable ? "portable" : "AES-NI") << endl;
+    aes256gcm::disableHardwareAcceleration(portable);
+    aes256gcm gcm(key.data());
+    aes256gcm::disableHardwareAcceleration(false);
+
+    byte_array<60> output;
+    byte_array<16> outTag;
+    gcm.seal(iv.data(), ad.data(), ad.size(), plaintext.data(), plaintext.size(),
+             output.data(), outTag.data());
+    CHECK(output == ciphertext);
+    CHECK(outTag == tag);
+
+    byte_array<60> decrypted;
+    CHECK(gcm.open(iv.data(), ad.data(), ad.size(), output.data(), output.size(),
+                   decrypted.data(), outTag.data()));
+    CHECK(decrypted == plaintext);
+
+    outTag[5] ^= 0x10;
+    CHECK(!gcm.open(iv.data(), ad.data(), ad.size(), output.data(), output.size(),
+                    decrypted.data(), outTag.data()));
+}
+
+
+TEST_CASE("DRBG", "[SecretHandshake]") {
+    byte_array<64> a, b;
+    drbg::randomize(a.data(), a.size());
+    drbg::randomize(b.data(), b.size());
+    CHECK(a != b);
+    CHECK(a != byte_array<64>{});
+
+    // Another thread has its own generator:
+    byte_array<64> c;
+    std::thread([&] {drbg::randomize(c.data(), c.size());}).join();
+    CHECK(c != a);
+    CHECK(c != b);
+
+    // Count the OS requests made by handshakes:
+    key_pair kp = key_pair::generate();
+    app_id appID;
+    strcpy((char*)&appID, "shsTests");
+    static constexpr int kCount = 1000;
+    for (bool useOS : {false, true}) {
+        drbg::useOSRandomness(useOS);
+        uint64_t startCount = drbg::osRequestCount();
+        for (int i = 0; i < kCount; ++i)
+            handshake hs(appID, kp.get_seed(), kp.get_public_key());
+        double perHandshake = double(drbg::osRequestCount() - startCount) / kCount;
+        cout << "\t---- " << (useOS ? "OS randomness" : "DRBG") << ": "
+             << perHandshake << " OS requests per handshake\n";
+        if (useOS)
+            CHECK(perHandshake == 1.0);
+        else
+            CHECK(perHandshake < 0.01);
+    }
+    drbg::useOSRandomness(false);
+
+#ifndef _WIN32
+    // After a fork, the child reseeds and so doesn't generate the same bytes as the parent:
+    int fds[2];
+    REQUIRE(::pipe(fds) == 0);
+    pid_t pid = ::fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+        byte_array<32> childBytes;
+        drbg::randomize(childBytes.data(), childBytes.size());
+        ssize_t n = ::write(fds[1], childBytes.data(), childBytes.size());
+        ::_exit(n == 32 ? 0 : 1);
+    }
+    byte_array<32> parentBytes, childBytes;
+    drbg::randomize(parentBytes.data(), parentBytes.size());
+    REQUIRE(::read(fds[0], childBytes.data(), childBytes.size()) == 32);
+    int status;
+    ::waitpid(pid, &status, 0);
+    ::close(fds[0]);
+    ::close(fds[1]);
+    CHECK(childBytes != parentBytes);
+#endif
+}
+
+
+TEST_CASE("Benchmark DRBG vs OS randomness", "[.benchmark]") {
+    // Constructing a handshake generates its ephemeral key pair, which is the only randomness
+    // it needs.
+    key_pair kp = key_pair::generate();
+    app_id appID;
+    strcpy((char*)&appID, "shsTests");
+    static constexpr int kCount = 20000;
+    for (bool useOS : {false, true}) {
+        drbg::useOSRandomness(useOS);
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < kCount; ++i)
+            handshake hs(appID, kp.get_seed(), kp.get_public_key());
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        cout << (useOS ? "OS randomness: " : "DRBG:          ")
+             << kCount / elapsed.count() << " handshake setups/sec\n";
+    }
+    drbg::useOSRandomness(false);
+}
@@ -0,0 +1,139 @@
+//
+// DatagramSocket.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "DatagramSocket.hh"
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace snej::shs {
+    using namespace std;
+
+
+    [[noreturn]] static void throwErrno(const char *what) {
+        throw system_error(errno, generic_category(), what);
+    }
+
+
+    DatagramSocket::DatagramSocket(int socketFD, Session const& session, size_t maxPayload)
+    :_socket(socketFD)
+    ,_maxPayload(maxPayload)
+    ,_encryptor(session)
+    ,_decryptor(session)
+    ,_sendBuffer(kMaxBatch * DatagramCrypto::encryptedSize(maxPayload))
+    ,_receiveBuffer(kMaxBatch * DatagramCrypto::encryptedSize(maxPayload))
+    { }
+
+
+    DatagramSocket::~DatagramSocket() {
+        ::close(_socket);
+    }
+
+
+    size_t DatagramSocket::send(const input_data *payloads, size_t count) {
+        const size_t slotSize = DatagramCrypto::encryptedSize(_maxPayload);
+        size_t sent = 0;
+        while (sent < count) {
+            // Encrypt a batch into the send buffer:
+            size_t batch = min(count - sent, kMaxBatch);
+            mmsghdr msgs[kMaxBatch] = {};
+            iovec iovs[kMaxBatch];
+            for (size_t i = 0; i < batch; ++i) {
+                input_data const& payload = payloads[sent + i];
+                if (payload.size > _maxPayload)
+                    throw invalid_argument("datagram payload is too large");
+                output_buffer out = {&_sendBuffer[i * slotSize], slotSize};
+                _encryptor.encrypt(payload, out);
+                iovs[i] = {out.data, out.size};
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            // Send it, which may take several calls:
+            size_t batchSent = 0;
+            while (batchSent < batch) {
+                int n = ::sendmmsg(_socket, &msgs[batchSent], unsigned(batch - batchSent), 0);
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return sent + batchSent;
+                    throwErrno("sendmmsg");
+                }
+                batchSent += n;
+            }
+            sent += batch;
+        }
+        return sent;
+    }
+
+
+    size_t DatagramSocket::receive(output_buffer *buffers, size_t count, uint64_t *sequences) {
+        const size_t slotSize = DatagramCrypto::encryptedSize(_maxPayload);
+        count = min(count, kMaxBatch);
+        while (count > 0) {
+            mmsghdr msgs[kMaxBatch] = {};
+            iovec iovs[kMaxBatch];
+            for (size_t i = 0; i < count; ++i) {
+                iovs[i] = {&_receiveBuffer[i * slotSize], slotSize};
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            // MSG_WAITFORONE blocks until the first datagram arrives, then takes only what's
+            // already queued:
+            int n = ::recvmmsg(_socket, msgs, unsigned(count), MSG_WAITFORONE, nullptr);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                throwErrno("recvmmsg");
+            }
+
+            size_t received = 0;
+            for (int i = 0; i < n; ++i) {
+                status_t status = CorruptData;
+                output_buffer &out = buffers[received];
+                if (!(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+                    input_data in = {iovs[i].iov_base, msgs[i].msg_len};
+                    status = _decryptor.decrypt(in, out, sequences ? &sequences[received] : nullptr);
+                }
+                if (status == Success)
+                    ++received;
+                else
+                    ++_dropped;
+            }
+            if (received > 0)
+                return received;
+            // If they were all invalid, go back and wait for more.
+        }
+        return 0;
+    }
+
+}
@@ -0,0 +1,74 @@
+//
+// DatagramSocket.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include "SecretDatagram.hh"
+#include <vector>
+
+namespace snej::shs {
+
+    /// Sends and receives SecretHandshake datagrams (see `DatagramCrypto`) on a connected UDP
+    /// socket, or any other connected datagram socket. Datagrams are sent and received in
+    /// batches, with one `sendmmsg` or `recvmmsg` call per batch. (Linux only.)
+    ///
+    /// The Session comes from a handshake done some other way, typically over a TCP connection
+    /// to the same peer.
+    ///
+    /// Datagrams may be lost, duplicated or reordered in transit. The receiver delivers each
+    /// valid one once, in the order they arrive, and silently drops the rest.
+    class DatagramSocket {
+    public:
+        /// A conservative default payload size, which fits in an IPv6 minimum-MTU packet.
+        static constexpr size_t kDefaultMaxPayload = 1200;
+
+        /// The maximum number of datagrams sent or received per system call.
+        static constexpr size_t kMaxBatch = 64;
+
+        /// Constructs a DatagramSocket, which takes ownership of the socket and closes it when
+        /// done.
+        /// @param socketFD  A connected datagram socket.
+        /// @param session  The session from a handshake with the peer.
+        /// @param maxPayload  The maximum payload size of a datagram.
+        DatagramSocket(int socketFD, Session const& session,
+                       size_t maxPayload = kDefaultMaxPayload);
+        ~DatagramSocket();
+
+        int fd() const                                  {return _socket;}
+        size_t maxPayload() const                       {return _maxPayload;}
+
+        /// Encrypts and sends datagrams. Each is given the next sequence number.
+        /// Returns the number sent, which is less than `count` only if the socket is non-blocking
+        /// and its buffer filled up. (The unsent ones use up sequence numbers, so to the peer
+        /// it looks like they were lost.)
+        /// @throws std::invalid_argument if a payload is larger than `maxPayload`.
+        /// @throws std::system_error if a system call fails.
+        size_t send(const input_data *payloads, size_t count);
+
+        /// Receives up to `count` datagrams and decrypts them into `buffers`, setting each
+        /// buffer's `size` to the payload size. Blocks until at least one valid datagram arrives,
+        /// unless the socket is non-blocking, in which case it returns 0 if none is available.
+        /// Invalid datagrams -- forged, altered, duplicated, too old, or too big for their
+        /// buffer -- are dropped.
+        /// @param buffers  Buffers to decrypt into; each should have room for `maxPayload` bytes.
+        /// @param count  The number of buffers.
+        /// @param sequences  If non-null, each datagram's sequence number is stored here.
+        /// @return  The number of datagrams received.
+        /// @throws std::system_error if a system call fails.
+        size_t receive(output_buffer *buffers, size_t count, uint64_t *sequences = nullptr);
+
+        /// The number of incoming datagrams that have been dropped as invalid.
+        uint64_t droppedCount() const                   {return _dropped;}
+
+    private:
+        int                     _socket;
+        size_t                  _maxPayload;
+        DatagramEncryptor       _encryptor;
+        DatagramDecryptor       _decryptor;
+        std::vector<uint8_t>    _sendBuffer, _receiveBuffer;
+        uint64_t                _dropped = 0;
+    };
+
+}
@@ -0,0 +1,456 @@
+//
+// SharedMemoryChannel.cc
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "SharedMemoryChannel.hh"
+#include "ByteRing.hh"
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace snej::shs {
+    using namespace std;
+
+    static constexpr size_t kMinRingCapacity = 256 * 1024;  // Must hold the largest frame
+    static constexpr size_t kMaxRingCapacity = 1 << 30;     // Sanity limit on the peer's ring
+    static constexpr int    kSpinCount       = 2000;        // Polls before sleeping on an eventfd
+
+
+    [[noreturn]] static void throwErrno(const char *what) {
+        throw system_error(errno, generic_category(), what);
+    }
+
+
+    static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+
+    static void writeAll(int fd, const void *src, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::send(fd, src, size, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                throwErrno("SharedMemoryChannel: send");
+            }
+            src = (const uint8_t*)src + n;
+            size -= n;
+        }
+    }
+
+
+    // Returns false on EOF.
+    static bool readAll(int fd, void *dst, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::read(fd, dst, size);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                throwErrno("SharedMemoryChannel: read");
+            } else if (n == 0) {
+                return false;
+            }
+            dst = (uint8_t*)dst + n;
+            size -= n;
+        }
+        return true;
+    }
+
+
+#pragma mark - RING:
+
+
+    /// One direction of the channel: a ByteRing in a shared memfd mapping, preceded by a control
+    /// block, and the eventfds used to wake the consumer (`dataEvent`) and producer (`spaceEvent`).
+    struct SharedMemoryChannel::Ring {
+        struct Control {
+            alignas(64) atomic<uint32_t> readerWaiting;     // Consumer is sleeping on dataEvent
+            atomic<uint32_t>             writerWaiting;     // Producer is sleeping on spaceEvent
+            atomic<uint32_t>             closed;            // Producer has closed the channel
+        };
+
+        int                     memfd = -1, dataEvent = -1, spaceEvent = -1;
+        void*                   mapping = MAP_FAILED;
+        size_t                  mapSize = 0;
+        Control*                control = nullptr;
+        unique_ptr<ByteRing>    ring;
+
+        ~Ring() {
+            ring.reset();
+            if (mapping != MAP_FAILED)
+                ::munmap(mapping, mapSize);
+            for (int fd : {memfd, dataEvent, spaceEvent})
+                if (fd >= 0)
+                    ::close(fd);
+        }
+
+        static size_t mappingSize(size_t capacity) {
+            return sizeof(Control) + ByteRing::memorySize(capacity);
+        }
+
+        void map(size_t capacity, bool initialize) {
+            mapSize = mappingSize(capacity);
+            mapping = ::mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+            if (mapping == MAP_FAILED)
+                throwErrno("SharedMemoryChannel: mmap");
+            control = (Control*)mapping;
+            if (initialize)
+                new (control) Control();
+            ring = make_unique<ByteRing>((uint8_t*)mapping + sizeof(Control), capacity, initialize);
+        }
+
+        /// Creates a new ring, to be written by this process.
+        static unique_ptr<Ring> create(size_t capacity) {
+            if (capacity < kMinRingCapacity || capacity > kMaxRingCapacity
+                    || (capacity & (capacity - 1)) != 0)
+                throw invalid_argument("SharedMemoryChannel: invalid ring capacity");
+            auto r = make_unique<Ring>();
+            r->memfd = ::memfd_create("shs-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (r->memfd < 0)
+                throwErrno("SharedMemoryChannel: memfd_create");
+            if (::ftruncate(r->memfd, mappingSize(capacity)) < 0)
+                throwErrno("SharedMemoryChannel: ftruncate");
+            // Seal the size, so neither process can make the other's mapping fault:
+            if (::fcntl(r->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+                throwErrno("SharedMemoryChannel: F_ADD_SEALS");
+            r->dataEvent  = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            r->spaceEvent = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (r->dataEvent < 0 || r->spaceEvent < 0)
+                throwErrno("SharedMemoryChannel: eventfd");
+            r->map(capacity, true);
+            return r;
+        }
+
+        /// Sends the ring's capacity and file descriptors to the peer.
+        void send(int socket) const {
+            uint64_t capacity = ring->capacity();
+            int fds[3] = {memfd, dataEvent, spaceEvent};
+            iovec iov = {&capacity, sizeof(capacity)};
+            alignas(cmsghdr) char cbuf[CMSG_SPACE(sizeof(fds))] = {};
+            msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = cbuf;
+            msg.msg_controllen = sizeof(cbuf);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+            ::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+            ssize_t n;
+            do {
+                n = ::sendmsg(socket, &msg, MSG_NOSIGNAL);
+            } while (n < 0 && errno == EINTR);
+            if (n != ssize_t(sizeof(capacity)))
+                throwErrno("SharedMemoryChannel: sendmsg");
+        }
+
+        /// Receives the peer's ring. Returns nullptr if the peer sent something invalid.
+        static unique_ptr<Ring> receive(int socket) {
+            uint64_t capacity = 0;
+            iovec iov = {&capacity, sizeof(capacity)};
+            alignas(cmsghdr) char cbuf[CMSG_SPACE(3 * sizeof(int))] = {};
+            msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = cbuf;
+            msg.msg_controllen = sizeof(cbuf);
+            ssize_t n;
+            do {
+                n = ::recvmsg(socket, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+            } while (n < 0 && errno == EINTR);
+            if (n < 0)
+                throwErrno("SharedMemoryChannel: recvmsg");
+
+            // Take ownership of any descriptors received, before validating anything:
+            auto r = make_unique<Ring>();
+            size_t nfds = 0;
+            if (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg && cmsg->cmsg_level == SOL_SOCKET
+                                                          && cmsg->cmsg_type == SCM_RIGHTS) {
+                nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                int fds[3] = {-1, -1, -1};
+                ::memcpy(fds, CMSG_DATA(cmsg), min(nfds, size_t(3)) * sizeof(int));
+                r->memfd = fds[0];
+                r->dataEvent = fds[1];
+                r->spaceEvent = fds[2];
+            }
+            if (n != ssize_t(sizeof(capacity)) || nfds != 3 || (msg.msg_flags & MSG_CTRUNC))
+                return nullptr;
+
+            // Don't trust the peer: check the capacity, the memfd's size, and its seals.
+            if (capacity < kMinRingCapacity || capacity > kMaxRingCapacity
+                    || (capacity & (capacity - 1)) != 0)
+                return nullptr;
+            struct stat st;
+            if (::fstat(r->memfd, &st) < 0 || !S_ISREG(st.st_mode)
+                    || size_t(st.st_size) != mappingSize(capacity))
+                return nullptr;
+            int seals = ::fcntl(r->memfd, F_GET_SEALS);
+            if (seals < 0 || !(seals & F_SEAL_SHRINK))
+                return nullptr;
+            r->map(capacity, false);
+            return r;
+        }
+    };
+
+
+#pragma mark - CHANNEL:
+
+
+    unique_ptr<SharedMemoryChannel> SharedMemoryChannel::connect(int socketFD,
+                                                                 Context const& context,
+                                                                 PublicKey const& serverKey,
+                                                                 Options const& options)
+    {
+        ClientHandshake handshake(context, serverKey);
+        return open(socketFD, handshake, options);
+    }
+
+
+    unique_ptr<SharedMemoryChannel> SharedMemoryChannel::accept(int socketFD,
+                                                                Context const& context,
+                                                                ServerHandshake::ClientAuthorizer auth,
+                                                                Options const& options)
+    {
+        ServerHandshake handshake(context);
+        if (auth)
+            handshake.setClientAuthorizer(std::move(auth));
+        return open(socketFD, handshake, options);
+    }
+
+
+    unique_ptr<SharedMemoryChannel> SharedMemoryChannel::open(int socketFD,
+                                                              Handshake &handshake,
+                                                              Options const& options)
+    {
+        // Handshake:
+        do {
+            if (auto [toSend, sizeToSend] = handshake.bytesToSend(); sizeToSend > 0) {
+                writeAll(socketFD, toSend, sizeToSend);
+                handshake.sendCompleted();
+            }
+            if (auto [toRead, sizeToRead] = handshake.bytesToRead(); sizeToRead > 0) {
+                if (readAll(socketFD, toRead, sizeToRead))
+                    handshake.readCompleted();
+                else
+                    handshake.readFailed();
+            }
+        } while (!handshake.finished() && !handshake.error());
+        if (handshake.error())
+            return nullptr;
+
+        // Negotiate the protocol. The client sends its offer first, and the server replies with
+        // its own. Both offers are the same size, and nothing else is sent on the socket before
+        // the rings, so read exactly that much:
+        bool isServer = dynamic_cast<ServerHandshake*>(&handshake) != nullptr;
+        ProtocolNegotiator negotiator(handshake.session(),
+                                      isServer ? ProtocolNegotiator::Server
+                                               : ProtocolNegotiator::Client,
+                                      options.protocols);
+        input_data offer = negotiator.bytesToSend();
+        if (!isServer)
+            writeAll(socketFD, offer.data, offer.size);
+        vector<uint8_t> peerOffer(ProtocolNegotiator::kEncryptedOfferSize);
+        if (!readAll(socketFD, peerOffer.data(), peerOffer.size()))
+            return nullptr;
+        input_data in = {peerOffer.data(), peerOffer.size()};
+        if (negotiator.receivedBytes(in) != Success || negotiator.peerIsLegacy() || in.size != 0)
+            return nullptr;
+        if (isServer) {
+            offer = negotiator.bytesToSend();
+            writeAll(socketFD, offer.data, offer.size);
+        }
+
+        // Exchange rings:
+        auto outRing = Ring::create(options.ringCapacity);
+        outRing->send(socketFD);
+        auto inRing = Ring::receive(socketFD);
+        if (!inRing)
+            return nullptr;
+
+        return unique_ptr<SharedMemoryChannel>(new SharedMemoryChannel(
+                        socketFD, negotiator.session(), negotiator.protocol(),
+                        negotiator.maxMessageSize(), std::move(outRing), std::move(inRing)));
+    }
+
+
+    SharedMemoryChannel::SharedMemoryChannel(int socketFD,
+                                             Session const& session,
+                                             Protocol protocol,
+                                             size_t maxMessageSize,
+                                             unique_ptr<Ring> outRing,
+                                             unique_ptr<Ring> inRing)
+    :_socket(socketFD)
+    ,_peerPublicKey(session.peerPublicKey)
+    ,_protocol(protocol)
+    ,_maxMessageSize(maxMessageSize)
+    ,_encryptor(session, protocol)
+    ,_decryptor(session, protocol)
+    ,_outRing(std::move(outRing))
+    ,_inRing(std::move(inRing))
+    { }
+
+
+    SharedMemoryChannel::~SharedMemoryChannel() {
+        close();
+        // Only now is it safe to close the socket, since the other thread may be polling it
+        // until it notices `_closed`:
+        ::close(_socket);
+    }
+
+
+    void SharedMemoryChannel::close() {
+        if (_closed.exchange(true))
+            return;
+        _outRing->control->closed.store(1);
+        wake(*_outRing, false);
+        // Shutting down the socket wakes the peer if it's waiting for ring space, and wakes our
+        // own reader or writer if it's polling the socket:
+        ::shutdown(_socket, SHUT_RDWR);
+    }
+
+
+    // Waits until the ring has `amount` bytes of space (if `forSpace`) or of data (if not.)
+    // Returns false if that can't happen because the channel is closed.
+    bool SharedMemoryChannel::waitFor(Ring &r, bool forSpace, size_t amount) {
+        ByteRing &ring = *r.ring;
+        auto ready = [&] {
+            return (forSpace ? ring.spaceAvailable() : ring.bytesAvailable()) >= amount;
+        };
+        // Spin briefly, since the peer is probably running on another core. (Unless there's only
+        // one core, in which case spinning just delays the peer.)
+        static const int sSpinCount = (thread::hardware_concurrency() > 1) ? kSpinCount : 0;
+        for (int i = 0; i < sSpinCount; ++i) {
+            if (ready())
+                return true;
+            cpuRelax();
+        }
+
+        auto &waiting = forSpace ? r.control->writerWaiting : r.control->readerWaiting;
+        int event = forSpace ? r.spaceEvent : r.dataEvent;
+        while (!ready()) {
+            if (_closed || _inRing->control->closed.load())
+                return ready();
+            // Announce that we're waiting, then check again before sleeping, so we can't miss a
+            // wakeup. (The other side checks `waiting` after updating the ring; see `wake`.)
+            waiting.store(1);
+            if (ready()) {
+                waiting.store(0);
+                break;
+            }
+            pollfd fds[2] = {{event, POLLIN, 0}, {_socket, POLLIN, 0}};
+            int n = ::poll(fds, 2, -1);
+            waiting.store(0);
+            if (n < 0 && errno != EINTR)
+                throwErrno("SharedMemoryChannel: poll");
+            if (fds[0].revents & POLLIN) {
+                uint64_t count;
+                (void)::read(event, &count, sizeof(count));
+            }
+            if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+                return ready();     // Peer closed its socket or exited
+        }
+        return true;
+    }
+
+
+    // Wakes the other side of the ring if it's waiting for data (or space, if `forSpace`.)
+    void SharedMemoryChannel::wake(Ring &r, bool forSpace) {
+        atomic_thread_fence(memory_order_seq_cst);
+        auto &waiting = forSpace ? r.control->writerWaiting : r.control->readerWaiting;
+        if (waiting.load(memory_order_relaxed)) {
+            uint64_t one = 1;
+            (void)::write(forSpace ? r.spaceEvent : r.dataEvent, &one, sizeof(one));
+        }
+    }
+
+
+    bool SharedMemoryChannel::write(const void *data, size_t size) {
+        if (_closed || _inRing->control->closed.load())
+            return false;
+        auto src = (const uint8_t*)data;
+        ByteRing &ring = *_outRing->ring;
+        while (size > 0) {
+            size_t chunk = min(size, _maxMessageSize);
+            size_t encSize = _encryptor.encryptedSize(chunk);
+            if (!waitFor(*_outRing, true, encSize))
+                return false;
+            if (output_buffer out = ring.writable(); out.size >= encSize) {
+                // Encrypt directly into the ring:
+                [[maybe_unused]] status_t status = _encryptor.encrypt({src, chunk}, out);
+                assert(status == Success);
+                ring.commit(encSize);
+            } else {
+                // The frame would wrap around the end of the ring, so encrypt it elsewhere first:
+                _scratch.resize(encSize);
+                out = {_scratch.data(), encSize};
+                [[maybe_unused]] status_t status = _encryptor.encrypt({src, chunk}, out);
+                assert(status == Success);
+                ring.write(_scratch.data(), encSize);
+            }
+            wake(*_outRing, false);
+            src += chunk;
+            size -= chunk;
+        }
+        return true;
+    }
+
+
+    size_t SharedMemoryChannel::read(void *dst, size_t maxSize) {
+        ByteRing &ring = *_inRing->ring;
+        while (_decryptor.bytesAvailable() == 0) {
+            if (!waitFor(*_inRing, false, 1)) {
+                if (!_decryptor.close())
+                    throw runtime_error("SharedMemoryChannel: peer closed in mid-frame");
+                return 0;
+            }
+            // DecryptionStream copies the data out of shared memory before verifying it, so the
+            // peer can't change it after it's been authenticated.
+            for (input_data in; (in = ring.readable()).size > 0; ) {
+                if (!_decryptor.push(in.data, in.size))
+                    throw runtime_error("SharedMemoryChannel: received corrupt data");
+                ring.consume(in.size);
+            }
+            wake(*_inRing, true);
+        }
+        return _decryptor.pull(dst, maxSize);
+    }
+
+}
@@ -0,0 +1,109 @@
+//
+// SharedMemoryChannel.hh
+//
+// Copyright © 2024 Jens Alfke. All rights reserved.
+//
+
+#pragma once
+#include "SecretHandshake.hh"
+#include "SecretStream.hh"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace snej::shs {
+
+    /// Options for a `SharedMemoryChannel`.
+    struct SharedMemoryChannelOptions {
+        /// The protocols to negotiate. (`MACOnly` is worth considering on a single host.)
+        std::vector<CryptoBox::Protocol> protocols {CryptoBox::Compact};
+        /// The capacity of this side's outgoing ring. Must be a power of 2, at least 256KB.
+        size_t ringCapacity = 1 << 20;
+    };
+
+
+    /// A SecretHandshake connection between two processes on the same host, which sends its
+    /// encrypted frames through shared memory instead of a socket. (Linux only.)
+    ///
+    /// The peers first connect with a Unix-domain socket, and run the handshake and protocol
+    /// negotiation over it as usual, so both are authenticated. Then each side creates a
+    /// `memfd`-backed ring buffer for the data it sends, plus two `eventfd`s for wakeups, and
+    /// passes their file descriptors to the peer over the socket. After that the socket is only
+    /// used to detect the peer's process going away.
+    ///
+    /// Frames are encrypted directly into the outgoing ring. The peer copies them out before
+    /// verifying and decrypting them, since it can't trust the shared memory not to change.
+    /// Wakeups are only signaled when the other side is actually waiting, so a busy connection
+    /// makes few system calls.
+    ///
+    /// Each channel must only be written by one thread and read by one thread (which may be
+    /// different threads.) `read` and `write` block.
+    class SharedMemoryChannel {
+    public:
+        using Protocol = CryptoBox::Protocol;
+        using Options = SharedMemoryChannelOptions;
+
+        /// Runs the handshake as the client, over a connected Unix-domain socket.
+        /// On success the channel takes ownership of the socket, and closes it when done.
+        /// Returns `nullptr` if the handshake fails.
+        /// @throws std::system_error if a system call fails.
+        static std::unique_ptr<SharedMemoryChannel> connect(int socketFD,
+                                                            Context const& context,
+                                                            PublicKey const& serverKey,
+                                                            Options const& options = {});
+
+        /// Runs the handshake as the server, over a connected Unix-domain socket.
+        /// On success the channel takes ownership of the socket, and closes it when done.
+        /// Returns `nullptr` if the handshake fails or the authorizer rejects the client.
+        /// @throws std::system_error if a system call fails.
+        static std::unique_ptr<SharedMemoryChannel> accept(int socketFD,
+                                                           Context const& context,
+                                                           ServerHandshake::ClientAuthorizer = nullptr,
+                                                           Options const& options = {});
+
+        ~SharedMemoryChannel();
+
+        /// The peer's authenticated public key.
+        PublicKey const& peerPublicKey() const  {return _peerPublicKey;}
+
+        /// The negotiated protocol.
+        Protocol protocol() const               {return _protocol;}
+
+        /// Encrypts and sends data, blocking while the ring is full.
+        /// Returns false if the peer has closed the channel or gone away.
+        bool write(const void *data, size_t size);
+
+        /// Reads decrypted data, blocking until some is available. Returns the number of bytes
+        /// read, or 0 at EOF (the peer closed the channel.)
+        /// @throws std::runtime_error if the peer sent corrupt data.
+        size_t read(void *dst, size_t maxSize);
+
+        /// Tells the peer no more data will be written; its `read` returns EOF once it's read
+        /// everything. Also shuts down the socket, which wakes up a blocked `read` or `write` on
+        /// this side. May be called on either thread. Called by the destructor if necessary;
+        /// the destructor closes the socket.
+        void close();
+
+    private:
+        struct Ring;
+
+        SharedMemoryChannel(int socketFD, Session const&, Protocol, size_t maxMessageSize,
+                            std::unique_ptr<Ring> outRing, std::unique_ptr<Ring> inRing);
+        static std::unique_ptr<SharedMemoryChannel> open(int socketFD,
+                                                         Handshake&,
+                                                         Options const&);
+        bool waitFor(Ring&, bool forSpace, size_t amount);
+        void wake(Ring&, bool forSpace);
+
+        int                         _socket;
+        PublicKey                   _peerPublicKey;
+        Protocol                    _protocol;
+        size_t                      _maxMessageSize;
+        EncryptoBox                 _encryptor;
+        DecryptionStream            _decryptor;
+        std::unique_ptr<Ring>       _outRing, _inRing;
+        std::vector<uint8_t>        _scratch;
+        std::atomic<bool>           _closed = false;    // Set by `close`, on either thread
+    };
+
+}